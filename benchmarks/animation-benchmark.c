@@ -0,0 +1,144 @@
+/* Times gthree_animation_mixer_update() with many actions */
+
+#include <gthree/gthree.h>
+
+#include "benchmark-utils.h"
+
+#define N_KEYFRAMES 30
+#define N_STEPS 10
+
+typedef struct {
+  GthreeObject *root;
+  GthreeAnimationMixer *mixer;
+} AnimationBenchmark;
+
+static GthreeKeyframeTrack *
+random_track (GRand *rand, const char *name, gboolean quaternion)
+{
+  g_autoptr(GthreeAttributeArray) times = NULL;
+  g_autoptr(GthreeAttributeArray) values = NULL;
+  int item_size = quaternion ? 4 : 3;
+  float time_data[N_KEYFRAMES];
+  float value_data[N_KEYFRAMES * 4];
+  int i, j;
+
+  for (i = 0; i < N_KEYFRAMES; i++)
+    {
+      time_data[i] = i / 10.0;
+
+      if (quaternion)
+        {
+          graphene_quaternion_t q;
+          graphene_vec4_t v;
+
+          graphene_quaternion_init_from_angles (&q,
+                                                g_rand_double_range (rand, 0, 360),
+                                                g_rand_double_range (rand, 0, 360),
+                                                g_rand_double_range (rand, 0, 360));
+          graphene_quaternion_to_vec4 (&q, &v);
+          graphene_vec4_to_float (&v, &value_data[i * 4]);
+        }
+      else
+        {
+          for (j = 0; j < item_size; j++)
+            value_data[i * item_size + j] = g_rand_double_range (rand, -1, 1);
+        }
+    }
+
+  times = gthree_attribute_array_new_from_float (time_data, N_KEYFRAMES, 1);
+  values = gthree_attribute_array_new_from_float (value_data, N_KEYFRAMES, item_size);
+
+  if (quaternion)
+    return gthree_quaternion_keyframe_track_new (name, times, values);
+  else
+    return gthree_vector_keyframe_track_new (name, times, values);
+}
+
+/* n_clips clips each animating position and rotation of all n_nodes
+ * nodes, all playing at once with different weights, so the mixer has
+ * to blend them */
+static void
+animation_benchmark_init (AnimationBenchmark *bench,
+                          int                 n_nodes,
+                          int                 n_clips)
+{
+  g_autoptr(GRand) rand = benchmark_rand_new ();
+  int i, j;
+
+  bench->root = GTHREE_OBJECT (gthree_group_new ());
+
+  for (i = 0; i < n_nodes; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("node%d", i);
+      GthreeObject *node = GTHREE_OBJECT (gthree_group_new ());
+
+      gthree_object_set_name (node, name);
+      gthree_object_add_child (bench->root, node);
+      g_object_unref (node);
+    }
+
+  bench->mixer = gthree_animation_mixer_new (bench->root);
+
+  for (i = 0; i < n_clips; i++)
+    {
+      g_autofree char *clip_name = g_strdup_printf ("clip%d", i);
+      g_autoptr(GthreeAnimationClip) clip = gthree_animation_clip_new (clip_name, -1);
+      GthreeAnimationAction *action;
+
+      for (j = 0; j < n_nodes; j++)
+        {
+          g_autofree char *position_name = g_strdup_printf ("node%d.position", j);
+          g_autofree char *quaternion_name = g_strdup_printf ("node%d.quaternion", j);
+          g_autoptr(GthreeKeyframeTrack) position = random_track (rand, position_name, FALSE);
+          g_autoptr(GthreeKeyframeTrack) quaternion = random_track (rand, quaternion_name, TRUE);
+
+          gthree_animation_clip_add_track (clip, position);
+          gthree_animation_clip_add_track (clip, quaternion);
+        }
+      gthree_animation_clip_reset_duration (clip);
+
+      action = gthree_animation_mixer_clip_action (bench->mixer, clip, NULL);
+      gthree_animation_action_set_loop_mode (action, GTHREE_LOOP_MODE_REPEAT, -1);
+      gthree_animation_action_set_effective_weight (action, 1.0 / (i + 1));
+      gthree_animation_action_play (action);
+    }
+}
+
+static void
+animation_benchmark_clear (AnimationBenchmark *bench)
+{
+  g_clear_object (&bench->mixer);
+  g_clear_object (&bench->root);
+}
+
+static void
+update (gpointer data)
+{
+  AnimationBenchmark *bench = data;
+  int i;
+
+  for (i = 0; i < N_STEPS; i++)
+    gthree_animation_mixer_update (bench->mixer, 1 / 60.0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  AnimationBenchmark bench;
+
+  benchmark_init (&argc, &argv, "animation");
+
+  animation_benchmark_init (&bench, 1000, 1);
+  benchmark_run ("mixer-update/1000-nodes-1-action", NULL, update, &bench);
+  animation_benchmark_clear (&bench);
+
+  animation_benchmark_init (&bench, 100, 32);
+  benchmark_run ("mixer-update/100-nodes-32-actions", NULL, update, &bench);
+  animation_benchmark_clear (&bench);
+
+  animation_benchmark_init (&bench, 1000, 8);
+  benchmark_run ("mixer-update/1000-nodes-8-actions", NULL, update, &bench);
+  animation_benchmark_clear (&bench);
+
+  return benchmark_finish ();
+}
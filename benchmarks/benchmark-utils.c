@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "benchmark-utils.h"
+
+static int n_iterations = 20;
+static int n_warmup_iterations = 3;
+static int seed = BENCHMARK_SEED;
+static char *filter = NULL;
+static char *output_file = NULL;
+
+static GOptionEntry entries[] = {
+  { "iterations", 'n', 0, G_OPTION_ARG_INT, &n_iterations, "Number of measured iterations per benchmark", "N" },
+  { "warmup", 'w', 0, G_OPTION_ARG_INT, &n_warmup_iterations, "Number of iterations run before measuring", "N" },
+  { "seed", 0, 0, G_OPTION_ARG_INT, &seed, "Random seed used to build the test data", "SEED" },
+  { "filter", 'f', 0, G_OPTION_ARG_STRING, &filter, "Only run benchmarks with names containing TEXT", "TEXT" },
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_file, "Write the JSON result to FILE instead of stdout", "FILE" },
+  { NULL }
+};
+
+static JsonBuilder *builder;
+
+void
+benchmark_init (int          *argc,
+                char       ***argv,
+                const char   *suite)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, argc, argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      exit (1);
+    }
+
+  if (n_iterations <= 0 || n_warmup_iterations < 0)
+    {
+      g_printerr ("Invalid iteration count\n");
+      exit (1);
+    }
+
+  builder = json_builder_new ();
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "suite");
+  json_builder_add_string_value (builder, suite);
+  json_builder_set_member_name (builder, "seed");
+  json_builder_add_int_value (builder, seed);
+  json_builder_set_member_name (builder, "iterations");
+  json_builder_add_int_value (builder, n_iterations);
+  json_builder_set_member_name (builder, "benchmarks");
+  json_builder_begin_array (builder);
+}
+
+/* The test data must only be generated from this, so that all runs
+ * measure the same work */
+GRand *
+benchmark_rand_new (void)
+{
+  return g_rand_new_with_seed (seed);
+}
+
+static int
+compare_double (gconstpointer a, gconstpointer b)
+{
+  double da = *(double *)a;
+  double db = *(double *)b;
+
+  return (da > db) - (da < db);
+}
+
+/* Nearest rank, times must be sorted */
+static double
+percentile (const double *times, int n_times, double p)
+{
+  int rank = (int)ceil (p / 100.0 * n_times);
+
+  return times[CLAMP (rank - 1, 0, n_times - 1)];
+}
+
+static void
+add_member (JsonBuilder *builder, const char *name, double value)
+{
+  json_builder_set_member_name (builder, name);
+  json_builder_add_double_value (builder, value);
+}
+
+/* Sorts times */
+void
+benchmark_add_times (JsonBuilder *builder,
+                     const char  *name,
+                     double      *times,
+                     int          n_times)
+{
+  double sum = 0;
+  int i;
+
+  qsort (times, n_times, sizeof (double), compare_double);
+  for (i = 0; i < n_times; i++)
+    sum += times[i];
+
+  json_builder_set_member_name (builder, name);
+  json_builder_begin_object (builder);
+  add_member (builder, "p50", percentile (times, n_times, 50));
+  add_member (builder, "p95", percentile (times, n_times, 95));
+  add_member (builder, "p99", percentile (times, n_times, 99));
+  add_member (builder, "min", times[0]);
+  add_member (builder, "max", times[n_times - 1]);
+  add_member (builder, "mean", sum / n_times);
+  json_builder_end_object (builder);
+}
+
+/* setup, if not NULL, is called before every iteration and is not
+ * part of the measured time */
+void
+benchmark_run (const char    *name,
+               BenchmarkFunc  setup,
+               BenchmarkFunc  func,
+               gpointer       data)
+{
+  g_autofree double *times = NULL;
+  int i;
+
+  if (filter != NULL && strstr (name, filter) == NULL)
+    return;
+
+  for (i = 0; i < n_warmup_iterations; i++)
+    {
+      if (setup)
+        setup (data);
+      func (data);
+    }
+
+  times = g_new (double, n_iterations);
+  for (i = 0; i < n_iterations; i++)
+    {
+      gint64 start;
+
+      if (setup)
+        setup (data);
+
+      start = g_get_monotonic_time ();
+      func (data);
+      times[i] = (g_get_monotonic_time () - start) / 1000.0;
+    }
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "name");
+  json_builder_add_string_value (builder, name);
+  benchmark_add_times (builder, "ms", times, n_iterations);
+  json_builder_end_object (builder);
+}
+
+int
+benchmark_finish (void)
+{
+  g_autoptr(JsonGenerator) generator = NULL;
+  g_autoptr(JsonNode) root = NULL;
+  g_autoptr(GError) error = NULL;
+
+  json_builder_end_array (builder);
+  json_builder_end_object (builder);
+
+  root = json_builder_get_root (builder);
+  generator = json_generator_new ();
+  json_generator_set_pretty (generator, TRUE);
+  json_generator_set_root (generator, root);
+  g_clear_object (&builder);
+
+  if (output_file)
+    {
+      if (!json_generator_to_file (generator, output_file, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          return 1;
+        }
+    }
+  else
+    {
+      g_autofree char *json = json_generator_to_data (generator, NULL);
+      g_print ("%s\n", json);
+    }
+
+  return 0;
+}
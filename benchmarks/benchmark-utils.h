@@ -0,0 +1,31 @@
+#ifndef __BENCHMARK_UTILS_H__
+#define __BENCHMARK_UTILS_H__
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+G_BEGIN_DECLS
+
+typedef void (*BenchmarkFunc) (gpointer data);
+
+/* Shared by all cpu benchmarks, so results can be compared between runs */
+#define BENCHMARK_SEED 4711
+
+void     benchmark_init      (int            *argc,
+                              char         ***argv,
+                              const char     *suite);
+GRand *  benchmark_rand_new  (void);
+void     benchmark_run       (const char     *name,
+                              BenchmarkFunc   setup,
+                              BenchmarkFunc   func,
+                              gpointer        data);
+int      benchmark_finish    (void);
+
+void     benchmark_add_times (JsonBuilder    *builder,
+                              const char     *name,
+                              double         *times,
+                              int             n_times);
+
+G_END_DECLS
+
+#endif /* __BENCHMARK_UTILS_H__ */
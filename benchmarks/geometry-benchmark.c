@@ -0,0 +1,108 @@
+/* Times vertex normal and bounding volume computation */
+
+#include <gthree/gthree.h>
+
+#include "benchmark-utils.h"
+
+static GBytes *
+load_model (const char *name)
+{
+  g_autofree char *path = g_build_filename (MODELSDIR, name, NULL);
+  g_autoptr(GError) error = NULL;
+  char *data;
+  gsize size;
+
+  if (!g_file_get_contents (path, &data, &size, &error))
+    g_error ("Can't load model %s: %s", name, error->message);
+
+  return g_bytes_new_take (data, size);
+}
+
+static gboolean
+find_mesh_geometry (GthreeObject *object,
+                    gpointer      user_data)
+{
+  GthreeGeometry **geometry = user_data;
+
+  if (*geometry == NULL && GTHREE_IS_MESH (object))
+    *geometry = g_object_ref (gthree_mesh_get_geometry (GTHREE_MESH (object)));
+
+  return *geometry == NULL;
+}
+
+static GthreeGeometry *
+load_gltf_geometry (const char *name)
+{
+  g_autoptr(GBytes) bytes = load_model (name);
+  g_autoptr(GthreeLoader) loader = NULL;
+  g_autoptr(GError) error = NULL;
+  GthreeGeometry *geometry = NULL;
+
+  loader = gthree_loader_parse_gltf (bytes, NULL, &error);
+  if (loader == NULL)
+    g_error ("Can't parse model %s: %s", name, error->message);
+
+  gthree_object_traverse (GTHREE_OBJECT (gthree_loader_get_scene (loader, 0)),
+                          find_mesh_geometry, &geometry);
+  if (geometry == NULL)
+    g_error ("No mesh in %s", name);
+
+  return geometry;
+}
+
+static GthreeGeometry *
+load_json_geometry (const char *name)
+{
+  g_autoptr(GBytes) bytes = load_model (name);
+  g_autoptr(GError) error = NULL;
+  GthreeGeometry *geometry;
+
+  geometry = gthree_load_geometry_from_json (g_bytes_get_data (bytes, NULL), &error);
+  if (geometry == NULL)
+    g_error ("Can't parse model %s: %s", name, error->message);
+
+  return geometry;
+}
+
+static void
+compute_vertex_normals (gpointer data)
+{
+  gthree_geometry_compute_vertex_normals (data);
+}
+
+static void
+invalidate_bounds (gpointer data)
+{
+  gthree_geometry_invalidate_bounds (data);
+}
+
+static void
+compute_bounding_sphere (gpointer data)
+{
+  gthree_geometry_get_bounding_sphere (data);
+}
+
+static void
+run_geometry (const char     *name,
+              GthreeGeometry *geometry)
+{
+  g_autofree char *normals_name = g_strdup_printf ("compute-vertex-normals/%s", name);
+  g_autofree char *sphere_name = g_strdup_printf ("bounding-sphere/%s", name);
+
+  benchmark_run (normals_name, NULL, compute_vertex_normals, geometry);
+  benchmark_run (sphere_name, invalidate_bounds, compute_bounding_sphere, geometry);
+  g_object_unref (geometry);
+}
+
+int
+main (int argc, char *argv[])
+{
+  benchmark_init (&argc, &argv, "geometry");
+
+  run_geometry ("suzanne", load_json_geometry ("Suzanne.js"));
+  run_geometry ("lee-perry-smith", load_gltf_geometry ("LeePerrySmith/LeePerrySmith.glb"));
+  /* 512 * 256 * 2 triangles */
+  run_geometry ("sphere-262k", gthree_geometry_new_sphere (1, 512, 256));
+
+  return benchmark_finish ();
+}
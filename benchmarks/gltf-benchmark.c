@@ -0,0 +1,48 @@
+/* Times gthree_loader_parse_gltf() on the bundled models */
+
+#include <gthree/gthree.h>
+
+#include "benchmark-utils.h"
+
+static void
+parse_gltf (gpointer data)
+{
+  g_autoptr(GthreeLoader) loader = NULL;
+  g_autoptr(GError) error = NULL;
+
+  loader = gthree_loader_parse_gltf (data, NULL, &error);
+  if (loader == NULL)
+    g_error ("Can't parse model: %s", error->message);
+}
+
+static void
+run_model (const char *name,
+           const char *file)
+{
+  g_autofree char *path = g_build_filename (MODELSDIR, file, NULL);
+  g_autofree char *benchmark_name = g_strdup_printf ("parse-gltf/%s", name);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+  char *data;
+  gsize size;
+
+  /* Reading the file is not part of the measurement */
+  if (!g_file_get_contents (path, &data, &size, &error))
+    g_error ("Can't load model %s: %s", file, error->message);
+  bytes = g_bytes_new_take (data, size);
+
+  benchmark_run (benchmark_name, NULL, parse_gltf, bytes);
+}
+
+int
+main (int argc, char *argv[])
+{
+  benchmark_init (&argc, &argv, "gltf");
+
+  run_model ("lee-perry-smith", "LeePerrySmith/LeePerrySmith.glb");
+  run_model ("robot-expressive", "RobotExpressive.glb");
+  run_model ("soldier", "Soldier.glb");
+  run_model ("littlest-tokyo", "LittlestTokyo.glb");
+
+  return benchmark_finish ();
+}
@@ -0,0 +1,105 @@
+/* Times gthree_raycaster_intersect_objects() against high poly meshes */
+
+#include <gthree/gthree.h>
+
+#include "benchmark-utils.h"
+
+#define N_MESHES 16
+#define N_RAYS 100
+
+typedef struct {
+  GthreeObject *root;
+  GthreeObject *meshes[N_MESHES];
+  graphene_ray_t rays[N_RAYS];
+  GthreeRaycaster *raycaster;
+  gboolean recurse;
+} RaycastBenchmark;
+
+static void
+raycast_benchmark_init (RaycastBenchmark *bench,
+                        int               sphere_segments)
+{
+  g_autoptr(GRand) rand = benchmark_rand_new ();
+  g_autoptr(GthreeGeometry) geometry = NULL;
+  g_autoptr(GthreeMeshBasicMaterial) material = NULL;
+  graphene_point3d_t origin = GRAPHENE_POINT3D_INIT (0, 0, 200);
+  int i;
+
+  bench->raycaster = gthree_raycaster_new ();
+  bench->root = GTHREE_OBJECT (gthree_group_new ());
+
+  /* About sphere_segments^2 triangles each */
+  geometry = gthree_geometry_new_sphere (10, sphere_segments, sphere_segments / 2);
+  material = gthree_mesh_basic_material_new ();
+
+  for (i = 0; i < N_MESHES; i++)
+    {
+      GthreeMesh *mesh = gthree_mesh_new (geometry, GTHREE_MATERIAL (material));
+
+      gthree_object_set_position_xyz (GTHREE_OBJECT (mesh),
+                                      (i % 4) * 30 - 45, (i / 4) * 30 - 45, 0);
+      gthree_object_add_child (bench->root, GTHREE_OBJECT (mesh));
+      bench->meshes[i] = GTHREE_OBJECT (mesh);
+      g_object_unref (mesh);
+    }
+
+  gthree_object_update_matrix_world (bench->root, TRUE);
+
+  /* Aimed at the meshes, with some missing them */
+  for (i = 0; i < N_RAYS; i++)
+    {
+      graphene_vec3_t target, direction;
+
+      graphene_vec3_init (&target,
+                          g_rand_double_range (rand, -60, 60),
+                          g_rand_double_range (rand, -60, 60),
+                          0);
+      graphene_vec3_subtract (&target, graphene_vec3_init (&direction, origin.x, origin.y, origin.z), &direction);
+      graphene_ray_init (&bench->rays[i], &origin, &direction);
+    }
+}
+
+static void
+raycast_benchmark_clear (RaycastBenchmark *bench)
+{
+  g_clear_object (&bench->root);
+  g_clear_object (&bench->raycaster);
+}
+
+static void
+intersect (gpointer data)
+{
+  RaycastBenchmark *bench = data;
+  int i;
+
+  for (i = 0; i < N_RAYS; i++)
+    {
+      g_autoptr(GPtrArray) intersections = NULL;
+
+      gthree_raycaster_set_ray (bench->raycaster, &bench->rays[i]);
+      if (bench->recurse)
+        intersections = gthree_raycaster_intersect_objects (bench->raycaster, &bench->root, 1, TRUE, NULL);
+      else
+        intersections = gthree_raycaster_intersect_objects (bench->raycaster, bench->meshes, N_MESHES, FALSE, NULL);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  RaycastBenchmark bench = { 0 };
+
+  benchmark_init (&argc, &argv, "raycast");
+
+  raycast_benchmark_init (&bench, 64);
+  benchmark_run ("intersect-objects/4k-triangles", NULL, intersect, &bench);
+  raycast_benchmark_clear (&bench);
+
+  raycast_benchmark_init (&bench, 256);
+  benchmark_run ("intersect-objects/65k-triangles", NULL, intersect, &bench);
+  bench.recurse = TRUE;
+  benchmark_run ("intersect-objects/65k-triangles-recursive", NULL, intersect, &bench);
+  raycast_benchmark_clear (&bench);
+
+  return benchmark_finish ();
+}
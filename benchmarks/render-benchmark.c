@@ -0,0 +1,808 @@
+/* Headless frame time benchmark
+ *
+ * Renders a fixed set of scenes for a fixed number of frames into an
+ * offscreen framebuffer, using an EGL context that needs no display
+ * (surfaceless if available, otherwise a pbuffer). This runs fine on
+ * Mesa llvmpipe, e.g. with LIBGL_ALWAYS_SOFTWARE=1.
+ *
+ * The result is written as JSON, with the p50/p95/p99 frame times and
+ * the average renderer statistics per frame for each scene.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <epoxy/gl.h>
+#include <epoxy/egl.h>
+#include <json-glib/json-glib.h>
+
+#include <gthree/gthree.h>
+
+#include "benchmark-utils.h"
+
+typedef struct _Benchmark Benchmark;
+
+typedef struct {
+  const char *name;
+  void (*setup) (Benchmark *bench);
+  void (*frame) (Benchmark *bench, int frame);
+} BenchmarkScene;
+
+struct _Benchmark {
+  int width;
+  int height;
+
+  GthreeRenderer *renderer;
+  GthreeRenderTarget *render_target;
+
+  GRand *rand;
+  GthreeScene *scene;
+  GthreePerspectiveCamera *camera;
+  GthreeLoader *loader;
+  GthreeAnimationMixer *mixer;
+  GthreeEffectComposer *composer;
+  GPtrArray *objects;
+  graphene_point3d_t center;
+  float radius;
+};
+
+static int n_frames = 100;
+static int n_warmup_frames = 10;
+static int width = 1280;
+static int height = 720;
+static char **scene_names = NULL;
+static char *output_file = NULL;
+
+static GOptionEntry entries[] = {
+  { "frames", 'n', 0, G_OPTION_ARG_INT, &n_frames, "Number of measured frames per scene", "N" },
+  { "warmup", 'w', 0, G_OPTION_ARG_INT, &n_warmup_frames, "Number of frames rendered before measuring", "N" },
+  { "width", 0, 0, G_OPTION_ARG_INT, &width, "Width of the framebuffer", "WIDTH" },
+  { "height", 0, 0, G_OPTION_ARG_INT, &height, "Height of the framebuffer", "HEIGHT" },
+  { "scene", 's', 0, G_OPTION_ARG_STRING_ARRAY, &scene_names, "Only run this scene (can be repeated)", "NAME" },
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_file, "Write the JSON result to FILE instead of stdout", "FILE" },
+  { NULL }
+};
+
+/* GL context */
+
+static gboolean
+has_extension (const char *extensions, const char *name)
+{
+  return extensions != NULL && epoxy_extension_in_string (extensions, name);
+}
+
+static gboolean
+init_egl (void)
+{
+  static const EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_ALPHA_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_NONE
+  };
+  static const EGLint context_attribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 2,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  static const EGLint pbuffer_attribs[] = {
+    EGL_WIDTH, 1,
+    EGL_HEIGHT, 1,
+    EGL_NONE
+  };
+  const char *client_extensions;
+  EGLDisplay display = EGL_NO_DISPLAY;
+  EGLConfig config;
+  EGLContext context;
+  EGLSurface surface = EGL_NO_SURFACE;
+  EGLint n_configs;
+
+  client_extensions = eglQueryString (EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+  if (has_extension (client_extensions, "EGL_MESA_platform_surfaceless"))
+    display = eglGetPlatformDisplayEXT (EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+
+  if (display == EGL_NO_DISPLAY)
+    display = eglGetDisplay (EGL_DEFAULT_DISPLAY);
+
+  if (display == EGL_NO_DISPLAY || !eglInitialize (display, NULL, NULL))
+    {
+      g_printerr ("Can't initialize EGL display\n");
+      return FALSE;
+    }
+
+  if (!eglBindAPI (EGL_OPENGL_API))
+    {
+      g_printerr ("EGL has no desktop OpenGL support\n");
+      return FALSE;
+    }
+
+  if (!eglChooseConfig (display, config_attribs, &config, 1, &n_configs) || n_configs == 0)
+    {
+      g_printerr ("No suitable EGL config\n");
+      return FALSE;
+    }
+
+  context = eglCreateContext (display, config, EGL_NO_CONTEXT, context_attribs);
+  if (context == EGL_NO_CONTEXT)
+    {
+      g_printerr ("Can't create an OpenGL 3.2 core context\n");
+      return FALSE;
+    }
+
+  if (!has_extension (eglQueryString (display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context"))
+    surface = eglCreatePbufferSurface (display, config, pbuffer_attribs);
+
+  if (!eglMakeCurrent (display, surface, surface, context))
+    {
+      g_printerr ("Can't make EGL context current\n");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* The renderer treats the framebuffer bound when it is created as the
+ * window, so this is where passes that render to the screen end up */
+static void
+init_framebuffer (int fb_width, int fb_height)
+{
+  GLuint framebuffer, renderbuffers[2];
+
+  glGenFramebuffers (1, &framebuffer);
+  glBindFramebuffer (GL_FRAMEBUFFER, framebuffer);
+
+  glGenRenderbuffers (2, renderbuffers);
+  glBindRenderbuffer (GL_RENDERBUFFER, renderbuffers[0]);
+  glRenderbufferStorage (GL_RENDERBUFFER, GL_RGBA8, fb_width, fb_height);
+  glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+  glBindRenderbuffer (GL_RENDERBUFFER, renderbuffers[1]);
+  glRenderbufferStorage (GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, fb_width, fb_height);
+  glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+
+  if (glCheckFramebufferStatus (GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    g_error ("Offscreen framebuffer is incomplete");
+
+  glViewport (0, 0, fb_width, fb_height);
+}
+
+/* Helpers */
+
+static GBytes *
+load_model (const char *name)
+{
+  g_autofree char *path = g_build_filename (MODELSDIR, name, NULL);
+  g_autoptr(GError) error = NULL;
+  char *data;
+  gsize size;
+
+  if (!g_file_get_contents (path, &data, &size, &error))
+    g_error ("Can't load model %s: %s", name, error->message);
+
+  return g_bytes_new_take (data, size);
+}
+
+static GthreeLoader *
+load_gltf (const char *name)
+{
+  g_autoptr(GBytes) bytes = load_model (name);
+  g_autoptr(GError) error = NULL;
+  GthreeLoader *loader;
+
+  loader = gthree_loader_parse_gltf (bytes, NULL, &error);
+  if (loader == NULL)
+    g_error ("Can't parse model %s: %s", name, error->message);
+
+  return loader;
+}
+
+/* Takes ownership of the object */
+static void
+scene_add (Benchmark *bench, gpointer object)
+{
+  gthree_object_add_child (GTHREE_OBJECT (bench->scene), GTHREE_OBJECT (object));
+  g_object_unref (object);
+}
+
+static void
+add_camera (Benchmark *bench, float fov, float near, float far)
+{
+  bench->camera = gthree_perspective_camera_new (fov, (float)bench->width / bench->height, near, far);
+  scene_add (bench, bench->camera);
+}
+
+/* Point the camera at the scene center from an angle that depends on the frame only */
+static void
+orbit_camera (Benchmark *bench, int frame, float distance, float elevation)
+{
+  float angle = frame * 0.01f;
+
+  gthree_object_set_position_xyz (GTHREE_OBJECT (bench->camera),
+                                  bench->center.x + sinf (angle) * distance,
+                                  bench->center.y + elevation,
+                                  bench->center.z + cosf (angle) * distance);
+  gthree_object_look_at_xyz (GTHREE_OBJECT (bench->camera),
+                             bench->center.x, bench->center.y, bench->center.z);
+}
+
+static void
+get_scene_size (Benchmark *bench, GthreeObject *object)
+{
+  graphene_box_t box;
+  graphene_vec3_t size;
+
+  gthree_object_update_matrix_world (object, TRUE);
+  gthree_object_get_mesh_extents (object, &box);
+
+  graphene_box_get_center (&box, &bench->center);
+  graphene_box_get_size (&box, &size);
+  bench->radius = graphene_vec3_length (&size) / 2;
+}
+
+static void
+add_default_lights (Benchmark *bench)
+{
+  GthreeHemisphereLight *hemi_light;
+  GthreeDirectionalLight *directional_light;
+  graphene_vec3_t sky, ground, white;
+
+  graphene_vec3_init (&sky, 1, 1, 1);
+  graphene_vec3_init (&ground, 0.27, 0.27, 0.27);
+  graphene_vec3_init (&white, 1, 1, 1);
+
+  hemi_light = gthree_hemisphere_light_new (&sky, &ground, 1);
+  scene_add (bench, hemi_light);
+
+  directional_light = gthree_directional_light_new (&white, 0.8);
+  gthree_object_set_position_xyz (GTHREE_OBJECT (directional_light), -3, 10, -10);
+  scene_add (bench, directional_light);
+}
+
+static void
+play_all_animations (Benchmark *bench, GthreeObject *root, int max_clips)
+{
+  int i;
+
+  bench->mixer = gthree_animation_mixer_new (root);
+
+  for (i = 0; i < gthree_loader_get_n_animations (bench->loader) && i < max_clips; i++)
+    {
+      GthreeAnimationClip *clip = gthree_loader_get_animation (bench->loader, i);
+      GthreeAnimationAction *action = gthree_animation_mixer_clip_action (bench->mixer, clip, NULL);
+
+      gthree_animation_action_set_loop_mode (action, GTHREE_LOOP_MODE_REPEAT, -1);
+      gthree_animation_action_play (action);
+    }
+}
+
+/* Scenes */
+
+static void
+suzannes_add (Benchmark *bench, int count, GthreeMaterial *material)
+{
+  g_autoptr(GBytes) bytes = load_model ("Suzanne.js");
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GthreeGeometry) geometry = NULL;
+  int i;
+
+  geometry = gthree_load_geometry_from_json (g_bytes_get_data (bytes, NULL), &error);
+  if (geometry == NULL)
+    g_error ("Can't parse Suzanne.js: %s", error->message);
+  gthree_geometry_compute_vertex_normals (geometry);
+
+  for (i = 0; i < count; i++)
+    {
+      GthreeMesh *mesh = gthree_mesh_new (geometry, material);
+
+      gthree_object_set_position_xyz (GTHREE_OBJECT (mesh),
+                                      g_rand_double_range (bench->rand, -4000, 4000),
+                                      g_rand_double_range (bench->rand, -4000, 4000),
+                                      g_rand_double_range (bench->rand, -4000, 4000));
+      gthree_object_set_scale_uniform (GTHREE_OBJECT (mesh),
+                                       g_rand_double_range (bench->rand, 100, 150));
+      gthree_object_set_rotation_xyz (GTHREE_OBJECT (mesh),
+                                      g_rand_double_range (bench->rand, 0, 360),
+                                      g_rand_double_range (bench->rand, 0, 360),
+                                      0);
+      scene_add (bench, mesh);
+      g_ptr_array_add (bench->objects, mesh);
+    }
+}
+
+static void
+suzannes_rotate (Benchmark *bench)
+{
+  guint i;
+
+  for (i = 0; i < bench->objects->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (bench->objects, i);
+      const graphene_euler_t *rot = gthree_object_get_rotation (object);
+
+      gthree_object_set_rotation_xyz (object,
+                                      graphene_euler_get_x (rot) + 0.57f,
+                                      graphene_euler_get_y (rot) + 1.15f,
+                                      graphene_euler_get_z (rot));
+    }
+}
+
+static void
+suzannes_setup (Benchmark *bench)
+{
+  g_autoptr(GthreeMeshNormalMaterial) material = gthree_mesh_normal_material_new ();
+
+  gthree_mesh_normal_material_set_shading_type (material, GTHREE_SHADING_SMOOTH);
+  suzannes_add (bench, 5000, GTHREE_MATERIAL (material));
+  add_camera (bench, 60, 1, 10000);
+}
+
+static void
+suzannes_frame (Benchmark *bench, int frame)
+{
+  suzannes_rotate (bench);
+  orbit_camera (bench, frame, 3200, 0);
+  gthree_renderer_render (bench->renderer, bench->scene, GTHREE_CAMERA (bench->camera));
+}
+
+static void
+soldier_setup (Benchmark *bench)
+{
+  GthreeScene *loader_scene;
+
+  bench->loader = load_gltf ("Soldier.glb");
+  loader_scene = gthree_loader_get_scene (bench->loader, 0);
+  gthree_object_add_child (GTHREE_OBJECT (bench->scene), GTHREE_OBJECT (loader_scene));
+
+  /* Blend the first two clips (idle and run), like the skeleton example */
+  play_all_animations (bench, GTHREE_OBJECT (loader_scene), 2);
+
+  add_default_lights (bench);
+  add_camera (bench, 45, 0.1, 100);
+  bench->center.y = 1;
+}
+
+static void
+animated_frame (Benchmark *bench, int frame, float distance, float elevation)
+{
+  gthree_animation_mixer_update (bench->mixer, 1 / 60.0);
+  orbit_camera (bench, frame, distance, elevation);
+  gthree_renderer_render (bench->renderer, bench->scene, GTHREE_CAMERA (bench->camera));
+}
+
+static void
+soldier_frame (Benchmark *bench, int frame)
+{
+  animated_frame (bench, frame, 4, 1);
+}
+
+static void
+tokyo_setup (Benchmark *bench)
+{
+  GthreeScene *loader_scene;
+
+  bench->loader = load_gltf ("LittlestTokyo.glb");
+  loader_scene = gthree_loader_get_scene (bench->loader, 0);
+  gthree_object_add_child (GTHREE_OBJECT (bench->scene), GTHREE_OBJECT (loader_scene));
+
+  play_all_animations (bench, GTHREE_OBJECT (loader_scene), G_MAXINT);
+
+  add_default_lights (bench);
+  get_scene_size (bench, GTHREE_OBJECT (loader_scene));
+  add_camera (bench, 40, bench->radius / 1000, bench->radius * 100);
+}
+
+static void
+tokyo_frame (Benchmark *bench, int frame)
+{
+  animated_frame (bench, frame, bench->radius * 2, bench->radius * 0.5);
+}
+
+static void
+shadows_setup (Benchmark *bench)
+{
+  g_autoptr(GthreeGeometry) sphere_geometry = gthree_geometry_new_sphere (20, 32, 16);
+  g_autoptr(GthreeGeometry) box_geometry = gthree_geometry_new_box (30, 30, 30, 1, 1, 1);
+  g_autoptr(GthreeGeometry) floor_geometry = gthree_geometry_new_box (1000, 10, 1000, 40, 1, 40);
+  g_autoptr(GthreeMeshPhongMaterial) material = gthree_mesh_phong_material_new ();
+  GthreeDirectionalLight *directional_light;
+  GthreeSpotLight *spot_light;
+  GthreePointLight *point_light;
+  GthreeAmbientLight *ambient_light;
+  GthreeLightShadow *shadow;
+  GthreeCamera *shadow_camera;
+  GthreeMesh *floor;
+  graphene_vec3_t color;
+  int x, z;
+
+  gthree_renderer_set_shadow_map_enabled (bench->renderer, TRUE);
+
+  gthree_mesh_phong_material_set_color (material, graphene_vec3_init (&color, 0.8, 0.8, 0.8));
+
+  for (x = -5; x < 5; x++)
+    for (z = -5; z < 5; z++)
+      {
+        GthreeMesh *mesh = gthree_mesh_new ((x + z) & 1 ? sphere_geometry : box_geometry,
+                                            GTHREE_MATERIAL (material));
+
+        gthree_object_set_position_xyz (GTHREE_OBJECT (mesh), x * 80 + 40, 30, z * 80 + 40);
+        gthree_object_set_cast_shadow (GTHREE_OBJECT (mesh), TRUE);
+        gthree_object_set_receive_shadow (GTHREE_OBJECT (mesh), TRUE);
+        scene_add (bench, mesh);
+        g_ptr_array_add (bench->objects, mesh);
+      }
+
+  floor = gthree_mesh_new (floor_geometry, GTHREE_MATERIAL (material));
+  gthree_object_set_position_xyz (GTHREE_OBJECT (floor), 0, -5, 0);
+  gthree_object_set_receive_shadow (GTHREE_OBJECT (floor), TRUE);
+  scene_add (bench, floor);
+
+  ambient_light = gthree_ambient_light_new (graphene_vec3_init (&color, 0.07, 0.07, 0.07));
+  scene_add (bench, ambient_light);
+
+  directional_light = gthree_directional_light_new (graphene_vec3_init (&color, 0, 1, 0), 0.3);
+  gthree_object_set_cast_shadow (GTHREE_OBJECT (directional_light), TRUE);
+  gthree_object_set_position_xyz (GTHREE_OBJECT (directional_light), 0, 200, 200);
+  scene_add (bench, directional_light);
+
+  shadow = gthree_light_get_shadow (GTHREE_LIGHT (directional_light));
+  shadow_camera = gthree_light_shadow_get_camera (shadow);
+  gthree_orthographic_camera_set_left (GTHREE_ORTHOGRAPHIC_CAMERA (shadow_camera), -500);
+  gthree_orthographic_camera_set_right (GTHREE_ORTHOGRAPHIC_CAMERA (shadow_camera), 500);
+  gthree_orthographic_camera_set_top (GTHREE_ORTHOGRAPHIC_CAMERA (shadow_camera), 500);
+  gthree_orthographic_camera_set_bottom (GTHREE_ORTHOGRAPHIC_CAMERA (shadow_camera), -500);
+  gthree_camera_set_far (shadow_camera, 1000);
+
+  spot_light = gthree_spot_light_new (graphene_vec3_init (&color, 0, 0, 1), 1.5, 5000, G_PI / 4, 0.2);
+  gthree_object_set_cast_shadow (GTHREE_OBJECT (spot_light), TRUE);
+  gthree_object_set_position_xyz (GTHREE_OBJECT (spot_light), 300, 400, 0);
+  scene_add (bench, spot_light);
+
+  /* The point light renders six shadow map faces */
+  point_light = gthree_point_light_new (graphene_vec3_init (&color, 1, 0, 0), 0.5, 0);
+  gthree_object_set_cast_shadow (GTHREE_OBJECT (point_light), TRUE);
+  gthree_object_set_position_xyz (GTHREE_OBJECT (point_light), 0, 150, 0);
+  scene_add (bench, point_light);
+
+  shadow = gthree_light_get_shadow (GTHREE_LIGHT (point_light));
+  shadow_camera = gthree_light_shadow_get_camera (shadow);
+  gthree_camera_set_far (shadow_camera, 1000);
+
+  add_camera (bench, 45, 1, 4000);
+}
+
+static void
+shadows_frame (Benchmark *bench, int frame)
+{
+  guint i;
+
+  /* Moving casters means the shadow maps change each frame */
+  for (i = 0; i < bench->objects->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (bench->objects, i);
+      const graphene_vec3_t *pos = gthree_object_get_position (object);
+
+      gthree_object_set_position_xyz (object,
+                                      graphene_vec3_get_x (pos),
+                                      30 + 20 * sinf (frame * 0.05f + i),
+                                      graphene_vec3_get_z (pos));
+    }
+
+  orbit_camera (bench, frame, 1200, 600);
+  gthree_renderer_render (bench->renderer, bench->scene, GTHREE_CAMERA (bench->camera));
+}
+
+static const char *vertex_shader =
+  "varying vec2 vUv;\n"
+  "void main()\n"
+  "{\n"
+  "  vUv = uv;\n"
+  "  gl_Position = projectionMatrix * modelViewMatrix * vec4( position, 1.0 );\n"
+  "}\n";
+
+static const char *fragment_greyscale_shader =
+  "uniform sampler2D tDiffuse;\n"
+  "varying vec2 vUv;\n"
+  "void main(void)\n"
+  "{\n"
+  "  vec4 c = texture2D( tDiffuse, vUv );\n"
+  "  gl_FragColor = vec4( vec3( c.r * 0.3 + c.g * 0.59 + c.b * 0.11 ), 1.0 );\n"
+  "}\n";
+
+static GthreeUniformsDefinition greyscale_uniforms_defs[] = {
+  {"tDiffuse", GTHREE_UNIFORM_TYPE_TEXTURE, NULL },
+};
+
+static void
+postprocessing_setup (Benchmark *bench)
+{
+  g_autoptr(GthreeMeshNormalMaterial) material = gthree_mesh_normal_material_new ();
+  g_autoptr(GthreeShader) greyscale_shader = NULL;
+  g_autoptr(GthreePass) render_pass = NULL;
+  g_autoptr(GthreePass) bloom_pass = NULL;
+  g_autoptr(GthreePass) greyscale_pass = NULL;
+  GthreeUniforms *uniforms;
+
+  suzannes_add (bench, 500, GTHREE_MATERIAL (material));
+  add_camera (bench, 60, 1, 10000);
+
+  uniforms = gthree_uniforms_new_from_definitions (greyscale_uniforms_defs,
+                                                   G_N_ELEMENTS (greyscale_uniforms_defs));
+  greyscale_shader = gthree_shader_new (NULL, uniforms, vertex_shader, fragment_greyscale_shader);
+  g_object_unref (uniforms);
+
+  render_pass = gthree_render_pass_new (bench->scene, GTHREE_CAMERA (bench->camera), NULL);
+  bloom_pass = gthree_bloom_pass_new (2, 4.0, 256);
+  greyscale_pass = gthree_shader_pass_new (greyscale_shader, NULL);
+
+  bench->composer = gthree_effect_composer_new ();
+  gthree_effect_composer_add_pass (bench->composer, render_pass);
+  gthree_effect_composer_add_pass (bench->composer, bloom_pass);
+  gthree_effect_composer_add_pass (bench->composer, greyscale_pass);
+  gthree_effect_composer_set_size (bench->composer, bench->width, bench->height);
+}
+
+static void
+postprocessing_frame (Benchmark *bench, int frame)
+{
+  suzannes_rotate (bench);
+  orbit_camera (bench, frame, 3200, 0);
+  gthree_effect_composer_render (bench->composer, bench->renderer, 1 / 60.0);
+}
+
+static const BenchmarkScene scenes[] = {
+  { "suzannes", suzannes_setup, suzannes_frame },
+  { "soldier", soldier_setup, soldier_frame },
+  { "littlest-tokyo", tokyo_setup, tokyo_frame },
+  { "shadows", shadows_setup, shadows_frame },
+  { "postprocessing", postprocessing_setup, postprocessing_frame },
+};
+
+/* Results */
+
+static void
+add_stats (GthreeRenderStats *sum, const GthreeRenderStats *stats, int sign)
+{
+  sum->draw_calls += sign * stats->draw_calls;
+  sum->triangles += sign * stats->triangles;
+  sum->lines += sign * stats->lines;
+  sum->points += sign * stats->points;
+  sum->program_switches += sign * stats->program_switches;
+  sum->material_refreshes += sign * stats->material_refreshes;
+  sum->uniform_uploads += sign * stats->uniform_uploads;
+  sum->buffer_upload_bytes += sign * stats->buffer_upload_bytes;
+  sum->texture_upload_bytes += sign * stats->texture_upload_bytes;
+  sum->shadow_map_renders += sign * stats->shadow_map_renders;
+  sum->objects_drawn += sign * stats->objects_drawn;
+  sum->objects_culled += sign * stats->objects_culled;
+  sum->occlusion_queries += sign * stats->occlusion_queries;
+  sum->programs_evicted += sign * stats->programs_evicted;
+  sum->program_bytes_evicted += sign * stats->program_bytes_evicted;
+}
+
+/* Everything counted so far, including the frame not yet reset */
+static void
+get_all_stats (GthreeRenderer *renderer, GthreeRenderStats *stats, GthreeRendererInfo *info)
+{
+  gthree_renderer_get_info (renderer, info);
+
+  memset (stats, 0, sizeof (GthreeRenderStats));
+  add_stats (stats, &info->total, 1);
+  add_stats (stats, &info->frame, 1);
+}
+
+static void
+add_member (JsonBuilder *builder, const char *name, double value)
+{
+  json_builder_set_member_name (builder, name);
+  json_builder_add_double_value (builder, value);
+}
+
+static void
+add_stats_per_frame (JsonBuilder *builder, const GthreeRenderStats *stats, int n)
+{
+  json_builder_set_member_name (builder, "per_frame");
+  json_builder_begin_object (builder);
+  add_member (builder, "draw_calls", (double)stats->draw_calls / n);
+  add_member (builder, "triangles", (double)stats->triangles / n);
+  add_member (builder, "lines", (double)stats->lines / n);
+  add_member (builder, "points", (double)stats->points / n);
+  add_member (builder, "program_switches", (double)stats->program_switches / n);
+  add_member (builder, "material_refreshes", (double)stats->material_refreshes / n);
+  add_member (builder, "uniform_uploads", (double)stats->uniform_uploads / n);
+  add_member (builder, "buffer_upload_bytes", (double)stats->buffer_upload_bytes / n);
+  add_member (builder, "texture_upload_bytes", (double)stats->texture_upload_bytes / n);
+  add_member (builder, "shadow_map_renders", (double)stats->shadow_map_renders / n);
+  add_member (builder, "objects_drawn", (double)stats->objects_drawn / n);
+  add_member (builder, "objects_culled", (double)stats->objects_culled / n);
+  add_member (builder, "occlusion_queries", (double)stats->occlusion_queries / n);
+  add_member (builder, "programs_evicted", (double)stats->programs_evicted / n);
+  add_member (builder, "program_bytes_evicted", (double)stats->program_bytes_evicted / n);
+  json_builder_end_object (builder);
+}
+
+static void
+add_memory (JsonBuilder *builder, const GthreeRendererInfo *info)
+{
+  json_builder_set_member_name (builder, "memory");
+  json_builder_begin_object (builder);
+  add_member (builder, "programs", info->programs);
+  add_member (builder, "program_bytes", info->program_bytes);
+  add_member (builder, "geometries", info->geometries);
+  add_member (builder, "geometry_bytes", info->geometry_bytes);
+  add_member (builder, "textures", info->textures);
+  add_member (builder, "texture_bytes", info->texture_bytes);
+  add_member (builder, "render_targets", info->render_targets);
+  add_member (builder, "render_target_bytes", info->render_target_bytes);
+  json_builder_end_object (builder);
+}
+
+static void
+run_scene (const BenchmarkScene *scene, JsonBuilder *builder)
+{
+  Benchmark bench = { 0 };
+  GthreeRenderStats start_stats, stats;
+  GthreeRendererInfo info;
+  g_autofree double *cpu_times = g_new (double, n_frames);
+  g_autofree double *frame_times = g_new (double, n_frames);
+  gint64 start;
+  double setup_ms;
+  int i;
+
+  bench.width = width;
+  bench.height = height;
+  bench.rand = g_rand_new_with_seed (BENCHMARK_SEED);
+  bench.objects = g_ptr_array_new ();
+
+  bench.renderer = gthree_renderer_new ();
+  gthree_renderer_set_size (bench.renderer, width, height);
+  bench.render_target = gthree_render_target_new (width, height);
+
+  start = g_get_monotonic_time ();
+  bench.scene = gthree_scene_new ();
+  scene->setup (&bench);
+  setup_ms = (g_get_monotonic_time () - start) / 1000.0;
+
+  /* The composer renders its final pass to the window framebuffer */
+  if (bench.composer == NULL)
+    gthree_renderer_set_render_target (bench.renderer, bench.render_target, 0, 0);
+
+  /* The warmup compiles the programs and uploads the buffers */
+  for (i = 0; i < n_warmup_frames; i++)
+    scene->frame (&bench, i);
+  glFinish ();
+
+  get_all_stats (bench.renderer, &start_stats, &info);
+
+  /* The cpu time is what gthree spends issuing the frame, the frame
+   * time includes waiting for the GL to finish it */
+  for (i = 0; i < n_frames; i++)
+    {
+      gint64 frame_start, frame_end;
+
+      frame_start = g_get_monotonic_time ();
+      scene->frame (&bench, n_warmup_frames + i);
+      frame_end = g_get_monotonic_time ();
+      glFinish ();
+
+      cpu_times[i] = (frame_end - frame_start) / 1000.0;
+      frame_times[i] = (g_get_monotonic_time () - frame_start) / 1000.0;
+    }
+
+  get_all_stats (bench.renderer, &stats, &info);
+  add_stats (&stats, &start_stats, -1);
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "name");
+  json_builder_add_string_value (builder, scene->name);
+  add_member (builder, "setup_ms", setup_ms);
+  benchmark_add_times (builder, "cpu_ms", cpu_times, n_frames);
+  benchmark_add_times (builder, "frame_ms", frame_times, n_frames);
+  add_stats_per_frame (builder, &stats, n_frames);
+  add_memory (builder, &info);
+  json_builder_end_object (builder);
+
+  gthree_renderer_set_render_target (bench.renderer, NULL, 0, 0);
+  g_clear_object (&bench.composer);
+  g_clear_object (&bench.mixer);
+  g_clear_object (&bench.loader);
+  g_clear_object (&bench.scene);
+  g_clear_object (&bench.render_target);
+  gthree_renderer_unrealize (bench.renderer);
+  g_clear_object (&bench.renderer);
+  g_ptr_array_unref (bench.objects);
+  g_rand_free (bench.rand);
+}
+
+static gboolean
+scene_selected (const char *name)
+{
+  int i;
+
+  if (scene_names == NULL)
+    return TRUE;
+
+  for (i = 0; scene_names[i] != NULL; i++)
+    if (strcmp (scene_names[i], name) == 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) option_context = NULL;
+  g_autoptr(JsonBuilder) builder = NULL;
+  g_autoptr(JsonGenerator) generator = NULL;
+  g_autoptr(JsonNode) root = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *json = NULL;
+  int i;
+
+  option_context = g_option_context_new ("- measure gthree frame times without a display");
+  g_option_context_add_main_entries (option_context, entries, NULL);
+  if (!g_option_context_parse (option_context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  if (n_frames <= 0 || n_warmup_frames < 0 || width <= 0 || height <= 0)
+    {
+      g_printerr ("Invalid frame count or size\n");
+      return 1;
+    }
+
+  if (!init_egl ())
+    return 77; /* Skipped */
+
+  init_framebuffer (width, height);
+
+  builder = json_builder_new ();
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "gl_renderer");
+  json_builder_add_string_value (builder, (const char *)glGetString (GL_RENDERER));
+  json_builder_set_member_name (builder, "gl_version");
+  json_builder_add_string_value (builder, (const char *)glGetString (GL_VERSION));
+  add_member (builder, "width", width);
+  add_member (builder, "height", height);
+  add_member (builder, "frames", n_frames);
+  add_member (builder, "warmup_frames", n_warmup_frames);
+
+  json_builder_set_member_name (builder, "scenes");
+  json_builder_begin_array (builder);
+  for (i = 0; i < G_N_ELEMENTS (scenes); i++)
+    {
+      if (scene_selected (scenes[i].name))
+        run_scene (&scenes[i], builder);
+    }
+  json_builder_end_array (builder);
+  json_builder_end_object (builder);
+
+  root = json_builder_get_root (builder);
+  generator = json_generator_new ();
+  json_generator_set_pretty (generator, TRUE);
+  json_generator_set_root (generator, root);
+
+  if (output_file)
+    {
+      if (!json_generator_to_file (generator, output_file, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          return 1;
+        }
+    }
+  else
+    {
+      json = json_generator_to_data (generator, NULL);
+      g_print ("%s\n", json);
+    }
+
+  return 0;
+}
@@ -0,0 +1,110 @@
+/* Times gthree_render_list_sort() on large lists
+ *
+ * The render list is private, so this uses the internal headers.
+ */
+
+#include <gthree/gthree.h>
+#include "gthreeprivate.h"
+
+#include "benchmark-utils.h"
+
+#define N_ITEMS 100000
+#define N_MATERIALS 64
+#define N_GEOMETRIES 256
+
+typedef struct {
+  GthreeRenderList *list;
+  GthreeObject *object;
+  GthreeGeometry *geometries[N_GEOMETRIES];
+  GthreeMaterial *materials[N_MATERIALS];
+  float z[N_ITEMS];
+  guint8 material[N_ITEMS];
+  guint8 geometry[N_ITEMS];
+  GthreeSortMode mode;
+} RenderListBenchmark;
+
+static void
+render_list_benchmark_init (RenderListBenchmark *bench)
+{
+  g_autoptr(GRand) rand = benchmark_rand_new ();
+  int i;
+
+  bench->list = gthree_render_list_new ();
+  bench->object = GTHREE_OBJECT (gthree_group_new ());
+
+  for (i = 0; i < N_GEOMETRIES; i++)
+    bench->geometries[i] = gthree_geometry_new ();
+
+  /* A quarter of the materials are transparent, and sorted by depth */
+  for (i = 0; i < N_MATERIALS; i++)
+    {
+      bench->materials[i] = GTHREE_MATERIAL (gthree_mesh_basic_material_new ());
+      gthree_material_set_is_transparent (bench->materials[i], i % 4 == 0);
+    }
+
+  for (i = 0; i < N_ITEMS; i++)
+    {
+      bench->z[i] = g_rand_double_range (rand, -1, 1);
+      bench->material[i] = g_rand_int_range (rand, 0, N_MATERIALS);
+      bench->geometry[i] = g_rand_int_range (rand, 0, N_GEOMETRIES);
+    }
+}
+
+static void
+render_list_benchmark_clear (RenderListBenchmark *bench)
+{
+  int i;
+
+  for (i = 0; i < N_GEOMETRIES; i++)
+    g_object_unref (bench->geometries[i]);
+  for (i = 0; i < N_MATERIALS; i++)
+    g_object_unref (bench->materials[i]);
+  g_object_unref (bench->object);
+  gthree_render_list_free (bench->list);
+}
+
+/* Refill in the original, unsorted order */
+static void
+fill_list (gpointer data)
+{
+  RenderListBenchmark *bench = data;
+  int i;
+
+  gthree_render_list_init (bench->list);
+
+  for (i = 0; i < N_ITEMS; i++)
+    {
+      gthree_render_list_set_current_z (bench->list, bench->z[i]);
+      gthree_render_list_push (bench->list, bench->object,
+                               bench->geometries[bench->geometry[i]],
+                               bench->materials[bench->material[i]],
+                               NULL);
+    }
+}
+
+static void
+sort_list (gpointer data)
+{
+  RenderListBenchmark *bench = data;
+
+  gthree_render_list_sort (bench->list, bench->mode);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static RenderListBenchmark bench;
+
+  benchmark_init (&argc, &argv, "renderlist");
+
+  render_list_benchmark_init (&bench);
+
+  bench.mode = GTHREE_SORT_MODE_STATE_FIRST;
+  benchmark_run ("render-list-sort/100k-state-first", fill_list, sort_list, &bench);
+  bench.mode = GTHREE_SORT_MODE_DEPTH_FIRST;
+  benchmark_run ("render-list-sort/100k-depth-first", fill_list, sort_list, &bench);
+
+  render_list_benchmark_clear (&bench);
+
+  return benchmark_finish ();
+}
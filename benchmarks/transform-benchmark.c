@@ -0,0 +1,147 @@
+/* Times gthree_object_update_matrix_world() on large hierarchies */
+
+#include <gthree/gthree.h>
+
+#include "benchmark-utils.h"
+
+#define N_OBJECTS 50000
+
+typedef struct {
+  GthreeObject *root;
+  GPtrArray *objects;
+  GRand *rand;
+  gboolean force;
+} TransformBenchmark;
+
+static GthreeObject *
+new_node (TransformBenchmark *bench, GthreeObject *parent)
+{
+  GthreeObject *object = GTHREE_OBJECT (gthree_group_new ());
+
+  gthree_object_set_position_xyz (object,
+                                  g_rand_double_range (bench->rand, -10, 10),
+                                  g_rand_double_range (bench->rand, -10, 10),
+                                  g_rand_double_range (bench->rand, -10, 10));
+  gthree_object_set_rotation_xyz (object,
+                                  g_rand_double_range (bench->rand, 0, 360),
+                                  g_rand_double_range (bench->rand, 0, 360),
+                                  g_rand_double_range (bench->rand, 0, 360));
+
+  gthree_object_add_child (parent, object);
+  g_object_unref (object);
+  g_ptr_array_add (bench->objects, object);
+
+  return object;
+}
+
+static void
+transform_benchmark_init (TransformBenchmark *bench, gboolean force)
+{
+  bench->rand = benchmark_rand_new ();
+  bench->objects = g_ptr_array_new ();
+  bench->root = GTHREE_OBJECT (gthree_group_new ());
+  bench->force = force;
+}
+
+static void
+transform_benchmark_clear (TransformBenchmark *bench)
+{
+  g_clear_object (&bench->root);
+  g_ptr_array_unref (bench->objects);
+  g_rand_free (bench->rand);
+}
+
+/* All objects are direct children of the root */
+static void
+build_wide (TransformBenchmark *bench)
+{
+  int i;
+
+  for (i = 0; i < N_OBJECTS; i++)
+    new_node (bench, bench->root);
+}
+
+/* Long chains, like skeletons */
+static void
+build_deep (TransformBenchmark *bench)
+{
+  int chain, i;
+
+  for (chain = 0; chain < 50; chain++)
+    {
+      GthreeObject *parent = bench->root;
+
+      for (i = 0; i < N_OBJECTS / 50; i++)
+        parent = new_node (bench, parent);
+    }
+}
+
+static void
+build_tree (TransformBenchmark *bench, GthreeObject *parent, int depth)
+{
+  int i;
+
+  if (depth == 0)
+    return;
+
+  for (i = 0; i < 8; i++)
+    build_tree (bench, new_node (bench, parent), depth - 1);
+}
+
+/* Moves 1% of the objects, as in a mostly static scene */
+static void
+move_some (gpointer data)
+{
+  TransformBenchmark *bench = data;
+  int i;
+
+  for (i = 0; i < bench->objects->len / 100; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (bench->objects, g_rand_int_range (bench->rand, 0, bench->objects->len));
+
+      gthree_object_set_position_xyz (object,
+                                      g_rand_double_range (bench->rand, -10, 10),
+                                      g_rand_double_range (bench->rand, -10, 10),
+                                      g_rand_double_range (bench->rand, -10, 10));
+    }
+}
+
+static void
+update_matrix_world (gpointer data)
+{
+  TransformBenchmark *bench = data;
+
+  gthree_object_update_matrix_world (bench->root, bench->force);
+}
+
+int
+main (int argc, char *argv[])
+{
+  TransformBenchmark bench;
+
+  benchmark_init (&argc, &argv, "transform");
+
+  transform_benchmark_init (&bench, TRUE);
+  build_wide (&bench);
+  benchmark_run ("update-matrix-world/wide", NULL, update_matrix_world, &bench);
+  bench.force = FALSE;
+  benchmark_run ("update-matrix-world/wide-1%-moved", move_some, update_matrix_world, &bench);
+  transform_benchmark_clear (&bench);
+
+  transform_benchmark_init (&bench, TRUE);
+  build_deep (&bench);
+  benchmark_run ("update-matrix-world/deep", NULL, update_matrix_world, &bench);
+  bench.force = FALSE;
+  benchmark_run ("update-matrix-world/deep-1%-moved", move_some, update_matrix_world, &bench);
+  transform_benchmark_clear (&bench);
+
+  /* 8 + 64 + 512 + 4096 + 32768 objects */
+  transform_benchmark_init (&bench, TRUE);
+  build_tree (&bench, bench.root, 5);
+  benchmark_run ("update-matrix-world/tree", NULL, update_matrix_world, &bench);
+  bench.force = FALSE;
+  benchmark_run ("update-matrix-world/tree-1%-moved", move_some, update_matrix_world, &bench);
+  transform_benchmark_clear (&bench);
+
+  return benchmark_finish ();
+}
@@ -19,9 +19,12 @@
 #include <gthree/gthreematerial.h>
 #include <gthree/gthreemesh.h>
 #include <gthree/gthreeskinnedmesh.h>
+#include <gthree/gthreeinstancedmesh.h>
 #include <gthree/gthreeobject.h>
 #include <gthree/gthreegroup.h>
+#include <gthree/gthreelod.h>
 #include <gthree/gthreerenderer.h>
+#include <gthree/gthreetrace.h>
 #include <gthree/gthreescene.h>
 #include <gthree/gthreetexture.h>
 #include <gthree/gthreecubetexture.h>
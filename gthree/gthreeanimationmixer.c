@@ -6,6 +6,7 @@
 #include "gthreepropertymixerprivate.h"
 #include "gthreelinearinterpolant.h"
 #include "gthreeprivate.h"
+#include "gthreetraceprivate.h"
 #include "gthreemarshalers.h"
 
 enum
@@ -713,6 +714,7 @@ gthree_animation_mixer_update (GthreeAnimationMixer  *mixer,
   int n_bindings = priv->n_active_bindings;
   float time, time_direction;
   int accu_index, i;
+  GTHREE_TRACE_BEGIN (trace_update);
 
   delta_time *= priv->time_scale;
 
@@ -741,6 +743,8 @@ gthree_animation_mixer_update (GthreeAnimationMixer  *mixer,
 
       gthree_property_mixer_apply (binding, accu_index);
     }
+
+  GTHREE_TRACE_END_FORMAT (trace_update, "animation mixer update", "%d actions, %d bindings", n_actions, n_bindings);
 }
 
 // free all resources specific to a particular clip
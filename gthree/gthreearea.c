@@ -8,6 +8,8 @@ typedef struct {
   GthreeRenderer *renderer;
   GthreeScene *scene;
   GthreeCamera *camera;
+  GdkFrameClock *frame_clock;
+  gulong before_paint_id;
 } GthreeAreaPrivate;
 
 enum {
@@ -162,6 +164,17 @@ gthree_area_render (GtkGLArea    *gl_area,
   return TRUE;
 }
 
+static void
+gthree_area_before_paint (GdkFrameClock *frame_clock,
+                          GthreeArea    *area)
+{
+  GthreeAreaPrivate *priv = gthree_area_get_instance_private (area);
+
+  /* Any number of renders in the render signal are one frame */
+  if (priv->renderer)
+    gthree_renderer_begin_frame (priv->renderer);
+}
+
 static void
 gthree_area_realize (GtkWidget *widget)
 {
@@ -175,6 +188,10 @@ gthree_area_realize (GtkWidget *widget)
   gtk_gl_area_attach_buffers (glarea);
 
   priv->renderer = gthree_renderer_new ();
+
+  priv->frame_clock = g_object_ref (gtk_widget_get_frame_clock (widget));
+  priv->before_paint_id = g_signal_connect (priv->frame_clock, "before-paint",
+                                            G_CALLBACK (gthree_area_before_paint), area);
 }
 
 static void
@@ -190,6 +207,10 @@ gthree_area_unrealize (GtkWidget *widget)
 
   g_clear_object (&priv->renderer);
 
+  g_signal_handler_disconnect (priv->frame_clock, priv->before_paint_id);
+  priv->before_paint_id = 0;
+  g_clear_object (&priv->frame_clock);
+
   GTK_WIDGET_CLASS (gthree_area_parent_class)->unrealize (widget);
 }
 
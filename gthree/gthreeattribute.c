@@ -3,6 +3,7 @@
 
 #include "gthreeattribute.h"
 #include "gthreeprivate.h"
+#include "gthreetraceprivate.h"
 #include "gthreeenums.h"
 
 struct _GthreeAttributeArray {
@@ -904,6 +905,8 @@ gthree_attribute_array_copy_uint16 (GthreeAttributeArray *array,
 
 static void gthree_attribute_real_unrealize (GthreeResource *resource,
                                              GthreeRenderer *renderer);
+static gsize gthree_attribute_real_get_gl_bytes (GthreeResource *resource,
+                                                 GthreeRenderer *renderer);
 
 struct _GthreeAttribute {
   GthreeResource parent;
@@ -914,8 +917,11 @@ struct _GthreeAttribute {
   int item_offset;  /* typically 0, but not if interleaved or stacked */
   int count;        /* May be smaller than the entire array if stacking */
   gboolean normalized;
+  guint32 buffer_stamp; /* Changes when the array is replaced */
 };
 
+static guint32 next_buffer_stamp = 0;
+
 typedef struct {
   GthreeResourceClass parent_class;
 } GthreeAttributeClass;
@@ -1105,6 +1111,7 @@ gthree_attribute_class_init (GthreeAttributeClass *klass)
   gobject_class->finalize = gthree_attribute_finalize;
 
   resource_class->unrealize = gthree_attribute_real_unrealize;
+  resource_class->get_gl_bytes = gthree_attribute_real_get_gl_bytes;
 
   //g_object_class_install_properties (gobject_class, N_PROPS, obj_props);
 }
@@ -1137,6 +1144,15 @@ gthree_attribute_set_array (GthreeAttribute      *attribute,
   if (attribute->array)
     gthree_attribute_array_unref (attribute->array);
   attribute->array = array;
+  attribute->buffer_stamp = ++next_buffer_stamp;
+}
+
+/* Stamps only increase, so the largest stamp of a set of attributes
+ * changes whenever any of them gets a new array */
+guint32
+gthree_attribute_get_buffer_stamp (GthreeAttribute *attribute)
+{
+  return attribute->buffer_stamp;
 }
 
 int
@@ -1238,6 +1254,21 @@ gthree_attribute_real_unrealize (GthreeResource *resource,
     gthree_attribute_array_unrealize (attribute->array, renderer);
 }
 
+/* Attributes sharing an array share its buffer, so each reports its part */
+static gsize
+gthree_attribute_real_get_gl_bytes (GthreeResource *resource,
+                                    GthreeRenderer *renderer)
+{
+  GthreeAttribute *attribute = GTHREE_ATTRIBUTE (resource);
+  GthreeAttributeArray *array = attribute->array;
+  GthreeAttributeArrayRealizeData *data = gthree_attribute_array_get_realize_data_at (array, gthree_renderer_get_resource_id (renderer));
+
+  if (data->gl_buffer == 0 || data->realize_count == 0)
+    return 0;
+
+  return gthree_attribute_array_get_len (array) * attribute_type_size[array->type] / data->realize_count;
+}
+
 guint8 *
 gthree_attribute_peek_uint8 (GthreeAttribute *attribute)
 {
@@ -1631,7 +1662,8 @@ gthree_attribute_get_point3d (GthreeAttribute      *attribute,
   gthree_attribute_array_get_point3d (attribute->array, index, attribute->item_offset, point);
 }
 
-static void
+/* Returns the number of bytes uploaded */
+static gsize
 gthree_attribute_array_update (GthreeAttributeArray *array,
                                GthreeAttributeArrayRealizeData *data,
                                gboolean allocate,
@@ -1639,26 +1671,29 @@ gthree_attribute_array_update (GthreeAttributeArray *array,
 {
   int usage = array->dynamic ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW;
   int element_size = attribute_type_size[array->type];
+  gsize bytes;
 
   glBindBuffer (buffer_type, data->gl_buffer);
   if (allocate || !array->dynamic)
     {
-      glBufferData (buffer_type, gthree_attribute_array_get_len (array) * element_size,
-                    &array->data[0], usage);
+      bytes = gthree_attribute_array_get_len (array) * element_size;
+      glBufferData (buffer_type, bytes, &array->data[0], usage);
     }
   else if (data->update_range_count == -1)
     {
       // Not using update ranges
-      glBufferSubData (buffer_type, 0,
-                       gthree_attribute_array_get_len (array) * element_size, &array->data[0]);
+      bytes = gthree_attribute_array_get_len (array) * element_size;
+      glBufferSubData (buffer_type, 0, bytes, &array->data[0]);
     }
   else
     {
-      glBufferSubData (buffer_type, data->update_range_offset * element_size,
-                       data->update_range_count * element_size,
+      bytes = data->update_range_count * element_size;
+      glBufferSubData (buffer_type, data->update_range_offset * element_size, bytes,
                        ((guint8 *)&array->data[0]) + data->update_range_offset * element_size);
       data->update_range_count = -1; // reset range
     }
+
+  return bytes;
 }
 
 void
@@ -1677,8 +1712,12 @@ gthree_attribute_update (GthreeAttribute *attribute, GthreeRenderer *renderer, g
 
   if (gthree_resource_get_dirty_for (GTHREE_RESOURCE (attribute), renderer))
     {
-      gthree_attribute_array_update (array, array_data, allocate, buffer_type);
+      GTHREE_TRACE_BEGIN (trace_upload);
+      gsize bytes = gthree_attribute_array_update (array, array_data, allocate, buffer_type);
+      gthree_renderer_count_buffer_upload (renderer, bytes);
       gthree_resource_mark_clean_for (GTHREE_RESOURCE (attribute), renderer);
+      GTHREE_TRACE_END_FORMAT (trace_upload, "upload buffer", "%s: %" G_GSIZE_FORMAT " bytes",
+                               gthree_attribute_get_name (attribute), bytes);
     }
 }
 
@@ -3,6 +3,7 @@
 
 #include "gthreecubetexture.h"
 #include "gthreeprivate.h"
+#include "gthreetraceprivate.h"
 
 enum {
   GTHREE_CUBE_FACE_PX,
@@ -81,6 +82,8 @@ gthree_cube_texture_real_load (GthreeTexture *texture, GthreeRenderer *renderer,
       gboolean is_compressed = FALSE; //texture instanceof THREE.CompressedTexture;
       guint gl_format, gl_type;
       gboolean is_image_power_of_two = is_power_of_two (width) && is_power_of_two (height);
+      gsize gl_bytes;
+      GTHREE_TRACE_BEGIN (trace_upload);
 
       for (i = 0; i < 6; i++)
         {
@@ -131,13 +134,21 @@ gthree_cube_texture_real_load (GthreeTexture *texture, GthreeRenderer *renderer,
 #endif
         }
 
+      gl_bytes = 6 * (gsize)width * height * gthree_texture_get_gl_bytes_per_pixel (gl_format, gl_type);
+
       if (gthree_texture_get_generate_mipmaps (texture) && is_image_power_of_two)
         {
           glGenerateMipmap (GL_TEXTURE_CUBE_MAP);
           gthree_texture_set_max_mip_level (texture, log2 (MAX (width, height)));
+          gl_bytes += gl_bytes / 3;
         }
 
+      gthree_texture_set_gl_bytes (texture, renderer, gl_bytes);
+
       gthree_resource_mark_clean_for (GTHREE_RESOURCE (texture), renderer);
+
+      GTHREE_TRACE_END_FORMAT (trace_upload, "upload texture", "cube %ux%u, %" G_GSIZE_FORMAT " bytes",
+                               width, height, gl_bytes);
     }
 }
 
@@ -138,11 +138,20 @@ gthree_effect_composer_render (GthreeEffectComposer *composer,
   gboolean should_render_to_screen = FALSE;
   gboolean rendered_to_screen = FALSE;
   gboolean last_pass_rendered_to_buffer = FALSE;
+  gboolean info_auto_reset;
   int i;
 
   if (priv->render_target1 == NULL)
     gthree_effect_composer_reset (composer, renderer, NULL);
 
+  /* The passes together are one frame in the renderer statistics */
+  info_auto_reset = gthree_renderer_get_info_auto_reset (renderer);
+  if (info_auto_reset)
+    {
+      gthree_renderer_reset_info (renderer);
+      gthree_renderer_set_info_auto_reset (renderer, FALSE);
+    }
+
   current_render_target = gthree_renderer_get_render_target (renderer);
   if (current_render_target)
     g_object_ref (current_render_target);
@@ -166,9 +175,11 @@ gthree_effect_composer_render (GthreeEffectComposer *composer,
 
       last_pass_rendered_to_buffer = !rendered_to_screen;
 
+      gthree_renderer_push_gpu_timer (renderer, G_OBJECT_TYPE_NAME (pass));
       gthree_pass_render (pass, renderer,
                           priv->write_buffer, priv->read_buffer,
                           delta_time, rendered_to_screen, mask_active);
+      gthree_renderer_pop_gpu_timer (renderer);
 
       if (pass->need_swap)
         {
@@ -201,12 +212,16 @@ gthree_effect_composer_render (GthreeEffectComposer *composer,
 
   if (!rendered_to_screen && priv->render_to_screen)
     {
+      gthree_renderer_push_gpu_timer (renderer, G_OBJECT_TYPE_NAME (priv->copy_pass));
       gthree_pass_render (priv->copy_pass, renderer,
                           priv->write_buffer, priv->read_buffer,
                           delta_time, TRUE, mask_active);
+      gthree_renderer_pop_gpu_timer (renderer);
     }
 
   gthree_renderer_set_render_target (renderer, current_render_target, 0, 0);
+
+  gthree_renderer_set_info_auto_reset (renderer, info_auto_reset);
 }
 
 void
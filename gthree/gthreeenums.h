@@ -149,12 +149,22 @@ typedef enum {
  GTHREE_DRAW_MODE_TRIANGLE_FAN,
 } GthreeDrawMode;
 
+typedef enum {
+ GTHREE_SORT_MODE_STATE_FIRST,
+ GTHREE_SORT_MODE_DEPTH_FIRST,
+} GthreeSortMode;
+
 typedef enum {
  GTHREE_SHADOW_MAP_TYPE_BASIC,
  GTHREE_SHADOW_MAP_TYPE_PCF,
  GTHREE_SHADOW_MAP_TYPE_PCF_SOFT,
 } GthreeShadowMapType;
 
+typedef enum {
+ GTHREE_LOD_MODE_DISTANCE,
+ GTHREE_LOD_MODE_SCREEN_SIZE,
+} GthreeLODMode;
+
 G_END_DECLS
 
 #endif /* __GTHREE_ENUM_H__ */
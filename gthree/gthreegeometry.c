@@ -25,10 +25,37 @@ typedef struct {
 
   gint draw_range_start;
   gint draw_range_count;
+
+  guint id;
+  guint32 attributes_version;
+  guint32 buffer_stamp; /* Largest buffer stamp of the attributes */
+  guint32 bounds_stamp;
+  GPtrArray *owners; /* Objects drawing this geometry, not owned */
 } GthreeGeometryPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeGeometry, gthree_geometry, G_TYPE_OBJECT);
 
+static guint next_geometry_id = 0;
+static guint32 next_bounds_stamp = 0;
+
+/* Stamps are unique across geometries, so swapping the geometry
+ * of an object is also seen as a bounds change. The cached subtree
+ * bounds of the objects drawing us, and of their ancestors, depend
+ * on our bounds, so invalidate those. */
+static void
+bounds_changed (GthreeGeometryPrivate *priv)
+{
+  int i;
+
+  priv->bounds_stamp = ++next_bounds_stamp;
+
+  if (priv->owners)
+    {
+      for (i = 0; i < priv->owners->len; i++)
+        gthree_object_invalidate_subtree_bounds (g_ptr_array_index (priv->owners, i));
+    }
+}
+
 static void
 drop_attribute (GthreeAttribute *attribute)
 {
@@ -46,6 +73,8 @@ gthree_geometry_init (GthreeGeometry *geometry)
 
   priv->draw_range_start = 0;
   priv->draw_range_count = -1;
+  priv->id = ++next_geometry_id;
+  bounds_changed (priv);
 }
 
 static void
@@ -60,6 +89,8 @@ gthree_geometry_finalize (GObject *obj)
   if (priv->morph_attributes)
     g_hash_table_unref (priv->morph_attributes);
   g_array_unref (priv->groups);
+  if (priv->owners)
+    g_ptr_array_unref (priv->owners);
 
   if (geometry->influences)
     g_array_unref (geometry->influences);
@@ -94,6 +125,7 @@ gthree_geometry_add_attribute (GthreeGeometry  *geometry,
   name = g_intern_string (name);
 
   g_hash_table_insert (priv->attributes, (char *)name, g_object_ref (attribute));
+  priv->attributes_version++;
 
   return attribute;
 }
@@ -105,6 +137,7 @@ gthree_geometry_invalidate_bounds (GthreeGeometry  *geometry)
 
   priv->bounding_box_set = FALSE;
   priv->bounding_sphere_set = FALSE;
+  bounds_changed (priv);
 }
 
 void
@@ -113,7 +146,8 @@ gthree_geometry_remove_attribute (GthreeGeometry  *geometry,
 {
   GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
 
-  g_hash_table_remove (priv->attributes, name);
+  if (g_hash_table_remove (priv->attributes, name))
+    priv->attributes_version++;
 }
 
 GthreeAttribute *
@@ -351,6 +385,66 @@ gthree_geometry_peek_groups (GthreeGeometry  *geometry)
   return (GthreeGeometryGroup *)priv->groups->data;
 }
 
+/* Small unique number, used to group draws by geometry */
+guint
+gthree_geometry_get_id (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+  return priv->id;
+}
+
+/* Changes whenever the set of attributes changes, so that cached
+ * vertex array objects can be invalidated */
+guint32
+gthree_geometry_get_attributes_version (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+  return priv->attributes_version;
+}
+
+/* Objects that draw the geometry register themselves, so their
+ * subtree bounds are invalidated when the geometry bounds change */
+void
+gthree_geometry_add_owner (GthreeGeometry *geometry,
+                           GthreeObject   *object)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  if (priv->owners == NULL)
+    priv->owners = g_ptr_array_new ();
+
+  g_ptr_array_add (priv->owners, object);
+  gthree_object_invalidate_subtree_bounds (object);
+}
+
+void
+gthree_geometry_remove_owner (GthreeGeometry *geometry,
+                              GthreeObject   *object)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  if (priv->owners)
+    g_ptr_array_remove_fast (priv->owners, object);
+}
+
+/* Changes whenever the bounds are invalidated or set, but not when
+ * they are lazily computed */
+guint32
+gthree_geometry_get_bounds_stamp (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+  return priv->bounds_stamp;
+}
+
+/* The returned list (but not the interned names) must be freed */
+GList *
+gthree_geometry_get_attribute_names (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  return g_hash_table_get_keys (priv->attributes);
+}
+
 int
 gthree_geometry_get_draw_range_start (GthreeGeometry  *geometry)
 {
@@ -492,6 +586,7 @@ gthree_geometry_set_bounding_sphere  (GthreeGeometry          *geometry,
 
   priv->bounding_sphere_set = TRUE;
   priv->bounding_sphere = *sphere;
+  bounds_changed (priv);
 }
 
 const graphene_box_t *
@@ -535,6 +630,7 @@ gthree_geometry_set_bounding_box  (GthreeGeometry       *geometry,
 
   priv->bounding_box = *box;
   priv->bounding_box_set = TRUE;
+  bounds_changed (priv);
 }
 
 void
@@ -668,6 +764,7 @@ gthree_geometry_update (GthreeGeometry *geometry,
   GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
   GthreeAttribute *attribute;
   GHashTableIter iter;
+  guint32 buffer_stamp = 0;
 
   if (priv->index)
     gthree_attribute_update (priv->index, renderer, GL_ELEMENT_ARRAY_BUFFER);
@@ -679,6 +776,15 @@ gthree_geometry_update (GthreeGeometry *geometry,
     {
       // TODO: Only do this once per frame
       gthree_attribute_update (attribute, renderer, GL_ARRAY_BUFFER);
+      buffer_stamp = MAX (buffer_stamp, gthree_attribute_get_buffer_stamp (attribute));
+    }
+
+  /* An attribute got a new array, and thus a new gl buffer, which
+   * the cached vertex arrays still point to */
+  if (buffer_stamp != priv->buffer_stamp)
+    {
+      priv->buffer_stamp = buffer_stamp;
+      priv->attributes_version++;
     }
 
   if (priv->morph_attributes != NULL)
@@ -842,6 +948,7 @@ gthree_geometry_parse_json (JsonObject *root)
 
       parse_sphere (bs, &priv->bounding_sphere);
       priv->bounding_sphere_set = TRUE;
+      bounds_changed (priv);
     }
 
   // TODO parse root.name
@@ -0,0 +1,382 @@
+#include <math.h>
+#include <epoxy/gl.h>
+
+#include "gthreeinstancedmesh.h"
+#include "gthreeobjectprivate.h"
+#include "gthreeprivate.h"
+
+typedef struct {
+  GthreeAttribute *instance_matrix;
+  GthreeAttribute *instance_color; /* Lazily created by set_color_at() */
+  int max_count;
+  int count;
+
+  graphene_sphere_t bounding_sphere;
+  gboolean bounding_sphere_valid;
+  guint32 geometry_bounds_stamp; /* Of the geometry the sphere was computed from */
+
+  guint id;
+} GthreeInstancedMeshPrivate;
+
+enum {
+  PROP_0,
+
+  PROP_MAX_COUNT,
+  PROP_COUNT,
+
+  N_PROPS
+};
+
+static GParamSpec *obj_props[N_PROPS] = { NULL, };
+
+G_DEFINE_TYPE_WITH_PRIVATE (GthreeInstancedMesh, gthree_instanced_mesh, GTHREE_TYPE_MESH)
+
+static guint next_instanced_mesh_id = 0;
+
+GthreeInstancedMesh *
+gthree_instanced_mesh_new (GthreeGeometry *geometry,
+                           GthreeMaterial *material,
+                           int             count)
+{
+  g_autoptr(GPtrArray) materials = g_ptr_array_new_with_free_func (g_object_unref);
+
+  if (material)
+    g_ptr_array_add (materials, g_object_ref (material));
+
+  return g_object_new (gthree_instanced_mesh_get_type (),
+                       "geometry", geometry,
+                       "materials", materials,
+                       "max-count", count,
+                       "count", count,
+                       NULL);
+}
+
+static void
+gthree_instanced_mesh_init (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  priv->count = 1;
+  priv->id = ++next_instanced_mesh_id;
+}
+
+static void
+gthree_instanced_mesh_finalize (GObject *obj)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (obj);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_clear_object (&priv->instance_matrix);
+  g_clear_object (&priv->instance_color);
+
+  G_OBJECT_CLASS (gthree_instanced_mesh_parent_class)->finalize (obj);
+}
+
+static void
+gthree_instanced_mesh_set_max_count (GthreeInstancedMesh *mesh,
+                                     int                  max_count)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  graphene_matrix_t identity;
+  int i;
+
+  g_assert (priv->instance_matrix == NULL);
+
+  priv->max_count = max_count;
+  priv->count = MIN (priv->count, max_count);
+
+  priv->instance_matrix = gthree_attribute_new ("instanceMatrix", GTHREE_ATTRIBUTE_TYPE_FLOAT,
+                                                MAX (max_count, 1), 16, FALSE);
+  gthree_attribute_set_dynamic (priv->instance_matrix, TRUE);
+
+  graphene_matrix_init_identity (&identity);
+  for (i = 0; i < max_count; i++)
+    graphene_matrix_to_float (&identity, gthree_attribute_peek_float_at (priv->instance_matrix, i));
+}
+
+static void
+gthree_instanced_mesh_update (GthreeObject *object,
+                              GthreeRenderer *renderer)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (object);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  GTHREE_OBJECT_CLASS (gthree_instanced_mesh_parent_class)->update (object, renderer);
+
+  gthree_attribute_update (priv->instance_matrix, renderer, GL_ARRAY_BUFFER);
+  if (priv->instance_color)
+    gthree_attribute_update (priv->instance_color, renderer, GL_ARRAY_BUFFER);
+}
+
+static const graphene_sphere_t *
+gthree_instanced_mesh_get_bounding_sphere (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (GTHREE_MESH (mesh));
+  const graphene_sphere_t *geometry_sphere;
+  graphene_box_t box, instance_box;
+  graphene_matrix_t m;
+  graphene_sphere_t s;
+  int i;
+
+  if (priv->bounding_sphere_valid &&
+      priv->geometry_bounds_stamp == gthree_geometry_get_bounds_stamp (geometry))
+    return &priv->bounding_sphere;
+
+  geometry_sphere = gthree_geometry_get_bounding_sphere (geometry);
+  priv->geometry_bounds_stamp = gthree_geometry_get_bounds_stamp (geometry);
+
+  /* Union of the geometry bounding sphere placed at each instance,
+     in the local space of the mesh */
+  graphene_box_init_from_box (&box, graphene_box_empty ());
+  for (i = 0; i < priv->count; i++)
+    {
+      gthree_attribute_get_matrix (priv->instance_matrix, i, &m);
+      graphene_matrix_transform_sphere (&m, geometry_sphere, &s);
+      graphene_sphere_get_bounding_box (&s, &instance_box);
+      graphene_box_union (&box, &instance_box, &box);
+    }
+
+  graphene_box_get_bounding_sphere (&box, &priv->bounding_sphere);
+  priv->bounding_sphere_valid = TRUE;
+
+  return &priv->bounding_sphere;
+}
+
+static gboolean
+gthree_instanced_mesh_get_world_bounding_sphere (GthreeObject *object,
+                                                 graphene_sphere_t *sphere)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (object);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  if (gthree_mesh_get_geometry (GTHREE_MESH (mesh)) == NULL || priv->count == 0)
+    return FALSE;
+
+  graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
+                                    gthree_instanced_mesh_get_bounding_sphere (mesh),
+                                    sphere);
+  return TRUE;
+}
+
+static gboolean
+gthree_instanced_mesh_in_frustum (GthreeObject *object,
+                                  const graphene_frustum_t *frustum)
+{
+  graphene_sphere_t sphere;
+
+  if (!gthree_instanced_mesh_get_world_bounding_sphere (object, &sphere))
+    return FALSE;
+
+  return graphene_frustum_intersects_sphere (frustum, &sphere);
+}
+
+static void
+gthree_instanced_mesh_set_property (GObject *obj,
+                                    guint prop_id,
+                                    const GValue *value,
+                                    GParamSpec *pspec)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (obj);
+
+  switch (prop_id)
+    {
+    case PROP_MAX_COUNT:
+      gthree_instanced_mesh_set_max_count (mesh, g_value_get_int (value));
+      break;
+
+    case PROP_COUNT:
+      gthree_instanced_mesh_set_count (mesh, g_value_get_int (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+    }
+}
+
+static void
+gthree_instanced_mesh_get_property (GObject *obj,
+                                    guint prop_id,
+                                    GValue *value,
+                                    GParamSpec *pspec)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (obj);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  switch (prop_id)
+    {
+    case PROP_MAX_COUNT:
+      g_value_set_int (value, priv->max_count);
+      break;
+
+    case PROP_COUNT:
+      g_value_set_int (value, priv->count);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+    }
+}
+
+static void
+gthree_instanced_mesh_class_init (GthreeInstancedMeshClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GthreeObjectClass *object_class = GTHREE_OBJECT_CLASS (klass);
+
+  gobject_class->set_property = gthree_instanced_mesh_set_property;
+  gobject_class->get_property = gthree_instanced_mesh_get_property;
+  gobject_class->finalize = gthree_instanced_mesh_finalize;
+
+  object_class->update = gthree_instanced_mesh_update;
+  object_class->in_frustum = gthree_instanced_mesh_in_frustum;
+  object_class->get_world_bounding_sphere = gthree_instanced_mesh_get_world_bounding_sphere;
+
+  obj_props[PROP_MAX_COUNT] =
+    g_param_spec_int ("max-count", "Max count", "Maximum number of instances",
+                      0, G_MAXINT, 1,
+                      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+  obj_props[PROP_COUNT] =
+    g_param_spec_int ("count", "Count", "Number of instances to draw",
+                      0, G_MAXINT, 1,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (gobject_class, N_PROPS, obj_props);
+}
+
+int
+gthree_instanced_mesh_get_count (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->count;
+}
+
+/* The number of drawn instances can be lowered without reallocating
+ * the instance buffers, but never above the count the mesh was created with. */
+void
+gthree_instanced_mesh_set_count (GthreeInstancedMesh *mesh,
+                                 int                  count)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  count = CLAMP (count, 0, priv->max_count);
+  if (priv->count == count)
+    return;
+
+  priv->count = count;
+  priv->bounding_sphere_valid = FALSE;
+  gthree_object_mark_transform_changed (GTHREE_OBJECT (mesh));
+  g_object_notify_by_pspec (G_OBJECT (mesh), obj_props[PROP_COUNT]);
+}
+
+int
+gthree_instanced_mesh_get_max_count (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->max_count;
+}
+
+void
+gthree_instanced_mesh_get_matrix_at (GthreeInstancedMesh *mesh,
+                                     int                  index,
+                                     graphene_matrix_t   *matrix)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  gthree_attribute_get_matrix (priv->instance_matrix, index, matrix);
+}
+
+void
+gthree_instanced_mesh_set_matrix_at (GthreeInstancedMesh     *mesh,
+                                     int                      index,
+                                     const graphene_matrix_t *matrix)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  graphene_matrix_to_float (matrix, gthree_attribute_peek_float_at (priv->instance_matrix, index));
+  gthree_attribute_set_needs_update (priv->instance_matrix);
+  priv->bounding_sphere_valid = FALSE;
+  gthree_object_mark_transform_changed (GTHREE_OBJECT (mesh));
+}
+
+void
+gthree_instanced_mesh_get_color_at (GthreeInstancedMesh *mesh,
+                                    int                  index,
+                                    graphene_vec3_t     *color)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  if (priv->instance_color == NULL)
+    graphene_vec3_init (color, 1, 1, 1);
+  else
+    gthree_attribute_get_vec3 (priv->instance_color, index, color);
+}
+
+void
+gthree_instanced_mesh_set_color_at (GthreeInstancedMesh   *mesh,
+                                    int                    index,
+                                    const graphene_vec3_t *color)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  int i;
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  if (priv->instance_color == NULL)
+    {
+      priv->instance_color = gthree_attribute_new ("instanceColor", GTHREE_ATTRIBUTE_TYPE_FLOAT,
+                                                   MAX (priv->max_count, 1), 3, FALSE);
+      gthree_attribute_set_dynamic (priv->instance_color, TRUE);
+      for (i = 0; i < priv->max_count; i++)
+        gthree_attribute_set_xyz (priv->instance_color, i, 1, 1, 1);
+    }
+
+  gthree_attribute_set_vec3 (priv->instance_color, index, color);
+  gthree_attribute_set_needs_update (priv->instance_color);
+}
+
+/* Small unique number, used to key cached vertex array objects */
+guint
+gthree_instanced_mesh_get_id (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->id;
+}
+
+GthreeAttribute *
+gthree_instanced_mesh_get_instance_matrix (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->instance_matrix;
+}
+
+GthreeAttribute *
+gthree_instanced_mesh_get_instance_color (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->instance_color;
+}
+
+/* Call this after modifying the instance attributes directly */
+void
+gthree_instanced_mesh_set_needs_update (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  gthree_attribute_set_needs_update (priv->instance_matrix);
+  if (priv->instance_color)
+    gthree_attribute_set_needs_update (priv->instance_color);
+  priv->bounding_sphere_valid = FALSE;
+  gthree_object_mark_transform_changed (GTHREE_OBJECT (mesh));
+}
@@ -46,6 +46,8 @@ gthree_line_finalize (GObject *obj)
   GthreeLine *line = GTHREE_LINE (obj);
   GthreeLinePrivate *priv = gthree_line_get_instance_private (line);
 
+  if (priv->geometry)
+    gthree_geometry_remove_owner (priv->geometry, GTHREE_OBJECT (line));
   g_clear_object (&priv->geometry);
   g_clear_object (&priv->material);
 
@@ -77,19 +79,29 @@ gthree_line_fill_render_list (GthreeObject   *object,
 }
 
 static gboolean
-gthree_line_in_frustum (GthreeObject *object,
-                                 const graphene_frustum_t *frustum)
+gthree_line_get_world_bounding_sphere (GthreeObject *object,
+                                       graphene_sphere_t *sphere)
 {
   GthreeLine *line = GTHREE_LINE (object);
   GthreeLinePrivate *priv = gthree_line_get_instance_private (line);
-  graphene_sphere_t sphere;
 
   if (!priv->geometry)
     return FALSE;
 
   graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
                                     gthree_geometry_get_bounding_sphere (priv->geometry),
-                                    &sphere);
+                                    sphere);
+  return TRUE;
+}
+
+static gboolean
+gthree_line_in_frustum (GthreeObject *object,
+                        const graphene_frustum_t *frustum)
+{
+  graphene_sphere_t sphere;
+
+  if (!gthree_line_get_world_bounding_sphere (object, &sphere))
+    return FALSE;
 
   return graphene_frustum_intersects_sphere (frustum, &sphere);
 }
@@ -107,6 +119,8 @@ gthree_line_set_property (GObject *obj,
     {
     case PROP_GEOMETRY:
       g_set_object (&priv->geometry, g_value_get_object (value));
+      if (priv->geometry)
+        gthree_geometry_add_owner (priv->geometry, GTHREE_OBJECT (line));
       break;
 
     case PROP_MATERIAL:
@@ -153,6 +167,7 @@ gthree_line_class_init (GthreeLineClass *klass)
   gobject_class->finalize = gthree_line_finalize;
 
   object_class->in_frustum = gthree_line_in_frustum;
+  object_class->get_world_bounding_sphere = gthree_line_get_world_bounding_sphere;
   object_class->update = gthree_line_update;
   object_class->fill_render_list = gthree_line_fill_render_list;
 
@@ -14,6 +14,7 @@
 #include "gthreegroup.h"
 #include "gthreeenums.h"
 #include "gthreeprivate.h"
+#include "gthreetraceprivate.h"
 #include "gthreeanimationclip.h"
 #include "gthreevectorkeyframetrack.h"
 #include "gthreenumberkeyframetrack.h"
@@ -2152,8 +2153,8 @@ parse_animations (GthreeLoader *loader, JsonObject *root, GError **error)
   return TRUE;
 }
 
-GthreeLoader *
-gthree_loader_parse_gltf (GBytes *data, GFile *base_path, GError **error)
+static GthreeLoader *
+parse_gltf (GBytes *data, GFile *base_path, GError **error)
 {
   g_autoptr(JsonParser) parser = NULL;
   g_autoptr(JsonNode) root_node = NULL;
@@ -2238,6 +2239,19 @@ gthree_loader_parse_gltf (GBytes *data, GFile *base_path, GError **error)
   return g_steal_pointer (&loader);
 }
 
+GthreeLoader *
+gthree_loader_parse_gltf (GBytes *data, GFile *base_path, GError **error)
+{
+  GthreeLoader *loader;
+  GTHREE_TRACE_BEGIN (trace_parse);
+
+  loader = parse_gltf (data, base_path, error);
+
+  GTHREE_TRACE_END_FORMAT (trace_parse, "parse gltf", "%" G_GSIZE_FORMAT " bytes", g_bytes_get_size (data));
+
+  return loader;
+}
+
 int
 gthree_loader_get_n_scenes (GthreeLoader *loader)
 {
@@ -0,0 +1,572 @@
+#include <math.h>
+
+#include "gthreelod.h"
+#include "gthreeorthographiccamera.h"
+#include "gthreeobjectprivate.h"
+#include "gthreeprivate.h"
+#include "gthreetypebuiltins.h"
+
+typedef struct {
+  GthreeObject *object;
+  float threshold;
+} GthreeLODLevel;
+
+typedef struct {
+  GArray *levels; /* GthreeLODLevel, finest first */
+  GthreeLODMode mode;
+  float hysteresis;
+  float cross_fade_duration; /* In seconds, 0 disables fading */
+  int shadow_level_bias;
+
+  int current_level; /* -1 before the first update */
+  int fade_level; /* Level being faded out, or -1 */
+  gint64 fade_start;
+} GthreeLODPrivate;
+
+enum {
+  PROP_0,
+
+  PROP_MODE,
+  PROP_HYSTERESIS,
+  PROP_CROSS_FADE_DURATION,
+  PROP_SHADOW_LEVEL_BIAS,
+
+  N_PROPS
+};
+
+static GParamSpec *obj_props[N_PROPS] = { NULL, };
+
+G_DEFINE_TYPE_WITH_PRIVATE (GthreeLOD, gthree_lod, GTHREE_TYPE_OBJECT)
+
+static void
+set_subtree_lod_fade (GthreeObject *object,
+                      float         fade)
+{
+  GthreeObject *child;
+  GthreeObjectIter iter;
+
+  gthree_object_set_lod_fade (object, fade);
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    set_subtree_lod_fade (child, fade);
+}
+
+static void
+clear_level (gpointer data)
+{
+  GthreeLODLevel *level = data;
+
+  g_object_unref (level->object);
+}
+
+GthreeLOD *
+gthree_lod_new (void)
+{
+  return g_object_new (gthree_lod_get_type (),
+                       NULL);
+}
+
+static void
+gthree_lod_init (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  priv->levels = g_array_new (FALSE, FALSE, sizeof (GthreeLODLevel));
+  g_array_set_clear_func (priv->levels, clear_level);
+  priv->mode = GTHREE_LOD_MODE_DISTANCE;
+  priv->hysteresis = 0.1;
+  priv->current_level = -1;
+  priv->fade_level = -1;
+}
+
+static void
+gthree_lod_finalize (GObject *obj)
+{
+  GthreeLOD *lod = GTHREE_LOD (obj);
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  g_array_unref (priv->levels);
+
+  G_OBJECT_CLASS (gthree_lod_parent_class)->finalize (obj);
+}
+
+static void
+gthree_lod_set_property (GObject *obj,
+                         guint prop_id,
+                         const GValue *value,
+                         GParamSpec *pspec)
+{
+  GthreeLOD *lod = GTHREE_LOD (obj);
+
+  switch (prop_id)
+    {
+    case PROP_MODE:
+      gthree_lod_set_mode (lod, g_value_get_enum (value));
+      break;
+
+    case PROP_HYSTERESIS:
+      gthree_lod_set_hysteresis (lod, g_value_get_float (value));
+      break;
+
+    case PROP_CROSS_FADE_DURATION:
+      gthree_lod_set_cross_fade_duration (lod, g_value_get_float (value));
+      break;
+
+    case PROP_SHADOW_LEVEL_BIAS:
+      gthree_lod_set_shadow_level_bias (lod, g_value_get_int (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+    }
+}
+
+static void
+gthree_lod_get_property (GObject *obj,
+                         guint prop_id,
+                         GValue *value,
+                         GParamSpec *pspec)
+{
+  GthreeLOD *lod = GTHREE_LOD (obj);
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  switch (prop_id)
+    {
+    case PROP_MODE:
+      g_value_set_enum (value, priv->mode);
+      break;
+
+    case PROP_HYSTERESIS:
+      g_value_set_float (value, priv->hysteresis);
+      break;
+
+    case PROP_CROSS_FADE_DURATION:
+      g_value_set_float (value, priv->cross_fade_duration);
+      break;
+
+    case PROP_SHADOW_LEVEL_BIAS:
+      g_value_set_int (value, priv->shadow_level_bias);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+    }
+}
+
+static void
+gthree_lod_class_init (GthreeLODClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->set_property = gthree_lod_set_property;
+  gobject_class->get_property = gthree_lod_get_property;
+  gobject_class->finalize = gthree_lod_finalize;
+
+  obj_props[PROP_MODE] =
+    g_param_spec_enum ("mode", "Mode", "What the level thresholds measure",
+                       GTHREE_TYPE_LOD_MODE,
+                       GTHREE_LOD_MODE_DISTANCE,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  obj_props[PROP_HYSTERESIS] =
+    g_param_spec_float ("hysteresis", "Hysteresis", "Fraction of a threshold to pass before switching back",
+                        0.f, 1.f, 0.1f,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  obj_props[PROP_CROSS_FADE_DURATION] =
+    g_param_spec_float ("cross-fade-duration", "Cross-fade duration", "Seconds to dither between levels",
+                        0.f, G_MAXFLOAT, 0.f,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  obj_props[PROP_SHADOW_LEVEL_BIAS] =
+    g_param_spec_int ("shadow-level-bias", "Shadow level bias", "How many levels coarser to cast shadows with",
+                      0, G_MAXINT, 0,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (gobject_class, N_PROPS, obj_props);
+}
+
+static gint
+compare_level_ascending (gconstpointer a,
+                         gconstpointer b)
+{
+  const GthreeLODLevel *la = a;
+  const GthreeLODLevel *lb = b;
+
+  return (la->threshold > lb->threshold) - (la->threshold < lb->threshold);
+}
+
+static gint
+compare_level_descending (gconstpointer a,
+                          gconstpointer b)
+{
+  return compare_level_ascending (b, a);
+}
+
+static void
+stop_fade (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  if (priv->fade_level >= 0)
+    {
+      set_subtree_lod_fade (g_array_index (priv->levels, GthreeLODLevel, priv->fade_level).object, 1.0f);
+      set_subtree_lod_fade (g_array_index (priv->levels, GthreeLODLevel, priv->current_level).object, 1.0f);
+    }
+  priv->fade_level = -1;
+}
+
+/* Levels are kept finest first, which is the smallest distance or the
+ * largest screen size depending on the mode */
+static void
+sort_levels (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  stop_fade (lod);
+  priv->current_level = -1;
+
+  if (priv->mode == GTHREE_LOD_MODE_DISTANCE)
+    g_array_sort (priv->levels, compare_level_ascending);
+  else
+    g_array_sort (priv->levels, compare_level_descending);
+}
+
+/**
+ * gthree_lod_add_level:
+ * @lod: a #GthreeLOD
+ * @object: the object to show for this level
+ * @threshold: where this level starts
+ *
+ * Adds @object as a child of @lod, shown as one of its levels of
+ * detail. Only one level is drawn at a time, chosen by
+ * gthree_lod_update(), which the renderer calls for each LOD it
+ * draws.
+ *
+ * In %GTHREE_LOD_MODE_DISTANCE mode @threshold is the distance from
+ * the camera from which this level is used, so the finest level
+ * should have 0. In %GTHREE_LOD_MODE_SCREEN_SIZE mode it is the
+ * smallest projected height of the LOD bounds, as a fraction of the
+ * viewport height, for which the level is used, so the coarsest
+ * level should have 0.
+ */
+void
+gthree_lod_add_level (GthreeLOD    *lod,
+                      GthreeObject *object,
+                      float         threshold)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+  GthreeLODLevel level = { g_object_ref (object), threshold };
+
+  if (gthree_object_get_parent (object) != GTHREE_OBJECT (lod))
+    gthree_object_add_child (GTHREE_OBJECT (lod), object);
+
+  g_array_append_val (priv->levels, level);
+  sort_levels (lod);
+}
+
+int
+gthree_lod_get_n_levels (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->levels->len;
+}
+
+GthreeObject *
+gthree_lod_get_level (GthreeLOD *lod,
+                      int        level)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  g_return_val_if_fail (level >= 0 && level < priv->levels->len, NULL);
+
+  return g_array_index (priv->levels, GthreeLODLevel, level).object;
+}
+
+float
+gthree_lod_get_level_threshold (GthreeLOD *lod,
+                                int        level)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  g_return_val_if_fail (level >= 0 && level < priv->levels->len, 0.f);
+
+  return g_array_index (priv->levels, GthreeLODLevel, level).threshold;
+}
+
+/* The level picked by the last gthree_lod_update(), or -1 */
+int
+gthree_lod_get_current_level (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->current_level;
+}
+
+void
+gthree_lod_set_mode (GthreeLOD     *lod,
+                     GthreeLODMode  mode)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  if (priv->mode == mode)
+    return;
+
+  priv->mode = mode;
+  sort_levels (lod);
+
+  g_object_notify_by_pspec (G_OBJECT (lod), obj_props[PROP_MODE]);
+}
+
+GthreeLODMode
+gthree_lod_get_mode (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->mode;
+}
+
+/* A level is only left once the distance or screen size is this
+ * fraction past its threshold, so that objects right at a threshold
+ * don't flip between levels every frame */
+void
+gthree_lod_set_hysteresis (GthreeLOD *lod,
+                           float      hysteresis)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  priv->hysteresis = hysteresis;
+
+  g_object_notify_by_pspec (G_OBJECT (lod), obj_props[PROP_HYSTERESIS]);
+}
+
+float
+gthree_lod_get_hysteresis (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->hysteresis;
+}
+
+/* When non-zero, both levels are drawn for this many seconds after a
+ * switch, with complementary screen-door dither patterns, rather than
+ * popping from one to the other */
+void
+gthree_lod_set_cross_fade_duration (GthreeLOD *lod,
+                                    float      duration)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  priv->cross_fade_duration = duration;
+  if (duration <= 0)
+    stop_fade (lod);
+
+  g_object_notify_by_pspec (G_OBJECT (lod), obj_props[PROP_CROSS_FADE_DURATION]);
+}
+
+float
+gthree_lod_get_cross_fade_duration (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->cross_fade_duration;
+}
+
+/* Shadow maps are drawn with the level this many steps coarser than
+ * the one in the main pass */
+void
+gthree_lod_set_shadow_level_bias (GthreeLOD *lod,
+                                  int        bias)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  priv->shadow_level_bias = bias;
+
+  g_object_notify_by_pspec (G_OBJECT (lod), obj_props[PROP_SHADOW_LEVEL_BIAS]);
+}
+
+int
+gthree_lod_get_shadow_level_bias (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->shadow_level_bias;
+}
+
+/* Levels removed from the lod by other means are dropped */
+static void
+prune_levels (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+  int i;
+
+  for (i = priv->levels->len - 1; i >= 0; i--)
+    {
+      GthreeLODLevel *level = &g_array_index (priv->levels, GthreeLODLevel, i);
+
+      if (gthree_object_get_parent (level->object) != GTHREE_OBJECT (lod))
+        {
+          stop_fade (lod);
+          g_array_remove_index (priv->levels, i);
+          priv->current_level = -1;
+        }
+    }
+}
+
+static float
+level_threshold (GthreeLODPrivate *priv,
+                 int               level)
+{
+  return g_array_index (priv->levels, GthreeLODLevel, level).threshold;
+}
+
+static int
+select_level (GthreeLODPrivate *priv,
+              float             metric)
+{
+  int n_levels = priv->levels->len;
+  int level = priv->current_level;
+  float h = priv->hysteresis;
+
+  /* Nothing to hold on to the first time */
+  if (level < 0)
+    {
+      level = 0;
+      h = 0;
+    }
+
+  if (priv->mode == GTHREE_LOD_MODE_DISTANCE)
+    {
+      while (level + 1 < n_levels && metric >= level_threshold (priv, level + 1) * (1 + h))
+        level++;
+      while (level > 0 && metric < level_threshold (priv, level) * (1 - h))
+        level--;
+    }
+  else
+    {
+      while (level + 1 < n_levels && metric < level_threshold (priv, level) * (1 - h))
+        level++;
+      while (level > 0 && metric >= level_threshold (priv, level - 1) * (1 + h))
+        level--;
+    }
+
+  return level;
+}
+
+static float
+get_metric (GthreeLOD    *lod,
+            GthreeCamera *camera)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+  graphene_vec4_t camera_row, lod_row;
+  graphene_vec3_t camera_position, lod_position;
+  graphene_box_t bounds;
+  graphene_vec3_t size;
+  float distance, radius, scale;
+
+  graphene_matrix_get_row (gthree_object_get_world_matrix (GTHREE_OBJECT (camera)), 3, &camera_row);
+  graphene_matrix_get_row (gthree_object_get_world_matrix (GTHREE_OBJECT (lod)), 3, &lod_row);
+  graphene_vec4_get_xyz (&camera_row, &camera_position);
+  graphene_vec4_get_xyz (&lod_row, &lod_position);
+
+  if (priv->mode == GTHREE_LOD_MODE_DISTANCE)
+    return graphene_vec3_distance (&camera_position, &lod_position, NULL);
+
+  /* Unbounded, so always as large as it gets */
+  if (gthree_object_get_subtree_bounds (GTHREE_OBJECT (lod), &bounds) != GTHREE_SUBTREE_BOUNDS_FINITE)
+    return G_MAXFLOAT;
+
+  graphene_box_get_size (&bounds, &size);
+  radius = graphene_vec3_length (&size) / 2;
+
+  /* Element [1][1] scales view space height to half the viewport */
+  scale = graphene_matrix_get_value (gthree_camera_get_projection_matrix (camera), 1, 1);
+  if (GTHREE_IS_ORTHOGRAPHIC_CAMERA (camera))
+    return radius * scale;
+
+  /* Distance rather than view depth, so turning the camera doesn't
+   * switch levels */
+  distance = graphene_vec3_distance (&camera_position, &lod_position, NULL);
+  if (distance <= radius)
+    return G_MAXFLOAT;
+
+  return radius * scale / distance;
+}
+
+/**
+ * gthree_lod_update:
+ * @lod: a #GthreeLOD
+ * @camera: the camera the LOD is seen from
+ *
+ * Picks the level to draw for @camera, and advances any cross-fade.
+ * The renderer calls this while traversing the scene, so it is only
+ * needed to query gthree_lod_get_current_level() outside rendering.
+ *
+ * The selection uses the world matrices of @lod and @camera, so these
+ * must be up to date.
+ */
+void
+gthree_lod_update (GthreeLOD    *lod,
+                   GthreeCamera *camera)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+  int level;
+
+  prune_levels (lod);
+
+  if (priv->levels->len == 0)
+    return;
+
+  level = select_level (priv, get_metric (lod, camera));
+
+  if (level != priv->current_level)
+    {
+      stop_fade (lod);
+
+      if (priv->cross_fade_duration > 0 && priv->current_level >= 0)
+        {
+          priv->fade_level = priv->current_level;
+          priv->fade_start = g_get_monotonic_time ();
+        }
+
+      priv->current_level = level;
+    }
+
+  if (priv->fade_level >= 0)
+    {
+      float t = (g_get_monotonic_time () - priv->fade_start) / (priv->cross_fade_duration * G_USEC_PER_SEC);
+
+      if (t >= 1.0f)
+        stop_fade (lod);
+      else
+        {
+          /* See lod_fade_pars_fragment.glsl */
+          set_subtree_lod_fade (g_array_index (priv->levels, GthreeLODLevel, priv->fade_level).object, 1.0f - t);
+          set_subtree_lod_fade (g_array_index (priv->levels, GthreeLODLevel, priv->current_level).object, -t);
+        }
+    }
+}
+
+/* Whether the renderer should descend into @child. Children that are
+ * not levels are always drawn. */
+gboolean
+gthree_lod_is_child_active (GthreeLOD    *lod,
+                            GthreeObject *child,
+                            gboolean      for_shadow)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+  int current = MAX (priv->current_level, 0);
+  int i;
+
+  for (i = 0; i < priv->levels->len; i++)
+    {
+      if (g_array_index (priv->levels, GthreeLODLevel, i).object != child)
+        continue;
+
+      if (for_shadow)
+        return i == MIN (current + priv->shadow_level_bias, (int)priv->levels->len - 1);
+
+      return i == current || i == priv->fade_level;
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,77 @@
+#ifndef __GTHREE_LOD_H__
+#define __GTHREE_LOD_H__
+
+#if !defined (__GTHREE_H_INSIDE__) && !defined (GTHREE_COMPILATION)
+#error "Only <gthree/gthree.h> can be included directly."
+#endif
+
+#include <gthree/gthreeobject.h>
+#include <gthree/gthreecamera.h>
+
+G_BEGIN_DECLS
+
+#define GTHREE_TYPE_LOD      (gthree_lod_get_type ())
+#define GTHREE_LOD(inst)     (G_TYPE_CHECK_INSTANCE_CAST ((inst), GTHREE_TYPE_LOD, GthreeLOD))
+#define GTHREE_LOD_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), GTHREE_TYPE_LOD, GthreeLODClass))
+#define GTHREE_IS_LOD(inst)  (G_TYPE_CHECK_INSTANCE_TYPE ((inst), GTHREE_TYPE_LOD))
+#define GTHREE_IS_LOD_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GTHREE_TYPE_LOD))
+#define GTHREE_LOD_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), GTHREE_TYPE_LOD, GthreeLODClass))
+
+typedef struct {
+  GthreeObject parent;
+} GthreeLOD;
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GthreeLOD, g_object_unref)
+
+typedef struct {
+  GthreeObjectClass parent_class;
+
+} GthreeLODClass;
+
+GTHREE_API
+GType gthree_lod_get_type (void) G_GNUC_CONST;
+
+GTHREE_API
+GthreeLOD *gthree_lod_new (void);
+
+GTHREE_API
+void          gthree_lod_add_level                  (GthreeLOD     *lod,
+                                                     GthreeObject  *object,
+                                                     float          threshold);
+GTHREE_API
+int           gthree_lod_get_n_levels               (GthreeLOD     *lod);
+GTHREE_API
+GthreeObject *gthree_lod_get_level                  (GthreeLOD     *lod,
+                                                     int            level);
+GTHREE_API
+float         gthree_lod_get_level_threshold        (GthreeLOD     *lod,
+                                                     int            level);
+GTHREE_API
+int           gthree_lod_get_current_level          (GthreeLOD     *lod);
+GTHREE_API
+void          gthree_lod_set_mode                   (GthreeLOD     *lod,
+                                                     GthreeLODMode  mode);
+GTHREE_API
+GthreeLODMode gthree_lod_get_mode                   (GthreeLOD     *lod);
+GTHREE_API
+void          gthree_lod_set_hysteresis             (GthreeLOD     *lod,
+                                                     float          hysteresis);
+GTHREE_API
+float         gthree_lod_get_hysteresis             (GthreeLOD     *lod);
+GTHREE_API
+void          gthree_lod_set_cross_fade_duration    (GthreeLOD     *lod,
+                                                     float          duration);
+GTHREE_API
+float         gthree_lod_get_cross_fade_duration    (GthreeLOD     *lod);
+GTHREE_API
+void          gthree_lod_set_shadow_level_bias      (GthreeLOD     *lod,
+                                                     int            bias);
+GTHREE_API
+int           gthree_lod_get_shadow_level_bias      (GthreeLOD     *lod);
+GTHREE_API
+void          gthree_lod_update                     (GthreeLOD     *lod,
+                                                     GthreeCamera  *camera);
+
+G_END_DECLS
+
+#endif /* __GTHREE_LOD_H__ */
@@ -20,6 +20,7 @@ typedef struct {
   float polygon_offset_units;
   gboolean depth_test;
   gboolean depth_write;
+  gboolean depth_prepass;
   float alpha_test;
   GthreeSide side;
   gboolean vertex_colors;
@@ -27,6 +28,7 @@ typedef struct {
 
   GthreeShader *shader;
   guint32 valid_for_renderer_id;
+  guint id;
 
   GArray *clipping_planes;
   gboolean clip_intersection;
@@ -53,6 +55,8 @@ enum {
 
 static GParamSpec *obj_props[N_PROPS] = { NULL, };
 
+static guint next_material_id = 0;
+
 GthreeMaterial *
 gthree_material_clone (GthreeMaterial *material)
 {
@@ -94,6 +98,7 @@ gthree_material_init (GthreeMaterial *material)
   priv->blend_dst_factor = GL_ONE_MINUS_SRC_ALPHA;
   priv->depth_test = TRUE;
   priv->depth_write = TRUE;
+  priv->depth_prepass = TRUE;
   priv->vertex_colors = FALSE;
   priv->fog = TRUE;
 
@@ -104,6 +109,7 @@ gthree_material_init (GthreeMaterial *material)
   priv->side = GTHREE_SIDE_FRONT;
   priv->clip_intersection = FALSE;
   priv->clipping_planes = g_array_new (FALSE, TRUE, sizeof (graphene_plane_t));
+  priv->id = ++next_material_id;
 }
 
 static void
@@ -556,6 +562,30 @@ gthree_material_set_depth_write (GthreeMaterial       *material,
   gthree_material_set_needs_update (material);
 }
 
+gboolean
+gthree_material_get_depth_prepass (GthreeMaterial *material)
+{
+  GthreeMaterialPrivate *priv = gthree_material_get_instance_private (material);
+
+  return priv->depth_prepass;
+}
+
+/* Allows opting out of the depth pre-pass, see
+ * gthree_renderer_set_depth_prepass(). */
+void
+gthree_material_set_depth_prepass (GthreeMaterial       *material,
+                                   gboolean              depth_prepass)
+{
+  GthreeMaterialPrivate *priv = gthree_material_get_instance_private (material);
+
+  if (priv->depth_prepass == !!depth_prepass)
+    return;
+
+  priv->depth_prepass = !!depth_prepass;
+
+  gthree_material_set_needs_update (material);
+}
+
 
 GthreeSide
 gthree_material_get_side (GthreeMaterial *material)
@@ -658,6 +688,14 @@ gthree_material_get_properties (GthreeMaterial  *material)
   return &priv->properties;
 }
 
+/* Small unique number, used to group draws by material */
+guint
+gthree_material_get_id (GthreeMaterial *material)
+{
+  GthreeMaterialPrivate *priv = gthree_material_get_instance_private (material);
+  return priv->id;
+}
+
 GArray *
 gthree_material_get_clipping_planes (GthreeMaterial *material)
 {
@@ -109,6 +109,11 @@ GTHREE_API
 void              gthree_material_set_depth_write          (GthreeMaterial          *material,
                                                             gboolean                 depth_write);
 GTHREE_API
+gboolean          gthree_material_get_depth_prepass        (GthreeMaterial          *material);
+GTHREE_API
+void              gthree_material_set_depth_prepass        (GthreeMaterial          *material,
+                                                            gboolean                 depth_prepass);
+GTHREE_API
 float             gthree_material_get_alpha_test           (GthreeMaterial          *material);
 GTHREE_API
 void              gthree_material_set_alpha_test           (GthreeMaterial          *material,
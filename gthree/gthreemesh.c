@@ -64,6 +64,8 @@ gthree_mesh_finalize (GObject *obj)
   GthreeMesh *mesh = GTHREE_MESH (obj);
   GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
 
+  if (priv->geometry)
+    gthree_geometry_remove_owner (priv->geometry, GTHREE_OBJECT (mesh));
   g_clear_object (&priv->geometry);
   g_ptr_array_unref (priv->materials);
 
@@ -167,19 +169,29 @@ gthree_mesh_fill_render_list (GthreeObject   *object,
 }
 
 static gboolean
-gthree_mesh_in_frustum (GthreeObject *object,
-                        const graphene_frustum_t *frustum)
+gthree_mesh_get_world_bounding_sphere (GthreeObject *object,
+                                       graphene_sphere_t *sphere)
 {
   GthreeMesh *mesh = GTHREE_MESH (object);
   GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
-  graphene_sphere_t sphere;
 
   if (!priv->geometry)
     return FALSE;
 
   graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
                                     gthree_geometry_get_bounding_sphere (priv->geometry),
-                                    &sphere);
+                                    sphere);
+  return TRUE;
+}
+
+static gboolean
+gthree_mesh_in_frustum (GthreeObject *object,
+                        const graphene_frustum_t *frustum)
+{
+  graphene_sphere_t sphere;
+
+  if (!gthree_mesh_get_world_bounding_sphere (object, &sphere))
+    return FALSE;
 
   return graphene_frustum_intersects_sphere (frustum, &sphere);
 }
@@ -503,6 +515,8 @@ gthree_mesh_set_property (GObject *obj,
     {
     case PROP_GEOMETRY:
       g_set_object (&priv->geometry, g_value_get_object (value));
+      if (priv->geometry)
+        gthree_geometry_add_owner (priv->geometry, GTHREE_OBJECT (mesh));
       break;
 
     case PROP_MATERIALS:
@@ -619,6 +633,7 @@ gthree_mesh_class_init (GthreeMeshClass *klass)
   gobject_class->finalize = gthree_mesh_finalize;
 
   object_class->in_frustum = gthree_mesh_in_frustum;
+  object_class->get_world_bounding_sphere = gthree_mesh_get_world_bounding_sphere;
   object_class->update = gthree_mesh_update;
   object_class->fill_render_list = gthree_mesh_fill_render_list;
   object_class->raycast = gthree_mesh_raycast;
@@ -1,8 +1,14 @@
 #include <math.h>
+#include <string.h>
 #include <epoxy/gl.h>
 
 #include "gthreeobjectprivate.h"
 #include "gthreemesh.h"
+#include "gthreeskinnedmesh.h"
+#include "gthreeline.h"
+#include "gthreepoints.h"
+#include "gthreesprite.h"
+#include "gthreelight.h"
 
 #include <graphene.h>
 
@@ -17,10 +23,20 @@ enum
 static GQuark q_modelMatrix;
 static GQuark q_modelViewMatrix;
 static GQuark q_normalMatrix;
+static GQuark q_lodFade;
 
 
 static guint object_signals[LAST_SIGNAL] = { 0, };
 
+static gint next_stamp = 0;
+
+/* Stamps may be allocated from the matrix update threads */
+static inline guint32
+new_stamp (void)
+{
+  return (guint32) g_atomic_int_add (&next_stamp, 1) + 1;
+}
+
 typedef struct {
   char *name;
   char *uuid;
@@ -31,17 +47,30 @@ typedef struct {
   graphene_vec3_t scale;
   graphene_vec3_t up;
 
-  graphene_matrix_t matrix;
-  graphene_matrix_t world_matrix;
-
+  /* These point to matrix_storage/world_matrix_storage, or into the
+   * transform store of the scene if it has one */
+  graphene_matrix_t *matrix;
+  graphene_matrix_t *world_matrix;
+  graphene_matrix_t matrix_storage;
+  graphene_matrix_t world_matrix_storage;
+  GthreeTransformStore *transform_store;
+
+  /* The model view and normal matrices are computed lazily from the
+   * last view matrix, and only if the world matrix or view changed
+   * since last time */
+  graphene_matrix_t view_matrix;
   graphene_matrix_t model_view_matrix;
-  graphene_matrix_t normal_matrix;
+  float normal_matrix[9];
+  guint32 model_view_stamp; /* transform_stamp when model_view_matrix was computed */
 
   gboolean visible;
   gboolean cast_shadow;
   gboolean receive_shadow;
   guint32 layer_mask;
 
+  /* Set by a GthreeLOD while cross-fading levels, 1 otherwise */
+  float lod_fade;
+
   GthreeBeforeRenderCallback before_render_cb;
 
   /* object graph */
@@ -53,6 +82,17 @@ typedef struct {
 
   gint n_children;
   gint age;
+  guint n_descendants;
+
+  /* Change tracking for retained rendering, the tree and structure
+   * stamps cover the whole subtree */
+  guint32 tree_stamp;
+  guint32 structure_stamp;  /* Only children added or removed */
+  guint32 transform_stamp;
+
+  /* World space bounds of everything renderable in this subtree,
+   * only valid if subtree_bounds_valid == TRUE */
+  graphene_box_t subtree_bounds;
 
   guint realized : 1;
   guint in_destruction : 1;
@@ -60,8 +100,19 @@ typedef struct {
   guint world_matrix_need_update : 1;
   guint matrix_auto_update : 1;
   guint matrix_need_update : 1;
+  guint dirty_descendants : 1; /* Some descendant needs update_matrix_world() */
 
   guint frustum_culled : 1;
+
+  guint model_view_valid : 1;
+  guint normal_matrix_valid : 1;
+
+  guint subtree_bounds_valid : 1;
+  guint subtree_bounds_kind : 2; /* GthreeSubtreeBoundsKind */
+
+  guint is_static : 1;
+  guint static_batched : 1; /* Drawn as part of a GthreeStaticBatch */
+  guint is_occluder : 1;
 } GthreeObjectPrivate;
 
 enum
@@ -85,6 +136,43 @@ G_DEFINE_TYPE_WITH_PRIVATE (GthreeObject, gthree_object, G_TYPE_OBJECT);
 
 #define PRIV(_o) ((GthreeObjectPrivate*)gthree_object_get_instance_private (_o))
 
+static gboolean gthree_object_real_update_matrix_world (GthreeObject *object,
+                                                        gboolean force);
+
+/* Only the base implementation is known to touch nothing but the
+ * object itself, anything overriding it might e.g. read the world
+ * matrix of other parts of the tree, so it has to run every time */
+static gboolean
+has_default_update_matrix_world (GthreeObject *object)
+{
+  return GTHREE_OBJECT_GET_CLASS (object)->update_matrix_world == gthree_object_real_update_matrix_world;
+}
+
+/* Whether update_matrix_world() needs to visit the object */
+static gboolean
+needs_update_matrix_world (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = PRIV (object);
+
+  return
+    (priv->matrix_need_update && priv->matrix_auto_update) ||
+    priv->world_matrix_need_update ||
+    priv->dirty_descendants ||
+    !has_default_update_matrix_world (object);
+}
+
+/* Make sure update_matrix_world() reaches the object from the root */
+static void
+propagate_matrix_dirty (GthreeObject *object)
+{
+  GthreeObject *ancestor;
+
+  for (ancestor = PRIV (object)->parent;
+       ancestor != NULL && !PRIV (ancestor)->dirty_descendants;
+       ancestor = PRIV (ancestor)->parent)
+    PRIV (ancestor)->dirty_descendants = TRUE;
+}
+
 static gboolean gthree_object_real_update_matrix_world (GthreeObject *object,
                                                         gboolean force);
 static void gthree_object_real_set_direct_uniforms  (GthreeObject *object,
@@ -133,9 +221,12 @@ gthree_object_init (GthreeObject *object)
   priv->visible = TRUE;
   priv->layer_mask = 1;
   priv->frustum_culled = TRUE;
+  priv->lod_fade = 1.0f;
 
-  graphene_matrix_init_identity (&priv->matrix);
-  graphene_matrix_init_identity (&priv->world_matrix);
+  priv->matrix = &priv->matrix_storage;
+  priv->world_matrix = &priv->world_matrix_storage;
+  graphene_matrix_init_identity (priv->matrix);
+  graphene_matrix_init_identity (priv->world_matrix);
   graphene_quaternion_init_identity (&priv->quaternion);
   graphene_vec3_init (&priv->scale, 1, 1, 1);
   graphene_vec3_init (&priv->up, 0, 1, 0);
@@ -254,6 +345,7 @@ gthree_object_class_init (GthreeObjectClass *klass)
   INIT_QUARK(modelMatrix);
   INIT_QUARK(modelViewMatrix);
   INIT_QUARK(normalMatrix);
+  INIT_QUARK(lodFade);
 
   obj_class->set_property = gthree_object_set_property;
   obj_class->get_property = gthree_object_get_property;
@@ -319,6 +411,7 @@ gthree_object_set_matrix_auto_update (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->matrix_auto_update = !! auto_update;
+  propagate_matrix_dirty (object);
 }
 
 const char *
@@ -376,6 +469,9 @@ gthree_object_set_visible (GthreeObject *object,
 
   priv->visible = visible;
 
+  gthree_object_mark_tree_changed (object);
+  gthree_object_invalidate_subtree_bounds (object);
+
   g_object_notify_by_pspec (G_OBJECT (object), obj_props[PROP_VISIBLE]);
 }
 
@@ -399,6 +495,113 @@ gthree_object_set_cast_shadow (GthreeObject *object,
   priv->cast_shadow = cast_shadow;
 }
 
+/**
+ * gthree_object_set_is_static:
+ * @object: a #GthreeObject
+ * @is_static: whether the object is static
+ *
+ * Marks the object as static, i.e. its geometry and material are not
+ * expected to change. Static meshes sharing a material are merged
+ * into a single draw by gthree_scene_build_static_batches().
+ *
+ * Moving or hiding a static object is still allowed, but each
+ * transform change rewrites its vertices in the combined buffers.
+ */
+void
+gthree_object_set_is_static (GthreeObject *object,
+                             gboolean is_static)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  priv->is_static = !!is_static;
+}
+
+gboolean
+gthree_object_get_is_static (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->is_static;
+}
+
+/**
+ * gthree_object_set_is_occluder:
+ * @object: a #GthreeObject
+ * @is_occluder: whether the object is an occluder
+ *
+ * Marks the object as an occluder for software occlusion culling, see
+ * gthree_renderer_set_software_occlusion_culling(). Occluders are
+ * rasterized into a small cpu depth buffer each frame, and objects
+ * entirely hidden behind them are not drawn.
+ *
+ * Good occluders are large and have few triangles, like walls and
+ * terrain. Only meshes are used as occluders.
+ */
+void
+gthree_object_set_is_occluder (GthreeObject *object,
+                               gboolean is_occluder)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  is_occluder = !!is_occluder;
+  if (priv->is_occluder == is_occluder)
+    return;
+
+  priv->is_occluder = is_occluder;
+  gthree_object_mark_tree_changed (object);
+}
+
+gboolean
+gthree_object_get_is_occluder (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->is_occluder;
+}
+
+/* The dither fade of a GthreeLOD level that is being faded in or
+ * out, see lod_fade_pars_fragment.glsl. 1 means fully drawn. */
+void
+gthree_object_set_lod_fade (GthreeObject *object,
+                            float         fade)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  priv->lod_fade = fade;
+}
+
+float
+gthree_object_get_lod_fade (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->lod_fade;
+}
+
+/* Set while a static batch draws this object, the renderer then skips
+ * it. This changes the set of rendered objects, so mark the tree. */
+void
+gthree_object_set_static_batched (GthreeObject *object,
+                                  gboolean batched)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  batched = !!batched;
+  if (priv->static_batched == batched)
+    return;
+
+  priv->static_batched = batched;
+  gthree_object_mark_tree_changed (object);
+}
+
+gboolean
+gthree_object_get_static_batched (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->static_batched;
+}
+
 gboolean
 gthree_object_get_receive_shadow (GthreeObject *object)
 {
@@ -446,6 +649,7 @@ gthree_object_set_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask = 1 << layer;
+  gthree_object_mark_tree_changed (object);
 }
 
 void
@@ -455,6 +659,7 @@ gthree_object_enable_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask |= 1 << layer;
+  gthree_object_mark_tree_changed (object);
 }
 
 void
@@ -464,6 +669,7 @@ gthree_object_disable_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask &= ~ (1 << layer);
+  gthree_object_mark_tree_changed (object);
 }
 
 void
@@ -473,6 +679,7 @@ gthree_object_toggle_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask ^= ~ 1 << layer;
+  gthree_object_mark_tree_changed (object);
 }
 
 gboolean
@@ -542,6 +749,7 @@ gthree_object_look_at (GthreeObject *object,
   graphene_matrix_init_look_at (&m, &priv->position, pos, &priv->up);
   graphene_quaternion_init_from_matrix (&priv->quaternion, &m);
   priv->matrix_need_update = TRUE;
+  propagate_matrix_dirty (object);
   priv->euler_valid = FALSE;
 }
 
@@ -575,6 +783,7 @@ gthree_object_set_position (GthreeObject *object,
 
   priv->position = *vec;
   priv->matrix_need_update = TRUE;
+  propagate_matrix_dirty (object);
 }
 
 void
@@ -587,6 +796,7 @@ gthree_object_set_position_xyz (GthreeObject *object,
 
   graphene_vec3_init (&priv->position, x, y, z);
   priv->matrix_need_update = TRUE;
+  propagate_matrix_dirty (object);
 }
 
 void
@@ -616,6 +826,7 @@ gthree_object_translate_on_axis (GthreeObject                *object,
   graphene_vec3_scale (&rotated_axis, distance, &rotated_axis);
   graphene_vec3_add (&priv->position, &rotated_axis, &priv->position);
   priv->matrix_need_update = TRUE;
+  propagate_matrix_dirty (object);
 }
 
 void
@@ -656,6 +867,7 @@ gthree_object_set_scale (GthreeObject             *object,
 
   priv->scale = *scale;
   priv->matrix_need_update = TRUE;
+  propagate_matrix_dirty (object);
 }
 
 void
@@ -668,6 +880,7 @@ gthree_object_set_scale_xyz (GthreeObject                *object,
 
   graphene_vec3_init (&priv->scale, x, y, z);
   priv->matrix_need_update = TRUE;
+  propagate_matrix_dirty (object);
 }
 
 void
@@ -695,6 +908,7 @@ gthree_object_set_quaternion (GthreeObject *object,
   graphene_quaternion_init_from_quaternion (&priv->quaternion, q);
   priv->euler_valid = FALSE;
   priv->matrix_need_update = TRUE;
+  propagate_matrix_dirty (object);
 }
 
 const graphene_quaternion_t *
@@ -715,6 +929,7 @@ gthree_object_set_rotation (GthreeObject *object,
   priv->euler_valid = TRUE;
   graphene_quaternion_init_from_euler (&priv->quaternion, rot);
   priv->matrix_need_update = TRUE;
+  propagate_matrix_dirty (object);
 }
 
 void
@@ -756,7 +971,7 @@ gthree_object_get_matrix (GthreeObject *object)
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  return &priv->matrix;
+  return priv->matrix;
 }
 
 static void
@@ -766,7 +981,7 @@ gthree_object_decompose_matrix (GthreeObject                *object)
   graphene_vec3_t shear;
   graphene_vec4_t perspective;
 
-  if (!graphene_matrix_decompose (&priv->matrix,
+  if (!graphene_matrix_decompose (priv->matrix,
                                   &priv->position,
                                   &priv->scale,
                                   &priv->quaternion,
@@ -774,7 +989,7 @@ gthree_object_decompose_matrix (GthreeObject                *object)
     {
       // If this fails, at least get the position
       graphene_vec4_t transl;
-      graphene_matrix_get_row (&priv->matrix, 3, &transl);
+      graphene_matrix_get_row (priv->matrix, 3, &transl);
       graphene_vec4_get_xyz (&transl, &priv->position);
     }
 }
@@ -786,12 +1001,13 @@ gthree_object_set_matrix (GthreeObject                *object,
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  graphene_matrix_init_from_matrix  (&priv->matrix, matrix);
+  graphene_matrix_init_from_matrix  (priv->matrix, matrix);
 
   gthree_object_decompose_matrix (object);
 
   priv->world_matrix_need_update = TRUE;
   priv->matrix_need_update = FALSE;
+  propagate_matrix_dirty (object);
 }
 
 void
@@ -804,13 +1020,14 @@ gthree_object_apply_matrix (GthreeObject                *object,
     gthree_object_update_matrix (object);
 
   graphene_matrix_multiply (matrix,
-                            &priv->matrix,
-                            &priv->matrix);
+                            priv->matrix,
+                            priv->matrix);
 
   gthree_object_decompose_matrix (object);
 
   priv->world_matrix_need_update = TRUE;
   priv->matrix_need_update = FALSE;
+  propagate_matrix_dirty (object);
 }
 
 void
@@ -822,13 +1039,13 @@ gthree_object_update_matrix (GthreeObject *object)
   if (priv->matrix_need_update)
     {
       priv->matrix_need_update = FALSE;
-      graphene_matrix_init_scale (&priv->matrix,
+      graphene_matrix_init_scale (priv->matrix,
                                   graphene_vec3_get_x (&priv->scale),
                                   graphene_vec3_get_y (&priv->scale),
                                   graphene_vec3_get_z (&priv->scale));
-      graphene_matrix_rotate_quaternion (&priv->matrix, &priv->quaternion);
+      graphene_matrix_rotate_quaternion (priv->matrix, &priv->quaternion);
       graphene_point3d_init_from_vec3 (&pos, &priv->position);
-      graphene_matrix_translate  (&priv->matrix, &pos);
+      graphene_matrix_translate  (priv->matrix, &pos);
 
       priv->world_matrix_need_update = TRUE;
     }
@@ -839,7 +1056,7 @@ gthree_object_get_world_matrix (GthreeObject *object)
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  return &priv->world_matrix;
+  return priv->world_matrix;
 }
 
 /* This is a bit special, it overrides the *world* matrix, which is
@@ -851,8 +1068,10 @@ gthree_object_set_world_matrix (GthreeObject *object, const graphene_matrix_t *m
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  priv->world_matrix = *matrix;
+  *priv->world_matrix = *matrix;
   priv->world_matrix_need_update = FALSE;
+  priv->transform_stamp = new_stamp ();
+  gthree_object_invalidate_subtree_bounds (object);
 
   // TODO: decompose matrix into position, quat, scale
 }
@@ -869,13 +1088,15 @@ gthree_object_real_update_matrix_world (GthreeObject *object,
   if (priv->world_matrix_need_update || force)
     {
       if (priv->parent == NULL)
-        priv->world_matrix = priv->matrix;
+        *priv->world_matrix = *priv->matrix;
       else
-        graphene_matrix_multiply (&priv->matrix,
-                                  &PRIV (priv->parent)->world_matrix,
-                                  &priv->world_matrix);
+        graphene_matrix_multiply (priv->matrix,
+                                  PRIV (priv->parent)->world_matrix,
+                                  priv->world_matrix);
 
       priv->world_matrix_need_update = FALSE;
+      priv->transform_stamp = new_stamp ();
+      gthree_object_invalidate_subtree_bounds (object);
       force = TRUE;
     }
 
@@ -890,25 +1111,521 @@ gthree_object_update_matrix_world (GthreeObject *object,
   GthreeObjectClass *class = GTHREE_OBJECT_GET_CLASS(object);
   GthreeObject *child;
 
+  gboolean dirty_descendants = FALSE;
+
   force = class->update_matrix_world (object, force);
 
+  /* Only descend into the parts of the tree that changed */
+  if (!force && !priv->dirty_descendants)
+    return;
+
+  for (child = priv->first_child;
+       child != NULL;
+       child = PRIV (child)->next_sibling)
+    {
+      if (force || needs_update_matrix_world (child))
+        gthree_object_update_matrix_world (child, force);
+
+      if (PRIV (child)->dirty_descendants || !has_default_update_matrix_world (child))
+        dirty_descendants = TRUE;
+    }
+
+  priv->dirty_descendants = dirty_descendants;
+}
+
+/* Like the tree stamp, but only for children added or removed, which
+ * is all the transform store cares about */
+static void
+mark_structure_changed (GthreeObject *object)
+{
+  guint32 stamp = new_stamp ();
+
+  for (; object != NULL; object = PRIV (object)->parent)
+    PRIV (object)->structure_stamp = stamp;
+}
+
+struct _GthreeTransformStore {
+  GthreeObject *root;
+  guint32 structure_stamp;
+  gboolean built;
+
+  /* All objects in the tree, in depth first order, so parents are
+   * always before their children */
+  guint n_objects;
+  GthreeObject **objects;
+  gint *parents;
+  guint *subtree_ends; /* Index after the last descendant */
+  guint8 *changed;
+  graphene_matrix_t *matrices;
+  graphene_matrix_t *world_matrices;
+};
+
+/* Move the matrices of object and its children from the transform
+ * store back to the objects themselves */
+static void
+transform_store_detach (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+  GthreeObject *child;
+
+  /* If the parent is not in the store, neither are the children */
+  if (priv->transform_store == NULL)
+    return;
+
+  priv->matrix_storage = *priv->matrix;
+  priv->world_matrix_storage = *priv->world_matrix;
+  priv->matrix = &priv->matrix_storage;
+  priv->world_matrix = &priv->world_matrix_storage;
+  priv->transform_store = NULL;
+
   for (child = priv->first_child;
        child != NULL;
        child = PRIV (child)->next_sibling)
-    gthree_object_update_matrix_world (child, force);
+    transform_store_detach (child);
 }
 
+static void
+transform_store_collect (GthreeObject *object,
+                         gint parent_index,
+                         GPtrArray *objects,
+                         GArray *parents,
+                         GArray *subtree_ends)
+{
+  GthreeObject *child;
+  gint index = objects->len;
+
+  g_ptr_array_add (objects, object);
+  g_array_append_val (parents, parent_index);
+  g_array_set_size (subtree_ends, index + 1);
+
+  for (child = PRIV (object)->first_child;
+       child != NULL;
+       child = PRIV (child)->next_sibling)
+    transform_store_collect (child, index, objects, parents, subtree_ends);
+
+  g_array_index (subtree_ends, guint, index) = objects->len;
+}
+
+static void
+transform_store_rebuild (GthreeTransformStore *store)
+{
+  g_autoptr(GPtrArray) objects = g_ptr_array_new ();
+  g_autoptr(GArray) parents = g_array_new (FALSE, FALSE, sizeof (gint));
+  g_autoptr(GArray) subtree_ends = g_array_new (FALSE, FALSE, sizeof (guint));
+  graphene_matrix_t *matrices, *world_matrices;
+  guint i;
+
+  transform_store_collect (store->root, -1, objects, parents, subtree_ends);
+
+  matrices = g_new (graphene_matrix_t, objects->len);
+  world_matrices = g_new (graphene_matrix_t, objects->len);
+
+  /* Objects that were removed from the tree have already been
+   * detached, and the rest point to the old arrays or their own
+   * storage, so copy over the current values first. */
+  for (i = 0; i < objects->len; i++)
+    {
+      GthreeObjectPrivate *priv = PRIV (g_ptr_array_index (objects, i));
+
+      matrices[i] = *priv->matrix;
+      world_matrices[i] = *priv->world_matrix;
+    }
+
+  for (i = 0; i < objects->len; i++)
+    {
+      GthreeObjectPrivate *priv = PRIV (g_ptr_array_index (objects, i));
+
+      priv->matrix = &matrices[i];
+      priv->world_matrix = &world_matrices[i];
+      priv->transform_store = store;
+    }
+
+  g_free (store->objects);
+  g_free (store->parents);
+  g_free (store->subtree_ends);
+  g_free (store->changed);
+  g_free (store->matrices);
+  g_free (store->world_matrices);
+
+  store->n_objects = objects->len;
+  store->objects = (GthreeObject **)g_ptr_array_free (g_steal_pointer (&objects), FALSE);
+  store->parents = (gint *)g_array_free (g_steal_pointer (&parents), FALSE);
+  store->subtree_ends = (guint *)g_array_free (g_steal_pointer (&subtree_ends), FALSE);
+  store->changed = g_new (guint8, store->n_objects);
+  store->matrices = matrices;
+  store->world_matrices = world_matrices;
+
+  store->structure_stamp = PRIV (store->root)->structure_stamp;
+  store->built = TRUE;
+}
+
+/* A transform store keeps the local and world matrices of all the
+ * objects in a tree in flat arrays, in depth first order. This makes
+ * the world matrix update a single linear pass over memory rather
+ * than a walk over the object graph. The arrays are rebuilt lazily
+ * whenever children are added or removed. Hidden objects and objects
+ * in other layers are stored too, so visibility and layer changes
+ * leave the arrays alone. */
+GthreeTransformStore *
+gthree_transform_store_new (GthreeObject *root)
+{
+  GthreeTransformStore *store = g_new0 (GthreeTransformStore, 1);
+
+  store->root = root;
+
+  return store;
+}
 
+void
+gthree_transform_store_free (GthreeTransformStore *store)
+{
+  transform_store_detach (store->root);
+
+  g_free (store->objects);
+  g_free (store->parents);
+  g_free (store->subtree_ends);
+  g_free (store->changed);
+  g_free (store->matrices);
+  g_free (store->world_matrices);
+  g_free (store);
+}
+
+void
+gthree_transform_store_update_matrix_world (GthreeTransformStore *store,
+                                            gboolean force)
+{
+  graphene_matrix_t *matrices, *world_matrices;
+  guint8 *changed;
+  gint *parents;
+  guint i;
+
+  if (!store->built || store->structure_stamp != PRIV (store->root)->structure_stamp)
+    transform_store_rebuild (store);
+
+  matrices = store->matrices;
+  world_matrices = store->world_matrices;
+  changed = store->changed;
+  parents = store->parents;
+
+  for (i = 0; i < store->n_objects; i++)
+    {
+      GthreeObject *object = store->objects[i];
+      GthreeObjectPrivate *priv = PRIV (object);
+      gint parent = parents[i];
+      gboolean object_force;
+
+      object_force = parent < 0 ? force : changed[parent];
+
+      /* Skip over clean subtrees */
+      if (!object_force && !needs_update_matrix_world (object))
+        {
+          i = store->subtree_ends[i] - 1;
+          continue;
+        }
+
+      priv->dirty_descendants = FALSE;
+
+      if (G_UNLIKELY (!has_default_update_matrix_world (object)))
+        {
+          changed[i] = GTHREE_OBJECT_GET_CLASS (object)->update_matrix_world (object, object_force);
+          /* This needs to run every time */
+          propagate_matrix_dirty (object);
+          continue;
+        }
+
+      if (priv->matrix_auto_update)
+        gthree_object_update_matrix (object);
+
+      if (priv->world_matrix_need_update || object_force)
+        {
+          if (parent < 0)
+            world_matrices[i] = matrices[i];
+          else
+            graphene_matrix_multiply (&matrices[i],
+                                      &world_matrices[parent],
+                                      &world_matrices[i]);
+
+          priv->world_matrix_need_update = FALSE;
+          priv->transform_stamp = new_stamp ();
+          gthree_object_invalidate_subtree_bounds (object);
+          object_force = TRUE;
+        }
+
+      changed[i] = object_force;
+    }
+}
+
+typedef struct {
+  GthreeObject *object;
+  gboolean force;
+} GthreeMatrixUpdate;
+
+typedef struct {
+  GthreeMatrixUpdate root;
+  GArray *deferred; /* GthreeMatrixUpdate, lazily created */
+} GthreeMatrixUpdateTask;
+
+typedef struct {
+  GArray *tasks; /* GthreeMatrixUpdateTask */
+  gint next_task;
+  gint running_workers;
+  GMutex mutex;
+  GCond cond;
+} GthreeMatrixUpdateJob;
+
+static GThreadPool *matrix_update_pool = NULL;
+
+static void
+defer_matrix_update (GArray **deferred,
+                     GthreeObject *object,
+                     gboolean force)
+{
+  GthreeMatrixUpdate update = { object, force };
+
+  if (*deferred == NULL)
+    *deferred = g_array_new (FALSE, FALSE, sizeof (GthreeMatrixUpdate));
+  g_array_append_val (*deferred, update);
+}
+
+static void
+update_matrix_world_in_thread (GthreeObject *object,
+                               gboolean force,
+                               GArray **deferred)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+  GthreeObject *child;
+  gboolean dirty_descendants = FALSE;
+
+  if (!has_default_update_matrix_world (object))
+    {
+      defer_matrix_update (deferred, object, force);
+      return;
+    }
+
+  force = gthree_object_real_update_matrix_world (object, force);
+
+  if (!force && !priv->dirty_descendants)
+    return;
+
+  for (child = priv->first_child;
+       child != NULL;
+       child = PRIV (child)->next_sibling)
+    {
+      if (force || needs_update_matrix_world (child))
+        update_matrix_world_in_thread (child, force, deferred);
+
+      /* Deferred children are still dirty at this point, but they
+       * never get cleared anyway */
+      if (PRIV (child)->dirty_descendants || !has_default_update_matrix_world (child))
+        dirty_descendants = TRUE;
+    }
+
+  priv->dirty_descendants = dirty_descendants;
+}
+
+static void
+run_matrix_update_tasks (GthreeMatrixUpdateJob *job)
+{
+  guint i;
+
+  while ((i = g_atomic_int_add (&job->next_task, 1)) < job->tasks->len)
+    {
+      GthreeMatrixUpdateTask *task = &g_array_index (job->tasks, GthreeMatrixUpdateTask, i);
+
+      update_matrix_world_in_thread (task->root.object, task->root.force, &task->deferred);
+    }
+}
+
+static void
+matrix_update_worker (gpointer data,
+                      gpointer user_data)
+{
+  GthreeMatrixUpdateJob *job = data;
+
+  run_matrix_update_tasks (job);
+
+  g_mutex_lock (&job->mutex);
+  if (--job->running_workers == 0)
+    g_cond_signal (&job->cond);
+  g_mutex_unlock (&job->mutex);
+}
+
+static void
+run_deferred_matrix_updates (GArray *deferred)
+{
+  guint i;
+
+  if (deferred == NULL)
+    return;
+
+  for (i = 0; i < deferred->len; i++)
+    {
+      GthreeMatrixUpdate *update = &g_array_index (deferred, GthreeMatrixUpdate, i);
+      gthree_object_update_matrix_world (update->object, update->force);
+    }
+
+  g_array_free (deferred, TRUE);
+}
+
+/* Same as gthree_object_update_matrix_world(), but if the tree has at
+ * least min_objects descendants the independent subtrees are updated
+ * in parallel on a thread pool. Every world matrix depends only on its
+ * ancestors, so the result is the same as for the serial update.
+ *
+ * The top of the tree is expanded breadth first on the calling thread
+ * until there are enough subtrees to keep all threads busy, these are
+ * then handed out to the workers (and the calling thread) one at a
+ * time. */
+void
+gthree_object_update_matrix_world_parallel (GthreeObject *object,
+                                            gboolean force,
+                                            guint min_objects)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+  GthreeMatrixUpdateJob job = { NULL };
+  g_autoptr(GArray) frontier = NULL;
+  g_autoptr(GArray) next_frontier = NULL;
+  GArray *deferred = NULL;
+  guint n_threads, i, n_workers;
+  int level;
+
+  n_threads = g_get_num_processors ();
+
+  if (min_objects == 0 || priv->n_descendants < min_objects || n_threads < 2)
+    {
+      gthree_object_update_matrix_world (object, force);
+      return;
+    }
+
+  if (matrix_update_pool == NULL)
+    matrix_update_pool = g_thread_pool_new (matrix_update_worker, NULL,
+                                            n_threads - 1, FALSE, NULL);
+
+  frontier = g_array_new (FALSE, FALSE, sizeof (GthreeMatrixUpdate));
+  next_frontier = g_array_new (FALSE, FALSE, sizeof (GthreeMatrixUpdate));
+
+  {
+    GthreeMatrixUpdate update = { object, force };
+    g_array_append_val (frontier, update);
+  }
+
+  /* Aim for a few subtrees per thread to even out the load */
+  for (level = 0; frontier->len < n_threads * 4 && level < 8; level++)
+    {
+      g_array_set_size (next_frontier, 0);
+
+      for (i = 0; i < frontier->len; i++)
+        {
+          GthreeMatrixUpdate *update = &g_array_index (frontier, GthreeMatrixUpdate, i);
+          GthreeObjectClass *class = GTHREE_OBJECT_GET_CLASS (update->object);
+          GthreeObject *child;
+          gboolean child_force;
+
+          if (!has_default_update_matrix_world (update->object))
+            {
+              defer_matrix_update (&deferred, update->object, update->force);
+              continue;
+            }
+
+          child_force = class->update_matrix_world (update->object, update->force);
+
+          /* The dirty_descendants flag of these top levels is left as
+           * is, which is conservative but avoids having to walk back
+           * up after the workers are done */
+          if (!child_force && !PRIV (update->object)->dirty_descendants)
+            continue;
+
+          for (child = PRIV (update->object)->first_child;
+               child != NULL;
+               child = PRIV (child)->next_sibling)
+            {
+              GthreeMatrixUpdate child_update = { child, child_force };
+
+              if (child_force || needs_update_matrix_world (child))
+                g_array_append_val (next_frontier, child_update);
+            }
+        }
+
+      g_array_set_size (frontier, 0);
+      g_array_append_vals (frontier, next_frontier->data, next_frontier->len);
+
+      if (frontier->len == 0)
+        break;
+    }
+
+  job.tasks = g_array_sized_new (FALSE, TRUE, sizeof (GthreeMatrixUpdateTask), frontier->len);
+  g_array_set_size (job.tasks, frontier->len);
+  for (i = 0; i < frontier->len; i++)
+    {
+      GthreeMatrixUpdateTask *task = &g_array_index (job.tasks, GthreeMatrixUpdateTask, i);
+      GthreeObject *parent = PRIV (g_array_index (frontier, GthreeMatrixUpdate, i).object)->parent;
+
+      task->root = g_array_index (frontier, GthreeMatrixUpdate, i);
+
+      /* The subtree bounds invalidation in the workers walks up the
+       * tree, make sure it stops before leaving the subtree */
+      if (parent)
+        gthree_object_invalidate_subtree_bounds (parent);
+    }
+
+  g_mutex_init (&job.mutex);
+  g_cond_init (&job.cond);
+
+  n_workers = MIN (n_threads - 1, job.tasks->len);
+  job.running_workers = n_workers;
+  for (i = 0; i < n_workers; i++)
+    g_thread_pool_push (matrix_update_pool, &job, NULL);
+
+  run_matrix_update_tasks (&job);
+
+  g_mutex_lock (&job.mutex);
+  while (job.running_workers > 0)
+    g_cond_wait (&job.cond, &job.mutex);
+  g_mutex_unlock (&job.mutex);
+
+  g_mutex_clear (&job.mutex);
+  g_cond_clear (&job.cond);
+
+  /* Run the deferred updates in a fixed order so the result doesn't
+   * depend on the thread scheduling */
+  run_deferred_matrix_updates (deferred);
+  for (i = 0; i < job.tasks->len; i++)
+    run_deferred_matrix_updates (g_array_index (job.tasks, GthreeMatrixUpdateTask, i).deferred);
+
+  g_array_free (job.tasks, TRUE);
+}
+
+
+/* This just sets the view matrix, the model view and normal matrices
+ * are only computed when they are actually needed */
 void
 gthree_object_update_matrix_view (GthreeObject *object,
                                   const graphene_matrix_t *camera_matrix)
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  graphene_matrix_multiply (&priv->world_matrix, camera_matrix, &priv->model_view_matrix);
+  if (priv->model_view_valid &&
+      graphene_matrix_equal_fast (&priv->view_matrix, camera_matrix))
+    return;
+
+  priv->view_matrix = *camera_matrix;
+  priv->model_view_valid = FALSE;
+  priv->normal_matrix_valid = FALSE;
+}
+
+static void
+gthree_object_ensure_model_view_matrix (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  if (priv->model_view_valid &&
+      priv->model_view_stamp == priv->transform_stamp)
+    return;
 
-  graphene_matrix_inverse (&priv->model_view_matrix, &priv->normal_matrix);
-  graphene_matrix_transpose (&priv->normal_matrix, &priv->normal_matrix);
+  graphene_matrix_multiply (priv->world_matrix, &priv->view_matrix, &priv->model_view_matrix);
+  priv->model_view_stamp = priv->transform_stamp;
+  priv->model_view_valid = TRUE;
+  priv->normal_matrix_valid = FALSE;
 }
 
 void
@@ -917,21 +1634,51 @@ gthree_object_get_model_view_matrix_floats (GthreeObject *object,
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
+  gthree_object_ensure_model_view_matrix (object);
+
   graphene_matrix_to_float (&priv->model_view_matrix, dest);
 }
 
+/* The normal matrix is the inverse transpose of the upper 3x3 part of
+ * the model view matrix, which is the cofactor matrix divided by the
+ * determinant. This is a lot cheaper than a full 4x4 inverse. */
 void
 gthree_object_get_normal_matrix3_floats (GthreeObject *object,
                                          float *dest)
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
-  float dest4[16];
 
-  graphene_matrix_to_float (&priv->normal_matrix, dest4);
+  gthree_object_ensure_model_view_matrix (object);
+
+  if (!priv->normal_matrix_valid)
+    {
+      graphene_vec3_t r0, r1, r2, c0, c1, c2;
+      float mv[16], det;
+
+      graphene_matrix_to_float (&priv->model_view_matrix, mv);
+      graphene_vec3_init (&r0, mv[0], mv[1], mv[2]);
+      graphene_vec3_init (&r1, mv[4], mv[5], mv[6]);
+      graphene_vec3_init (&r2, mv[8], mv[9], mv[10]);
+
+      graphene_vec3_cross (&r1, &r2, &c0);
+      graphene_vec3_cross (&r2, &r0, &c1);
+      graphene_vec3_cross (&r0, &r1, &c2);
+
+      det = graphene_vec3_dot (&r0, &c0);
+      if (det != 0)
+        {
+          graphene_vec3_scale (&c0, 1.0f / det, &c0);
+          graphene_vec3_scale (&c1, 1.0f / det, &c1);
+          graphene_vec3_scale (&c2, 1.0f / det, &c2);
+        }
+
+      graphene_vec3_to_float (&c0, &priv->normal_matrix[0]);
+      graphene_vec3_to_float (&c1, &priv->normal_matrix[3]);
+      graphene_vec3_to_float (&c2, &priv->normal_matrix[6]);
+      priv->normal_matrix_valid = TRUE;
+    }
 
-  dest[0] = dest4[0];  dest[1] = dest4[1]; dest[2] = dest4[2];
-  dest[3] = dest4[4];  dest[4] = dest4[5]; dest[5] = dest4[6];
-  dest[6] = dest4[8];  dest[7] = dest4[9]; dest[8] = dest4[10];
+  memcpy (dest, priv->normal_matrix, sizeof (priv->normal_matrix));
 }
 
 void
@@ -940,7 +1687,7 @@ gthree_object_get_world_matrix_floats (GthreeObject *object,
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  graphene_matrix_to_float (&priv->world_matrix, dest);
+  graphene_matrix_to_float (priv->world_matrix, dest);
 }
 
 
@@ -950,7 +1697,7 @@ gthree_object_add_child (GthreeObject              *object,
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
   GthreeObjectPrivate *child_priv = gthree_object_get_instance_private (child);
-  GthreeObject *last_child;
+  GthreeObject *last_child, *ancestor;
   GObject *obj;
 
   if (child_priv->parent != NULL)
@@ -999,8 +1746,19 @@ gthree_object_add_child (GthreeObject              *object,
 
   priv->n_children += 1;
 
+  for (ancestor = object; ancestor != NULL; ancestor = PRIV (ancestor)->parent)
+    PRIV (ancestor)->n_descendants += child_priv->n_descendants + 1;
+
+  /* The world matrix depends on the new parent */
+  child_priv->world_matrix_need_update = TRUE;
+  propagate_matrix_dirty (child);
+
   priv->age += 1;
 
+  mark_structure_changed (object);
+  gthree_object_mark_tree_changed (object);
+  gthree_object_invalidate_subtree_bounds (object);
+
   g_signal_emit (child, object_signals[PARENT_SET], 0, NULL);
 
   g_object_thaw_notify (obj);
@@ -1012,7 +1770,7 @@ gthree_object_remove_child (GthreeObject                 *object,
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
   GthreeObjectPrivate *child_priv = gthree_object_get_instance_private (child);
-  GthreeObject *prev_sibling, *next_sibling;
+  GthreeObject *prev_sibling, *next_sibling, *ancestor;
   GObject *obj;
 
   g_return_if_fail (GTHREE_IS_OBJECT (object));
@@ -1043,10 +1801,19 @@ gthree_object_remove_child (GthreeObject                 *object,
   child_priv->prev_sibling = NULL;
   child_priv->next_sibling = NULL;
 
+  transform_store_detach (child);
+
   priv->n_children -= 1;
 
+  for (ancestor = object; ancestor != NULL; ancestor = PRIV (ancestor)->parent)
+    PRIV (ancestor)->n_descendants -= child_priv->n_descendants + 1;
+
   priv->age += 1;
 
+  mark_structure_changed (object);
+  gthree_object_mark_tree_changed (object);
+  gthree_object_invalidate_subtree_bounds (object);
+
   g_signal_emit (child, object_signals[PARENT_SET], 0, object);
 
   g_object_thaw_notify (obj);
@@ -1145,6 +1912,143 @@ gthree_object_destroy_all_children (GthreeObject *object)
   g_assert (priv->n_children == 0);
 }
 
+/* Called whenever the set of objects that could be rendered from the
+ * tree changes (children added or removed, visibility or layers
+ * changed). This updates the stamp of the object and all its
+ * ancestors, so renderers can cheaply check if they need to re-walk
+ * the tree from whatever object they render. */
+void
+gthree_object_mark_tree_changed (GthreeObject *object)
+{
+  guint32 stamp = new_stamp ();
+
+  for (; object != NULL; object = PRIV (object)->parent)
+    PRIV (object)->tree_stamp = stamp;
+}
+
+guint32
+gthree_object_get_tree_stamp (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->tree_stamp;
+}
+
+/* Called whenever the world space extents of the object changes
+ * without the world matrix changing, e.g. for instance transforms */
+void
+gthree_object_mark_transform_changed (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  priv->transform_stamp = new_stamp ();
+  gthree_object_invalidate_subtree_bounds (object);
+}
+
+guint32
+gthree_object_get_transform_stamp (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->transform_stamp;
+}
+
+/* Called whenever something that affects the world space bounds of
+ * the object changes. Any ancestor with valid bounds includes us, so
+ * invalidate those too. If an ancestor is already invalid then all its
+ * ancestors are too, so we can stop there. */
+void
+gthree_object_invalidate_subtree_bounds (GthreeObject *object)
+{
+  while (object != NULL && PRIV (object)->subtree_bounds_valid)
+    {
+      PRIV (object)->subtree_bounds_valid = FALSE;
+      object = PRIV (object)->parent;
+    }
+}
+
+static GthreeSubtreeBoundsKind
+gthree_object_get_own_bounds (GthreeObject *object,
+                              graphene_box_t *box)
+{
+  GthreeObjectClass *class = GTHREE_OBJECT_GET_CLASS (object);
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+  graphene_sphere_t sphere;
+
+  /* Lights affect everything, and skinned meshes need their skeleton
+   * updated even when not drawn, so these always need to be visited */
+  if (GTHREE_IS_LIGHT (object) || GTHREE_IS_SKINNED_MESH (object))
+    return GTHREE_SUBTREE_BOUNDS_INFINITE;
+
+  if (!(GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) ||
+        GTHREE_IS_SPRITE (object) || GTHREE_IS_POINTS (object)))
+    return GTHREE_SUBTREE_BOUNDS_EMPTY;
+
+  if (!priv->frustum_culled)
+    return GTHREE_SUBTREE_BOUNDS_INFINITE;
+
+  /* If we can't tell the bounds, but the object has a custom
+   * frustum test we have to let it decide */
+  if (class->get_world_bounding_sphere == NULL)
+    return class->in_frustum ? GTHREE_SUBTREE_BOUNDS_INFINITE : GTHREE_SUBTREE_BOUNDS_EMPTY;
+
+  if (!class->get_world_bounding_sphere (object, &sphere))
+    return GTHREE_SUBTREE_BOUNDS_EMPTY;
+
+  graphene_sphere_get_bounding_box (&sphere, box);
+  return GTHREE_SUBTREE_BOUNDS_FINITE;
+}
+
+/* Returns the world space bounds of all the things that would be
+ * rendered in the subtree (ignoring layers), so that whole subtrees can
+ * be culled at once. The result is cached until something in the
+ * subtree changes. This relies on the world matrices being up to
+ * date. */
+GthreeSubtreeBoundsKind
+gthree_object_get_subtree_bounds (GthreeObject *object,
+                                  graphene_box_t *box)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+  GthreeSubtreeBoundsKind kind;
+  graphene_box_t child_box;
+  GthreeObject *child;
+
+  if (!priv->subtree_bounds_valid)
+    {
+      kind = gthree_object_get_own_bounds (object, &priv->subtree_bounds);
+
+      for (child = priv->first_child;
+           child != NULL && kind != GTHREE_SUBTREE_BOUNDS_INFINITE;
+           child = PRIV (child)->next_sibling)
+        {
+          GthreeSubtreeBoundsKind child_kind;
+
+          if (!PRIV (child)->visible)
+            continue;
+
+          child_kind = gthree_object_get_subtree_bounds (child, &child_box);
+          if (child_kind == GTHREE_SUBTREE_BOUNDS_INFINITE)
+            kind = GTHREE_SUBTREE_BOUNDS_INFINITE;
+          else if (child_kind == GTHREE_SUBTREE_BOUNDS_FINITE)
+            {
+              if (kind == GTHREE_SUBTREE_BOUNDS_EMPTY)
+                priv->subtree_bounds = child_box;
+              else
+                graphene_box_union (&priv->subtree_bounds, &child_box, &priv->subtree_bounds);
+              kind = GTHREE_SUBTREE_BOUNDS_FINITE;
+            }
+        }
+
+      priv->subtree_bounds_kind = kind;
+      priv->subtree_bounds_valid = TRUE;
+    }
+
+  if (priv->subtree_bounds_kind == GTHREE_SUBTREE_BOUNDS_FINITE)
+    *box = priv->subtree_bounds;
+
+  return priv->subtree_bounds_kind;
+}
+
 void
 gthree_object_update (GthreeObject *object,
                       GthreeRenderer *renderer)
@@ -1170,13 +2074,18 @@ gthree_object_real_set_direct_uniforms  (GthreeObject *object,
                                          GthreeProgram *program,
                                          GthreeRenderer *renderer)
 {
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
   float matrix[16];
   int mvm_location = gthree_program_lookup_uniform_location (program, q_modelViewMatrix);
   int nm_location = gthree_program_lookup_uniform_location (program, q_normalMatrix);
   int mm_location;
 
-  gthree_object_get_model_view_matrix_floats (object, matrix);
-  glUniformMatrix4fv (mvm_location, 1, FALSE, matrix);
+  /* Only compute the matrices the program actually uses */
+  if (mvm_location >= 0)
+    {
+      gthree_object_get_model_view_matrix_floats (object, matrix);
+      glUniformMatrix4fv (mvm_location, 1, FALSE, matrix);
+    }
 
   if (nm_location >= 0)
     {
@@ -1191,6 +2100,14 @@ gthree_object_real_set_direct_uniforms  (GthreeObject *object,
       gthree_object_get_world_matrix_floats (object, matrix);
       glUniformMatrix4fv (mm_location, 1, FALSE, matrix);
     }
+
+  /* Only programs for fading objects have this */
+  if (priv->lod_fade != 1.0f)
+    {
+      int fade_location = gthree_program_lookup_uniform_location (program, q_lodFade);
+      if (fade_location >= 0)
+        glUniform1f (fade_location, priv->lod_fade);
+    }
 }
 
 void
@@ -52,8 +52,10 @@ typedef struct {
   void (* raycast)               (GthreeObject          *object,
                                   GthreeRaycaster       *raycaster,
                                   GPtrArray             *intersections);
+  gboolean (* get_world_bounding_sphere) (GthreeObject          *object,
+                                          graphene_sphere_t     *sphere);
 
-  gpointer padding[8];
+  gpointer padding[7];
 } GthreeObjectClass;
 
 GTHREE_API
@@ -199,6 +201,16 @@ GTHREE_API
 void                         gthree_object_set_receive_shadow           (GthreeObject                *object,
                                                                          gboolean                     receive_shadow);
 GTHREE_API
+gboolean                     gthree_object_get_is_static                (GthreeObject                *object);
+GTHREE_API
+void                         gthree_object_set_is_static                (GthreeObject                *object,
+                                                                         gboolean                     is_static);
+GTHREE_API
+gboolean                     gthree_object_get_is_occluder              (GthreeObject                *object);
+GTHREE_API
+void                         gthree_object_set_is_occluder              (GthreeObject                *object,
+                                                                         gboolean                     is_occluder);
+GTHREE_API
 gboolean                     gthree_object_get_visible                  (GthreeObject                *object);
 GTHREE_API
 void                         gthree_object_set_visible                  (GthreeObject                *object,
@@ -6,6 +6,12 @@
 
 G_BEGIN_DECLS
 
+typedef enum {
+  GTHREE_SUBTREE_BOUNDS_EMPTY,
+  GTHREE_SUBTREE_BOUNDS_FINITE,
+  GTHREE_SUBTREE_BOUNDS_INFINITE,
+} GthreeSubtreeBoundsKind;
+
 void       gthree_object_set_direct_uniforms  (GthreeObject          *object,
                                                GthreeProgram         *program,
                                                GthreeRenderer *renderer);
@@ -15,6 +21,33 @@ void       gthree_object_call_before_render_callback (GthreeObject   *object,
                                                       GthreeScene    *scene,
                                                       GthreeCamera   *camera);
 
+void       gthree_object_mark_tree_changed      (GthreeObject *object);
+guint32    gthree_object_get_tree_stamp         (GthreeObject *object);
+void       gthree_object_mark_transform_changed (GthreeObject *object);
+guint32    gthree_object_get_transform_stamp    (GthreeObject *object);
+
+void       gthree_object_set_static_batched     (GthreeObject *object,
+                                                 gboolean      batched);
+gboolean   gthree_object_get_static_batched     (GthreeObject *object);
+void       gthree_object_set_lod_fade           (GthreeObject *object,
+                                                 float         fade);
+float      gthree_object_get_lod_fade           (GthreeObject *object);
+
+typedef struct _GthreeTransformStore GthreeTransformStore;
+
+GthreeTransformStore *gthree_transform_store_new                 (GthreeObject         *root);
+void                  gthree_transform_store_free                (GthreeTransformStore *store);
+void                  gthree_transform_store_update_matrix_world (GthreeTransformStore *store,
+                                                                  gboolean              force);
+
+void       gthree_object_update_matrix_world_parallel (GthreeObject *object,
+                                                       gboolean      force,
+                                                       guint         min_objects);
+
+void                    gthree_object_invalidate_subtree_bounds (GthreeObject   *object);
+GthreeSubtreeBoundsKind gthree_object_get_subtree_bounds        (GthreeObject   *object,
+                                                                 graphene_box_t *box);
+
 G_END_DECLS
 
 #endif /* __GTHREE_OBJECT_PRIVATE_H__ */
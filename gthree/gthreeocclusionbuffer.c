@@ -0,0 +1,527 @@
+#include <math.h>
+
+#include "gthreeprivate.h"
+
+/* A small software depth buffer for occlusion culling on the cpu.
+ *
+ * Occluder triangles are transformed and binned into screen tiles on
+ * the calling thread, then the tiles are rasterized independently, on
+ * a thread pool. Only the nearest depth per pixel is kept, plus the
+ * farthest depth per tile so that most box tests can be decided
+ * without looking at individual pixels.
+ *
+ * This doesn't use GL at all, so it can be tested without a context.
+ */
+
+#define TILE_SIZE 32
+
+/* Triangles reaching this far outside the screen (in pixels) lose too
+ * much float precision in the edge functions and are skipped, which
+ * is safe as fewer occluders only means less culling */
+#define GUARD_BAND 1000000.f
+
+typedef struct {
+  float x[3];
+  float y[3];
+  float z[3];
+  int min_x, min_y; /* Pixel bounds, max exclusive */
+  int max_x, max_y;
+} GthreeOcclusionTriangle;
+
+struct _GthreeOcclusionBuffer {
+  int width;
+  int height;
+  int tiles_x;
+  int tiles_y;
+
+  float *depth; /* Row major, 0 is the near plane and 1 the far plane */
+  float *tile_max_depth;
+
+  graphene_matrix_t view_projection;
+  GArray *clip_vertices; /* graphene_vec4_t, scratch space */
+  GArray *triangles; /* GthreeOcclusionTriangle */
+  GArray **bins; /* Per tile, guint indexes into triangles */
+
+  /* Set while rasterizing */
+  gint next_tile;
+  gint running_workers;
+  GMutex mutex;
+  GCond cond;
+};
+
+static GThreadPool *occlusion_pool = NULL;
+
+GthreeOcclusionBuffer *
+gthree_occlusion_buffer_new (int width,
+                             int height)
+{
+  GthreeOcclusionBuffer *buffer = g_new0 (GthreeOcclusionBuffer, 1);
+  int i;
+
+  buffer->width = width;
+  buffer->height = height;
+  buffer->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  buffer->tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+  buffer->depth = g_new (float, width * height);
+  buffer->tile_max_depth = g_new (float, buffer->tiles_x * buffer->tiles_y);
+  for (i = 0; i < width * height; i++)
+    buffer->depth[i] = 1.f;
+  for (i = 0; i < buffer->tiles_x * buffer->tiles_y; i++)
+    buffer->tile_max_depth[i] = 1.f;
+
+  graphene_matrix_init_identity (&buffer->view_projection);
+  buffer->clip_vertices = g_array_new (FALSE, FALSE, sizeof (graphene_vec4_t));
+  buffer->triangles = g_array_new (FALSE, FALSE, sizeof (GthreeOcclusionTriangle));
+  buffer->bins = g_new (GArray *, buffer->tiles_x * buffer->tiles_y);
+  for (i = 0; i < buffer->tiles_x * buffer->tiles_y; i++)
+    buffer->bins[i] = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  g_mutex_init (&buffer->mutex);
+  g_cond_init (&buffer->cond);
+
+  return buffer;
+}
+
+void
+gthree_occlusion_buffer_free (GthreeOcclusionBuffer *buffer)
+{
+  int i;
+
+  for (i = 0; i < buffer->tiles_x * buffer->tiles_y; i++)
+    g_array_unref (buffer->bins[i]);
+  g_free (buffer->bins);
+  g_array_unref (buffer->triangles);
+  g_array_unref (buffer->clip_vertices);
+  g_free (buffer->tile_max_depth);
+  g_free (buffer->depth);
+
+  g_mutex_clear (&buffer->mutex);
+  g_cond_clear (&buffer->cond);
+
+  g_free (buffer);
+}
+
+int
+gthree_occlusion_buffer_get_width (GthreeOcclusionBuffer *buffer)
+{
+  return buffer->width;
+}
+
+int
+gthree_occlusion_buffer_get_height (GthreeOcclusionBuffer *buffer)
+{
+  return buffer->height;
+}
+
+/* Valid after rasterizing, row major */
+const float *
+gthree_occlusion_buffer_peek_depth (GthreeOcclusionBuffer *buffer)
+{
+  return buffer->depth;
+}
+
+/* Drops all occluders, the depth buffer itself is cleared when the
+ * new set is rasterized */
+void
+gthree_occlusion_buffer_begin (GthreeOcclusionBuffer   *buffer,
+                               const graphene_matrix_t *view_projection)
+{
+  int i;
+
+  buffer->view_projection = *view_projection;
+
+  g_array_set_size (buffer->triangles, 0);
+  for (i = 0; i < buffer->tiles_x * buffer->tiles_y; i++)
+    g_array_set_size (buffer->bins[i], 0);
+}
+
+static void
+add_screen_triangle (GthreeOcclusionBuffer *buffer,
+                     const graphene_vec4_t *v0,
+                     const graphene_vec4_t *v1,
+                     const graphene_vec4_t *v2)
+{
+  const graphene_vec4_t *clip[3] = { v0, v1, v2 };
+  GthreeOcclusionTriangle tri;
+  float min_x = G_MAXFLOAT, min_y = G_MAXFLOAT;
+  float max_x = -G_MAXFLOAT, max_y = -G_MAXFLOAT;
+  float area;
+  guint index;
+  int i, tx, ty;
+
+  for (i = 0; i < 3; i++)
+    {
+      float inv_w = 1.f / graphene_vec4_get_w (clip[i]);
+
+      tri.x[i] = (graphene_vec4_get_x (clip[i]) * inv_w * 0.5f + 0.5f) * buffer->width;
+      tri.y[i] = (graphene_vec4_get_y (clip[i]) * inv_w * 0.5f + 0.5f) * buffer->height;
+      tri.z[i] = graphene_vec4_get_z (clip[i]) * inv_w * 0.5f + 0.5f;
+
+      if (fabsf (tri.x[i]) > GUARD_BAND || fabsf (tri.y[i]) > GUARD_BAND)
+        return;
+
+      min_x = MIN (min_x, tri.x[i]);
+      min_y = MIN (min_y, tri.y[i]);
+      max_x = MAX (max_x, tri.x[i]);
+      max_y = MAX (max_y, tri.y[i]);
+    }
+
+  /* Both windings are rasterized, make the area positive */
+  area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.y[1] - tri.y[0]) * (tri.x[2] - tri.x[0]);
+  if (fabsf (area) < 1e-6f)
+    return;
+  if (area < 0)
+    {
+      float t;
+
+      t = tri.x[1]; tri.x[1] = tri.x[2]; tri.x[2] = t;
+      t = tri.y[1]; tri.y[1] = tri.y[2]; tri.y[2] = t;
+      t = tri.z[1]; tri.z[1] = tri.z[2]; tri.z[2] = t;
+    }
+
+  tri.min_x = MAX ((int)floorf (min_x), 0);
+  tri.min_y = MAX ((int)floorf (min_y), 0);
+  tri.max_x = MIN ((int)ceilf (max_x), buffer->width);
+  tri.max_y = MIN ((int)ceilf (max_y), buffer->height);
+  if (tri.min_x >= tri.max_x || tri.min_y >= tri.max_y)
+    return;
+
+  index = buffer->triangles->len;
+  g_array_append_val (buffer->triangles, tri);
+
+  for (ty = tri.min_y / TILE_SIZE; ty <= (tri.max_y - 1) / TILE_SIZE; ty++)
+    for (tx = tri.min_x / TILE_SIZE; tx <= (tri.max_x - 1) / TILE_SIZE; tx++)
+      g_array_append_val (buffer->bins[ty * buffer->tiles_x + tx], index);
+}
+
+static void
+lerp_clip (const graphene_vec4_t *a,
+           const graphene_vec4_t *b,
+           float                  da,
+           float                  db,
+           graphene_vec4_t       *res)
+{
+  graphene_vec4_interpolate (a, b, da / (da - db), res);
+}
+
+/* Clips against the near plane (z > -w), the other planes are
+ * handled by clamping to the screen */
+static void
+add_clip_triangle (GthreeOcclusionBuffer *buffer,
+                   const graphene_vec4_t *v0,
+                   const graphene_vec4_t *v1,
+                   const graphene_vec4_t *v2)
+{
+  const graphene_vec4_t *in[3] = { v0, v1, v2 };
+  graphene_vec4_t out[4];
+  float d[3];
+  int i, n_out = 0;
+
+  for (i = 0; i < 3; i++)
+    d[i] = graphene_vec4_get_z (in[i]) + graphene_vec4_get_w (in[i]);
+
+  if (d[0] >= 0 && d[1] >= 0 && d[2] >= 0)
+    {
+      add_screen_triangle (buffer, v0, v1, v2);
+      return;
+    }
+
+  for (i = 0; i < 3; i++)
+    {
+      int j = (i + 1) % 3;
+
+      if (d[i] >= 0)
+        out[n_out++] = *in[i];
+      if ((d[i] >= 0) != (d[j] >= 0))
+        lerp_clip (in[i], in[j], d[i], d[j], &out[n_out++]);
+    }
+
+  if (n_out >= 3)
+    add_screen_triangle (buffer, &out[0], &out[1], &out[2]);
+  if (n_out == 4)
+    add_screen_triangle (buffer, &out[0], &out[2], &out[3]);
+}
+
+/* Adds the triangles of @geometry, placed with @world_matrix, as
+ * occluders. Must be called between begin and rasterize. */
+void
+gthree_occlusion_buffer_add_occluder (GthreeOcclusionBuffer   *buffer,
+                                      const graphene_matrix_t *world_matrix,
+                                      GthreeGeometry          *geometry)
+{
+  GthreeAttribute *position = gthree_geometry_get_position (geometry);
+  GthreeAttribute *index = gthree_geometry_get_index (geometry);
+  graphene_matrix_t mvp;
+  graphene_vec4_t *clip;
+  const float *floats, *f;
+  int n_vertices, n_indices, stride, i;
+
+  if (position == NULL ||
+      gthree_attribute_get_attribute_type (position) != GTHREE_ATTRIBUTE_TYPE_FLOAT)
+    return;
+
+  graphene_matrix_multiply (world_matrix, &buffer->view_projection, &mvp);
+
+  n_vertices = gthree_attribute_get_count (position);
+  stride = gthree_attribute_get_stride (position);
+  floats = gthree_attribute_peek_float (position);
+
+  g_array_set_size (buffer->clip_vertices, n_vertices);
+  clip = (graphene_vec4_t *)buffer->clip_vertices->data;
+  for (f = floats, i = 0; i < n_vertices; i++, f += stride)
+    {
+      graphene_vec4_t v;
+
+      graphene_vec4_init (&v, f[0], f[1], f[2], 1.f);
+      graphene_matrix_transform_vec4 (&mvp, &v, &clip[i]);
+    }
+
+  if (index)
+    {
+      n_indices = gthree_attribute_get_count (index);
+      for (i = 0; i + 2 < n_indices; i += 3)
+        {
+          guint i0 = gthree_attribute_get_uint (index, i);
+          guint i1 = gthree_attribute_get_uint (index, i + 1);
+          guint i2 = gthree_attribute_get_uint (index, i + 2);
+
+          if (i0 < n_vertices && i1 < n_vertices && i2 < n_vertices)
+            add_clip_triangle (buffer, &clip[i0], &clip[i1], &clip[i2]);
+        }
+    }
+  else
+    {
+      for (i = 0; i + 2 < n_vertices; i += 3)
+        add_clip_triangle (buffer, &clip[i], &clip[i + 1], &clip[i + 2]);
+    }
+}
+
+static void
+rasterize_triangle (GthreeOcclusionBuffer         *buffer,
+                    const GthreeOcclusionTriangle *tri,
+                    int                            x0,
+                    int                            y0,
+                    int                            x1,
+                    int                            y1)
+{
+  float area, inv_area;
+  float a0, a1, a2, b0, b1, b2;
+  float dz_dx;
+  int x, y, n;
+
+  x0 = MAX (x0, tri->min_x);
+  y0 = MAX (y0, tri->min_y);
+  x1 = MIN (x1, tri->max_x);
+  y1 = MIN (y1, tri->max_y);
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  area = (tri->x[1] - tri->x[0]) * (tri->y[2] - tri->y[0]) - (tri->y[1] - tri->y[0]) * (tri->x[2] - tri->x[0]);
+  inv_area = 1.f / area;
+
+  /* Edge function i is opposite to vertex i, and is
+   * e(p) = a * p.x + b * p.y + c, positive inside */
+  a0 = tri->y[1] - tri->y[2];
+  b0 = tri->x[2] - tri->x[1];
+  a1 = tri->y[2] - tri->y[0];
+  b1 = tri->x[0] - tri->x[2];
+  a2 = tri->y[0] - tri->y[1];
+  b2 = tri->x[1] - tri->x[0];
+
+  /* Depth is affine in screen space */
+  dz_dx = (a0 * tri->z[0] + a1 * tri->z[1] + a2 * tri->z[2]) * inv_area;
+
+  n = x1 - x0;
+  for (y = y0; y < y1; y++)
+    {
+      float *row = buffer->depth + y * buffer->width + x0;
+      float px = x0 + 0.5f;
+      float py = y + 0.5f;
+      float e0 = a0 * (px - tri->x[1]) + b0 * (py - tri->y[1]);
+      float e1 = a1 * (px - tri->x[2]) + b1 * (py - tri->y[2]);
+      float e2 = a2 * (px - tri->x[0]) + b2 * (py - tri->y[0]);
+      float z = (e0 * tri->z[0] + e1 * tri->z[1] + e2 * tri->z[2]) * inv_area;
+
+      /* Written without branches so the compiler can vectorize it */
+      for (x = 0; x < n; x++)
+        {
+          float w0 = e0 + x * a0;
+          float w1 = e1 + x * a1;
+          float w2 = e2 + x * a2;
+          float d = z + x * dz_dx;
+          gboolean inside = w0 >= 0 && w1 >= 0 && w2 >= 0 && d < row[x];
+
+          row[x] = inside ? d : row[x];
+        }
+    }
+}
+
+static void
+rasterize_tile (GthreeOcclusionBuffer *buffer,
+                int                    tile)
+{
+  GArray *bin = buffer->bins[tile];
+  int x0 = (tile % buffer->tiles_x) * TILE_SIZE;
+  int y0 = (tile / buffer->tiles_x) * TILE_SIZE;
+  int x1 = MIN (x0 + TILE_SIZE, buffer->width);
+  int y1 = MIN (y0 + TILE_SIZE, buffer->height);
+  float max_depth = 0.f;
+  guint i;
+  int x, y;
+
+  for (y = y0; y < y1; y++)
+    for (x = x0; x < x1; x++)
+      buffer->depth[y * buffer->width + x] = 1.f;
+
+  for (i = 0; i < bin->len; i++)
+    {
+      guint index = g_array_index (bin, guint, i);
+
+      rasterize_triangle (buffer,
+                          &g_array_index (buffer->triangles, GthreeOcclusionTriangle, index),
+                          x0, y0, x1, y1);
+    }
+
+  for (y = y0; y < y1; y++)
+    for (x = x0; x < x1; x++)
+      max_depth = MAX (max_depth, buffer->depth[y * buffer->width + x]);
+
+  buffer->tile_max_depth[tile] = max_depth;
+}
+
+static void
+run_rasterize_tiles (GthreeOcclusionBuffer *buffer)
+{
+  int n_tiles = buffer->tiles_x * buffer->tiles_y;
+  int i;
+
+  while ((i = g_atomic_int_add (&buffer->next_tile, 1)) < n_tiles)
+    rasterize_tile (buffer, i);
+}
+
+static void
+occlusion_worker (gpointer data,
+                  gpointer user_data)
+{
+  GthreeOcclusionBuffer *buffer = data;
+
+  run_rasterize_tiles (buffer);
+
+  g_mutex_lock (&buffer->mutex);
+  if (--buffer->running_workers == 0)
+    g_cond_signal (&buffer->cond);
+  g_mutex_unlock (&buffer->mutex);
+}
+
+/* Starts rasterizing the occluders on the thread pool and returns
+ * immediately. The buffer must not be touched until
+ * gthree_occlusion_buffer_rasterize_wait() returns. */
+void
+gthree_occlusion_buffer_rasterize_start (GthreeOcclusionBuffer *buffer)
+{
+  guint n_threads = g_get_num_processors ();
+  guint n_workers, i;
+
+  buffer->next_tile = 0;
+  buffer->running_workers = 0;
+
+  if (n_threads < 2)
+    return;
+
+  if (occlusion_pool == NULL)
+    occlusion_pool = g_thread_pool_new (occlusion_worker, NULL,
+                                        n_threads - 1, FALSE, NULL);
+
+  n_workers = MIN (n_threads - 1, buffer->tiles_x * buffer->tiles_y);
+  buffer->running_workers = n_workers;
+  for (i = 0; i < n_workers; i++)
+    g_thread_pool_push (occlusion_pool, buffer, NULL);
+}
+
+/* The calling thread helps with the remaining tiles */
+void
+gthree_occlusion_buffer_rasterize_wait (GthreeOcclusionBuffer *buffer)
+{
+  run_rasterize_tiles (buffer);
+
+  g_mutex_lock (&buffer->mutex);
+  while (buffer->running_workers > 0)
+    g_cond_wait (&buffer->cond, &buffer->mutex);
+  g_mutex_unlock (&buffer->mutex);
+}
+
+void
+gthree_occlusion_buffer_rasterize (GthreeOcclusionBuffer *buffer)
+{
+  gthree_occlusion_buffer_rasterize_start (buffer);
+  gthree_occlusion_buffer_rasterize_wait (buffer);
+}
+
+/* Returns TRUE if any part of the world space @box may be visible. Boxes
+ * crossing the near plane or outside the screen are always visible,
+ * those are for the frustum culling to decide. */
+gboolean
+gthree_occlusion_buffer_test_box (GthreeOcclusionBuffer *buffer,
+                                  const graphene_box_t  *box)
+{
+  graphene_vec3_t corners[8];
+  float min_x = G_MAXFLOAT, min_y = G_MAXFLOAT, min_z = G_MAXFLOAT;
+  float max_x = -G_MAXFLOAT, max_y = -G_MAXFLOAT;
+  int x0, y0, x1, y1, tx, ty, x, y;
+  int i;
+
+  graphene_box_get_vertices (box, corners);
+  for (i = 0; i < 8; i++)
+    {
+      graphene_vec4_t v, clip;
+      float w, inv_w;
+
+      graphene_vec4_init_from_vec3 (&v, &corners[i], 1.f);
+      graphene_matrix_transform_vec4 (&buffer->view_projection, &v, &clip);
+
+      w = graphene_vec4_get_w (&clip);
+      if (graphene_vec4_get_z (&clip) + w < 0 || w <= 0)
+        return TRUE;
+
+      inv_w = 1.f / w;
+      min_x = MIN (min_x, (graphene_vec4_get_x (&clip) * inv_w * 0.5f + 0.5f) * buffer->width);
+      max_x = MAX (max_x, (graphene_vec4_get_x (&clip) * inv_w * 0.5f + 0.5f) * buffer->width);
+      min_y = MIN (min_y, (graphene_vec4_get_y (&clip) * inv_w * 0.5f + 0.5f) * buffer->height);
+      max_y = MAX (max_y, (graphene_vec4_get_y (&clip) * inv_w * 0.5f + 0.5f) * buffer->height);
+      min_z = MIN (min_z, graphene_vec4_get_z (&clip) * inv_w * 0.5f + 0.5f);
+    }
+
+  x0 = MAX ((int)floorf (min_x), 0);
+  y0 = MAX ((int)floorf (min_y), 0);
+  x1 = MIN ((int)ceilf (max_x), buffer->width);
+  y1 = MIN ((int)ceilf (max_y), buffer->height);
+  if (x0 >= x1 || y0 >= y1)
+    return TRUE;
+
+  for (ty = y0 / TILE_SIZE; ty <= (y1 - 1) / TILE_SIZE; ty++)
+    for (tx = x0 / TILE_SIZE; tx <= (x1 - 1) / TILE_SIZE; tx++)
+      {
+        int tile_y0, tile_y1, tile_x0, tile_x1;
+
+        /* Everything in the tile is nearer than the box */
+        if (min_z > buffer->tile_max_depth[ty * buffer->tiles_x + tx])
+          continue;
+
+        tile_x0 = MAX (x0, tx * TILE_SIZE);
+        tile_y0 = MAX (y0, ty * TILE_SIZE);
+        tile_x1 = MIN (x1, (tx + 1) * TILE_SIZE);
+        tile_y1 = MIN (y1, (ty + 1) * TILE_SIZE);
+
+        for (y = tile_y0; y < tile_y1; y++)
+          {
+            const float *row = buffer->depth + y * buffer->width;
+
+            for (x = tile_x0; x < tile_x1; x++)
+              if (min_z <= row[x])
+                return TRUE;
+          }
+      }
+
+  return FALSE;
+}
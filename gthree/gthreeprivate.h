@@ -8,6 +8,8 @@
 #include <gthree/gthreekeyframetrack.h>
 #include <gthree/gthreerendertarget.h>
 #include <gthree/gthreemesh.h>
+#include <gthree/gthreeinstancedmesh.h>
+#include <gthree/gthreelod.h>
 #include <gthree/gthreesprite.h>
 #include <gthree/gthreelightshadow.h>
 #include <gthree/gthreedirectionallightshadow.h>
@@ -47,14 +49,29 @@ struct _GthreeLightSetup
   GthreeLightSetupHash hash;
 };
 
+/* The same material needs different programs depending on the object
+ * it is drawn for, these select one of the material variants */
+#define GTHREE_MATERIAL_VARIANT_INSTANCING       (1 << 0)
+#define GTHREE_MATERIAL_VARIANT_INSTANCING_COLOR (1 << 1)
+#define GTHREE_MATERIAL_VARIANT_LOD_FADE         (1 << 2)
+#define GTHREE_MATERIAL_N_VARIANTS 8
+
+typedef struct {
+  GthreeProgram *program; /* Not owned, only use while valid for the owning renderer */
+  guint program_id; /* Cached gthree_program_get_id (program), for render list sort keys */
+  guint valid : 1; /* Set up for the current material state */
+  guint program_setup_pending : 1; /* Waiting for the program to finish compiling */
+} GthreeMaterialVariant;
+
 /* Keep track of what state the material is wired up for */
 struct _GthreeMaterialProperties
 {
-  GthreeProgram *program; /* Not owned, only use while valid for the owning renderer */
+  GthreeMaterialVariant variants[GTHREE_MATERIAL_N_VARIANTS];
   GthreeFog *fog; /* Not owned, only use while valid for the owning renderer */
   GthreeLightSetupHash light_hash;
   guint num_clipping_planes;
   guint num_intersection;
+  guint depth_prepass : 1;
 };
 
 struct  _GthreeProgramParameters {
@@ -92,6 +109,10 @@ struct  _GthreeProgramParameters {
   guint size_attenuation : 1;
   guint logarithmic_depth_buffer : 1;
   guint skinning : 1;
+  guint instancing : 1;
+  guint instancing_color : 1;
+  guint lod_fade : 1;     /* Object is cross-fading between GthreeLOD levels */
+  guint depth_prepass : 1; /* Depth may be written by the depth pre-pass */
   guint use_vertex_texture : 1;
   guint morph_targets : 1;
   guint morph_normals : 1;
@@ -104,6 +125,7 @@ struct  _GthreeProgramParameters {
   guint flip_sided : 1;
   guint depth_packing : 2;
   guint dithering : 1;
+  guint uniform_blocks : 1;
 
   guint8 alpha_test;
   guint16 max_bones;
@@ -120,8 +142,72 @@ struct  _GthreeProgramParameters {
 };
 
 
+/* Fixed binding points of the std140 uniform blocks shared by all programs */
+typedef enum {
+  GTHREE_UNIFORM_BLOCK_CAMERA,
+  GTHREE_UNIFORM_BLOCK_DIRECTIONAL_LIGHTS,
+  GTHREE_UNIFORM_BLOCK_POINT_LIGHTS,
+  GTHREE_UNIFORM_BLOCK_SPOT_LIGHTS,
+  GTHREE_UNIFORM_BLOCK_HEMISPHERE_LIGHTS,
+
+  GTHREE_UNIFORM_BLOCK_LAST
+} GthreeUniformBlock;
+
+/* A member of a struct in a uniform block, in declaration order */
+typedef struct {
+  const char *name;
+  GthreeUniformType type;
+  GQuark qname;
+} GthreeUniformBlockMember;
+
 gboolean gthree_uniform_is_array (GthreeUniform *uniform);
 GthreeUniform *gthree_uniform_newq (GQuark name, GthreeUniformType type);
+gsize gthree_uniforms_pack_std140 (GthreeUniforms           *uniforms,
+                                   GthreeUniformBlockMember *members,
+                                   guint                     n_members,
+                                   guint8                   *dest);
+
+typedef struct _GthreeUniformTable GthreeUniformTable;
+
+GthreeUniformTable *gthree_uniform_table_new          (GthreeUniforms     *uniforms,
+                                                       GthreeProgram      *program);
+void                gthree_uniform_table_free         (GthreeUniformTable *table);
+gboolean            gthree_uniform_table_is_valid_for (GthreeUniformTable *table,
+                                                       GthreeUniforms     *uniforms,
+                                                       GthreeProgram      *program);
+void                gthree_uniform_table_load         (GthreeUniformTable *table,
+                                                       GthreeProgram      *program,
+                                                       GthreeRenderer     *renderer);
+guint               gthree_uniform_table_get_program_id (GthreeUniformTable *table);
+void                gthree_uniform_table_apply_locations (GthreeUniformTable *table);
+
+void gthree_shader_load_uniforms (GthreeShader   *shader,
+                                  GthreeProgram  *program,
+                                  GthreeRenderer *renderer);
+char *gthree_shader_expand_includes (const char *text);
+
+gboolean gthree_lod_is_child_active (GthreeLOD    *lod,
+                                     GthreeObject *child,
+                                     gboolean      for_shadow);
+
+typedef struct _GthreeOcclusionBuffer GthreeOcclusionBuffer;
+
+GthreeOcclusionBuffer *gthree_occlusion_buffer_new             (int                      width,
+                                                                int                      height);
+void                   gthree_occlusion_buffer_free            (GthreeOcclusionBuffer   *buffer);
+int                    gthree_occlusion_buffer_get_width       (GthreeOcclusionBuffer   *buffer);
+int                    gthree_occlusion_buffer_get_height      (GthreeOcclusionBuffer   *buffer);
+const float *          gthree_occlusion_buffer_peek_depth      (GthreeOcclusionBuffer   *buffer);
+void                   gthree_occlusion_buffer_begin           (GthreeOcclusionBuffer   *buffer,
+                                                                const graphene_matrix_t *view_projection);
+void                   gthree_occlusion_buffer_add_occluder    (GthreeOcclusionBuffer   *buffer,
+                                                                const graphene_matrix_t *world_matrix,
+                                                                GthreeGeometry          *geometry);
+void                   gthree_occlusion_buffer_rasterize_start (GthreeOcclusionBuffer   *buffer);
+void                   gthree_occlusion_buffer_rasterize_wait  (GthreeOcclusionBuffer   *buffer);
+void                   gthree_occlusion_buffer_rasterize       (GthreeOcclusionBuffer   *buffer);
+gboolean               gthree_occlusion_buffer_test_box        (GthreeOcclusionBuffer   *buffer,
+                                                                const graphene_box_t    *box);
 
 GthreeRenderList *gthree_render_list_new ();
 void gthree_render_list_free (GthreeRenderList *list);
@@ -131,7 +217,16 @@ void gthree_render_list_push (GthreeRenderList *list,
                               GthreeGeometry *geometry,
                               GthreeMaterial *material,
                               GthreeGeometryGroup *group);
-void gthree_render_list_sort (GthreeRenderList *list);
+void gthree_render_list_sort (GthreeRenderList *list,
+                              GthreeSortMode    opaque_sort_mode);
+gboolean gthree_render_list_peek_item (GthreeRenderList  *list,
+                                       gboolean           transparent,
+                                       guint              i,
+                                       GthreeGeometry   **geometry,
+                                       GthreeMaterial   **material,
+                                       float             *z);
+void gthree_render_list_set_current_z (GthreeRenderList *list,
+                                       float             z);
 
 guint32 gthree_renderer_get_resource_id (GthreeRenderer *renderer);
 void gthree_renderer_mark_realized (GthreeRenderer *renderer,
@@ -143,13 +238,27 @@ gboolean gthree_resource_get_dirty_for (GthreeResource  *resource,
                                         GthreeRenderer   *renderer);
 void gthree_resource_mark_clean_for (GthreeResource *resource,
                                      GthreeRenderer *renderer);
+gsize gthree_resource_get_gl_bytes (GthreeResource *resource,
+                                    GthreeRenderer *renderer);
+
+void gthree_renderer_count_uniform_upload (GthreeRenderer *renderer);
+void gthree_renderer_count_buffer_upload  (GthreeRenderer *renderer,
+                                           gsize           bytes);
+void gthree_renderer_count_texture_upload (GthreeRenderer *renderer,
+                                           gsize           bytes);
 
 guint gthree_renderer_allocate_texture_unit (GthreeRenderer *renderer);
+gboolean gthree_renderer_get_supports_parallel_compile (GthreeRenderer *renderer);
 
 int gthree_texture_get_internal_gl_format (guint gl_format,
                                            guint gl_type);
 int gthree_texture_format_to_gl (GthreeTextureFormat format);
 int gthree_texture_data_type_to_gl (GthreeDataType type);
+gsize gthree_texture_get_gl_bytes_per_pixel (guint gl_format,
+                                             guint gl_type);
+void gthree_texture_set_gl_bytes (GthreeTexture  *texture,
+                                  GthreeRenderer *renderer,
+                                  gsize           bytes);
 
 void gthree_texture_setup_framebuffer (GthreeTexture *texture,
                                        GthreeRenderer *renderer,
@@ -182,6 +291,7 @@ guint gthree_render_target_get_gl_framebuffer (GthreeRenderTarget *target,
 void gthree_render_target_realize (GthreeRenderTarget *target,
                                    GthreeRenderer *renderer);
 const graphene_rect_t * gthree_render_target_get_viewport (GthreeRenderTarget *target);
+gboolean gthree_render_target_is_power_of_two (GthreeRenderTarget *target);
 
 
 GthreeGeometry *gthree_geometry_parse_json (JsonObject *object);
@@ -224,6 +334,35 @@ void                      gthree_material_mark_valid_for   (GthreeMaterial *mate
                                                             guint32         renderer_id);
 gboolean                  gthree_material_is_valid_for     (GthreeMaterial *material,
                                                             guint32         renderer_id);
+guint                     gthree_material_get_id           (GthreeMaterial *material);
+
+guint   gthree_geometry_get_id                 (GthreeGeometry *geometry);
+guint32 gthree_geometry_get_attributes_version (GthreeGeometry *geometry);
+guint32 gthree_geometry_get_bounds_stamp       (GthreeGeometry *geometry);
+void    gthree_geometry_add_owner              (GthreeGeometry *geometry,
+                                                GthreeObject   *object);
+void    gthree_geometry_remove_owner           (GthreeGeometry *geometry,
+                                                GthreeObject   *object);
+GList * gthree_geometry_get_attribute_names    (GthreeGeometry *geometry);
+guint   gthree_program_get_id                  (GthreeProgram  *program);
+guint   gthree_program_get_uniform_table_id    (GthreeProgram  *program);
+void    gthree_program_set_uniform_table_id    (GthreeProgram  *program,
+                                                guint           table_id);
+gsize   gthree_program_get_gl_bytes            (GthreeProgram  *program);
+gboolean gthree_program_poll_link              (GthreeProgram  *program);
+gboolean gthree_program_is_ready               (GthreeProgram  *program);
+void    gthree_program_add_user                (GthreeProgram  *program,
+                                                GthreeMaterial *material);
+void    gthree_program_remove_user             (GthreeProgram  *program,
+                                                GthreeMaterial *material);
+void    gthree_program_mark_used               (GthreeProgram  *program);
+guint   gthree_program_cache_poll              (GthreeProgramCache *cache);
+guint   gthree_program_cache_collect           (GthreeProgramCache *cache,
+                                                guint32             frame,
+                                                guint               max_unused_frames,
+                                                guint               max_programs,
+                                                guint64            *evicted_bytes);
+guint   gthree_instanced_mesh_get_id           (GthreeInstancedMesh *mesh);
 
 graphene_matrix_t *gthree_camera_get_projection_matrix_for_write (GthreeCamera *camera);
 
@@ -233,6 +372,7 @@ GthreeAttribute *gthree_attribute_parse_json                 (JsonObject
                                                               const char           *name);
 
 /* These are valid when realized */
+guint32 gthree_attribute_get_buffer_stamp    (GthreeAttribute *attribute);
 int gthree_attribute_get_gl_buffer            (GthreeAttribute *attribute,
                                                GthreeRenderer *renderer);
 int gthree_attribute_get_gl_type              (GthreeAttribute *attribute);
@@ -318,6 +458,7 @@ typedef enum {
   GTHREE_RESOURCE_KIND_BUFFER,
   GTHREE_RESOURCE_KIND_FRAMEBUFFER,
   GTHREE_RESOURCE_KIND_RENDERBUFFER,
+  GTHREE_RESOURCE_KIND_QUERY,
 } GthreeResourceKind;
 
 void gthree_renderer_lazy_delete (GthreeRenderer *renderer,
@@ -326,4 +467,6 @@ void gthree_renderer_lazy_delete (GthreeRenderer *renderer,
 
 GthreeGeometry *gthree_sprite_get_geometry (GthreeSprite *sprite);
 
+void gthree_scene_update_matrix_world (GthreeScene *scene);
+
 #endif /* __GTHREE_PRIVATE_H__ */
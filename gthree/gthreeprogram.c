@@ -6,25 +6,67 @@
 #include "gthreeshader.h"
 #include "gthreerenderer.h"
 #include "gthreeprivate.h"
+#include "gthreeprogrambinarycacheprivate.h"
+#include "gthreetraceprivate.h"
 
 typedef struct {
   GHashTable *uniform_locations;
   GHashTable *attribute_locations;
 
   GLuint gl_program;
+  gsize gl_bytes; /* Estimated driver memory for the linked program */
+  guint id;
+  guint uniform_table_id; /* The GthreeUniformTable the uniform values were last loaded from */
 
   /* Cache keys: */
   GthreeProgramCache *cache;
   GthreeShader *shader;
   GthreeProgramParameters params;
+
+  /* With parallel shader compile the link finishes in the background,
+   * these are kept until we've checked the result */
+  gboolean linked;
+  GLuint gl_vertex_shader;
+  GLuint gl_fragment_shader;
+  gsize source_bytes;
+  char *binary_key;
+
+  GPtrArray *users; /* Materials set up for this program, weak refs */
+  guint32 last_used_frame;
 } GthreeProgramPrivate;
 
 struct _GthreeProgramCache
 {
-    GHashTable *hash;
+    GHashTable *hash; /* Owns the programs */
+    GPtrArray *pending; /* Programs not linked yet, not owned */
+    guint32 frame;
+};
+
+/* Shared by the vertex and fragment prefix, these must be identical in both stages.
+ * With uniform blocks this is filled once per camera by the renderer. */
+#define CAMERA_UNIFORMS                                 \
+  "#ifdef USE_UNIFORM_BLOCKS\n"                         \
+  "layout(std140) uniform GthreeCamera {\n"             \
+  "\tmat4 projectionMatrix;\n"                          \
+  "\tmat4 viewMatrix;\n"                                \
+  "\tvec3 cameraPosition;\n"                            \
+  "};\n"                                                \
+  "#else\n"                                             \
+  "uniform mat4 projectionMatrix;\n"                    \
+  "uniform mat4 viewMatrix;\n"                          \
+  "uniform vec3 cameraPosition;\n"                      \
+  "#endif\n"
+
+static const char *uniform_block_names[GTHREE_UNIFORM_BLOCK_LAST] = {
+  "GthreeCamera",
+  "GthreeDirectionalLights",
+  "GthreePointLights",
+  "GthreeSpotLights",
+  "GthreeHemisphereLights",
 };
 
 static void gthree_program_cache_remove (GthreeProgramCache *cache, GthreeProgram *program);
+static void gthree_program_finish_link (GthreeProgram *program);
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeProgram, gthree_program, G_TYPE_OBJECT);
 
@@ -57,11 +99,18 @@ GLuint
 create_shader (int type, const char *code)
 {
   GLuint shader = glCreateShader (type);
-  GLint status;
 
   glShaderSource (shader, 1, &code, NULL);
   glCompileShader (shader);
 
+  return shader;
+}
+
+static void
+check_shader (int type, GLuint shader)
+{
+  GLint status;
+
   glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
   if (status == GL_FALSE)
     {
@@ -78,8 +127,6 @@ create_shader (int type, const char *code)
 
       g_free (buffer);
     }
-
-  return shader;
 }
 
 static void
@@ -143,7 +190,8 @@ string_replace (GString *string,
       g_string_erase (string, pos, strlen (find));
       g_string_insert (string, pos, replace);
 
-      at = strstr (string->str, find);
+      /* Don't rescan the start, or what we just inserted */
+      at = strstr (string->str + pos + strlen (replace), find);
     }
 }
 
@@ -203,85 +251,104 @@ unroll_replace_cb (const GMatchInfo *info,
 static char *
 unroll_loops (GString *str)
 {
-  g_autoptr(GRegex) regex = g_regex_new ("#pragma unroll_loop[\\s]+?for \\( int i \\= (\\d+)\\; i < (\\d+)\\; i \\+\\+ \\) \\{([\\s\\S]+?)(?=\\})\\}", 0, 0, NULL);
+  static GRegex *regex = NULL;
+
+  if (g_once_init_enter (&regex))
+    {
+      GRegex *r = g_regex_new ("#pragma unroll_loop[\\s]+?for \\( int i \\= (\\d+)\\; i < (\\d+)\\; i \\+\\+ \\) \\{([\\s\\S]+?)(?=\\})\\}",
+                               G_REGEX_OPTIMIZE, 0, NULL);
+      g_once_init_leave (&regex, r);
+    }
+
+  /* Most texts have no loops, and the regex is comparatively slow */
+  if (strstr (str->str, "#pragma unroll_loop") == NULL)
+    return g_strndup (str->str, str->len);
 
   return g_regex_replace_eval (regex, str->str, str->len, 0, 0, unroll_replace_cb, NULL, NULL);
 }
 
-static void
-parse_include (char *file,
-               GString *s)
+static char *
+preprocess_text (GString *str, GthreeProgramParameters *parameters)
 {
-  GBytes *bytes;
-  char *end;
-  g_autofree char *full_path = NULL;
+  g_autofree char *unrolled = NULL;
 
-  while (*file != '<' && *file != 0)
-    file++;
+  replace_light_nums (str, parameters);
+  replace_clipping_plane_nums (str, parameters);
+  unrolled = unroll_loops (str);
 
-  if (*file == 0)
-    {
-      g_warning ("No initial \" in include");
-      return;
-    }
+  return gthree_shader_expand_includes (unrolled);
+}
+
+/* The shader text is the same for all the variants of a shader, apart
+ * from the defines in the prefix, and the light and clipping plane
+ * counts. So, we keep the preprocessed text by source and counts. */
+#define MAX_EXPANDED_SHADER_TEXTS 512
+
+static GHashTable *expanded_shader_texts; /* source -> (counts -> expanded text) */
+static guint n_expanded_shader_texts;
+G_LOCK_DEFINE_STATIC (expanded_shader_texts);
+
+static void
+append_preprocessed_shader_text (GString *out,
+                                 const char *text,
+                                 GthreeProgramParameters *parameters)
+{
+  GHashTable *variants;
+  char counts[64];
+  const char *expanded;
 
-  file++;
+  g_snprintf (counts, sizeof (counts), "%d %d %d %d %d %d %d",
+              parameters->num_dir_lights, parameters->num_spot_lights,
+              parameters->num_rect_area_lights, parameters->num_point_lights,
+              parameters->num_hemi_lights, parameters->num_clipping_planes,
+              parameters->num_clip_intersection);
 
-  end = file;
-  while (*end != '>' && *end != 0)
-    end++;
+  G_LOCK (expanded_shader_texts);
 
-  if (*end == 0)
+  if (expanded_shader_texts == NULL ||
+      n_expanded_shader_texts >= MAX_EXPANDED_SHADER_TEXTS)
     {
-      g_warning ("No final \" in include");
-      return;
+      g_clear_pointer (&expanded_shader_texts, g_hash_table_destroy);
+      expanded_shader_texts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, (GDestroyNotify)g_hash_table_destroy);
+      n_expanded_shader_texts = 0;
     }
 
-  *end = 0;
+  variants = g_hash_table_lookup (expanded_shader_texts, text);
+  if (variants == NULL)
+    {
+      variants = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      g_hash_table_insert (expanded_shader_texts, g_strdup (text), variants);
+    }
 
-  full_path = g_strconcat ("/org/gnome/gthree/shader_chunks/", file, ".glsl", NULL);
-  bytes = g_resources_lookup_data (full_path, 0, NULL);
-  if (bytes == NULL)
+  expanded = g_hash_table_lookup (variants, counts);
+  if (expanded == NULL)
     {
-      g_warning ("shader snipped %s not found", file);
-      return;
+      g_autoptr(GString) str = g_string_new (text);
+      char *e = preprocess_text (str, parameters);
+
+      g_hash_table_insert (variants, g_strdup (counts), e);
+      n_expanded_shader_texts++;
+      expanded = e;
     }
 
-  g_string_append_printf (s, "// Include: %s\n", file);
-  g_string_append_len (s,
-                        g_bytes_get_data (bytes, NULL),
-                        g_bytes_get_size (bytes));
-  g_string_append_c (s, '\n');
-  g_bytes_unref (bytes);
+  g_string_append (out, expanded);
+
+  G_UNLOCK (expanded_shader_texts);
 }
 
 static char *
-parse_text_with_includes (const char *text)
+preprocess_shader (GString *prefix,
+                   const char *text,
+                   GthreeProgramParameters *parameters)
 {
-  GString *s;
-  char **lines;
-  int i;
-
-  s = g_string_new ("");
+  /* The prefix is different for every program, but short */
+  g_autofree char *expanded_prefix = preprocess_text (prefix, parameters);
+  GString *out = g_string_new (expanded_prefix);
 
-  lines = g_strsplit (text, "\n", -1);
-  for (i = 0; lines[i] != NULL; i++)
-    {
-      char *line = lines[i];
-      while (g_ascii_isspace (*line))
-        line++;
-      if (g_str_has_prefix (line, "#include"))
-        parse_include (lines[i] + strlen ("#include"), s);
-      else
-        {
-          g_string_append (s, lines[i]);
-          g_string_append_c (s, '\n');
-        }
-    }
+  append_preprocessed_shader_text (out, text, parameters);
 
-  g_strfreev (lines);
-
-  return g_string_free (s, FALSE);
+  return g_string_free (out, FALSE);
 }
 
 static void
@@ -362,14 +429,16 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
   float gamma_factor_define;
   GLuint gl_program;
   GString *vertex, *fragment;
-  g_autofree char *vertex_unrolled = NULL;
-  g_autofree char *fragment_unrolled = NULL;
   g_autofree char *vertex_expanded = NULL;
   g_autofree char *fragment_expanded = NULL;
   const char *shader_name;
-  GLuint glVertexShader, glFragmentShader;
-  GLint status;
+  GLuint glVertexShader = 0, glFragmentShader = 0;
+  GthreeProgramBinaryCache *binary_cache;
+  g_autofree char *binary_key = NULL;
+  gboolean from_binary = FALSE;
+  gboolean parallel = FALSE;
   char formatd_buffer[G_ASCII_DTOSTR_BUF_SIZE];
+  GTHREE_TRACE_BEGIN (trace_compile);
 
   program = g_object_new (gthree_program_get_type (),
                           NULL);
@@ -458,9 +527,16 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
   if (TRUE /*! material instanceof THREE.RawShaderMaterial */)
     {
       g_string_append (vertex, "#version 130\n");
+      if (parameters->uniform_blocks)
+        g_string_append (vertex, "#extension GL_ARB_uniform_buffer_object : require\n");
       g_string_append_printf (vertex, "precision %s float;\n", precision_to_string (parameters->precision));
       g_string_append_printf (vertex, "precision %s int;\n", precision_to_string (parameters->precision));
 
+      /* The depth pre-pass needs its programs to compute bit-identical
+       * depths for the same vertex */
+      if (parameters->depth_prepass)
+        g_string_append (vertex, "invariant gl_Position;\n");
+
       if (shader_name)
         g_string_append_printf (vertex, "#define SHADER_NAME %s\n", shader_name);
 
@@ -470,6 +546,9 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       if (parameters->supports_vertex_textures)
         g_string_append (vertex, "#define VERTEX_TEXTURES\n");
 
+      if (parameters->uniform_blocks)
+        g_string_append (vertex, "#define USE_UNIFORM_BLOCKS\n");
+
       g_string_append_printf (vertex, "#define GAMMA_FACTOR %s\n",
                               g_ascii_formatd (formatd_buffer, sizeof(formatd_buffer),
                                                "%f", gamma_factor_define));
@@ -524,6 +603,11 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       if (parameters->flat_shading)
         g_string_append (vertex, "#define FLAT_SHADED\n");
 
+      if (parameters->instancing)
+        g_string_append (vertex, "#define USE_INSTANCING\n");
+      if (parameters->instancing_color)
+        g_string_append (vertex, "#define USE_INSTANCING_COLOR\n");
+
       if (parameters->skinning)
         g_string_append (vertex, "#define USE_SKINNING\n");
       if (parameters->use_vertex_texture)
@@ -557,10 +641,8 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
         g_string_append (vertex,
                          "uniform mat4 modelMatrix;\n"
                          "uniform mat4 modelViewMatrix;\n"
-                         "uniform mat4 projectionMatrix;\n"
-                         "uniform mat4 viewMatrix;\n"
                          "uniform mat3 normalMatrix;\n"
-                         "uniform vec3 cameraPosition;\n"
+                         CAMERA_UNIFORMS
 
                          "attribute vec3 position;\n"
                          "attribute vec3 normal;\n"
@@ -570,6 +652,14 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
                          "	attribute vec4 tangent;\n"
                          "#endif\n"
 
+                         "#ifdef USE_INSTANCING\n"
+                         "	attribute mat4 instanceMatrix;\n"
+                         "#endif\n"
+
+                         "#ifdef USE_INSTANCING_COLOR\n"
+                         "	attribute vec3 instanceColor;\n"
+                         "#endif\n"
+
                          "#ifdef USE_COLOR\n"
                          "	attribute vec3 color;\n"
                          "#endif\n"
@@ -601,6 +691,8 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       /* fragment shader prefix */
 
       g_string_append (fragment, "#version 130\n");
+      if (parameters->uniform_blocks)
+        g_string_append (fragment, "#extension GL_ARB_uniform_buffer_object : require\n");
       g_string_append_printf (fragment, "precision %s float;\n", precision_to_string (parameters->precision));
       g_string_append_printf (fragment, "precision %s int;\n", precision_to_string (parameters->precision));
 
@@ -664,7 +756,7 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
 
       if (parameters->vertex_tangents)
         g_string_append (fragment, "#define USE_TANGENT\n");
-      if (parameters->vertex_colors)
+      if (parameters->vertex_colors || parameters->instancing_color)
         g_string_append (fragment, "#define USE_COLOR\n");
 
       if (parameters->gradient_map)
@@ -678,6 +770,9 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       if (parameters->flip_sided)
         g_string_append (fragment, "#define FLIP_SIDED\n");
 
+      if (parameters->lod_fade)
+        g_string_append (fragment, "#define USE_LOD_FADE\n");
+
       if (parameters->shadow_map_enabled)
         g_string_append_printf (fragment,
                                 "#define USE_SHADOWMAP\n"
@@ -690,6 +785,9 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       if (parameters->physically_correct_lights)
         g_string_append (fragment, "#define PHYSICALLY_CORRECT_LIGHTS\n");
 
+      if (parameters->uniform_blocks)
+        g_string_append (fragment, "#define USE_UNIFORM_BLOCKS\n");
+
       if (parameters->logarithmic_depth_buffer)
         g_string_append (fragment, "#define USE_LOGDEPTHBUF\n");
 #if TODO
@@ -698,9 +796,7 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       parameters.envMap && ( capabilities.isWebGL2 || extensions.get( 'EXT_shader_texture_lod' ) ) ? '#define TEXTURE_LOD_EXT' : '',
 #endif
 
-        g_string_append (fragment,
-                         "uniform mat4 viewMatrix;\n"
-                         "uniform vec3 cameraPosition;\n");
+        g_string_append (fragment, CAMERA_UNIFORMS);
 #if TODO
       // ( parameters.toneMapping !== NoToneMapping ) ? '#define TONE_MAPPING' : '',
       // ( parameters.toneMapping !== NoToneMapping ) ? ShaderChunk[ 'tonemapping_pars_fragment' ] : '', // this code is required here because it is used by the toneMapping() function defined below
@@ -729,19 +825,8 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
         }
   }
 
-  g_string_append (vertex, vertex_shader);
-  replace_light_nums (vertex, parameters);
-  replace_clipping_plane_nums (vertex, parameters);
-
-  g_string_append (fragment, fragment_shader);
-  replace_light_nums (fragment, parameters);
-  replace_clipping_plane_nums (fragment, parameters);
-
-  vertex_unrolled = unroll_loops (vertex);
-  fragment_unrolled = unroll_loops (fragment);
-
-  vertex_expanded = parse_text_with_includes (vertex_unrolled);
-  fragment_expanded = parse_text_with_includes (fragment_unrolled);
+  vertex_expanded = preprocess_shader (vertex, vertex_shader, parameters);
+  fragment_expanded = preprocess_shader (fragment, fragment_shader, parameters);
 
   if (0)
     {
@@ -751,65 +836,232 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
                fragment_expanded);
     }
 
-  glVertexShader = create_shader (GL_VERTEX_SHADER, vertex_expanded);
-  glFragmentShader = create_shader (GL_FRAGMENT_SHADER, fragment_expanded);
-
   g_string_free (vertex, TRUE);
   g_string_free (fragment, TRUE);
 
-  glAttachShader (gl_program, glVertexShader);
-  glAttachShader (gl_program, glFragmentShader);
+  /* The expanded source covers everything that affects the program,
+   * if the driver rejects the binary we just compile as usual */
+  binary_cache = gthree_renderer_get_program_binary_cache (renderer);
+  if (binary_cache && gthree_program_binary_cache_is_supported (binary_cache))
+    {
+      binary_key = gthree_program_binary_cache_get_key (binary_cache, vertex_expanded, fragment_expanded, parameters);
+      from_binary = gthree_program_binary_cache_load (binary_cache, binary_key, gl_program);
+    }
 
-#ifdef DEBUG_LABELS
-  if (shader_name)
+  if (!from_binary)
     {
-      g_autofree char *vlabel = g_strdup_printf ("%s.vert", shader_name);
-      g_autofree char *flabel = g_strdup_printf ("%s.frag", shader_name);
-      glObjectLabel (GL_SHADER, glVertexShader, strlen (vlabel), vlabel);
-      glObjectLabel (GL_SHADER, glFragmentShader, strlen (flabel), flabel);
-      glObjectLabel (GL_PROGRAM, gl_program, strlen (shader_name), shader_name);
+      glVertexShader = create_shader (GL_VERTEX_SHADER, vertex_expanded);
+      glFragmentShader = create_shader (GL_FRAGMENT_SHADER, fragment_expanded);
+
+      glAttachShader (gl_program, glVertexShader);
+      glAttachShader (gl_program, glFragmentShader);
+
+#ifdef DEBUG_LABELS
+      if (shader_name)
+        {
+          g_autofree char *vlabel = g_strdup_printf ("%s.vert", shader_name);
+          g_autofree char *flabel = g_strdup_printf ("%s.frag", shader_name);
+          glObjectLabel (GL_SHADER, glVertexShader, strlen (vlabel), vlabel);
+          glObjectLabel (GL_SHADER, glFragmentShader, strlen (flabel), flabel);
+        }
+#endif
+
+      if (index0AttributeName != NULL) {
+
+        // Force a particular attribute to index 0.
+        // because potentially expensive emulation is done by browser if attribute 0 is disabled.
+        // And, color, for example is often automatically bound to index 0 so disabling it
+
+        glBindAttribLocation (gl_program, 0, index0AttributeName);
+      }
+
+      if (binary_key)
+        gthree_program_binary_cache_prepare (binary_cache, gl_program);
+
+      glLinkProgram (gl_program);
+
+      /* Any query of the results would wait for the compile, so leave
+       * that until it's done if the driver compiles in the background */
+      parallel = gthree_renderer_get_supports_parallel_compile (renderer);
     }
+
+#ifdef DEBUG_LABELS
+  if (shader_name)
+    glObjectLabel (GL_PROGRAM, gl_program, strlen (shader_name), shader_name);
 #endif
 
-  if (index0AttributeName != NULL) {
+  priv->gl_program = gl_program;
+  priv->gl_vertex_shader = glVertexShader;
+  priv->gl_fragment_shader = glFragmentShader;
+  priv->source_bytes = strlen (vertex_expanded) + strlen (fragment_expanded);
+  if (!from_binary)
+    priv->binary_key = g_steal_pointer (&binary_key);
 
-    // Force a particular attribute to index 0.
-    // because potentially expensive emulation is done by browser if attribute 0 is disabled.
-    // And, color, for example is often automatically bound to index 0 so disabling it
+  if (!parallel)
+    gthree_program_finish_link (program);
 
-    glBindAttribLocation (gl_program, 0, index0AttributeName);
-  }
+  GTHREE_TRACE_END_FORMAT (trace_compile, "compile program", "%s%s", shader_name,
+                           from_binary ? " (binary)" : "");
 
-  glLinkProgram (gl_program);
+  return program;
+}
 
-  glGetProgramiv (gl_program, GL_LINK_STATUS, &status);
+/* Check the link result and do the setup that needs a linked program.
+ * This blocks if the driver is still compiling the program. */
+static void
+gthree_program_finish_link (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+  GthreeRenderer *renderer;
+  GLint status;
+
+  if (priv->linked)
+    return;
+
+  priv->linked = TRUE;
+
+  if (priv->cache)
+    g_ptr_array_remove_fast (priv->cache->pending, program);
+
+  glGetProgramiv (priv->gl_program, GL_LINK_STATUS, &status);
   if (status == GL_FALSE)
     {
       GLint log_len;
       char *buffer;
 
-      glGetProgramiv (gl_program, GL_INFO_LOG_LENGTH, &log_len);
+      if (priv->gl_vertex_shader)
+        check_shader (GL_VERTEX_SHADER, priv->gl_vertex_shader);
+      if (priv->gl_fragment_shader)
+        check_shader (GL_FRAGMENT_SHADER, priv->gl_fragment_shader);
+
+      glGetProgramiv (priv->gl_program, GL_INFO_LOG_LENGTH, &log_len);
 
       buffer = g_malloc (log_len + 1);
-      glGetProgramInfoLog (gl_program, log_len, NULL, buffer);
+      glGetProgramInfoLog (priv->gl_program, log_len, NULL, buffer);
       g_warning ("Linker failure: %s\n", buffer);
       g_free (buffer);
     }
+  else
+    {
+      if (priv->params.uniform_blocks)
+        {
+          /* Blocks not used by this program are optimized out and return GL_INVALID_INDEX */
+          for (int i = 0; i < GTHREE_UNIFORM_BLOCK_LAST; i++)
+            {
+              GLuint index = glGetUniformBlockIndex (priv->gl_program, uniform_block_names[i]);
+              if (index != GL_INVALID_INDEX)
+                glUniformBlockBinding (priv->gl_program, index, i);
+            }
+        }
+
+      /* The binary size is the closest thing to the driver side cost we
+       * can query, otherwise fall back to the size of the sources */
+      if (epoxy_gl_version () >= 41 || epoxy_has_gl_extension ("GL_ARB_get_program_binary"))
+        {
+          GLint binary_length = 0;
+          glGetProgramiv (priv->gl_program, GL_PROGRAM_BINARY_LENGTH, &binary_length);
+          priv->gl_bytes = binary_length;
+        }
+
+      if (priv->gl_bytes == 0)
+        priv->gl_bytes = priv->source_bytes;
+
+      /* This is always called with the owning renderer current */
+      renderer = gthree_renderer_get_current ();
+      if (priv->binary_key && renderer && gthree_renderer_get_program_binary_cache (renderer))
+        gthree_program_binary_cache_store (gthree_renderer_get_program_binary_cache (renderer),
+                                           priv->binary_key, priv->gl_program);
+    }
 
   // clean up
 
-  glDeleteShader (glVertexShader);
-  glDeleteShader (glFragmentShader);
+  if (priv->gl_vertex_shader)
+    glDeleteShader (priv->gl_vertex_shader);
+  if (priv->gl_fragment_shader)
+    glDeleteShader (priv->gl_fragment_shader);
+  priv->gl_vertex_shader = 0;
+  priv->gl_fragment_shader = 0;
 
-  priv->gl_program = gl_program;
+  g_clear_pointer (&priv->binary_key, g_free);
+}
 
-  return program;
+/* Returns FALSE while the driver is still compiling the program in
+ * the background. This never blocks. */
+gboolean
+gthree_program_poll_link (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+  GLint completed = GL_TRUE;
+
+  if (priv->linked)
+    return TRUE;
+
+  glGetProgramiv (priv->gl_program, GL_COMPLETION_STATUS_KHR, &completed);
+  if (!completed)
+    return FALSE;
+
+  gthree_program_finish_link (program);
+  return TRUE;
+}
+
+/* Doesn't call into GL, so this is cheap enough for the draw path.
+ * Programs are made ready by gthree_program_cache_poll(). */
+gboolean
+gthree_program_is_ready (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  return priv->linked;
 }
 
+static guint next_program_id = 0;
+
 static void
 gthree_program_init (GthreeProgram *program)
 {
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  priv->id = ++next_program_id;
+  priv->users = g_ptr_array_new ();
+}
+
+static void
+program_user_died (gpointer  data,
+                   GObject  *where_the_object_was)
+{
+  GthreeProgram *program = data;
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  g_ptr_array_remove_fast (priv->users, where_the_object_was);
+}
+
+void
+gthree_program_add_user (GthreeProgram  *program,
+                         GthreeMaterial *material)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  g_object_weak_ref (G_OBJECT (material), program_user_died, program);
+  g_ptr_array_add (priv->users, material);
+}
+
+void
+gthree_program_remove_user (GthreeProgram  *program,
+                            GthreeMaterial *material)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  if (g_ptr_array_remove_fast (priv->users, material))
+    g_object_weak_unref (G_OBJECT (material), program_user_died, program);
+}
+
+void
+gthree_program_mark_used (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
 
+  if (priv->cache)
+    priv->last_used_frame = priv->cache->frame;
 }
 
 static void
@@ -817,6 +1069,13 @@ gthree_program_finalize (GObject *obj)
 {
   GthreeProgram *program = GTHREE_PROGRAM (obj);
   GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+  int i, j;
+
+  if (priv->gl_vertex_shader)
+    glDeleteShader (priv->gl_vertex_shader);
+  if (priv->gl_fragment_shader)
+    glDeleteShader (priv->gl_fragment_shader);
+  g_free (priv->binary_key);
 
   if (priv->gl_program)
     {
@@ -827,6 +1086,27 @@ gthree_program_finalize (GObject *obj)
   g_hash_table_destroy (priv->uniform_locations);
   g_hash_table_destroy (priv->attribute_locations);
 
+  /* Materials still pointing at us have to pick a new program */
+  for (i = 0; i < priv->users->len; i++)
+    {
+      GthreeMaterial *material = g_ptr_array_index (priv->users, i);
+      GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+
+      g_object_weak_unref (G_OBJECT (material), program_user_died, program);
+      for (j = 0; j < GTHREE_MATERIAL_N_VARIANTS; j++)
+        {
+          GthreeMaterialVariant *variant = &material_properties->variants[j];
+
+          if (variant->program == program)
+            {
+              variant->program = NULL;
+              variant->valid = FALSE;
+              variant->program_setup_pending = FALSE;
+            }
+        }
+    }
+  g_ptr_array_unref (priv->users);
+
   if (priv->cache)
     gthree_program_cache_remove (priv->cache, program);
 
@@ -841,11 +1121,46 @@ gthree_program_class_init (GthreeProgramClass *klass)
   G_OBJECT_CLASS (klass)->finalize = gthree_program_finalize;
 }
 
+guint
+gthree_program_get_id (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  return priv->id;
+}
+
+guint
+gthree_program_get_uniform_table_id (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  return priv->uniform_table_id;
+}
+
+void
+gthree_program_set_uniform_table_id (GthreeProgram *program,
+                                     guint table_id)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  priv->uniform_table_id = table_id;
+}
+
+gsize
+gthree_program_get_gl_bytes (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  return priv->gl_bytes;
+}
+
 void
 gthree_program_use (GthreeProgram *program)
 {
   GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
 
+  gthree_program_finish_link (program);
+
   glUseProgram (priv->gl_program);
 }
 
@@ -857,7 +1172,10 @@ gthree_program_lookup_uniform_location (GthreeProgram *program,
   gpointer location;
 
   if (priv->uniform_locations == NULL)
-    get_uniform_locations (program);
+    {
+      gthree_program_finish_link (program);
+      get_uniform_locations (program);
+    }
 
   if (g_hash_table_lookup_extended (priv->uniform_locations,
                                     GINT_TO_POINTER (uniform), NULL, &location))
@@ -903,6 +1221,8 @@ gthree_program_get_attribute_locations (GthreeProgram *program)
       GLint n, i, max_len;
       char *buffer;
 
+      gthree_program_finish_link (program);
+
       priv->attribute_locations = g_hash_table_new (g_direct_hash, g_direct_equal);
 
       glGetProgramiv (priv->gl_program,  GL_ACTIVE_ATTRIBUTE_MAX_LENGTH,  &max_len);
@@ -967,6 +1287,7 @@ gthree_program_cache_new (void)
   cache = g_new0 (GthreeProgramCache, 1);
 
   cache->hash = g_hash_table_new ((GHashFunc)gthree_program_priv_hash, (GEqualFunc)gthree_program_priv_equal);
+  cache->pending = g_ptr_array_new ();
 
   return cache;
 }
@@ -976,6 +1297,7 @@ gthree_program_cache_remove (GthreeProgramCache *cache, GthreeProgram *program)
 {
   GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
   g_hash_table_remove (cache->hash, gthree_program_get_instance_private (program));
+  g_ptr_array_remove_fast (cache->pending, program);
   priv->cache = NULL;
 }
 
@@ -992,17 +1314,142 @@ gthree_program_cache_get (GthreeProgramCache *cache, GthreeShader *shader, Gthre
 
   program = g_hash_table_lookup (cache->hash, &key);
   if (program)
-    return program;
+    {
+      gthree_program_mark_used (program);
+      return program;
+    }
 
   program = gthree_program_new (shader, parameters, renderer);
   priv = gthree_program_get_instance_private (program);
   priv->cache = cache;
+  priv->last_used_frame = cache->frame;
 
   g_hash_table_insert (cache->hash, gthree_program_get_instance_private (program), program);
+  if (!priv->linked)
+    g_ptr_array_add (cache->pending, program);
 
   return program;
 }
 
+/* Finish all the programs the driver is done compiling in the
+ * background, returns the number of programs still compiling */
+guint
+gthree_program_cache_poll (GthreeProgramCache *cache)
+{
+  int i;
+
+  /* Finishing removes the program from the array */
+  for (i = cache->pending->len - 1; i >= 0; i--)
+    gthree_program_poll_link (g_ptr_array_index (cache->pending, i));
+
+  return cache->pending->len;
+}
+
+static gint
+compare_programs_by_use (gconstpointer a,
+                         gconstpointer b,
+                         gpointer      user_data)
+{
+  GthreeProgramCache *cache = user_data;
+  GthreeProgramPrivate *pa = gthree_program_get_instance_private (*(GthreeProgram **)a);
+  GthreeProgramPrivate *pb = gthree_program_get_instance_private (*(GthreeProgram **)b);
+  guint32 age_a = cache->frame - pa->last_used_frame;
+  guint32 age_b = cache->frame - pb->last_used_frame;
+
+  if (age_a > age_b)
+    return -1;
+  if (age_a < age_b)
+    return 1;
+  return 0;
+}
+
+/* Starts a new frame and evicts programs, which must be done with the
+ * context current. Programs that no material uses any more go after
+ * max_unused_frames frames, and if there are still more than
+ * max_programs the least recently used ones go too, even if some
+ * material uses them (it will get a new program next time it is
+ * drawn). Programs used in the last frame are never evicted, so a
+ * working set larger than the cap doesn't recompile every frame.
+ * Zero disables either limit. Returns the number of evicted programs. */
+guint
+gthree_program_cache_collect (GthreeProgramCache *cache,
+                              guint32             frame,
+                              guint               max_unused_frames,
+                              guint               max_programs,
+                              guint64            *evicted_bytes)
+{
+  g_autoptr(GPtrArray) candidates = NULL;
+  GHashTableIter iter;
+  gpointer value;
+  guint n_programs, n_evicted = 0;
+  guint64 bytes = 0;
+  int i;
+
+  cache->frame = frame;
+
+  n_programs = g_hash_table_size (cache->hash);
+  if (max_unused_frames == 0 &&
+      (max_programs == 0 || n_programs <= max_programs))
+    goto out;
+
+  candidates = g_ptr_array_new ();
+  g_hash_table_iter_init (&iter, cache->hash);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      GthreeProgramPrivate *priv = gthree_program_get_instance_private (value);
+
+      if (frame - priv->last_used_frame > 1)
+        g_ptr_array_add (candidates, value);
+    }
+
+  /* Oldest first */
+  g_ptr_array_sort_with_data (candidates, compare_programs_by_use, cache);
+
+  for (i = 0; i < candidates->len; i++)
+    {
+      GthreeProgram *program = g_ptr_array_index (candidates, i);
+      GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+      gboolean over_cap = max_programs != 0 && n_programs > max_programs;
+      gboolean idle = max_unused_frames != 0 && priv->users->len == 0 &&
+        frame - priv->last_used_frame > max_unused_frames;
+
+      if (!over_cap && !idle)
+        continue;
+
+      bytes += priv->gl_bytes;
+      n_programs--;
+      n_evicted++;
+
+      gthree_program_cache_remove (cache, program);
+      g_object_unref (program);
+    }
+
+ out:
+  if (evicted_bytes)
+    *evicted_bytes = bytes;
+
+  return n_evicted;
+}
+
+void
+gthree_program_cache_get_usage (GthreeProgramCache *cache,
+                                guint              *n_programs,
+                                guint64            *bytes)
+{
+  GHashTableIter iter;
+  gpointer value;
+  guint64 total = 0;
+
+  g_hash_table_iter_init (&iter, cache->hash);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    total += gthree_program_get_gl_bytes (value);
+
+  if (n_programs)
+    *n_programs = g_hash_table_size (cache->hash);
+  if (bytes)
+    *bytes = total;
+}
+
 void
 gthree_program_cache_free (GthreeProgramCache *cache)
 {
@@ -1010,15 +1457,20 @@ gthree_program_cache_free (GthreeProgramCache *cache)
   GHashTableIter iter;
   gpointer value;
   GthreeProgram *program;
+  g_autoptr(GPtrArray) programs = g_ptr_array_new_with_free_func (g_object_unref);
 
+  /* Drop the refs the cache owns after it is gone, so the programs
+   * don't try to remove themselves from it */
   g_hash_table_iter_init (&iter, cache->hash);
   while (g_hash_table_iter_next (&iter, NULL, &value))
     {
       program = value;
       priv = gthree_program_get_instance_private (program);
       priv->cache = NULL;
+      g_ptr_array_add (programs, program);
     }
 
   g_hash_table_destroy (cache->hash);
+  g_ptr_array_unref (cache->pending);
   g_free (cache);
 }
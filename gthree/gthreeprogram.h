@@ -63,6 +63,10 @@ GthreeProgram *     gthree_program_cache_get  (GthreeProgramCache      *cache,
                                                GthreeShader            *shader,
                                                GthreeProgramParameters *parameters,
                                                GthreeRenderer          *renderer);
+GTHREE_API
+void                gthree_program_cache_get_usage (GthreeProgramCache *cache,
+                                                    guint              *n_programs,
+                                                    guint64            *bytes);
 
 G_END_DECLS
 
@@ -0,0 +1,401 @@
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <epoxy/gl.h>
+
+#include "gthreeprogrambinarycacheprivate.h"
+#include "gthreeprivate.h"
+
+/* Bump this whenever the key or the file layout changes */
+#define BINARY_CACHE_VERSION 1
+#define BINARY_CACHE_MAGIC "GTHRPBIN"
+#define BINARY_CACHE_SUFFIX ".bin"
+
+typedef struct {
+  char magic[8];
+  guint32 version;
+  guint32 format;
+} BinaryHeader;
+
+typedef struct {
+  guint64 size;
+  gint64 last_used; /* Real time in usec, the file mtime between runs */
+} BinaryEntry;
+
+struct _GthreeProgramBinaryCache
+{
+  char *directory;
+  guint64 max_size;
+
+  /* Lazily scanned from the directory, by file name */
+  GHashTable *entries;
+  guint64 total_size;
+
+  /* Driver state, lazily queried with the context current */
+  gboolean initialized;
+  gboolean supported;
+  gboolean write_failed;
+  char *driver_id;
+  GArray *formats;
+};
+
+GthreeProgramBinaryCache *
+gthree_program_binary_cache_new (const char *directory,
+                                 guint64     max_size)
+{
+  GthreeProgramBinaryCache *cache;
+
+  cache = g_new0 (GthreeProgramBinaryCache, 1);
+  cache->directory = g_strdup (directory);
+  cache->max_size = max_size;
+
+  return cache;
+}
+
+void
+gthree_program_binary_cache_free (GthreeProgramBinaryCache *cache)
+{
+  g_free (cache->directory);
+  g_free (cache->driver_id);
+  if (cache->entries)
+    g_hash_table_destroy (cache->entries);
+  if (cache->formats)
+    g_array_unref (cache->formats);
+  g_free (cache);
+}
+
+const char *
+gthree_program_binary_cache_get_directory (GthreeProgramBinaryCache *cache)
+{
+  return cache->directory;
+}
+
+static void evict (GthreeProgramBinaryCache *cache);
+
+void
+gthree_program_binary_cache_set_max_size (GthreeProgramBinaryCache *cache,
+                                          guint64                   max_size)
+{
+  cache->max_size = max_size;
+  if (cache->entries)
+    evict (cache);
+}
+
+static void
+ensure_initialized (GthreeProgramBinaryCache *cache)
+{
+  GLint n_formats = 0;
+
+  if (cache->initialized)
+    return;
+
+  cache->initialized = TRUE;
+
+  if (epoxy_gl_version () < 41 && !epoxy_has_gl_extension ("GL_ARB_get_program_binary"))
+    return;
+
+  /* Some drivers support the entry points but no actual formats */
+  glGetIntegerv (GL_NUM_PROGRAM_BINARY_FORMATS, &n_formats);
+  if (n_formats <= 0)
+    return;
+
+  cache->formats = g_array_sized_new (FALSE, TRUE, sizeof (GLint), n_formats);
+  g_array_set_size (cache->formats, n_formats);
+  glGetIntegerv (GL_PROGRAM_BINARY_FORMATS, (GLint *)cache->formats->data);
+
+  /* Binaries are only valid for the exact same driver build */
+  cache->driver_id = g_strdup_printf ("%s\n%s\n%s\n%s",
+                                      (const char *)glGetString (GL_VENDOR),
+                                      (const char *)glGetString (GL_RENDERER),
+                                      (const char *)glGetString (GL_VERSION),
+                                      (const char *)glGetString (GL_SHADING_LANGUAGE_VERSION));
+  cache->supported = TRUE;
+}
+
+gboolean
+gthree_program_binary_cache_is_supported (GthreeProgramBinaryCache *cache)
+{
+  ensure_initialized (cache);
+  return cache->supported;
+}
+
+char *
+gthree_program_binary_cache_get_key (GthreeProgramBinaryCache *cache,
+                                     const char               *vertex,
+                                     const char               *fragment,
+                                     GthreeProgramParameters  *parameters)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  guint32 version = BINARY_CACHE_VERSION;
+
+  ensure_initialized (cache);
+
+  /* Include the terminating zeros, so the strings can't run into each other */
+  g_checksum_update (checksum, (const guchar *)&version, sizeof (version));
+  g_checksum_update (checksum, (const guchar *)cache->driver_id, strlen (cache->driver_id) + 1);
+  g_checksum_update (checksum, (const guchar *)parameters, sizeof (GthreeProgramParameters));
+  g_checksum_update (checksum, (const guchar *)vertex, strlen (vertex) + 1);
+  g_checksum_update (checksum, (const guchar *)fragment, strlen (fragment) + 1);
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static char *
+get_filename (const char *key)
+{
+  return g_strconcat (key, BINARY_CACHE_SUFFIX, NULL);
+}
+
+static void
+ensure_entries (GthreeProgramBinaryCache *cache)
+{
+  GDir *dir;
+  const char *name;
+
+  if (cache->entries)
+    return;
+
+  cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  dir = g_dir_open (cache->directory, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  /* Only ever touch our own files, the directory may be shared */
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *path = NULL;
+      GStatBuf buf;
+      BinaryEntry *entry;
+
+      if (!g_str_has_suffix (name, BINARY_CACHE_SUFFIX))
+        continue;
+
+      path = g_build_filename (cache->directory, name, NULL);
+      if (g_stat (path, &buf) != 0)
+        continue;
+
+      entry = g_new0 (BinaryEntry, 1);
+      entry->size = buf.st_size;
+      entry->last_used = (gint64)buf.st_mtime * G_USEC_PER_SEC;
+      g_hash_table_insert (cache->entries, g_strdup (name), entry);
+      cache->total_size += entry->size;
+    }
+
+  g_dir_close (dir);
+}
+
+static void
+remove_entry (GthreeProgramBinaryCache *cache,
+              const char               *filename)
+{
+  g_autofree char *path = g_build_filename (cache->directory, filename, NULL);
+  BinaryEntry *entry;
+
+  g_unlink (path);
+
+  entry = g_hash_table_lookup (cache->entries, filename);
+  if (entry)
+    {
+      cache->total_size -= entry->size;
+      g_hash_table_remove (cache->entries, filename);
+    }
+}
+
+static void
+touch_entry (GthreeProgramBinaryCache *cache,
+             const char               *filename,
+             guint64                   size)
+{
+  g_autofree char *path = g_build_filename (cache->directory, filename, NULL);
+  BinaryEntry *entry;
+
+  entry = g_hash_table_lookup (cache->entries, filename);
+  if (entry == NULL)
+    {
+      entry = g_new0 (BinaryEntry, 1);
+      g_hash_table_insert (cache->entries, g_strdup (filename), entry);
+    }
+
+  cache->total_size -= entry->size;
+  entry->size = size;
+  cache->total_size += entry->size;
+  entry->last_used = g_get_real_time ();
+
+  /* The mtime carries the recency over to the next run */
+  g_utime (path, NULL);
+}
+
+static gint
+compare_entries_by_use (gconstpointer a,
+                        gconstpointer b,
+                        gpointer      user_data)
+{
+  GHashTable *entries = user_data;
+  const BinaryEntry *ea = g_hash_table_lookup (entries, *(const char **)a);
+  const BinaryEntry *eb = g_hash_table_lookup (entries, *(const char **)b);
+
+  if (ea->last_used < eb->last_used)
+    return -1;
+  if (ea->last_used > eb->last_used)
+    return 1;
+  return 0;
+}
+
+/* Drop the least recently used binaries until we're within the limit */
+static void
+evict (GthreeProgramBinaryCache *cache)
+{
+  g_autoptr(GPtrArray) names = NULL;
+  GHashTableIter iter;
+  gpointer key;
+  int i;
+
+  if (cache->total_size <= cache->max_size)
+    return;
+
+  names = g_ptr_array_new_with_free_func (g_free);
+  g_hash_table_iter_init (&iter, cache->entries);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (names, g_strdup (key));
+
+  g_ptr_array_sort_with_data (names, compare_entries_by_use, cache->entries);
+
+  for (i = 0; i < names->len && cache->total_size > cache->max_size; i++)
+    remove_entry (cache, g_ptr_array_index (names, i));
+}
+
+static gboolean
+is_supported_format (GthreeProgramBinaryCache *cache,
+                     GLint                     format)
+{
+  int i;
+
+  for (i = 0; i < cache->formats->len; i++)
+    {
+      if (g_array_index (cache->formats, GLint, i) == format)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* On failure the program is left unlinked, so the caller can compile
+ * and link it from source as usual. */
+gboolean
+gthree_program_binary_cache_load (GthreeProgramBinaryCache *cache,
+                                  const char               *key,
+                                  guint                     gl_program)
+{
+  g_autofree char *filename = get_filename (key);
+  g_autofree char *path = NULL;
+  g_autofree char *contents = NULL;
+  BinaryHeader header;
+  gsize len;
+  GLint status;
+
+  if (!gthree_program_binary_cache_is_supported (cache))
+    return FALSE;
+
+  ensure_entries (cache);
+
+  path = g_build_filename (cache->directory, filename, NULL);
+  if (!g_file_get_contents (path, &contents, &len, NULL))
+    return FALSE;
+
+  if (len <= sizeof (header))
+    {
+      remove_entry (cache, filename);
+      return FALSE;
+    }
+
+  memcpy (&header, contents, sizeof (header));
+  if (memcmp (header.magic, BINARY_CACHE_MAGIC, sizeof (header.magic)) != 0 ||
+      header.version != BINARY_CACHE_VERSION ||
+      !is_supported_format (cache, header.format))
+    {
+      remove_entry (cache, filename);
+      return FALSE;
+    }
+
+  glProgramBinary (gl_program, header.format,
+                   contents + sizeof (header), len - sizeof (header));
+
+  /* Drivers may reject binaries at any time, e.g. after an update that
+   * didn't change the version strings. */
+  glGetProgramiv (gl_program, GL_LINK_STATUS, &status);
+  if (status == GL_FALSE)
+    {
+      g_debug ("Program binary %s rejected by the driver, recompiling", key);
+      remove_entry (cache, filename);
+      return FALSE;
+    }
+
+  touch_entry (cache, filename, len);
+
+  return TRUE;
+}
+
+/* Call before linking a program that will be stored */
+void
+gthree_program_binary_cache_prepare (GthreeProgramBinaryCache *cache,
+                                     guint                     gl_program)
+{
+  if (!gthree_program_binary_cache_is_supported (cache))
+    return;
+
+  glProgramParameteri (gl_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+void
+gthree_program_binary_cache_store (GthreeProgramBinaryCache *cache,
+                                   const char               *key,
+                                   guint                     gl_program)
+{
+  g_autofree char *filename = get_filename (key);
+  g_autofree char *path = NULL;
+  g_autofree char *contents = NULL;
+  g_autoptr(GError) error = NULL;
+  BinaryHeader header = { BINARY_CACHE_MAGIC };
+  GLint length = 0;
+  GLsizei written = 0;
+  GLenum format = 0;
+
+  if (!gthree_program_binary_cache_is_supported (cache) || cache->write_failed)
+    return;
+
+  glGetProgramiv (gl_program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0 || sizeof (header) + length > cache->max_size)
+    return;
+
+  ensure_entries (cache);
+
+  contents = g_malloc (sizeof (header) + length);
+  glGetProgramBinary (gl_program, length, &written, &format, contents + sizeof (header));
+  if (written <= 0)
+    return;
+
+  header.version = BINARY_CACHE_VERSION;
+  header.format = format;
+  memcpy (contents, &header, sizeof (header));
+
+  if (g_mkdir_with_parents (cache->directory, 0700) != 0)
+    {
+      g_warning ("Can't create program binary cache directory %s: %s",
+                 cache->directory, g_strerror (errno));
+      cache->write_failed = TRUE;
+      return;
+    }
+
+  /* Written atomically, so concurrent processes never see partial files */
+  path = g_build_filename (cache->directory, filename, NULL);
+  if (!g_file_set_contents (path, contents, sizeof (header) + written, &error))
+    {
+      g_warning ("Can't write program binary cache: %s", error->message);
+      cache->write_failed = TRUE;
+      return;
+    }
+
+  touch_entry (cache, filename, sizeof (header) + written);
+  evict (cache);
+}
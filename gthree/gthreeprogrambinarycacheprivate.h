@@ -0,0 +1,44 @@
+#ifndef __GTHREE_PROGRAM_BINARY_CACHE_H__
+#define __GTHREE_PROGRAM_BINARY_CACHE_H__
+
+#if !defined (__GTHREE_H_INSIDE__) && !defined (GTHREE_COMPILATION)
+#error "Only <gthree/gthree.h> can be included directly."
+#endif
+
+#include <gthree/gthreeprogram.h>
+
+G_BEGIN_DECLS
+
+/* A persistent cache of linked program binaries, shared between runs.
+ * Entries are keyed by the expanded shader source, the program parameters
+ * and the GL driver, so they are never used by a different driver. */
+typedef struct _GthreeProgramBinaryCache GthreeProgramBinaryCache;
+
+GthreeProgramBinaryCache *gthree_program_binary_cache_new          (const char               *directory,
+                                                                    guint64                   max_size);
+void                      gthree_program_binary_cache_free         (GthreeProgramBinaryCache *cache);
+const char *              gthree_program_binary_cache_get_directory (GthreeProgramBinaryCache *cache);
+void                      gthree_program_binary_cache_set_max_size (GthreeProgramBinaryCache *cache,
+                                                                    guint64                   max_size);
+
+/* These need the GL context of the program to be current */
+gboolean                  gthree_program_binary_cache_is_supported (GthreeProgramBinaryCache *cache);
+char *                    gthree_program_binary_cache_get_key      (GthreeProgramBinaryCache *cache,
+                                                                    const char               *vertex,
+                                                                    const char               *fragment,
+                                                                    GthreeProgramParameters  *parameters);
+gboolean                  gthree_program_binary_cache_load         (GthreeProgramBinaryCache *cache,
+                                                                    const char               *key,
+                                                                    guint                     gl_program);
+void                      gthree_program_binary_cache_prepare      (GthreeProgramBinaryCache *cache,
+                                                                    guint                     gl_program);
+void                      gthree_program_binary_cache_store        (GthreeProgramBinaryCache *cache,
+                                                                    const char               *key,
+                                                                    guint                     gl_program);
+
+/* NULL unless enabled with gthree_renderer_set_program_binary_cache_dir() */
+GthreeProgramBinaryCache *gthree_renderer_get_program_binary_cache (GthreeRenderer           *renderer);
+
+G_END_DECLS
+
+#endif /* __GTHREE_PROGRAM_BINARY_CACHE_H__ */
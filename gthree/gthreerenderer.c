@@ -5,19 +5,28 @@
 #include "gthreeobjectprivate.h"
 #include "gthreemesh.h"
 #include "gthreeskinnedmesh.h"
+#include "gthreeinstancedmesh.h"
+#include "gthreestaticbatchprivate.h"
+#include "gthreeprogrambinarycacheprivate.h"
 #include "gthreelinesegments.h"
 #include "gthreeshader.h"
 #include "gthreematerial.h"
 #include "gthreeprivate.h"
+#include "gthreetraceprivate.h"
 #include "gthreeobjectprivate.h"
 #include "gthreecubetexture.h"
 #include "gthreeshadermaterial.h"
 #include "gthreemeshdepthmaterial.h"
 #include "gthreemeshdistancematerial.h"
 #include "gthreemeshmaterial.h"
+#include "gthreemeshtoonmaterial.h"
+#include "gthreemeshphongmaterial.h"
+#include "gthreemeshspecglosmaterial.h"
+#include "gthreemeshstandardmaterial.h"
 #include "gthreelinebasicmaterial.h"
 #include "gthreeprimitives.h"
 #include "gthreegroup.h"
+#include "gthreelod.h"
 #include "gthreeattribute.h"
 #include "gthreesprite.h"
 #include "gthreepoints.h"
@@ -40,8 +49,37 @@ typedef struct {
   GthreeMaterial *material;
   GthreeGeometryGroup *group;
   float z;
+  guint64 sort_key; /* Computed by gthree_render_list_sort() */
+  guint depth_prepassed : 1; /* Depth already written by the pre-pass */
 } GthreeRenderListItem;
 
+typedef struct {
+  guint64 key;
+  int index;
+} GthreeRenderListSortEntry;
+
+/* Occlusion state of an object, kept across frames */
+typedef struct {
+  GthreeRenderer *renderer;
+  GthreeObject *object; /* Weak reference */
+  GthreeCamera *camera; /* Only compared, results are per camera */
+  guint query;
+  guint32 last_used_frame;
+  guint occluded_count; /* Consecutive results with no samples passed */
+  graphene_box_t box; /* World space bounds to query this frame */
+  guint pending : 1;
+  guint visible : 1;
+} GthreeOcclusionQuery;
+
+/* A renderable object in the retained tree, with its cached culling state */
+typedef struct {
+  GthreeObject *object;
+  guint32 transform_stamp;
+  guint32 bounds_stamp;
+  gboolean in_frustum;
+  float z;
+} GthreeRetainedObject;
+
 struct _GthreeRenderList {
   float current_z;
   gboolean use_background;
@@ -49,6 +87,10 @@ struct _GthreeRenderList {
   GArray *opaque;
   GArray *transparent;
   GArray *background;
+
+  /* Scratch space for the radix sort, kept to avoid per-frame allocations */
+  GArray *sort_entries;
+  GArray *sort_entries_tmp;
 };
 
 typedef struct {
@@ -66,6 +108,7 @@ typedef struct {
   graphene_vec3_t clear_color;
   float clear_alpha;
   gboolean sort_objects;
+  GthreeSortMode opaque_sort_mode;
   float gamma_factor;
   gboolean physically_correct_lights;
   gboolean shadowmap_enabled;
@@ -74,6 +117,9 @@ typedef struct {
   GthreeShadowMapType shadowmap_type;
   GPtrArray *shadowmap_depth_materials;
   GPtrArray *shadowmap_distance_materials;
+  gboolean depth_prepass;
+  gboolean async_compile;
+  GthreeMaterial *depth_prepass_materials[12]; /* By side and morph/skinning variant */
 
   gboolean local_clipping_enabled;
   GArray *clipping_planes;
@@ -82,6 +128,15 @@ typedef struct {
 
   /* Render state */
   GthreeProgramCache *program_cache;
+  guint program_cache_max_unused_frames;
+  guint program_cache_max_programs;
+  /* The program cache ages by displayed frames, which may each have
+   * several renders (e.g. to render targets first) */
+  guint32 program_cache_frame;
+  guint explicit_frames : 1; /* gthree_renderer_begin_frame() is used */
+  guint frame_pending : 1;
+  GthreeProgramBinaryCache *program_binary_cache;
+  guint64 program_binary_cache_max_size;
 
   graphene_frustum_t frustum;
   graphene_matrix_t proj_screen_matrix;
@@ -98,6 +153,7 @@ typedef struct {
   gboolean old_double_sided;
   gboolean old_depth_test;
   gboolean old_depth_write;
+  int old_depth_func;
   float old_line_width;
   gboolean old_polygon_offset;
   float old_polygon_offset_factor;
@@ -121,17 +177,54 @@ typedef struct {
   guint num_clipping_intersections;
   guint old_local_clipping_enabled;
   gboolean rendering_shadows;
+  gboolean in_shadow_pass; /* Set for all of render_shadow_map(), unlike rendering_shadows */
 
   GthreeGeometry *current_geometry_program_geometry;
   GthreeProgram *current_geometry_program_program;
   gboolean current_geometry_program_wireframe;
+  GthreeInstancedMesh *current_geometry_program_instances;
 
   GthreeRenderList *current_render_list;
 
-  guint8 new_attributes[8];
-  guint8 enabled_attributes[8];
+  /* Retained mode: flattened renderables and lights of the last rendered
+     scene, rebuilt only when the tree stamp of the scene changes */
+  gboolean retained_mode;
+  GthreeObject *retained_scene; /* weak pointer */
+  guint32 retained_tree_stamp;
+  guint32 retained_layer_mask;
+  gboolean retained_sort_objects;
+  graphene_matrix_t retained_proj_screen_matrix;
+  GArray *retained_objects;
+  GPtrArray *retained_lights;
+  GPtrArray *retained_lods;
+
+  /* Occlusion culling: GthreeObject -> GthreeOcclusionQuery, and the
+     ones that get a new query issued after the opaque pass */
+  gboolean occlusion_culling;
+  guint occlusion_query_target;
+  GHashTable *occlusion_queries;
+  GPtrArray *occlusion_queue;
+  guint occlusion_program;
+  int occlusion_box_matrix_location;
+  guint occlusion_vao;
+  guint occlusion_buffers[2];
+
+  /* Software occlusion culling: the occluder meshes of the last rendered
+     scene, rasterized on the cpu while the scene is projected */
+  gboolean software_occlusion_culling;
+  GthreeOcclusionBuffer *occlusion_buffer;
+  GthreeObject *occluder_scene; /* weak pointer */
+  guint32 occluder_tree_stamp;
+  GPtrArray *occluders;
+
+  guint8 new_attributes[16];
+  guint8 enabled_attributes[16];
+  guint8 attribute_divisors[16];
 
   float morph_influences[8];
+  /* The morph attributes of the current draw, not owned */
+  GthreeAttribute *morph_targets[8];
+  GthreeAttribute *morph_normals[8];
 
   int max_textures;
   int max_vertex_textures;
@@ -141,9 +234,22 @@ typedef struct {
 
   gboolean supports_vertex_textures;
   gboolean supports_bone_textures;
+  gboolean supports_uniform_blocks;
+  gboolean supports_parallel_compile;
+  gboolean supports_instancing;
+  gboolean warned_no_instancing;
+
+  /* Shared std140 buffers for camera and light data, indexed by GthreeUniformBlock */
+  guint uniform_buffers[GTHREE_UNIFORM_BLOCK_LAST];
+  gsize uniform_buffer_sizes[GTHREE_UNIFORM_BLOCK_LAST];
+  GByteArray *uniform_block_data;
 
   guint vertex_array_object;
 
+  /* Cached vertex array objects, GthreeVertexArrayKey -> GthreeVertexArray */
+  GHashTable *vertex_arrays;
+  guint32 frame_count;
+
   /* Background */
   GthreeMesh *bg_box_mesh;
   GthreeMesh *bg_plane_mesh;
@@ -155,9 +261,130 @@ typedef struct {
   GPtrArray *realized_resources;
   GArray *lazy_deletes;
 
+  /* Statistics */
+  gboolean info_auto_reset;
+  guint64 info_renders;
+  GthreeRenderStats frame_stats;
+  GthreeRenderStats total_stats; /* Not including frame_stats */
+
+  /* Gpu timing */
+  gboolean supports_timer_queries;
+  gboolean gpu_timing;
+  gboolean gpu_timing_active; /* Only changes between frames */
+  GArray *gpu_timers;         /* GthreeGpuTimer, of the current frame */
+  GArray *gpu_timer_stack;    /* guint index into gpu_timers */
+  GPtrArray *gpu_timer_frames; /* GArray of GthreeGpuTimer, waiting for results */
+  GArray *gpu_free_queries;
+  GArray *gpu_timings;        /* GthreeGpuTiming, of the last measured frame */
+
 } GthreeRendererPrivate;
 
+typedef struct {
+  guint geometry_id;
+  guint program_id;
+  guint instances_id; /* 0 if not instanced */
+  guint wireframe : 1;
+  guint instance_color : 1;
+} GthreeVertexArrayKey;
+
+typedef struct {
+  GQuark name;
+  int location;
+} GthreeDefaultAttribute;
+
+typedef struct {
+  GthreeVertexArrayKey key;
+  guint vao;
+  guint32 attributes_version;
+  guint32 last_used_frame;
+  GArray *default_attributes; /* GthreeDefaultAttribute */
+} GthreeVertexArray;
+
+/* Vertex arrays unused for this many frames are deleted */
+#define VERTEX_ARRAY_MAX_AGE 120
+
+/* Occlusion queries of objects not drawn for this many frames are deleted */
+#define OCCLUSION_QUERY_MAX_AGE 120
+
+/* Objects are only hidden after this many consecutive occluded
+ * query results, and shown again on the first visible one */
+#define OCCLUSION_HIDE_FRAMES 3
+
+/* Size of the cpu depth buffer used for software occlusion culling */
+#define SOFTWARE_OCCLUSION_WIDTH 256
+#define SOFTWARE_OCCLUSION_HEIGHT 128
+
+/* Frames of gpu timer queries waiting for their results. If the gpu
+ * is further behind than this, new frames are not measured */
+#define GPU_TIMER_MAX_PENDING_FRAMES 4
+
+#define DEFAULT_PROGRAM_BINARY_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+/* Programs no material uses are deleted after this many frames */
+#define DEFAULT_PROGRAM_CACHE_MAX_UNUSED_FRAMES 600
+
+typedef struct {
+  const char *name; /* Interned */
+  int depth;
+  guint begin_query;
+  guint end_query;
+} GthreeGpuTimer;
+
+/* These must match the light structs in lights_pars_begin.glsl */
+static GthreeUniformBlockMember directional_light_members[] = {
+  { "direction", GTHREE_UNIFORM_TYPE_VECTOR3 },
+  { "color", GTHREE_UNIFORM_TYPE_VECTOR3 },
+  { "shadow", GTHREE_UNIFORM_TYPE_INT },
+  { "shadowBias", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "shadowRadius", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "shadowMapSize", GTHREE_UNIFORM_TYPE_VECTOR2 },
+};
+
+static GthreeUniformBlockMember point_light_members[] = {
+  { "position", GTHREE_UNIFORM_TYPE_VECTOR3 },
+  { "color", GTHREE_UNIFORM_TYPE_VECTOR3 },
+  { "distance", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "decay", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "shadow", GTHREE_UNIFORM_TYPE_INT },
+  { "shadowBias", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "shadowRadius", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "shadowMapSize", GTHREE_UNIFORM_TYPE_VECTOR2 },
+  { "shadowCameraNear", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "shadowCameraFar", GTHREE_UNIFORM_TYPE_FLOAT },
+};
+
+static GthreeUniformBlockMember spot_light_members[] = {
+  { "position", GTHREE_UNIFORM_TYPE_VECTOR3 },
+  { "direction", GTHREE_UNIFORM_TYPE_VECTOR3 },
+  { "color", GTHREE_UNIFORM_TYPE_VECTOR3 },
+  { "distance", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "decay", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "coneCos", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "penumbraCos", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "shadow", GTHREE_UNIFORM_TYPE_INT },
+  { "shadowBias", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "shadowRadius", GTHREE_UNIFORM_TYPE_FLOAT },
+  { "shadowMapSize", GTHREE_UNIFORM_TYPE_VECTOR2 },
+};
+
+static GthreeUniformBlockMember hemisphere_light_members[] = {
+  { "direction", GTHREE_UNIFORM_TYPE_VECTOR3 },
+  { "skyColor", GTHREE_UNIFORM_TYPE_VECTOR3 },
+  { "groundColor", GTHREE_UNIFORM_TYPE_VECTOR3 },
+};
+
 static void gthree_set_default_gl_state (GthreeRenderer *renderer);
+static void retained_clear (GthreeRenderer *renderer);
+static void vertex_arrays_clear (GthreeRenderer *renderer);
+static guint vertex_array_key_hash (gconstpointer data);
+static gboolean vertex_array_key_equal (gconstpointer a,
+                                        gconstpointer b);
+static void vertex_array_free (GthreeVertexArray *vertex_array);
+static void occlusion_query_free (GthreeOcclusionQuery *query);
+static void occlusion_resources_clear (GthreeRenderer *renderer);
+static void occluders_clear (GthreeRenderer *renderer);
+static void gpu_timers_end_frame (GthreeRenderer *renderer);
+static void gpu_timers_clear (GthreeRenderer *renderer);
 
 static GQuark q_position;
 static GQuark q_color;
@@ -179,6 +406,10 @@ static GQuark q_spotLights;
 static GQuark q_bindMatrix;
 static GQuark q_bindMatrixInverse;
 static GQuark q_boneMatrices;
+static GQuark q_instanceMatrix;
+static GQuark q_instanceColor;
+static GQuark q_morphTarget[8];
+static GQuark q_morphNormal[8];
 
 static GArray *free_resource_ids;
 static guint32 next_unused_resource_id = 0;
@@ -300,6 +531,8 @@ gthree_renderer_init (GthreeRenderer *renderer)
 #endif
 
   priv->program_cache = gthree_program_cache_new ();
+  priv->program_cache_max_unused_frames = DEFAULT_PROGRAM_CACHE_MAX_UNUSED_FRAMES;
+  priv->program_binary_cache_max_size = DEFAULT_PROGRAM_BINARY_CACHE_MAX_SIZE;
 
   priv->auto_clear = TRUE;
   priv->auto_clear_color = TRUE;
@@ -307,6 +540,7 @@ gthree_renderer_init (GthreeRenderer *renderer)
   priv->auto_clear_stencil = TRUE;
   priv->clear_alpha = 1.0;
   priv->sort_objects = TRUE;
+  priv->opaque_sort_mode = GTHREE_SORT_MODE_STATE_FIRST;
   priv->width = 1;
   priv->height = 1;
   priv->pixel_ratio = 1;
@@ -316,6 +550,7 @@ gthree_renderer_init (GthreeRenderer *renderer)
   priv->shadowmap_enabled = FALSE;
   priv->shadowmap_auto_update = TRUE;
   priv->shadowmap_needs_update = FALSE;
+  priv->info_auto_reset = TRUE;
 
   priv->clipping_planes = g_array_new (FALSE, FALSE, sizeof (graphene_plane_t));
   priv->clipping_state = g_array_new (FALSE, FALSE, sizeof (float));
@@ -336,19 +571,43 @@ gthree_renderer_init (GthreeRenderer *renderer)
   priv->light_setup.hemi = g_ptr_array_new ();
 
   priv->current_render_list = gthree_render_list_new ();
+  priv->retained_objects = g_array_new (FALSE, FALSE, sizeof (GthreeRetainedObject));
+  priv->retained_lights = g_ptr_array_new ();
+  priv->retained_lods = g_ptr_array_new ();
 
   priv->old_blending = -1;
   priv->old_blend_equation = -1;
   priv->old_blend_src = -1;
   priv->old_blend_dst = -1;
   priv->old_depth_write = -1;
+  priv->old_depth_func = GL_LEQUAL;
   priv->old_depth_test = -1;
 
   gthree_set_default_gl_state (renderer);
 
-  /* We only use one vao, so bind it here */
+  /* This vao is bound when not rendering objects, which use cached
+   * per geometry and program vaos */
   glGenVertexArrays (1, &priv->vertex_array_object);
   glBindVertexArray (priv->vertex_array_object);
+  priv->vertex_arrays = g_hash_table_new_full (vertex_array_key_hash, vertex_array_key_equal,
+                                               NULL, (GDestroyNotify)vertex_array_free);
+
+  priv->gpu_timers = g_array_new (FALSE, FALSE, sizeof (GthreeGpuTimer));
+  priv->gpu_timer_stack = g_array_new (FALSE, FALSE, sizeof (guint));
+  priv->gpu_timer_frames = g_ptr_array_new_with_free_func ((GDestroyNotify)g_array_unref);
+  priv->gpu_free_queries = g_array_new (FALSE, FALSE, sizeof (guint));
+  priv->gpu_timings = g_array_new (FALSE, FALSE, sizeof (GthreeGpuTiming));
+  /* Timestamps rather than elapsed time queries, as those can't nest */
+  priv->supports_timer_queries = epoxy_gl_version () >= 33 || epoxy_has_gl_extension ("GL_ARB_timer_query");
+
+  priv->occlusion_queries = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)occlusion_query_free);
+  priv->occlusion_queue = g_ptr_array_new ();
+  priv->occluders = g_ptr_array_new ();
+  /* Any-samples queries let the driver stop counting early */
+  if (epoxy_gl_version () >= 33 || epoxy_has_gl_extension ("GL_ARB_occlusion_query2"))
+    priv->occlusion_query_target = GL_ANY_SAMPLES_PASSED;
+  else
+    priv->occlusion_query_target = GL_SAMPLES_PASSED;
 
   // GPU capabilities
   glGetIntegerv (GL_MAX_TEXTURE_IMAGE_UNITS, &priv->max_textures);
@@ -365,6 +624,32 @@ gthree_renderer_init (GthreeRenderer *renderer)
     priv->supports_vertex_textures &&
     epoxy_has_gl_extension("GL_ARB_texture_float");
 
+  /* Instance divisors are core in 3.3, instanced draws in 3.1 */
+  priv->supports_instancing =
+    epoxy_gl_version () >= 33 ||
+    (epoxy_has_gl_extension ("GL_ARB_instanced_arrays") &&
+     (epoxy_gl_version () >= 31 || epoxy_has_gl_extension ("GL_ARB_draw_instanced")));
+
+  /* The shaders are #version 130, so blocks need the extension even on newer GL */
+  priv->supports_uniform_blocks = epoxy_has_gl_extension ("GL_ARB_uniform_buffer_object");
+  if (priv->supports_uniform_blocks)
+    {
+      glGenBuffers (GTHREE_UNIFORM_BLOCK_LAST, priv->uniform_buffers);
+      priv->uniform_block_data = g_byte_array_new ();
+    }
+
+  /* Let the driver compile and link on its own threads */
+  if (epoxy_has_gl_extension ("GL_KHR_parallel_shader_compile"))
+    {
+      glMaxShaderCompilerThreadsKHR (0xffffffff);
+      priv->supports_parallel_compile = TRUE;
+    }
+  else if (epoxy_has_gl_extension ("GL_ARB_parallel_shader_compile"))
+    {
+      glMaxShaderCompilerThreadsARB (0xffffffff);
+      priv->supports_parallel_compile = TRUE;
+    }
+
   //priv->compressed_texture_formats = _glExtensionCompressedTextureS3TC ? glGetParameter( _gl.COMPRESSED_TEXTURE_FORMATS ) : [];
 
   gthree_renderer_pop_current (renderer);
@@ -390,6 +675,7 @@ gthree_renderer_finalize (GObject *obj)
 {
   GthreeRenderer *renderer = GTHREE_RENDERER (obj);
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint i;
 
   g_assert (priv->realized_resources->len == 0);
 
@@ -402,8 +688,11 @@ gthree_renderer_finalize (GObject *obj)
     g_ptr_array_unref (priv->shadowmap_depth_materials);
   if (priv->shadowmap_distance_materials)
     g_ptr_array_unref (priv->shadowmap_distance_materials);
+  for (i = 0; i < G_N_ELEMENTS (priv->depth_prepass_materials); i++)
+    g_clear_object (&priv->depth_prepass_materials[i]);
 
   gthree_program_cache_free (priv->program_cache);
+  g_clear_pointer (&priv->program_binary_cache, gthree_program_binary_cache_free);
 
   g_array_free (priv->clipping_planes, TRUE);
   g_array_free (priv->clipping_state, TRUE);
@@ -424,10 +713,40 @@ gthree_renderer_finalize (GObject *obj)
 
   gthree_render_list_free (priv->current_render_list);
 
+  retained_clear (renderer);
+  g_array_unref (priv->retained_objects);
+  g_ptr_array_unref (priv->retained_lights);
+  g_ptr_array_unref (priv->retained_lods);
+
   g_clear_object (&priv->bg_box_mesh);
   g_clear_object (&priv->bg_plane_mesh);
   g_clear_object (&priv->current_bg_texture);
 
+  vertex_arrays_clear (renderer);
+  g_hash_table_unref (priv->vertex_arrays);
+
+  g_hash_table_unref (priv->occlusion_queries);
+  g_ptr_array_unref (priv->occlusion_queue);
+  occlusion_resources_clear (renderer);
+
+  occluders_clear (renderer);
+  g_ptr_array_unref (priv->occluders);
+  if (priv->occlusion_buffer)
+    gthree_occlusion_buffer_free (priv->occlusion_buffer);
+
+  gpu_timers_clear (renderer);
+  g_array_unref (priv->gpu_timers);
+  g_array_unref (priv->gpu_timer_stack);
+  g_ptr_array_unref (priv->gpu_timer_frames);
+  g_array_unref (priv->gpu_free_queries);
+  g_array_unref (priv->gpu_timings);
+
+  if (priv->supports_uniform_blocks)
+    {
+      glDeleteBuffers (GTHREE_UNIFORM_BLOCK_LAST, priv->uniform_buffers);
+      g_byte_array_unref (priv->uniform_block_data);
+    }
+
   if (priv->lazy_deletes)
     g_array_unref (priv->lazy_deletes);
 
@@ -465,6 +784,25 @@ gthree_renderer_class_init (GthreeRendererClass *klass)
   INIT_QUARK(bindMatrix);
   INIT_QUARK(bindMatrixInverse);
   INIT_QUARK(boneMatrices);
+  INIT_QUARK(instanceMatrix);
+  INIT_QUARK(instanceColor);
+
+  for (guint i = 0; i < G_N_ELEMENTS (q_morphTarget); i++)
+    {
+      g_autofree char *target = g_strdup_printf ("morphTarget%d", i);
+      g_autofree char *normal = g_strdup_printf ("morphNormal%d", i);
+
+      q_morphTarget[i] = g_quark_from_string (target);
+      q_morphNormal[i] = g_quark_from_string (normal);
+    }
+
+#define INIT_MEMBER_QUARKS(members) \
+  for (guint i = 0; i < G_N_ELEMENTS (members); i++) \
+    members[i].qname = g_quark_from_static_string (members[i].name)
+  INIT_MEMBER_QUARKS(directional_light_members);
+  INIT_MEMBER_QUARKS(point_light_members);
+  INIT_MEMBER_QUARKS(spot_light_members);
+  INIT_MEMBER_QUARKS(hemisphere_light_members);
 
   graphene_vec3_init (&cube_directions[0],  1,  0,  0);
   graphene_vec3_init (&cube_directions[1], -1,  0,  0);
@@ -513,6 +851,90 @@ gthree_renderer_mark_unrealized (GthreeRenderer *renderer,
   /* TEST */ g_assert (!g_ptr_array_find (priv->realized_resources, resource, NULL));
 }
 
+void
+gthree_renderer_count_uniform_upload (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->frame_stats.uniform_uploads++;
+}
+
+void
+gthree_renderer_count_buffer_upload (GthreeRenderer *renderer,
+                                     gsize           bytes)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->frame_stats.buffer_upload_bytes += bytes;
+}
+
+void
+gthree_renderer_count_texture_upload (GthreeRenderer *renderer,
+                                      gsize           bytes)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->frame_stats.texture_upload_bytes += bytes;
+}
+
+static void
+count_draw (GthreeRenderer *renderer,
+            int             draw_mode,
+            int             count,
+            int             n_instances)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeRenderStats *stats = &priv->frame_stats;
+
+  stats->draw_calls++;
+
+  switch (draw_mode)
+    {
+    case GL_TRIANGLES:
+      stats->triangles += (guint64)(count / 3) * n_instances;
+      break;
+    case GL_TRIANGLE_STRIP:
+    case GL_TRIANGLE_FAN:
+      stats->triangles += (guint64)MAX (count - 2, 0) * n_instances;
+      break;
+    case GL_LINES:
+      stats->lines += (guint64)(count / 2) * n_instances;
+      break;
+    case GL_LINE_STRIP:
+      stats->lines += (guint64)MAX (count - 1, 0) * n_instances;
+      break;
+    case GL_LINE_LOOP:
+      stats->lines += (guint64)count * n_instances;
+      break;
+    case GL_POINTS:
+      stats->points += (guint64)count * n_instances;
+      break;
+    default:
+      break;
+    }
+}
+
+static void
+render_stats_add (GthreeRenderStats       *stats,
+                  const GthreeRenderStats *other)
+{
+  stats->draw_calls += other->draw_calls;
+  stats->triangles += other->triangles;
+  stats->lines += other->lines;
+  stats->points += other->points;
+  stats->program_switches += other->program_switches;
+  stats->material_refreshes += other->material_refreshes;
+  stats->uniform_uploads += other->uniform_uploads;
+  stats->buffer_upload_bytes += other->buffer_upload_bytes;
+  stats->texture_upload_bytes += other->texture_upload_bytes;
+  stats->shadow_map_renders += other->shadow_map_renders;
+  stats->objects_drawn += other->objects_drawn;
+  stats->objects_culled += other->objects_culled;
+  stats->occlusion_queries += other->occlusion_queries;
+  stats->programs_evicted += other->programs_evicted;
+  stats->program_bytes_evicted += other->program_bytes_evicted;
+}
+
 static void
 do_delete (GthreeResourceKind kind,
            guint id)
@@ -531,6 +953,9 @@ do_delete (GthreeResourceKind kind,
     case GTHREE_RESOURCE_KIND_RENDERBUFFER:
       glDeleteRenderbuffers (1, &id);
       break;
+    case GTHREE_RESOURCE_KIND_QUERY:
+      glDeleteQueries (1, &id);
+      break;
     }
 }
 
@@ -593,6 +1018,14 @@ gthree_renderer_unrealize (GthreeRenderer *renderer)
       /* TEST */ g_assert (!g_ptr_array_find (priv->realized_resources, resource, NULL));
     }
 
+  /* The cached vertex arrays reference the now deleted buffers */
+  vertex_arrays_clear (renderer);
+
+  g_hash_table_remove_all (priv->occlusion_queries);
+  occlusion_resources_clear (renderer);
+
+  gpu_timers_clear (renderer);
+
   gthree_renderer_flush_deletes (renderer);
 
   /* TODO: Move pure render unrealize here from finalize */
@@ -835,212 +1268,564 @@ gthree_renderer_get_gamma_factor (GthreeRenderer *renderer)
   return priv->gamma_factor;
 }
 
-gboolean
-gthree_renderer_get_shadow_map_enabled (GthreeRenderer     *renderer)
+/* State-first (the default) groups opaque objects by program, material
+ * and geometry to minimize state changes, and only sorts front-to-back
+ * within such a group. Depth-first sorts front-to-back to maximize early
+ * depth rejection, which may be better for scenes with heavy fragment
+ * shaders and a lot of overdraw. Transparent objects are always sorted
+ * back-to-front. */
+void
+gthree_renderer_set_opaque_sort_mode (GthreeRenderer *renderer,
+                                      GthreeSortMode  mode)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  return priv->shadowmap_enabled;
+  priv->opaque_sort_mode = mode;
+}
+
+GthreeSortMode
+gthree_renderer_get_opaque_sort_mode (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->opaque_sort_mode;
 }
 
+/* In retained mode the renderer keeps a flattened list of the
+ * renderable objects of the last rendered scene, and only walks the
+ * scene graph again when objects are added, removed, hidden or change
+ * layers. Objects are only re-culled when the camera or their world
+ * transform changes. This is a large win for big, mostly static
+ * scenes. */
 void
-gthree_renderer_set_shadow_map_enabled (GthreeRenderer     *renderer,
-                                        gboolean            enabled)
+gthree_renderer_set_retained_mode (GthreeRenderer *renderer,
+                                   gboolean        retained)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  priv->shadowmap_enabled = enabled;
+  retained = !!retained;
+  if (priv->retained_mode == retained)
+    return;
+
+  priv->retained_mode = retained;
+  retained_clear (renderer);
 }
 
 gboolean
-gthree_renderer_get_shadow_map_auto_update (GthreeRenderer     *renderer)
+gthree_renderer_get_retained_mode (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  return priv->shadowmap_auto_update;
+  return priv->retained_mode;
 }
 
+/* With occlusion culling the bounding boxes of the meshes that pass
+ * frustum culling are drawn against the depth buffer after the opaque
+ * pass, each inside an occlusion query. Meshes whose earlier queries
+ * found them fully hidden are skipped. The results are read back a
+ * frame later without waiting, so this never stalls, but a mesh that
+ * comes into view may show up a frame late. Results are tracked for
+ * one camera at a time, and shadow maps are not affected, as occluded
+ * objects can still cast visible shadows. */
 void
-gthree_renderer_set_shadow_map_auto_update (GthreeRenderer     *renderer,
-                                            gboolean            auto_update)
+gthree_renderer_set_occlusion_culling (GthreeRenderer *renderer,
+                                       gboolean        occlusion_culling)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  priv->shadowmap_auto_update = auto_update;
+  occlusion_culling = !!occlusion_culling;
+  if (priv->occlusion_culling == occlusion_culling)
+    return;
+
+  priv->occlusion_culling = occlusion_culling;
+  g_hash_table_remove_all (priv->occlusion_queries);
 }
 
 gboolean
-gthree_renderer_get_shadow_map_needs_update (GthreeRenderer     *renderer)
+gthree_renderer_get_occlusion_culling (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  return priv->shadowmap_needs_update;
+  return priv->occlusion_culling;
 }
 
+/* With software occlusion culling the meshes marked with
+ * gthree_object_set_is_occluder() are rasterized into a small depth
+ * buffer on the cpu, on worker threads while the scene is projected.
+ * Meshes whose bounding boxes are entirely behind it are then dropped
+ * from the render list. Unlike gthree_renderer_set_occlusion_culling()
+ * this needs no gpu readback and has no frame of latency, but only
+ * the designated occluders can hide anything. Shadow maps are not
+ * affected. */
 void
-gthree_renderer_set_shadow_map_needs_update (GthreeRenderer     *renderer,
-                                             gboolean            needs_update)
+gthree_renderer_set_software_occlusion_culling (GthreeRenderer *renderer,
+                                                gboolean        software_occlusion_culling)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  priv->shadowmap_needs_update = needs_update;
+  software_occlusion_culling = !!software_occlusion_culling;
+  if (priv->software_occlusion_culling == software_occlusion_culling)
+    return;
+
+  priv->software_occlusion_culling = software_occlusion_culling;
+  if (!software_occlusion_culling)
+    {
+      occluders_clear (renderer);
+      g_clear_pointer (&priv->occlusion_buffer, gthree_occlusion_buffer_free);
+    }
 }
 
-void
-gthree_renderer_set_local_clipping_enabled (GthreeRenderer     *renderer,
-                                            gboolean            enabled)
+gboolean
+gthree_renderer_get_software_occlusion_culling (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->software_occlusion_culling;
+}
 
-  priv->local_clipping_enabled = enabled;
+/* With a depth pre-pass the opaque meshes with expensive materials
+ * are first drawn depth only, and then shaded with an equal depth
+ * test, so each pixel is only shaded once. This costs an extra
+ * vertex pass, so it only helps when fragment shading dominates,
+ * which is assumed for the per-pixel lit materials. Materials can
+ * opt out with gthree_material_set_depth_prepass(). */
+void
+gthree_renderer_set_depth_prepass (GthreeRenderer *renderer,
+                                   gboolean        depth_prepass)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  priv->depth_prepass = !!depth_prepass;
 }
 
 gboolean
-gthree_renderer_get_local_clipping_enabled (GthreeRenderer     *renderer)
+gthree_renderer_get_depth_prepass (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  return priv->local_clipping_enabled;
+  return priv->depth_prepass;
 }
 
-int
-gthree_renderer_get_n_clipping_planes (GthreeRenderer *renderer)
+/* Programs are compiled the first time a material is drawn. Where the
+ * driver supports parallel shader compilation this happens in the
+ * background, and with async compile the objects using a program that
+ * isn't ready yet are skipped instead of waiting for it. Combine with
+ * gthree_renderer_compile() to prepare new objects before they show. */
+void
+gthree_renderer_set_async_compile (GthreeRenderer *renderer,
+                                   gboolean        async_compile)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  return priv->clipping_planes->len;
+  priv->async_compile = !!async_compile;
 }
 
-GArray *
-gthree_renderer_get_clipping_planes (GthreeRenderer     *renderer)
+gboolean
+gthree_renderer_get_async_compile (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->async_compile;
+}
 
-  return priv->clipping_planes;
+gboolean
+gthree_renderer_get_supports_parallel_compile (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->supports_parallel_compile;
 }
 
+/* Linked programs can be stored on disk and loaded again by later
+ * runs, which avoids most of the shader compile time at startup. The
+ * binaries are specific to the driver, so use a per-machine directory,
+ * e.g. below g_get_user_cache_dir(). Pass NULL to disable, which is
+ * the default. */
 void
-gthree_renderer_set_clipping_planes (GthreeRenderer     *renderer,
-                                     GArray             *clipping_planes)
+gthree_renderer_set_program_binary_cache_dir (GthreeRenderer *renderer,
+                                              const char     *directory)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  if (clipping_planes)
-    g_array_ref (clipping_planes);
-  else
-    clipping_planes = g_array_new (FALSE, FALSE, sizeof (graphene_plane_t));
+  if (g_strcmp0 (directory, gthree_renderer_get_program_binary_cache_dir (renderer)) == 0)
+    return;
 
-  g_array_unref (priv->clipping_planes);
-  priv->clipping_planes = clipping_planes;
+  g_clear_pointer (&priv->program_binary_cache, gthree_program_binary_cache_free);
+  if (directory)
+    priv->program_binary_cache = gthree_program_binary_cache_new (directory,
+                                                                  priv->program_binary_cache_max_size);
 }
 
-const graphene_plane_t *
-gthree_renderer_get_clipping_plane (GthreeRenderer     *renderer,
-                                    int                 index)
+const char *
+gthree_renderer_get_program_binary_cache_dir (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  if (index < 0 || index >= priv->clipping_planes->len)
+  if (priv->program_binary_cache == NULL)
     return NULL;
 
-  return &g_array_index (priv->clipping_planes, graphene_plane_t, index);
+  return gthree_program_binary_cache_get_directory (priv->program_binary_cache);
 }
 
-int
-gthree_renderer_set_clipping_plane (GthreeRenderer     *renderer,
-                                    int                 index,
-                                    const graphene_plane_t *plane)
+/* When the binaries in the cache directory grow above this, the least
+ * recently used ones are removed */
+void
+gthree_renderer_set_program_binary_cache_max_size (GthreeRenderer *renderer,
+                                                   guint64         max_size)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  if (index < 0 || index >= priv->clipping_planes->len)
-    {
-      /* Out of bounds => append */
-      index = priv->clipping_planes->len;
-      if (plane != NULL)
-        g_array_append_val (priv->clipping_planes, *plane);
-    }
-  else if (plane != NULL)
-    g_array_index (priv->clipping_planes, graphene_plane_t, index) = *plane;
-  else
-    g_array_remove_index (priv->clipping_planes, index);
+  priv->program_binary_cache_max_size = max_size;
+  if (priv->program_binary_cache)
+    gthree_program_binary_cache_set_max_size (priv->program_binary_cache, max_size);
+}
 
-  return index;
+guint64
+gthree_renderer_get_program_binary_cache_max_size (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->program_binary_cache_max_size;
 }
 
+/* Programs that no material is set up for any more (e.g. because the
+ * number of lights changed) are deleted when they haven't been used
+ * for this many frames. 0 keeps them forever. */
 void
-gthree_renderer_remove_clipping_plane (GthreeRenderer *renderer,
-                                       int             index)
+gthree_renderer_set_program_cache_max_unused_frames (GthreeRenderer *renderer,
+                                                     guint           frames)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  if (index < 0 || index >= priv->clipping_planes->len)
-    return;
+  priv->program_cache_max_unused_frames = frames;
+}
 
-  g_array_remove_index (priv->clipping_planes, index);
+guint
+gthree_renderer_get_program_cache_max_unused_frames (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->program_cache_max_unused_frames;
 }
 
+/* Starts a new displayed frame. All the renders until the next call
+ * count as one frame for the program cache limits, so programs only
+ * used by an earlier render of the frame (e.g. to a render target)
+ * are not taken as unused. GthreeArea calls this for every frame of
+ * its frame clock. If it is never called, every render is a frame. */
 void
-gthree_renderer_remove_all_clipping_planes (GthreeRenderer *renderer)
+gthree_renderer_begin_frame (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  g_array_set_size (priv->clipping_planes, 0);
+  priv->explicit_frames = TRUE;
+  priv->frame_pending = TRUE;
 }
 
-GthreeRenderTarget *
-gthree_renderer_get_render_target (GthreeRenderer *renderer)
+/* Limits the number of linked programs. Above this the least recently
+ * used ones are deleted, even if materials still use them, and are
+ * recompiled if they are needed again. Programs used in the last frame
+ * are always kept. 0 (the default) means no limit. */
+void
+gthree_renderer_set_program_cache_max_programs (GthreeRenderer *renderer,
+                                                guint           max_programs)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  return priv->current_render_target;
+  priv->program_cache_max_programs = max_programs;
 }
 
+guint
+gthree_renderer_get_program_cache_max_programs (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->program_cache_max_programs;
+}
 
-static void
-update_multisample_render_target (GthreeRenderer *renderer,
-                                  GthreeRenderTarget *render_target)
+GthreeProgramBinaryCache *
+gthree_renderer_get_program_binary_cache (GthreeRenderer *renderer)
 {
-  // TODO
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->program_binary_cache;
 }
 
+/* By default the frame statistics are reset at the start of each
+ * gthree_renderer_render(). When a frame is made up of several
+ * renders (e.g. with an effect composer) disable this and call
+ * gthree_renderer_reset_info() at the start of the frame instead. */
 void
-gthree_renderer_set_render_target (GthreeRenderer *renderer,
-                                   GthreeRenderTarget *render_target,
-                                   int active_cube_target,
-                                   int active_mipmap_level)
+gthree_renderer_set_info_auto_reset (GthreeRenderer *renderer,
+                                     gboolean        auto_reset)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  gboolean is_cube;
-  int framebuffer;
-  int pixel_ratio;
+  priv->info_auto_reset = !!auto_reset;
+}
 
-  gthree_renderer_push_current (renderer);
+gboolean
+gthree_renderer_get_info_auto_reset (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->info_auto_reset;
+}
 
-  if (render_target)
-    g_object_ref (render_target);
+/* Moves the frame statistics into the totals */
+void
+gthree_renderer_reset_info (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  g_clear_object (&priv->current_render_target);
-  priv->current_render_target = render_target;
+  render_stats_add (&priv->total_stats, &priv->frame_stats);
+  memset (&priv->frame_stats, 0, sizeof (GthreeRenderStats));
 
-  if (render_target != NULL)
-    gthree_render_target_realize (render_target, renderer);
+  gpu_timers_end_frame (renderer);
+}
 
-  framebuffer = priv->window_framebuffer;
-  is_cube = FALSE;
+/* The memory numbers are estimates of the gl objects that are
+ * currently alive. Geometries are the ones that were drawn recently,
+ * and their bytes are those of all realized vertex and index
+ * buffers. The color and depth buffers of render targets are not
+ * counted as textures. */
+void
+gthree_renderer_get_info (GthreeRenderer     *renderer,
+                          GthreeRendererInfo *info)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  g_autoptr(GHashTable) geometries = g_hash_table_new (g_direct_hash, g_direct_equal);
+  GthreeVertexArrayKey *key;
+  GHashTableIter iter;
+  guint i;
 
-  if (render_target)
+  memset (info, 0, sizeof (GthreeRendererInfo));
+
+  info->frame = priv->frame_stats;
+  info->total = priv->total_stats;
+  render_stats_add (&info->total, &priv->frame_stats);
+  info->renders = priv->info_renders;
+
+  gthree_program_cache_get_usage (priv->program_cache, &info->programs, &info->program_bytes);
+
+  g_hash_table_iter_init (&iter, priv->vertex_arrays);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
+    g_hash_table_add (geometries, GUINT_TO_POINTER (key->geometry_id));
+  info->geometries = g_hash_table_size (geometries);
+
+  for (i = 0; i < priv->realized_resources->len; i++)
     {
-#ifdef TODO
-      if ( renderTarget.isWebGLRenderTargetCube )
+      GthreeResource *resource = g_ptr_array_index (priv->realized_resources, i);
+      gsize bytes = gthree_resource_get_gl_bytes (resource, renderer);
+
+      if (GTHREE_IS_ATTRIBUTE (resource))
         {
-          var __webglFramebuffer = properties.get( renderTarget ).__webglFramebuffer;
-          framebuffer = __webglFramebuffer[ activeCubeFace || 0 ];
-          isCube = true;
+          info->geometry_bytes += bytes;
         }
-      else if ( renderTarget.isWebGLMultisampleRenderTarget )
+      else if (GTHREE_IS_TEXTURE (resource))
         {
-          framebuffer = properties.get( renderTarget ).__webglMultisampledFramebuffer;
+          info->textures++;
+          info->texture_bytes += bytes;
+        }
+      else if (GTHREE_IS_RENDER_TARGET (resource))
+        {
+          info->render_targets++;
+          info->render_target_bytes += bytes;
+        }
+    }
+}
+
+gboolean
+gthree_renderer_get_shadow_map_enabled (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_enabled;
+}
+
+void
+gthree_renderer_set_shadow_map_enabled (GthreeRenderer     *renderer,
+                                        gboolean            enabled)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->shadowmap_enabled = enabled;
+}
+
+gboolean
+gthree_renderer_get_shadow_map_auto_update (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_auto_update;
+}
+
+void
+gthree_renderer_set_shadow_map_auto_update (GthreeRenderer     *renderer,
+                                            gboolean            auto_update)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->shadowmap_auto_update = auto_update;
+}
+
+gboolean
+gthree_renderer_get_shadow_map_needs_update (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_needs_update;
+}
+
+void
+gthree_renderer_set_shadow_map_needs_update (GthreeRenderer     *renderer,
+                                             gboolean            needs_update)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->shadowmap_needs_update = needs_update;
+}
+
+void
+gthree_renderer_set_local_clipping_enabled (GthreeRenderer     *renderer,
+                                            gboolean            enabled)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->local_clipping_enabled = enabled;
+}
+
+gboolean
+gthree_renderer_get_local_clipping_enabled (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->local_clipping_enabled;
+}
+
+int
+gthree_renderer_get_n_clipping_planes (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->clipping_planes->len;
+}
+
+GArray *
+gthree_renderer_get_clipping_planes (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->clipping_planes;
+}
+
+void
+gthree_renderer_set_clipping_planes (GthreeRenderer     *renderer,
+                                     GArray             *clipping_planes)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (clipping_planes)
+    g_array_ref (clipping_planes);
+  else
+    clipping_planes = g_array_new (FALSE, FALSE, sizeof (graphene_plane_t));
+
+  g_array_unref (priv->clipping_planes);
+  priv->clipping_planes = clipping_planes;
+}
+
+const graphene_plane_t *
+gthree_renderer_get_clipping_plane (GthreeRenderer     *renderer,
+                                    int                 index)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (index < 0 || index >= priv->clipping_planes->len)
+    return NULL;
+
+  return &g_array_index (priv->clipping_planes, graphene_plane_t, index);
+}
+
+int
+gthree_renderer_set_clipping_plane (GthreeRenderer     *renderer,
+                                    int                 index,
+                                    const graphene_plane_t *plane)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (index < 0 || index >= priv->clipping_planes->len)
+    {
+      /* Out of bounds => append */
+      index = priv->clipping_planes->len;
+      if (plane != NULL)
+        g_array_append_val (priv->clipping_planes, *plane);
+    }
+  else if (plane != NULL)
+    g_array_index (priv->clipping_planes, graphene_plane_t, index) = *plane;
+  else
+    g_array_remove_index (priv->clipping_planes, index);
+
+  return index;
+}
+
+void
+gthree_renderer_remove_clipping_plane (GthreeRenderer *renderer,
+                                       int             index)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (index < 0 || index >= priv->clipping_planes->len)
+    return;
+
+  g_array_remove_index (priv->clipping_planes, index);
+}
+
+void
+gthree_renderer_remove_all_clipping_planes (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_array_set_size (priv->clipping_planes, 0);
+}
+
+GthreeRenderTarget *
+gthree_renderer_get_render_target (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->current_render_target;
+}
+
+
+static void
+update_multisample_render_target (GthreeRenderer *renderer,
+                                  GthreeRenderTarget *render_target)
+{
+  // TODO
+}
+
+void
+gthree_renderer_set_render_target (GthreeRenderer *renderer,
+                                   GthreeRenderTarget *render_target,
+                                   int active_cube_target,
+                                   int active_mipmap_level)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  gboolean is_cube;
+  int framebuffer;
+  int pixel_ratio;
+
+  gthree_renderer_push_current (renderer);
+
+  if (render_target)
+    g_object_ref (render_target);
+
+  g_clear_object (&priv->current_render_target);
+  priv->current_render_target = render_target;
+
+  if (render_target != NULL)
+    gthree_render_target_realize (render_target, renderer);
+
+  framebuffer = priv->window_framebuffer;
+  is_cube = FALSE;
+
+  if (render_target)
+    {
+#ifdef TODO
+      if ( renderTarget.isWebGLRenderTargetCube )
+        {
+          var __webglFramebuffer = properties.get( renderTarget ).__webglFramebuffer;
+          framebuffer = __webglFramebuffer[ activeCubeFace || 0 ];
+          isCube = true;
+        }
+      else if ( renderTarget.isWebGLMultisampleRenderTarget )
+        {
+          framebuffer = properties.get( renderTarget ).__webglMultisampledFramebuffer;
         }
       else
 #endif
@@ -1232,6 +2017,19 @@ set_depth_write (GthreeRenderer *renderer,
     }
 }
 
+static void
+set_depth_func (GthreeRenderer *renderer,
+                int depth_func)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->old_depth_func != depth_func)
+    {
+      glDepthFunc (depth_func);
+      priv->old_depth_func = depth_func;
+    }
+}
+
 static void
 set_line_width (GthreeRenderer *renderer,
                 float line_width)
@@ -1364,27 +2162,729 @@ set_blending (GthreeRenderer *renderer,
     }
 }
 
+static gboolean
+frustum_contains_box (const graphene_frustum_t *frustum,
+                      const graphene_box_t     *box)
+{
+  graphene_vec3_t vertices[8];
+  graphene_point3d_t p;
+  int i;
+
+  graphene_box_get_vertices (box, vertices);
+  for (i = 0; i < 8; i++)
+    {
+      graphene_point3d_init_from_vec3 (&p, &vertices[i]);
+      if (!graphene_frustum_contains_point (frustum, &p))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
-project_object (GthreeRenderer *renderer,
-                GthreeScene    *scene,
-                GthreeObject   *object,
-                GthreeCamera   *camera)
+occlusion_query_object_died (gpointer  data,
+                             GObject  *where_the_object_was)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  GthreeObject *child;
-  GthreeObjectIter iter;
-  float z = 0;
+  GthreeOcclusionQuery *query = data;
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (query->renderer);
 
-  if (!gthree_object_get_visible (object))
-    return;
+  query->object = NULL;
+  g_hash_table_remove (priv->occlusion_queries, where_the_object_was);
+}
 
-  if (gthree_object_check_layer (object, gthree_object_get_layer_mask (GTHREE_OBJECT (camera))))
+static void
+occlusion_query_free (GthreeOcclusionQuery *query)
+{
+  if (query->object)
+    g_object_weak_unref (G_OBJECT (query->object), occlusion_query_object_died, query);
+  if (query->query)
+    gthree_renderer_lazy_delete (query->renderer, GTHREE_RESOURCE_KIND_QUERY, query->query);
+  g_free (query);
+}
+
+static void
+occlusion_queries_collect_unused (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GHashTableIter iter;
+  GthreeOcclusionQuery *query;
+
+  g_hash_table_iter_init (&iter, priv->occlusion_queries);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&query))
     {
-      if (GTHREE_IS_GROUP (object))
-        {
-#if 0
-          groupOrder = object.renderOrder;
-#endif
+      if (priv->frame_count - query->last_used_frame > OCCLUSION_QUERY_MAX_AGE)
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
+static void
+occlusion_resources_clear (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->occlusion_program)
+    glDeleteProgram (priv->occlusion_program);
+  priv->occlusion_program = 0;
+
+  if (priv->occlusion_vao)
+    {
+      glDeleteVertexArrays (1, &priv->occlusion_vao);
+      glDeleteBuffers (2, priv->occlusion_buffers);
+    }
+  priv->occlusion_vao = 0;
+}
+
+/* The world space bounds of a mesh, if it is bounded by its geometry,
+ * which skinned and instanced meshes are not */
+static gboolean
+get_object_world_box (GthreeObject   *object,
+                      graphene_box_t *box)
+{
+  GthreeGeometry *geometry;
+  graphene_vec3_t size;
+
+  if (!GTHREE_IS_MESH (object) ||
+      GTHREE_IS_SKINNED_MESH (object) ||
+      GTHREE_IS_INSTANCED_MESH (object))
+    return FALSE;
+
+  geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
+  if (geometry == NULL)
+    return FALSE;
+
+  graphene_matrix_transform_box (gthree_object_get_world_matrix (object),
+                                 gthree_geometry_get_bounding_box (geometry),
+                                 box);
+  graphene_box_get_size (box, &size);
+  return isfinite (graphene_vec3_get_x (&size)) &&
+         isfinite (graphene_vec3_get_y (&size)) &&
+         isfinite (graphene_vec3_get_z (&size));
+}
+
+/* Decides if an object that passed frustum culling should be drawn,
+ * based on earlier query results, and queues a new query for it.
+ * Results are only read once available, so they lag at least a frame. */
+static gboolean
+occlusion_test (GthreeRenderer *renderer,
+                GthreeObject   *object,
+                GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeOcclusionQuery *query;
+  graphene_box_t box, near_box;
+  graphene_vec4_t camera_row;
+  graphene_point3d_t camera_position;
+
+  if (!get_object_world_box (object, &box))
+    return TRUE;
+
+  query = g_hash_table_lookup (priv->occlusion_queries, object);
+  if (query == NULL)
+    {
+      query = g_new0 (GthreeOcclusionQuery, 1);
+      query->renderer = renderer;
+      query->object = object;
+      query->visible = TRUE;
+      g_object_weak_ref (G_OBJECT (object), occlusion_query_object_died, query);
+      g_hash_table_insert (priv->occlusion_queries, object, query);
+    }
+
+  if (query->last_used_frame == priv->frame_count)
+    return query->visible;
+
+  /* Old results say nothing about the current view if the object
+   * wasn't tested last frame, or was seen from another camera */
+  if (query->last_used_frame + 1 != priv->frame_count ||
+      query->camera != camera)
+    {
+      query->camera = camera;
+      query->visible = TRUE;
+      query->occluded_count = 0;
+      query->pending = FALSE;
+    }
+  query->last_used_frame = priv->frame_count;
+
+  if (query->pending)
+    {
+      GLuint available = 0;
+      GLuint samples = 0;
+
+      glGetQueryObjectuiv (query->query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (available)
+        {
+          glGetQueryObjectuiv (query->query, GL_QUERY_RESULT, &samples);
+          query->pending = FALSE;
+
+          if (samples > 0)
+            {
+              query->visible = TRUE;
+              query->occluded_count = 0;
+            }
+          else if (++query->occluded_count >= OCCLUSION_HIDE_FRAMES)
+            query->visible = FALSE;
+        }
+    }
+
+  /* If the near plane may cut the box the query can miss samples */
+  graphene_matrix_get_row (gthree_object_get_world_matrix (GTHREE_OBJECT (camera)), 3, &camera_row);
+  graphene_point3d_init (&camera_position,
+                         graphene_vec4_get_x (&camera_row),
+                         graphene_vec4_get_y (&camera_row),
+                         graphene_vec4_get_z (&camera_row));
+  graphene_box_expand_scalar (&box, 2 * gthree_camera_get_near (camera), &near_box);
+  if (graphene_box_contains_point (&near_box, &camera_position))
+    {
+      query->visible = TRUE;
+      query->occluded_count = 0;
+      return TRUE;
+    }
+
+  if (!query->pending)
+    {
+      query->box = box;
+      g_ptr_array_add (priv->occlusion_queue, query);
+    }
+
+  return query->visible;
+}
+
+static void
+occlusion_resources_init (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  static const char *vertex_source =
+    "#version 130\n"
+    "uniform mat4 boxMatrix;\n"
+    "in vec3 position;\n"
+    "void main() {\n"
+    "  gl_Position = boxMatrix * vec4 (position, 1.0);\n"
+    "}\n";
+  static const char *fragment_source =
+    "#version 130\n"
+    "out vec4 fragColor;\n"
+    "void main() {\n"
+    "  fragColor = vec4 (1.0);\n"
+    "}\n";
+  /* Corner i of the unit cube is at (i & 1, (i >> 1) & 1, (i >> 2) & 1) */
+  static const float corners[8 * 3] = {
+    0, 0, 0,  1, 0, 0,  0, 1, 0,  1, 1, 0,
+    0, 0, 1,  1, 0, 1,  0, 1, 1,  1, 1, 1,
+  };
+  static const guint8 indices[36] = {
+    0, 2, 6,  0, 6, 4, /* -x */
+    1, 5, 7,  1, 7, 3, /* +x */
+    0, 4, 5,  0, 5, 1, /* -y */
+    2, 3, 7,  2, 7, 6, /* +y */
+    0, 1, 3,  0, 3, 2, /* -z */
+    4, 6, 7,  4, 7, 5, /* +z */
+  };
+  GLuint vertex_shader, fragment_shader;
+  GLint status;
+
+  vertex_shader = glCreateShader (GL_VERTEX_SHADER);
+  glShaderSource (vertex_shader, 1, &vertex_source, NULL);
+  glCompileShader (vertex_shader);
+
+  fragment_shader = glCreateShader (GL_FRAGMENT_SHADER);
+  glShaderSource (fragment_shader, 1, &fragment_source, NULL);
+  glCompileShader (fragment_shader);
+
+  priv->occlusion_program = glCreateProgram ();
+  glAttachShader (priv->occlusion_program, vertex_shader);
+  glAttachShader (priv->occlusion_program, fragment_shader);
+  glBindAttribLocation (priv->occlusion_program, 0, "position");
+  glLinkProgram (priv->occlusion_program);
+  glDeleteShader (vertex_shader);
+  glDeleteShader (fragment_shader);
+
+  glGetProgramiv (priv->occlusion_program, GL_LINK_STATUS, &status);
+  if (status == GL_FALSE)
+    g_warning ("Failed to link occlusion query program");
+
+  priv->occlusion_box_matrix_location = glGetUniformLocation (priv->occlusion_program, "boxMatrix");
+
+  glGenVertexArrays (1, &priv->occlusion_vao);
+  glBindVertexArray (priv->occlusion_vao);
+
+  glGenBuffers (2, priv->occlusion_buffers);
+  glBindBuffer (GL_ARRAY_BUFFER, priv->occlusion_buffers[0]);
+  glBufferData (GL_ARRAY_BUFFER, sizeof (corners), corners, GL_STATIC_DRAW);
+  glEnableVertexAttribArray (0);
+  glVertexAttribPointer (0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+  glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, priv->occlusion_buffers[1]);
+  glBufferData (GL_ELEMENT_ARRAY_BUFFER, sizeof (indices), indices, GL_STATIC_DRAW);
+}
+
+/* Gpu timing uses timestamp queries around each timed section. They
+ * are grouped into frames, which end whenever the statistics are
+ * reset, and only read back once the last query of a frame has its
+ * result, so measuring never waits for the gpu. */
+void
+gthree_renderer_set_gpu_timing (GthreeRenderer *renderer,
+                                gboolean        gpu_timing)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  priv->gpu_timing = !!gpu_timing;
+}
+
+gboolean
+gthree_renderer_get_gpu_timing (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->gpu_timing;
+}
+
+/* Returns the timings of the last frame that has its results, in the
+ * order the timers were pushed */
+GArray *
+gthree_renderer_get_gpu_timings (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->gpu_timings;
+}
+
+static guint
+gpu_timer_query (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint query;
+
+  if (priv->gpu_free_queries->len > 0)
+    {
+      query = g_array_index (priv->gpu_free_queries, guint, priv->gpu_free_queries->len - 1);
+      g_array_set_size (priv->gpu_free_queries, priv->gpu_free_queries->len - 1);
+    }
+  else
+    glGenQueries (1, &query);
+
+  glQueryCounter (query, GL_TIMESTAMP);
+
+  return query;
+}
+
+/* Timers nest, the names need not be unique */
+void
+gthree_renderer_push_gpu_timer (GthreeRenderer *renderer,
+                                const char     *name)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeGpuTimer timer;
+  guint index;
+
+  if (!priv->gpu_timing_active)
+    return;
+
+  timer.name = g_intern_string (name);
+  timer.depth = priv->gpu_timer_stack->len;
+  timer.begin_query = gpu_timer_query (renderer);
+  timer.end_query = 0;
+
+  index = priv->gpu_timers->len;
+  g_array_append_val (priv->gpu_timers, timer);
+  g_array_append_val (priv->gpu_timer_stack, index);
+}
+
+void
+gthree_renderer_pop_gpu_timer (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeGpuTimer *timer;
+  guint index;
+
+  if (!priv->gpu_timing_active)
+    return;
+
+  g_return_if_fail (priv->gpu_timer_stack->len > 0);
+
+  index = g_array_index (priv->gpu_timer_stack, guint, priv->gpu_timer_stack->len - 1);
+  g_array_set_size (priv->gpu_timer_stack, priv->gpu_timer_stack->len - 1);
+
+  timer = &g_array_index (priv->gpu_timers, GthreeGpuTimer, index);
+  timer->end_query = gpu_timer_query (renderer);
+}
+
+static void
+gpu_timers_release (GthreeRenderer *renderer,
+                    GArray         *timers)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint i;
+
+  for (i = 0; i < timers->len; i++)
+    {
+      GthreeGpuTimer *timer = &g_array_index (timers, GthreeGpuTimer, i);
+
+      g_array_append_val (priv->gpu_free_queries, timer->begin_query);
+      if (timer->end_query)
+        g_array_append_val (priv->gpu_free_queries, timer->end_query);
+    }
+
+  g_array_set_size (timers, 0);
+}
+
+/* Doesn't need a current context, so this can be called from
+ * gthree_renderer_reset_info() at any time */
+static void
+gpu_timers_end_frame (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  /* A render inside a timed section (e.g. by a pass) is part of the
+   * same frame */
+  if (priv->gpu_timer_stack->len > 0)
+    return;
+
+  if (priv->gpu_timers->len > 0)
+    {
+      if (priv->gpu_timer_frames->len < GPU_TIMER_MAX_PENDING_FRAMES)
+        {
+          g_ptr_array_add (priv->gpu_timer_frames, priv->gpu_timers);
+          priv->gpu_timers = g_array_new (FALSE, FALSE, sizeof (GthreeGpuTimer));
+        }
+      else
+        gpu_timers_release (renderer, priv->gpu_timers);
+    }
+
+  priv->gpu_timing_active = priv->gpu_timing && priv->supports_timer_queries;
+}
+
+static gboolean
+gpu_timers_available (GArray *timers)
+{
+  guint i;
+
+  for (i = 0; i < timers->len; i++)
+    {
+      GthreeGpuTimer *timer = &g_array_index (timers, GthreeGpuTimer, i);
+      GLint available = 0;
+
+      glGetQueryObjectiv (timer->end_query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Reads back the finished frames, without waiting for the others */
+static void
+gpu_timers_collect (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  while (priv->gpu_timer_frames->len > 0)
+    {
+      GArray *timers = g_ptr_array_index (priv->gpu_timer_frames, 0);
+      guint i;
+
+      if (!gpu_timers_available (timers))
+        break;
+
+      g_array_set_size (priv->gpu_timings, timers->len);
+      for (i = 0; i < timers->len; i++)
+        {
+          GthreeGpuTimer *timer = &g_array_index (timers, GthreeGpuTimer, i);
+          GthreeGpuTiming *timing = &g_array_index (priv->gpu_timings, GthreeGpuTiming, i);
+          GLuint64 begin = 0, end = 0;
+
+          glGetQueryObjectui64v (timer->begin_query, GL_QUERY_RESULT, &begin);
+          glGetQueryObjectui64v (timer->end_query, GL_QUERY_RESULT, &end);
+
+          timing->name = timer->name;
+          timing->depth = timer->depth;
+          timing->time_ns = end > begin ? end - begin : 0;
+        }
+
+      gpu_timers_release (renderer, timers);
+      g_ptr_array_remove_index (priv->gpu_timer_frames, 0);
+    }
+}
+
+static void
+gpu_timers_clear (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint i;
+
+  gpu_timers_release (renderer, priv->gpu_timers);
+  for (i = 0; i < priv->gpu_timer_frames->len; i++)
+    gpu_timers_release (renderer, g_ptr_array_index (priv->gpu_timer_frames, i));
+  g_ptr_array_set_size (priv->gpu_timer_frames, 0);
+  g_array_set_size (priv->gpu_timer_stack, 0);
+
+  if (priv->gpu_free_queries->len > 0)
+    glDeleteQueries (priv->gpu_free_queries->len, (guint *)priv->gpu_free_queries->data);
+  g_array_set_size (priv->gpu_free_queries, 0);
+}
+
+/* Draws the bounding boxes queued by occlusion_test() against the
+ * current depth buffer, without touching color or depth */
+static void
+issue_occlusion_queries (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  gboolean old_depth_test, old_depth_write;
+  int i;
+
+  if (priv->occlusion_queue->len == 0)
+    return;
+
+  push_debug_group ("occlusion queries");
+  gthree_renderer_push_gpu_timer (renderer, "occlusion queries");
+
+  /* An override material only sets these once for all passes */
+  old_depth_test = priv->old_depth_test;
+  old_depth_write = priv->old_depth_write;
+
+  if (priv->occlusion_program == 0)
+    occlusion_resources_init (renderer);
+
+  set_depth_test (renderer, TRUE);
+  set_depth_write (renderer, FALSE);
+  if (!priv->old_double_sided)
+    {
+      glDisable (GL_CULL_FACE);
+      priv->old_double_sided = TRUE;
+    }
+  glColorMask (GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+  glUseProgram (priv->occlusion_program);
+  glBindVertexArray (priv->occlusion_vao);
+
+  for (i = 0; i < priv->occlusion_queue->len; i++)
+    {
+      GthreeOcclusionQuery *query = g_ptr_array_index (priv->occlusion_queue, i);
+      graphene_point3d_t min;
+      graphene_vec3_t size;
+      graphene_matrix_t box_matrix;
+      float floats[16];
+
+      graphene_box_get_min (&query->box, &min);
+      graphene_box_get_size (&query->box, &size);
+      graphene_matrix_init_scale (&box_matrix,
+                                  graphene_vec3_get_x (&size),
+                                  graphene_vec3_get_y (&size),
+                                  graphene_vec3_get_z (&size));
+      graphene_matrix_translate (&box_matrix, &min);
+      graphene_matrix_multiply (&box_matrix, &priv->proj_screen_matrix, &box_matrix);
+      graphene_matrix_to_float (&box_matrix, floats);
+      glUniformMatrix4fv (priv->occlusion_box_matrix_location, 1, FALSE, floats);
+
+      if (query->query == 0)
+        glGenQueries (1, &query->query);
+
+      glBeginQuery (priv->occlusion_query_target, query->query);
+      glDrawElements (GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, NULL);
+      glEndQuery (priv->occlusion_query_target);
+      priv->frame_stats.occlusion_queries++;
+
+      query->pending = TRUE;
+    }
+
+  glColorMask (GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  glBindVertexArray (priv->vertex_array_object);
+  set_depth_test (renderer, old_depth_test);
+  set_depth_write (renderer, old_depth_write);
+
+  /* The next object has to rebind its program and vertex array */
+  priv->current_program = NULL;
+  priv->current_geometry_program_geometry = NULL;
+  priv->current_geometry_program_program = NULL;
+
+  g_ptr_array_set_size (priv->occlusion_queue, 0);
+
+  gthree_renderer_pop_gpu_timer (renderer);
+  pop_debug_group ();
+}
+
+static void
+occluders_clear (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->occluder_scene)
+    g_object_remove_weak_pointer (G_OBJECT (priv->occluder_scene), (gpointer *)&priv->occluder_scene);
+  priv->occluder_scene = NULL;
+
+  g_ptr_array_set_size (priv->occluders, 0);
+}
+
+/* Static batched meshes are not drawn, but still occlude */
+static void
+occluders_collect (GthreeRenderer *renderer,
+                   GthreeObject   *object)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeObject *child;
+  GthreeObjectIter iter;
+
+  if (!gthree_object_get_visible (object))
+    return;
+
+  if (gthree_object_get_is_occluder (object) &&
+      GTHREE_IS_MESH (object) &&
+      !GTHREE_IS_SKINNED_MESH (object) &&
+      !GTHREE_IS_INSTANCED_MESH (object) &&
+      gthree_mesh_get_draw_mode (GTHREE_MESH (object)) == GTHREE_DRAW_MODE_TRIANGLES &&
+      gthree_mesh_get_geometry (GTHREE_MESH (object)) != NULL)
+    g_ptr_array_add (priv->occluders, object);
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    occluders_collect (renderer, child);
+}
+
+/* Starts rasterizing the occluders in the frustum on the worker
+ * threads, the result is used by software_occlusion_cull() */
+static void
+software_occlusion_begin (GthreeRenderer *renderer,
+                          GthreeScene    *scene,
+                          GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint32 layer_mask = gthree_object_get_layer_mask (GTHREE_OBJECT (camera));
+  int i;
+
+  if (priv->occluder_scene != GTHREE_OBJECT (scene) ||
+      priv->occluder_tree_stamp != gthree_object_get_tree_stamp (GTHREE_OBJECT (scene)))
+    {
+      occluders_clear (renderer);
+
+      priv->occluder_scene = GTHREE_OBJECT (scene);
+      g_object_add_weak_pointer (G_OBJECT (scene), (gpointer *)&priv->occluder_scene);
+      priv->occluder_tree_stamp = gthree_object_get_tree_stamp (GTHREE_OBJECT (scene));
+
+      occluders_collect (renderer, GTHREE_OBJECT (scene));
+    }
+
+  if (priv->occlusion_buffer == NULL)
+    priv->occlusion_buffer = gthree_occlusion_buffer_new (SOFTWARE_OCCLUSION_WIDTH,
+                                                          SOFTWARE_OCCLUSION_HEIGHT);
+
+  gthree_occlusion_buffer_begin (priv->occlusion_buffer, &priv->proj_screen_matrix);
+
+  for (i = 0; i < priv->occluders->len; i++)
+    {
+      GthreeObject *occluder = g_ptr_array_index (priv->occluders, i);
+
+      if (!gthree_object_check_layer (occluder, layer_mask) ||
+          (gthree_object_get_is_frustum_culled (occluder) &&
+           !gthree_object_is_in_frustum (occluder, &priv->frustum)))
+        continue;
+
+      gthree_occlusion_buffer_add_occluder (priv->occlusion_buffer,
+                                            gthree_object_get_world_matrix (occluder),
+                                            gthree_mesh_get_geometry (GTHREE_MESH (occluder)));
+    }
+
+  gthree_occlusion_buffer_rasterize_start (priv->occlusion_buffer);
+}
+
+/* Waits for the occluders, then drops the hidden items from the
+ * render list.
+ *
+ * The opaque and transparent index arrays are both still in push
+ * order here, so walking them merged visits the items of each object
+ * together, whichever lists they are in, and tests and counts each
+ * object once. */
+static void
+software_occlusion_cull (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeRenderList *list = priv->current_render_list;
+  GArray *opaque = list->opaque;
+  GArray *transparent = list->transparent;
+  GthreeObject *last_object = NULL;
+  gboolean last_visible = TRUE;
+  guint o = 0, t = 0, n_opaque = 0, n_transparent = 0;
+
+  gthree_occlusion_buffer_rasterize_wait (priv->occlusion_buffer);
+
+  while (o < opaque->len || t < transparent->len)
+    {
+      gboolean is_opaque =
+        t == transparent->len ||
+        (o < opaque->len && g_array_index (opaque, int, o) < g_array_index (transparent, int, t));
+      int index = is_opaque ? g_array_index (opaque, int, o++) : g_array_index (transparent, int, t++);
+      GthreeRenderListItem *item = &g_array_index (list->items, GthreeRenderListItem, index);
+
+      /* Items of one object are pushed next to each other */
+      if (item->object != last_object)
+        {
+          graphene_box_t box;
+
+          last_object = item->object;
+          last_visible =
+            gthree_object_get_is_occluder (item->object) ||
+            !get_object_world_box (item->object, &box) ||
+            gthree_occlusion_buffer_test_box (priv->occlusion_buffer, &box);
+
+          if (!last_visible)
+            {
+              priv->frame_stats.objects_drawn--;
+              priv->frame_stats.objects_culled++;
+            }
+        }
+
+      if (!last_visible)
+        continue;
+
+      if (is_opaque)
+        g_array_index (opaque, int, n_opaque++) = index;
+      else
+        g_array_index (transparent, int, n_transparent++) = index;
+    }
+
+  g_array_set_size (opaque, n_opaque);
+  g_array_set_size (transparent, n_transparent);
+}
+
+static void
+project_object (GthreeRenderer *renderer,
+                GthreeScene    *scene,
+                GthreeObject   *object,
+                GthreeCamera   *camera,
+                gboolean        fully_inside)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeObject *child;
+  GthreeObjectIter iter;
+  float z = 0;
+
+  if (!gthree_object_get_visible (object))
+    return;
+
+  /* For groups, try to cull (or accept) the whole subtree at once */
+  if (!fully_inside && gthree_object_get_first_child (object) != NULL)
+    {
+      graphene_box_t bounds;
+
+      switch (gthree_object_get_subtree_bounds (object, &bounds))
+        {
+        case GTHREE_SUBTREE_BOUNDS_EMPTY:
+          return;
+        case GTHREE_SUBTREE_BOUNDS_FINITE:
+          if (!graphene_frustum_intersects_box (&priv->frustum, &bounds))
+            {
+              /* The whole subtree counts as one culled object */
+              priv->frame_stats.objects_culled++;
+              return;
+            }
+          fully_inside = frustum_contains_box (&priv->frustum, &bounds);
+          break;
+        case GTHREE_SUBTREE_BOUNDS_INFINITE:
+        default:
+          break;
+        }
+    }
+
+  if (gthree_object_check_layer (object, gthree_object_get_layer_mask (GTHREE_OBJECT (camera))))
+    {
+      if (GTHREE_IS_GROUP (object))
+        {
+#if 0
+          groupOrder = object.renderOrder;
+#endif
         }
       else if (GTHREE_IS_LIGHT (object))
         {
@@ -1392,7 +2892,8 @@ project_object (GthreeRenderer *renderer,
           if (gthree_object_get_cast_shadow (object))
             priv->shadows = g_list_append (priv->shadows, object);
         }
-      else if (GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_SPRITE (object) || GTHREE_IS_POINTS (object))
+      else if ((GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_SPRITE (object) || GTHREE_IS_POINTS (object)) &&
+               !gthree_object_get_static_batched (object))
         {
           if (GTHREE_IS_SKINNED_MESH (object))
             {
@@ -1401,7 +2902,10 @@ project_object (GthreeRenderer *renderer,
                 gthree_skeleton_update (skeleton);
             }
 
-          if (!gthree_object_get_is_frustum_culled (object) || gthree_object_is_in_frustum (object, &priv->frustum))
+          if ((fully_inside ||
+               !gthree_object_get_is_frustum_culled (object) ||
+               gthree_object_is_in_frustum (object, &priv->frustum)) &&
+              (!priv->occlusion_culling || occlusion_test (renderer, object, camera)))
             {
               gthree_object_update (object, renderer);
 
@@ -1421,26 +2925,208 @@ project_object (GthreeRenderer *renderer,
               priv->current_render_list->current_z = z;
 
               gthree_object_fill_render_list (object, priv->current_render_list);
+              priv->frame_stats.objects_drawn++;
             }
+          else
+            priv->frame_stats.objects_culled++;
         }
     }
 
+  if (GTHREE_IS_LOD (object))
+    gthree_lod_update (GTHREE_LOD (object), camera);
+
   gthree_object_iter_init (&iter, object);
   while (gthree_object_iter_next (&iter, &child))
-    project_object (renderer, scene, child, camera);
+    {
+      if (GTHREE_IS_LOD (object) &&
+          !gthree_lod_is_child_active (GTHREE_LOD (object), child, FALSE))
+        continue;
+
+      project_object (renderer, scene, child, camera, fully_inside);
+    }
+}
+
+static void
+retained_clear (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->retained_scene)
+    g_object_remove_weak_pointer (G_OBJECT (priv->retained_scene), (gpointer *)&priv->retained_scene);
+  priv->retained_scene = NULL;
+
+  g_array_set_size (priv->retained_objects, 0);
+  g_ptr_array_set_size (priv->retained_lights, 0);
+  g_ptr_array_set_size (priv->retained_lods, 0);
+}
+
+static void
+retained_collect (GthreeRenderer *renderer,
+                  GthreeObject   *object,
+                  guint32         layer_mask)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeObject *child;
+  GthreeObjectIter iter;
+
+  if (!gthree_object_get_visible (object))
+    return;
+
+  /* The level changes without the tree changing, so these subtrees
+   * are walked every frame */
+  if (GTHREE_IS_LOD (object))
+    {
+      g_ptr_array_add (priv->retained_lods, object);
+      return;
+    }
+
+  if (gthree_object_check_layer (object, layer_mask))
+    {
+      if (GTHREE_IS_LIGHT (object))
+        g_ptr_array_add (priv->retained_lights, object);
+      else if ((GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_SPRITE (object) || GTHREE_IS_POINTS (object)) &&
+               !gthree_object_get_static_batched (object))
+        {
+          /* A zero stamp forces the culling on first use */
+          GthreeRetainedObject retained = { object, 0, 0, FALSE, 0 };
+          g_array_append_val (priv->retained_objects, retained);
+        }
+    }
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    retained_collect (renderer, child, layer_mask);
+}
+
+/* The bounds stamp of the geometry the object is culled with, or 0 */
+static guint32
+retained_bounds_stamp (GthreeObject *object)
+{
+  GthreeGeometry *geometry = NULL;
+
+  if (GTHREE_IS_MESH (object))
+    geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
+  else if (GTHREE_IS_LINE (object))
+    geometry = gthree_line_get_geometry (GTHREE_LINE (object));
+  else if (GTHREE_IS_POINTS (object))
+    geometry = gthree_points_get_geometry (GTHREE_POINTS (object));
+  else if (GTHREE_IS_SPRITE (object))
+    geometry = gthree_sprite_get_geometry (GTHREE_SPRITE (object));
+
+  return geometry ? gthree_geometry_get_bounds_stamp (geometry) : 0;
+}
+
+/* Same result as project_object(), but the tree is only walked when
+ * its structure changed, and objects are only re-culled when the
+ * camera, their world transform or their geometry bounds changed. */
+static void
+project_retained (GthreeRenderer *renderer,
+                  GthreeScene    *scene,
+                  GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint32 layer_mask = gthree_object_get_layer_mask (GTHREE_OBJECT (camera));
+  gboolean camera_changed;
+  int i;
+
+  if (priv->retained_scene != GTHREE_OBJECT (scene) ||
+      priv->retained_tree_stamp != gthree_object_get_tree_stamp (GTHREE_OBJECT (scene)) ||
+      priv->retained_layer_mask != layer_mask)
+    {
+      retained_clear (renderer);
+
+      priv->retained_scene = GTHREE_OBJECT (scene);
+      g_object_add_weak_pointer (G_OBJECT (scene), (gpointer *)&priv->retained_scene);
+      priv->retained_tree_stamp = gthree_object_get_tree_stamp (GTHREE_OBJECT (scene));
+      priv->retained_layer_mask = layer_mask;
+
+      retained_collect (renderer, GTHREE_OBJECT (scene), layer_mask);
+    }
+
+  for (i = 0; i < priv->retained_lights->len; i++)
+    {
+      GthreeObject *light = g_ptr_array_index (priv->retained_lights, i);
+
+      priv->lights = g_list_prepend (priv->lights, light);
+      if (gthree_object_get_cast_shadow (light))
+        priv->shadows = g_list_prepend (priv->shadows, light);
+    }
+  priv->lights = g_list_reverse (priv->lights);
+  priv->shadows = g_list_reverse (priv->shadows);
+
+  camera_changed =
+    priv->retained_sort_objects != priv->sort_objects ||
+    !graphene_matrix_equal_fast (&priv->retained_proj_screen_matrix, &priv->proj_screen_matrix);
+  priv->retained_proj_screen_matrix = priv->proj_screen_matrix;
+  priv->retained_sort_objects = priv->sort_objects;
+
+  for (i = 0; i < priv->retained_objects->len; i++)
+    {
+      GthreeRetainedObject *retained = &g_array_index (priv->retained_objects, GthreeRetainedObject, i);
+      GthreeObject *object = retained->object;
+      guint32 transform_stamp = gthree_object_get_transform_stamp (object);
+      guint32 bounds_stamp = retained_bounds_stamp (object);
+
+      if (GTHREE_IS_SKINNED_MESH (object))
+        {
+          GthreeSkeleton *skeleton = gthree_skinned_mesh_get_skeleton (GTHREE_SKINNED_MESH (object));
+          if (skeleton)
+            gthree_skeleton_update (skeleton);
+        }
+
+      if (camera_changed || retained->transform_stamp != transform_stamp || transform_stamp == 0 ||
+          retained->bounds_stamp != bounds_stamp)
+        {
+          retained->transform_stamp = transform_stamp;
+          retained->bounds_stamp = bounds_stamp;
+          retained->in_frustum =
+            !gthree_object_get_is_frustum_culled (object) ||
+            gthree_object_is_in_frustum (object, &priv->frustum);
+          retained->z = 0;
+
+          if (retained->in_frustum && priv->sort_objects)
+            {
+              graphene_vec4_t vector;
+
+              graphene_matrix_get_row (gthree_object_get_world_matrix (object), 3, &vector);
+              graphene_matrix_transform_vec4 (&priv->proj_screen_matrix, &vector, &vector);
+              retained->z = graphene_vec4_get_z (&vector) / graphene_vec4_get_w (&vector);
+            }
+        }
+
+      if (retained->in_frustum &&
+          (!priv->occlusion_culling || occlusion_test (renderer, object, camera)))
+        {
+          gthree_object_update (object, renderer);
+
+          priv->current_render_list->current_z = retained->z;
+          gthree_object_fill_render_list (object, priv->current_render_list);
+          priv->frame_stats.objects_drawn++;
+        }
+      else
+        priv->frame_stats.objects_culled++;
+    }
+
+  for (i = 0; i < priv->retained_lods->len; i++)
+    project_object (renderer, scene, g_ptr_array_index (priv->retained_lods, i), camera, FALSE);
 }
 
 static void
 material_apply_light_setup (GthreeUniforms *m_uniforms,
                             GthreeLightSetup *light_setup,
-                            gboolean update_only)
+                            gboolean update_only,
+                            gboolean uniform_blocks)
 {
   gthree_uniforms_set_vec3 (m_uniforms, "ambientLightColor", &light_setup->ambient);
 
-  gthree_uniforms_set_uarray (m_uniforms, "directionalLights", light_setup->directional, update_only);
-  gthree_uniforms_set_uarray (m_uniforms, "pointLights", light_setup->point, update_only);
-  gthree_uniforms_set_uarray (m_uniforms, "spotLights", light_setup->spot, update_only);
-  gthree_uniforms_set_uarray (m_uniforms, "hemisphereLights", light_setup->hemi, update_only);
+  /* With uniform blocks the light structs are shared by all programs */
+  if (!uniform_blocks)
+    {
+      gthree_uniforms_set_uarray (m_uniforms, "directionalLights", light_setup->directional, update_only);
+      gthree_uniforms_set_uarray (m_uniforms, "pointLights", light_setup->point, update_only);
+      gthree_uniforms_set_uarray (m_uniforms, "spotLights", light_setup->spot, update_only);
+      gthree_uniforms_set_uarray (m_uniforms, "hemisphereLights", light_setup->hemi, update_only);
+    }
 
   gthree_uniforms_set_texture_array (m_uniforms, "directionalShadowMap", light_setup->directional_shadow_map);
   gthree_uniforms_set_matrix4_array (m_uniforms, "directionalShadowMatrix", light_setup->directional_shadow_map_matrix);
@@ -1452,11 +3138,88 @@ material_apply_light_setup (GthreeUniforms *m_uniforms,
   gthree_uniforms_set_matrix4_array (m_uniforms, "pointShadowMatrix", light_setup->point_shadow_map_matrix);
 }
 
+/* Which of the program variants of a material the object needs.
+ *
+ * The shadow maps only draw the incoming level of a cross-fading
+ * GthreeLOD, so they must not dither it or the shadow gets holes. */
+static guint
+get_material_variant (GthreeObject *object,
+                      gboolean for_shadow)
+{
+  guint variant = 0;
+
+  if (GTHREE_IS_INSTANCED_MESH (object))
+    {
+      variant |= GTHREE_MATERIAL_VARIANT_INSTANCING;
+      if (gthree_instanced_mesh_get_instance_color (GTHREE_INSTANCED_MESH (object)) != NULL)
+        variant |= GTHREE_MATERIAL_VARIANT_INSTANCING_COLOR;
+    }
+
+  if (!for_shadow && gthree_object_get_lod_fade (object) != 1.0f)
+    variant |= GTHREE_MATERIAL_VARIANT_LOD_FADE;
+
+  return variant;
+}
+
+/* The part of the material setup that needs the linked program */
+static void
+init_material_program (GthreeRenderer *renderer,
+                       GthreeMaterial *material,
+                       guint           variant)
+{
+  GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+  GthreeProgram *program = material_properties->variants[variant].program;
+  GthreeShader *shader = gthree_material_get_shader (material);
+
+  // TODO: thee.js uses the lightstate current_hash and other stuff to avoid some stuff here?
+  // I think it caches the material uniforms we calculate here and avoid reloading if switching to a new program?
+
+  if (GTHREE_IS_MESH_MATERIAL (material) &&
+      gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (material)))
+    {
+      GHashTable *program_attributes = gthree_program_get_attribute_locations (program);
+      int num_supported = 0;
+
+      for (int i = 0; i < MAX_MORPH_TARGETS; i++ )
+        {
+          g_autofree char *attr = g_strdup_printf ("morphTarget%d", i);
+
+          if (g_hash_table_lookup (program_attributes, attr) != NULL)
+            num_supported++;
+        }
+      gthree_mesh_material_set_num_supported_morph_targets (GTHREE_MESH_MATERIAL (material),
+                                                            num_supported);
+    }
+
+  if (GTHREE_IS_MESH_MATERIAL (material) &&
+      gthree_mesh_material_get_morph_normals (GTHREE_MESH_MATERIAL (material)))
+    {
+      GHashTable *program_attributes = gthree_program_get_attribute_locations (program);
+      int num_supported = 0;
+
+      for (int i = 0; i < MAX_MORPH_NORMALS; i++ )
+        {
+          g_autofree char *attr = g_strdup_printf ("morphNormal%d", i);
+
+          if (g_hash_table_lookup (program_attributes, attr) != NULL)
+            num_supported++;
+        }
+
+      gthree_mesh_material_set_num_supported_morph_normals (GTHREE_MESH_MATERIAL (material),
+                                                            num_supported);
+    }
+
+  gthree_shader_update_uniform_locations_for_program (shader, program);
+
+  material_properties->variants[variant].program_setup_pending = FALSE;
+}
+
 static GthreeProgram *
 init_material (GthreeRenderer *renderer,
                GthreeMaterial *material,
                GthreeFog *fog,
-               GthreeObject *object)
+               GthreeObject *object,
+               guint variant_index)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
   GthreeProgram *program;
@@ -1465,6 +3228,8 @@ init_material (GthreeRenderer *renderer,
   GthreeUniforms *m_uniforms;
   int max_bones;
   GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+  GthreeMaterialVariant *variant = &material_properties->variants[variant_index];
+  GTHREE_TRACE_BEGIN (trace_init);
 
   shader = gthree_material_get_shader (material);
 
@@ -1477,6 +3242,7 @@ init_material (GthreeRenderer *renderer,
   // TODO: Get encoding from currentRenderTarget if set
   parameters.output_encoding = GTHREE_ENCODING_FORMAT_GAMMA;
   parameters.physically_correct_lights = priv->physically_correct_lights;
+  parameters.uniform_blocks = priv->supports_uniform_blocks;
 
   gthree_material_set_params (material, &parameters);
   parameters.num_dir_lights = priv->light_setup.directional->len;
@@ -1496,6 +3262,11 @@ init_material (GthreeRenderer *renderer,
   parameters.max_bones = max_bones;
   parameters.skinning = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_skinning (GTHREE_MESH_MATERIAL (material));
 
+  parameters.instancing = (variant_index & GTHREE_MATERIAL_VARIANT_INSTANCING) != 0;
+  parameters.instancing_color = (variant_index & GTHREE_MATERIAL_VARIANT_INSTANCING_COLOR) != 0;
+  parameters.lod_fade = (variant_index & GTHREE_MATERIAL_VARIANT_LOD_FADE) != 0;
+  parameters.depth_prepass = priv->depth_prepass && gthree_material_get_depth_prepass (material);
+
   parameters.morph_targets = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (material));
   parameters.morph_normals = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_morph_normals (GTHREE_MESH_MATERIAL (material));
 
@@ -1522,50 +3293,21 @@ init_material (GthreeRenderer *renderer,
 
     useVertexTexture: _supportsBoneTextures && object && object.skeleton && object.skeleton.useVertexTexture,
     };
-#endif
-
-  program = gthree_program_cache_get (priv->program_cache, shader, &parameters, renderer);
-  /* This is owned by the cache, so it will live as long as the renderer (as it owns the cache and it never frees) */
-  /* This isn't a ref to avoid leaking the program until something else uses the material */
-  material_properties->program = program;
-
-  // TODO: thee.js uses the lightstate current_hash and other stuff to avoid some stuff here?
-  // I think it caches the material uniforms we calculate here and avoid reloading if switching to a new program?
-
-  if (GTHREE_IS_MESH_MATERIAL (material) &&
-      gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (material)))
-    {
-      GHashTable *program_attributes = gthree_program_get_attribute_locations (program);
-      int num_supported = 0;
-
-      for (int i = 0; i < MAX_MORPH_TARGETS; i++ )
-        {
-          g_autofree char *attr = g_strdup_printf ("morphTarget%d", i);
-
-          if (g_hash_table_lookup (program_attributes, attr) != NULL)
-            num_supported++;
-        }
-      gthree_mesh_material_set_num_supported_morph_targets (GTHREE_MESH_MATERIAL (material),
-                                                            num_supported);
-    }
-
-  if (GTHREE_IS_MESH_MATERIAL (material) &&
-      gthree_mesh_material_get_morph_normals (GTHREE_MESH_MATERIAL (material)))
-    {
-      GHashTable *program_attributes = gthree_program_get_attribute_locations (program);
-      int num_supported = 0;
-
-      for (int i = 0; i < MAX_MORPH_NORMALS; i++ )
-        {
-          g_autofree char *attr = g_strdup_printf ("morphNormal%d", i);
-
-          if (g_hash_table_lookup (program_attributes, attr) != NULL)
-            num_supported++;
-        }
+#endif
 
-      gthree_mesh_material_set_num_supported_morph_normals (GTHREE_MESH_MATERIAL (material),
-                                                            num_supported);
+  program = gthree_program_cache_get (priv->program_cache, shader, &parameters, renderer);
+  /* This is owned by the cache. It isn't a ref, so unused programs can
+   * be evicted, instead the program tracks its users and clears this
+   * when it goes away. */
+  if (variant->program != program)
+    {
+      if (variant->program)
+        gthree_program_remove_user (variant->program, material);
+      gthree_program_add_user (program, material);
     }
+  variant->program = program;
+  variant->program_id = gthree_program_get_id (program);
+  variant->valid = TRUE;
 
   m_uniforms = gthree_shader_get_uniforms (shader);
 
@@ -1589,10 +3331,17 @@ init_material (GthreeRenderer *renderer,
     }
 
   material_properties->fog = fog;
+  material_properties->depth_prepass = parameters.depth_prepass;
 
-  material_apply_light_setup (m_uniforms, &priv->light_setup, FALSE);
+  material_apply_light_setup (m_uniforms, &priv->light_setup, FALSE, priv->supports_uniform_blocks);
 
-  gthree_shader_update_uniform_locations_for_program (shader, program);
+  /* Querying the program would wait for a background compile */
+  if (gthree_program_is_ready (program))
+    init_material_program (renderer, material, variant_index);
+  else
+    variant->program_setup_pending = TRUE;
+
+  GTHREE_TRACE_END_FORMAT (trace_init, "init material", "%s", G_OBJECT_TYPE_NAME (material));
 
   return NULL;
 }
@@ -1656,6 +3405,86 @@ setup_lights (GthreeRenderer *renderer, GthreeCamera *camera)
   setup->hash.num_shadow = setup->shadow->len;
 }
 
+static void
+upload_uniform_block (GthreeRenderer *renderer,
+                      GthreeUniformBlock block,
+                      const guint8 *data,
+                      gsize size)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  glBindBuffer (GL_UNIFORM_BUFFER, priv->uniform_buffers[block]);
+  if (size > priv->uniform_buffer_sizes[block])
+    {
+      glBufferData (GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW);
+      priv->uniform_buffer_sizes[block] = size;
+    }
+  else
+    glBufferSubData (GL_UNIFORM_BUFFER, 0, size, data);
+
+  priv->frame_stats.buffer_upload_bytes += size;
+
+  glBindBufferBase (GL_UNIFORM_BUFFER, block, priv->uniform_buffers[block]);
+}
+
+static void
+update_light_uniform_block (GthreeRenderer *renderer,
+                            GthreeUniformBlock block,
+                            GPtrArray *lights,
+                            GthreeUniformBlockMember *members,
+                            guint n_members)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  gsize stride;
+
+  /* Programs are built for the current number of lights, so with none the block is unused */
+  if (lights->len == 0)
+    return;
+
+  stride = gthree_uniforms_pack_std140 (NULL, members, n_members, NULL);
+  g_byte_array_set_size (priv->uniform_block_data, stride * lights->len);
+
+  for (int i = 0; i < lights->len; i++)
+    gthree_uniforms_pack_std140 (g_ptr_array_index (lights, i), members, n_members,
+                                 priv->uniform_block_data->data + i * stride);
+
+  upload_uniform_block (renderer, block, priv->uniform_block_data->data, stride * lights->len);
+}
+
+/* Called once per render after setup_lights(), the light data is in view space of the main camera */
+static void
+update_light_uniform_blocks (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeLightSetup *setup = &priv->light_setup;
+
+  update_light_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_DIRECTIONAL_LIGHTS, setup->directional,
+                              directional_light_members, G_N_ELEMENTS (directional_light_members));
+  update_light_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_POINT_LIGHTS, setup->point,
+                              point_light_members, G_N_ELEMENTS (point_light_members));
+  update_light_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_SPOT_LIGHTS, setup->spot,
+                              spot_light_members, G_N_ELEMENTS (spot_light_members));
+  update_light_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_HEMISPHERE_LIGHTS, setup->hemi,
+                              hemisphere_light_members, G_N_ELEMENTS (hemisphere_light_members));
+}
+
+static void
+update_camera_uniform_block (GthreeRenderer *renderer,
+                             GthreeCamera *camera)
+{
+  const graphene_matrix_t *camera_matrix_world = gthree_object_get_world_matrix (GTHREE_OBJECT (camera));
+  /* std140: mat4 projectionMatrix, mat4 viewMatrix, vec3 cameraPosition (padded to vec4) */
+  float data[16 + 16 + 4];
+  graphene_vec4_t pos;
+
+  graphene_matrix_to_float (gthree_camera_get_projection_matrix (camera), &data[0]);
+  graphene_matrix_to_float (gthree_camera_get_world_inverse_matrix (camera), &data[16]);
+  graphene_matrix_get_row (camera_matrix_world, 3, &pos);
+  graphene_vec4_to_float (&pos, &data[32]);
+
+  upload_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_CAMERA, (guint8 *)data, sizeof (data));
+}
+
 static void *
 project_planes (GthreeRenderer *renderer,
                 const graphene_plane_t *planes,
@@ -2004,8 +3833,27 @@ shadow_map_render_object (GthreeRenderer *renderer,
   if (!gthree_object_get_visible (object))
     return;
 
+  if (gthree_object_get_first_child (object) != NULL)
+    {
+      graphene_box_t bounds;
+
+      switch (gthree_object_get_subtree_bounds (object, &bounds))
+        {
+        case GTHREE_SUBTREE_BOUNDS_EMPTY:
+          return;
+        case GTHREE_SUBTREE_BOUNDS_FINITE:
+          if (!graphene_frustum_intersects_box (frustum, &bounds))
+            return;
+          break;
+        case GTHREE_SUBTREE_BOUNDS_INFINITE:
+        default:
+          break;
+        }
+    }
+
   if (gthree_object_check_layer (object, gthree_object_get_layer_mask (GTHREE_OBJECT (camera))) &&
-      (GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_POINTS (object)))
+      (GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_POINTS (object)) &&
+      !gthree_object_get_static_batched (object))
     {
       if (gthree_object_get_cast_shadow (object) &&
           (!gthree_object_get_is_frustum_culled (object) || gthree_object_is_in_frustum (object, frustum)))
@@ -2052,15 +3900,37 @@ shadow_map_render_object (GthreeRenderer *renderer,
             {
               GthreeMaterial *depthMaterial = getDepthMaterial (renderer, object, geometry, material, is_point_light, _lightPositionWorld,
                                                                 gthree_camera_get_near (shadow_camera), gthree_camera_get_far (shadow_camera));
-              GthreeRenderListItem item = { object, geometry, depthMaterial, NULL, 0.0 };
-              render_item (renderer, shadow_camera, NULL, depthMaterial, &item);
+
+              if (GTHREE_IS_STATIC_BATCH (object))
+                {
+                  /* Only the ranges of the visible members */
+                  GthreeGeometryGroup *groups = gthree_geometry_peek_groups (geometry);
+                  int k, n_groups = gthree_geometry_get_n_groups (geometry);
+
+                  for (k = 0; k < n_groups; k++)
+                    {
+                      GthreeRenderListItem item = { object, geometry, depthMaterial, &groups[k], 0.0 };
+                      render_item (renderer, shadow_camera, NULL, depthMaterial, &item);
+                    }
+                }
+              else
+                {
+                  GthreeRenderListItem item = { object, geometry, depthMaterial, NULL, 0.0 };
+                  render_item (renderer, shadow_camera, NULL, depthMaterial, &item);
+                }
             }
         }
     }
 
   gthree_object_iter_init (&iter, object);
   while (gthree_object_iter_next (&iter, &child))
-    shadow_map_render_object (renderer, child, camera, frustum, shadow_camera, _lightPositionWorld, is_point_light);
+    {
+      if (GTHREE_IS_LOD (object) &&
+          !gthree_lod_is_child_active (GTHREE_LOD (object), child, TRUE))
+        continue;
+
+      shadow_map_render_object (renderer, child, camera, frustum, shadow_camera, _lightPositionWorld, is_point_light);
+    }
 }
 
 
@@ -2084,7 +3954,10 @@ render_shadow_map (GthreeRenderer *renderer,
   if (priv->shadows == NULL)
     return;
 
+  GTHREE_TRACE_BEGIN (trace_shadows);
+
   push_debug_group ("rendering shadow maps");
+  gthree_renderer_push_gpu_timer (renderer, "shadows");
 
   g_set_object (&current_render_target,  priv->current_render_target);
 
@@ -2118,6 +3991,8 @@ render_shadow_map (GthreeRenderer *renderer,
 
       push_debug_group ("shadow maps light %p", light);
 
+      priv->frame_stats.shadow_map_renders++;
+
       if (GTHREE_IS_POINT_LIGHT (light))
         {
           int vpWidth = shadow_map_width;
@@ -2270,9 +4145,11 @@ render_shadow_map (GthreeRenderer *renderer,
           graphene_frustum_init_from_matrix (&frustum, &_projScreenMatrix);
 
           // set object matrices & frustum culling
+          priv->in_shadow_pass = TRUE;
           shadow_map_render_object (renderer, GTHREE_OBJECT (scene), camera, &frustum, shadow_camera,
                                     &_lightPositionWorld,
                                     GTHREE_IS_POINT_LIGHT (light));
+          priv->in_shadow_pass = FALSE;
         }
 
       pop_debug_group ();
@@ -2282,13 +4159,16 @@ render_shadow_map (GthreeRenderer *renderer,
 
   gthree_renderer_set_render_target (renderer, current_render_target, 0, 0);
 
+  gthree_renderer_pop_gpu_timer (renderer);
   pop_debug_group ();
+
+  GTHREE_TRACE_END_FORMAT (trace_shadows, "shadows", "%u lights", g_list_length (priv->shadows));
 }
 
 
 // If uniforms are marked as clean, they don't need to be loaded to the GPU.
 static void
-mark_uniforms_lights_needs_update (GthreeUniforms *uniforms, gboolean needs_update)
+mark_uniforms_lights_needs_update (GthreeUniforms *uniforms, gboolean needs_update, gboolean uniform_blocks)
 {
   GthreeUniform *uni;
 
@@ -2296,6 +4176,10 @@ mark_uniforms_lights_needs_update (GthreeUniforms *uniforms, gboolean needs_upda
   if (uni)
     gthree_uniform_set_needs_update (uni, needs_update);
 
+  /* The light structs are in uniform blocks, so never load them per material */
+  if (uniform_blocks)
+    needs_update = FALSE;
+
   uni = gthree_uniforms_lookup (uniforms, q_directionalLights);
   if (uni)
     gthree_uniform_set_needs_update (uni, needs_update);
@@ -2343,6 +4227,57 @@ refresh_uniforms_fog (GthreeRenderer *renderer,
 }
 
 
+/* (Re)initialize the material if the state it was set up for changed.
+ * Each program variant is set up on its own, so a material that is
+ * shared by e.g. instanced and plain meshes keeps both programs. */
+static void
+update_material_variant (GthreeRenderer *renderer,
+                         GthreeFog *fog,
+                         GthreeMaterial *material,
+                         GthreeObject *object,
+                         guint variant_index)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+  GthreeMaterialVariant *variant = &material_properties->variants[variant_index];
+  int i;
+
+  /* Maybe the light state (e.g. nr of lights, or if this is a shaded
+     object) changed since we last initialized the material, even if
+     the material itself didn't change */
+  priv->light_setup.hash.obj_receive_shadow = gthree_object_get_receive_shadow (object) && priv->shadowmap_enabled;
+  if (!gthree_material_is_valid_for (material, priv->renderer_id) ||
+      !gthree_light_setup_hash_equal (&material_properties->light_hash, &priv->light_setup.hash) ||
+      (gthree_material_get_fog (material) && material_properties->fog != fog) ||
+      material_properties->num_clipping_planes != priv->num_clipping_planes ||
+      material_properties->num_intersection != priv->num_clipping_intersections ||
+      material_properties->depth_prepass != (priv->depth_prepass && gthree_material_get_depth_prepass (material)))
+    {
+      for (i = 0; i < GTHREE_MATERIAL_N_VARIANTS; i++)
+        material_properties->variants[i].valid = FALSE;
+    }
+
+  if (!variant->valid)
+    {
+      init_material (renderer, material, fog, object, variant_index);
+      gthree_material_mark_valid_for (material, priv->renderer_id);
+    }
+}
+
+static guint
+update_material (GthreeRenderer *renderer,
+                 GthreeFog *fog,
+                 GthreeMaterial *material,
+                 GthreeObject *object)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint variant_index = get_material_variant (object, priv->in_shadow_pass);
+
+  update_material_variant (renderer, fog, material, object, variant_index);
+
+  return variant_index;
+}
+
 static GthreeProgram *
 set_program (GthreeRenderer *renderer,
              GthreeCamera *camera,
@@ -2358,6 +4293,8 @@ set_program (GthreeRenderer *renderer,
   GthreeShader *shader;
   GthreeUniforms *m_uniforms;
   GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+  GthreeMaterialVariant *variant;
+  guint variant_index;
 
   if (priv->clipping_enabled)
     {
@@ -2372,21 +4309,21 @@ set_program (GthreeRenderer *renderer,
 
   priv->used_texture_units = 0;
 
-  /* Maybe the light state (e.g. nr of lights, or if this is a shaded
-     object) changed since we last initialized the material, even if
-     the material itself didn't change */
-  priv->light_setup.hash.obj_receive_shadow = gthree_object_get_receive_shadow (object) && priv->shadowmap_enabled;
-  if (!gthree_material_is_valid_for (material, priv->renderer_id) ||
-      !gthree_light_setup_hash_equal (&material_properties->light_hash, &priv->light_setup.hash) ||
-      (gthree_material_get_fog (material) && material_properties->fog != fog) ||
-      material_properties->num_clipping_planes != priv->num_clipping_planes ||
-      material_properties->num_intersection != priv->num_clipping_intersections)
+  variant_index = update_material (renderer, fog, material, object);
+  variant = &material_properties->variants[variant_index];
+
+  program = variant->program;
+  gthree_program_mark_used (program);
+
+  if (variant->program_setup_pending)
     {
-      init_material (renderer, material, fog, object);
-      gthree_material_mark_valid_for (material, priv->renderer_id);
+      /* Skip the draw rather than wait for the compile */
+      if (priv->async_compile && !gthree_program_is_ready (program))
+        return NULL;
+
+      init_material_program (renderer, material, variant_index);
     }
 
-  program = material_properties->program;
   shader = gthree_material_get_shader (material);
   m_uniforms = gthree_shader_get_uniforms (shader);
 
@@ -2394,6 +4331,7 @@ set_program (GthreeRenderer *renderer,
     {
       gthree_program_use (program);
       priv->current_program = program;
+      priv->frame_stats.program_switches++;
 
       refreshProgram = TRUE;
       refreshMaterial = TRUE;
@@ -2406,7 +4344,19 @@ set_program (GthreeRenderer *renderer,
       refreshMaterial = TRUE;
     }
 
-  if (refreshProgram || camera != priv->current_camera)
+  if (priv->supports_uniform_blocks)
+    {
+      /* The camera block is shared by all programs, so only update it when the camera changes */
+      if (camera != priv->current_camera)
+        {
+          update_camera_uniform_block (renderer, camera);
+          priv->current_camera = camera;
+
+          refreshMaterial = TRUE;
+          refreshLights = TRUE;
+        }
+    }
+  else if (refreshProgram || camera != priv->current_camera)
     {
       const graphene_matrix_t *projection_matrix = gthree_camera_get_projection_matrix (camera);
       float projection_matrixv[16];
@@ -2537,16 +4487,18 @@ set_program (GthreeRenderer *renderer,
 
   if ( refreshMaterial )
     {
+      priv->frame_stats.material_refreshes++;
+
       if (gthree_material_needs_lights (material))
         {
-          mark_uniforms_lights_needs_update (m_uniforms, refreshLights);
+          mark_uniforms_lights_needs_update (m_uniforms, refreshLights, priv->supports_uniform_blocks);
           if (refreshLights)
             {
               /* We marked the uniforms so they are uploaded, but we also need to sync
                * the actual values from the light uniforms into the material uniforms
                * (these are not the same because the location differs for each instance)
                */
-              material_apply_light_setup (m_uniforms, &priv->light_setup, TRUE);
+              material_apply_light_setup (m_uniforms, &priv->light_setup, TRUE, priv->supports_uniform_blocks);
             }
         }
 
@@ -2580,7 +4532,7 @@ set_program (GthreeRenderer *renderer,
 #endif
 
       // load common uniforms
-      gthree_uniforms_load (m_uniforms, renderer);
+      gthree_shader_load_uniforms (shader, program, renderer);
     }
   else
     {
@@ -2607,8 +4559,9 @@ init_attributes (GthreeRenderer *renderer)
 }
 
 static void
-enable_attribute (GthreeRenderer *renderer,
-                  guint attribute)
+enable_attribute_and_divisor (GthreeRenderer *renderer,
+                              guint attribute,
+                              guint divisor)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
@@ -2618,6 +4571,19 @@ enable_attribute (GthreeRenderer *renderer,
       glEnableVertexAttribArray(attribute);
       priv->enabled_attributes[attribute] = 1;
     }
+
+  if (priv->attribute_divisors[attribute] != divisor)
+    {
+      glVertexAttribDivisor (attribute, divisor);
+      priv->attribute_divisors[attribute] = divisor;
+    }
+}
+
+static void
+enable_attribute (GthreeRenderer *renderer,
+                  guint attribute)
+{
+  enable_attribute_and_divisor (renderer, attribute, 0);
 }
 
 static void
@@ -2636,11 +4602,56 @@ disable_unused_attributes (GthreeRenderer *renderer)
     }
 }
 
+static void
+setup_instance_attribute (GthreeRenderer *renderer,
+                          GthreeAttribute *attribute,
+                          int program_attribute)
+{
+  int size = gthree_attribute_get_item_size (attribute);
+  int offset = gthree_attribute_get_item_offset (attribute);
+  int stride = gthree_attribute_get_stride (attribute);
+  int buffer = gthree_attribute_get_gl_buffer (attribute, renderer);
+  int type = gthree_attribute_get_gl_type (attribute);
+  int bytes_per_element = gthree_attribute_get_gl_bytes_per_element (attribute);
+  int i, n_locations;
+
+  /* Matrix attributes (i.e. instanceMatrix) take one location per column */
+  n_locations = (size + 3) / 4;
+
+  glBindBuffer (GL_ARRAY_BUFFER, buffer);
+  for (i = 0; i < n_locations; i++)
+    {
+      int column_size = MIN (size - i * 4, 4);
+
+      enable_attribute_and_divisor (renderer, program_attribute + i, 1);
+      glVertexAttribPointer (program_attribute + i, column_size, type,
+                             gthree_attribute_get_normalized (attribute),
+                             stride * bytes_per_element,
+                             GINT_TO_POINTER ((offset + i * 4) * bytes_per_element));
+    }
+}
+
+static gboolean
+is_morph_attribute (GQuark name)
+{
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (q_morphTarget); i++)
+    {
+      if (name == q_morphTarget[i] || name == q_morphNormal[i])
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 static void
 setup_vertex_attributes (GthreeRenderer *renderer,
                          GthreeMaterial *material,
                          GthreeProgram *program,
-                         GthreeGeometry *geometry)
+                         GthreeGeometry *geometry,
+                         GthreeInstancedMesh *instances,
+                         GArray *default_attributes)
 {
   GHashTable *program_attributes;
   GHashTableIter iter;
@@ -2659,7 +4670,26 @@ setup_vertex_attributes (GthreeRenderer *renderer,
 
       if (program_attribute >= 0)
         {
-          GthreeAttribute *geometry_attribute = gthree_geometry_get_attribute (geometry, name);
+          GthreeAttribute *geometry_attribute;
+
+          if (instances != NULL && nameq == q_instanceMatrix)
+            {
+              setup_instance_attribute (renderer, gthree_instanced_mesh_get_instance_matrix (instances), program_attribute);
+              continue;
+            }
+
+          if (instances != NULL && nameq == q_instanceColor &&
+              gthree_instanced_mesh_get_instance_color (instances) != NULL)
+            {
+              setup_instance_attribute (renderer, gthree_instanced_mesh_get_instance_color (instances), program_attribute);
+              continue;
+            }
+
+          /* These change per draw, see bind_morph_attributes() */
+          if (is_morph_attribute (nameq))
+            continue;
+
+          geometry_attribute = gthree_geometry_get_attribute (geometry, name);
           if (geometry_attribute != NULL)
             {
               gboolean normalized = gthree_attribute_get_normalized (geometry_attribute);
@@ -2671,25 +4701,16 @@ setup_vertex_attributes (GthreeRenderer *renderer,
               int type = gthree_attribute_get_gl_type (geometry_attribute);
               int bytes_per_element = gthree_attribute_get_gl_bytes_per_element (geometry_attribute);
 
-              /*
-                if ( geometryAttribute.isInstancedBufferAttribute )
-                {
-                state.enableAttributeAndDivisor( programAttribute, geometryAttribute.meshPerAttribute );
-                if ( geometry.maxInstancedCount === undefined )
-                {
-                geometry.maxInstancedCount = geometryAttribute.meshPerAttribute * geometryAttribute.count;
-                }
-                }
-                else
-              */
-              {
-                enable_attribute (renderer, program_attribute);
-              }
+              enable_attribute (renderer, program_attribute);
               glBindBuffer (GL_ARRAY_BUFFER, buffer);
               glVertexAttribPointer (program_attribute, size, type, normalized, stride * bytes_per_element, GINT_TO_POINTER (offset * bytes_per_element));
             }
           else
             {
+              GthreeDefaultAttribute default_attribute = { nameq, program_attribute };
+
+              /* The current attribute value is not part of the vao state */
+              g_array_append_val (default_attributes, default_attribute);
               gthree_material_load_default_attribute (material, program_attribute, nameq);
             }
         }
@@ -2700,6 +4721,192 @@ setup_vertex_attributes (GthreeRenderer *renderer,
   disable_unused_attributes (renderer);
 }
 
+static guint
+vertex_array_key_hash (gconstpointer data)
+{
+  const GthreeVertexArrayKey *key = data;
+
+  return
+    key->geometry_id ^
+    (key->program_id << 16 | key->program_id >> 16) ^
+    key->instances_id * 31 ^
+    key->wireframe << 30 ^
+    key->instance_color << 31;
+}
+
+static gboolean
+vertex_array_key_equal (gconstpointer a,
+                        gconstpointer b)
+{
+  const GthreeVertexArrayKey *key_a = a;
+  const GthreeVertexArrayKey *key_b = b;
+
+  return
+    key_a->geometry_id == key_b->geometry_id &&
+    key_a->program_id == key_b->program_id &&
+    key_a->instances_id == key_b->instances_id &&
+    key_a->wireframe == key_b->wireframe &&
+    key_a->instance_color == key_b->instance_color;
+}
+
+/* Only called with the renderer current */
+static void
+vertex_array_free (GthreeVertexArray *vertex_array)
+{
+  if (vertex_array->vao != 0)
+    glDeleteVertexArrays (1, &vertex_array->vao);
+  g_array_unref (vertex_array->default_attributes);
+  g_free (vertex_array);
+}
+
+static void
+vertex_arrays_clear (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_hash_table_remove_all (priv->vertex_arrays);
+
+  priv->current_geometry_program_geometry = NULL;
+  priv->current_geometry_program_program = NULL;
+}
+
+/* There is no notification when geometries go away, so instead we
+ * drop the vertex arrays that haven't been used in a while */
+static void
+vertex_arrays_collect_unused (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GHashTableIter iter;
+  GthreeVertexArray *vertex_array;
+
+  g_hash_table_iter_init (&iter, priv->vertex_arrays);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&vertex_array))
+    {
+      if (priv->frame_count - vertex_array->last_used_frame > VERTEX_ARRAY_MAX_AGE)
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
+/* Binds a cached vertex array object for the geometry/program
+ * combination, creating it if needed */
+static void
+bind_vertex_array (GthreeRenderer *renderer,
+                   GthreeMaterial *material,
+                   GthreeProgram *program,
+                   GthreeGeometry *geometry,
+                   GthreeInstancedMesh *instances,
+                   gboolean wireframe)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeVertexArrayKey key = { 0 };
+  GthreeVertexArray *vertex_array;
+  guint32 attributes_version;
+  int i;
+
+  key.geometry_id = gthree_geometry_get_id (geometry);
+  key.program_id = gthree_program_get_id (program);
+  if (instances)
+    {
+      key.instances_id = gthree_instanced_mesh_get_id (instances);
+      key.instance_color = gthree_instanced_mesh_get_instance_color (instances) != NULL;
+    }
+  key.wireframe = !!wireframe;
+
+  attributes_version = gthree_geometry_get_attributes_version (geometry);
+
+  vertex_array = g_hash_table_lookup (priv->vertex_arrays, &key);
+  if (vertex_array == NULL)
+    {
+      vertex_array = g_new0 (GthreeVertexArray, 1);
+      vertex_array->key = key;
+      vertex_array->default_attributes = g_array_new (FALSE, FALSE, sizeof (GthreeDefaultAttribute));
+      g_hash_table_insert (priv->vertex_arrays, &vertex_array->key, vertex_array);
+    }
+  else if (vertex_array->vao != 0 && vertex_array->attributes_version != attributes_version)
+    {
+      glDeleteVertexArrays (1, &vertex_array->vao);
+      vertex_array->vao = 0;
+    }
+
+  vertex_array->last_used_frame = priv->frame_count;
+
+  if (vertex_array->vao == 0)
+    {
+      glGenVertexArrays (1, &vertex_array->vao);
+      glBindVertexArray (vertex_array->vao);
+
+      /* A new vao has all attributes disabled */
+      memset (priv->enabled_attributes, 0, sizeof (priv->enabled_attributes));
+      memset (priv->attribute_divisors, 0, sizeof (priv->attribute_divisors));
+
+      g_array_set_size (vertex_array->default_attributes, 0);
+      setup_vertex_attributes (renderer, material, program, geometry, instances,
+                               vertex_array->default_attributes);
+      vertex_array->attributes_version = attributes_version;
+    }
+  else
+    {
+      glBindVertexArray (vertex_array->vao);
+
+      for (i = 0; i < vertex_array->default_attributes->len; i++)
+        {
+          GthreeDefaultAttribute *default_attribute = &g_array_index (vertex_array->default_attributes, GthreeDefaultAttribute, i);
+          gthree_material_load_default_attribute (material, default_attribute->location, default_attribute->name);
+        }
+    }
+}
+
+static void
+bind_morph_attribute (GthreeRenderer *renderer,
+                      GHashTable *program_attributes,
+                      GQuark name,
+                      GthreeAttribute *attribute)
+{
+  gpointer value;
+  int location;
+
+  if (!g_hash_table_lookup_extended (program_attributes, GINT_TO_POINTER (name), NULL, &value))
+    return;
+
+  location = GPOINTER_TO_INT (value);
+  if (location < 0)
+    return;
+
+  if (attribute == NULL)
+    {
+      /* The influence is zero, so the value doesn't matter */
+      glDisableVertexAttribArray (location);
+      return;
+    }
+
+  glBindBuffer (GL_ARRAY_BUFFER, gthree_attribute_get_gl_buffer (attribute, renderer));
+  glEnableVertexAttribArray (location);
+  glVertexAttribPointer (location,
+                         gthree_attribute_get_item_size (attribute),
+                         gthree_attribute_get_gl_type (attribute),
+                         gthree_attribute_get_normalized (attribute),
+                         gthree_attribute_get_stride (attribute) * gthree_attribute_get_gl_bytes_per_element (attribute),
+                         GINT_TO_POINTER (gthree_attribute_get_item_offset (attribute) * gthree_attribute_get_gl_bytes_per_element (attribute)));
+}
+
+/* The morph attributes change with the influences of each mesh, so
+ * they are set on the bound vao for every draw instead of being part
+ * of the cached vao state */
+static void
+bind_morph_attributes (GthreeRenderer *renderer,
+                       GthreeProgram *program)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GHashTable *program_attributes = gthree_program_get_attribute_locations (program);
+  int i;
+
+  for (i = 0; i < 8; i++)
+    {
+      bind_morph_attribute (renderer, program_attributes, q_morphTarget[i], priv->morph_targets[i]);
+      bind_morph_attribute (renderer, program_attributes, q_morphNormal[i], priv->morph_normals[i]);
+    }
+}
+
 //	var influencesList = {};
 //	var morphInfluences = new Float32Array( 8 );
 
@@ -2756,26 +4963,6 @@ update_morphtargets (GthreeRenderer *renderer,
   if (gthree_mesh_material_get_morph_normals (material))
     morphNormals = gthree_geometry_get_morph_attributes (geometry, "normal");
 
-  // Remove current morphAttributes
-  for (i = 0; i < length; i++)
-    {
-      InfluenceInfo *info = &g_array_index (influences, InfluenceInfo, i);
-      if (info->value != 0)
-        {
-          if (morphTargets)
-            {
-              g_autofree char *name = g_strdup_printf ("morphTarget%d", i);
-              gthree_geometry_remove_attribute (geometry, name);
-            }
-
-          if (morphNormals)
-            {
-              g_autofree char *name = g_strdup_printf ("morphNormal%d", i);
-              gthree_geometry_remove_attribute (geometry, name);
-            }
-        }
-    }
-
   // Collect influences
   for (i = 0; i < length; i++)
     {
@@ -2786,36 +4973,30 @@ update_morphtargets (GthreeRenderer *renderer,
 
   g_array_sort (influences, (GCompareFunc)influence_info_cmp);
 
-  // Add morphAttributes
+  // Pick the morph attributes, these are bound by bind_morph_attributes()
+  // rather than added to the geometry, so the vao of the geometry stays
+  // valid when the influences change
   for (i = 0; i < 8; i++)
     {
+      priv->morph_targets[i] = NULL;
+      priv->morph_normals[i] = NULL;
+      priv->morph_influences[i] = 0;
+
       if (i < length)
         {
           InfluenceInfo *info = &g_array_index (influences, InfluenceInfo, i);
 
           if (info->value != 0)
             {
-              if (morphTargets)
-                {
-                  g_autofree char *name = g_strdup_printf ("morphTarget%d", i);
-                  GthreeAttribute *attribute = g_ptr_array_index (morphTargets, info->index);
-                  gthree_geometry_add_attribute (geometry, name, attribute);
-                }
+              if (morphTargets)
+                priv->morph_targets[i] = g_ptr_array_index (morphTargets, info->index);
 
               if (morphNormals)
-                {
-                  g_autofree char *name = g_strdup_printf ("morphNormal%d", i);
-                  GthreeAttribute *attribute = g_ptr_array_index (morphTargets, info->index);
-                  gthree_geometry_add_attribute (geometry, name, attribute);
-                }
+                priv->morph_normals[i] = g_ptr_array_index (morphNormals, info->index);
 
               priv->morph_influences[i] = info->value;
-              continue;
             }
-
         }
-
-      priv->morph_influences[i] = 0;
     }
 
   gint morph_target_influences_location =
@@ -2842,26 +5023,47 @@ render_item (GthreeRenderer *renderer,
   GthreeAttribute *position, *index;
   gboolean update_buffers = FALSE;
   gboolean wireframe = FALSE;
+  gboolean morph = FALSE;
   int data_count;
   int range_factor, range_start, range_count, group_start, group_count, draw_start, draw_end, draw_count;
   int draw_mode = GL_TRIANGLES;
+  GthreeInstancedMesh *instances = NULL;
 
   if (!gthree_material_get_is_visible (material))
     return;
 
+  if (GTHREE_IS_INSTANCED_MESH (object))
+    {
+      instances = GTHREE_INSTANCED_MESH (object);
+      if (gthree_instanced_mesh_get_count (instances) == 0)
+        return;
+
+      if (!priv->supports_instancing)
+        {
+          if (!priv->warned_no_instancing)
+            g_warning ("Instanced meshes need GL 3.3 or GL_ARB_instanced_arrays, not drawing them");
+          priv->warned_no_instancing = TRUE;
+          return;
+        }
+    }
+
   if (GTHREE_IS_MESH_MATERIAL (material) &&
       gthree_mesh_material_get_is_wireframe (GTHREE_MESH_MATERIAL (material)))
     wireframe = TRUE;
 
   program = set_program (renderer, camera, fog, material, object);
+  if (program == NULL)
+    return;
 
   if (geometry != priv->current_geometry_program_geometry ||
       program != priv->current_geometry_program_program ||
-      wireframe != priv->current_geometry_program_wireframe)
+      wireframe != priv->current_geometry_program_wireframe ||
+      instances != priv->current_geometry_program_instances)
     {
       priv->current_geometry_program_geometry = geometry;
       priv->current_geometry_program_program = program;
       priv->current_geometry_program_wireframe = wireframe;
+      priv->current_geometry_program_instances = instances;
       update_buffers = true;
     }
 
@@ -2870,7 +5072,7 @@ render_item (GthreeRenderer *renderer,
       GTHREE_IS_MESH_MATERIAL (material))
     {
       update_morphtargets (renderer, GTHREE_MESH (object), geometry, GTHREE_MESH_MATERIAL (material), program);
-      update_buffers = TRUE;
+      morph = TRUE;
     }
 
   index = gthree_geometry_get_index (geometry);
@@ -2886,11 +5088,14 @@ render_item (GthreeRenderer *renderer,
 
   if (update_buffers)
     {
-      setup_vertex_attributes (renderer, material, program, geometry);
+      bind_vertex_array (renderer, material, program, geometry, instances, wireframe);
       if (index != NULL)
         glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, gthree_attribute_get_gl_buffer (index, renderer));
     }
 
+  if (morph)
+    bind_morph_attributes (renderer, program);
+
   data_count = -1;
 
   if (index != NULL)
@@ -2969,12 +5174,23 @@ render_item (GthreeRenderer *renderer,
       int index_bytes_per_element = gthree_attribute_get_gl_bytes_per_element (index);
       int index_offset = gthree_attribute_get_item_offset (index);
 
-      glDrawElements (draw_mode, draw_count, index_type, GINT_TO_POINTER ((index_offset + draw_start) * index_bytes_per_element));
+      if (instances)
+        glDrawElementsInstanced (draw_mode, draw_count, index_type, GINT_TO_POINTER ((index_offset + draw_start) * index_bytes_per_element),
+                                 gthree_instanced_mesh_get_count (instances));
+      else
+        glDrawElements (draw_mode, draw_count, index_type, GINT_TO_POINTER ((index_offset + draw_start) * index_bytes_per_element));
     }
   else
     {
-      glDrawArrays (draw_mode, draw_start, draw_count);
+      if (instances)
+        glDrawArraysInstanced (draw_mode, draw_start, draw_count,
+                               gthree_instanced_mesh_get_count (instances));
+      else
+        glDrawArrays (draw_mode, draw_start, draw_count);
     }
+
+  count_draw (renderer, draw_mode, draw_count,
+              instances ? gthree_instanced_mesh_get_count (instances) : 1);
 }
 
 static void
@@ -3016,7 +5232,16 @@ render_objects (GthreeRenderer *renderer,
         }
 
       set_depth_test (renderer, gthree_material_get_depth_test (material));
-      set_depth_write (renderer, gthree_material_get_depth_write (material));
+      if (item->depth_prepassed)
+        {
+          set_depth_func (renderer, GL_EQUAL);
+          set_depth_write (renderer, FALSE);
+        }
+      else
+        {
+          set_depth_func (renderer, GL_LEQUAL);
+          set_depth_write (renderer, gthree_material_get_depth_write (material));
+        }
 
       {
         gboolean polygon_offset;
@@ -3031,6 +5256,137 @@ render_objects (GthreeRenderer *renderer,
     }
 }
 
+/* The depth pass must produce exactly the depth of the real pass, so
+ * anything that changes the coverage or position in the fragment or
+ * vertex shader rules it out, as do custom shaders */
+static gboolean
+use_depth_prepass (GthreeRenderer *renderer,
+                   GthreeRenderListItem *item)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeMaterial *material = item->material;
+  GthreeTexture *displacement_map = NULL;
+
+  if (!GTHREE_IS_MESH (item->object) ||
+      !gthree_material_get_depth_prepass (material) ||
+      !gthree_material_get_depth_test (material) ||
+      !gthree_material_get_depth_write (material) ||
+      gthree_material_get_alpha_test (material) > 0)
+    return FALSE;
+
+  if (priv->local_clipping_enabled && gthree_material_get_n_clipping_planes (material) > 0)
+    return FALSE;
+
+  /* Only per-pixel lighting is expensive enough */
+  if (GTHREE_IS_MESH_STANDARD_MATERIAL (material))
+    displacement_map = gthree_mesh_standard_material_get_displacement_map (GTHREE_MESH_STANDARD_MATERIAL (material));
+  else if (GTHREE_IS_MESH_SPECGLOS_MATERIAL (material))
+    displacement_map = gthree_mesh_specglos_material_get_displacement_map (GTHREE_MESH_SPECGLOS_MATERIAL (material));
+  else if (GTHREE_IS_MESH_TOON_MATERIAL (material))
+    displacement_map = gthree_mesh_toon_material_get_displacement_map (GTHREE_MESH_TOON_MATERIAL (material));
+  else if (!GTHREE_IS_MESH_PHONG_MATERIAL (material))
+    return FALSE;
+
+  return displacement_map == NULL;
+}
+
+static GthreeMaterial *
+get_depth_prepass_material (GthreeRenderer *renderer,
+                            GthreeRenderListItem *item)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeMeshMaterial *material = GTHREE_MESH_MATERIAL (item->material);
+  GthreeSide side = gthree_material_get_side (item->material);
+  gboolean use_morphing = FALSE;
+  gboolean use_skinning;
+  int variant = 0;
+
+  if (gthree_mesh_material_get_morph_targets (material))
+    {
+      GPtrArray *morph_position = gthree_geometry_get_morph_attributes (item->geometry, "position");
+      use_morphing = morph_position != NULL && morph_position->len > 0;
+    }
+  use_skinning = GTHREE_IS_SKINNED_MESH (item->object) && gthree_mesh_material_get_skinning (material);
+
+  if (use_morphing)
+    variant |= SHADER_MAP_MORPHING_FLAG;
+  if (use_skinning)
+    variant |= SHADER_MAP_SKINNING_FLAG;
+  variant += 4 * side;
+
+  if (priv->depth_prepass_materials[variant] == NULL)
+    {
+      GthreeMeshDepthMaterial *m = gthree_mesh_depth_material_new ();
+
+      gthree_mesh_material_set_morph_targets (GTHREE_MESH_MATERIAL (m), use_morphing);
+      gthree_mesh_material_set_skinning (GTHREE_MESH_MATERIAL (m), use_skinning);
+      gthree_material_set_side (GTHREE_MATERIAL (m), side);
+      priv->depth_prepass_materials[variant] = GTHREE_MATERIAL (m);
+    }
+
+  gthree_mesh_material_set_is_wireframe (GTHREE_MESH_MATERIAL (priv->depth_prepass_materials[variant]),
+                                         gthree_mesh_material_get_is_wireframe (material));
+
+  return priv->depth_prepass_materials[variant];
+}
+
+/* Writes the depth of the eligible opaque items, which are then
+ * marked for the equal depth test in render_objects() */
+static void
+render_depth_prepass (GthreeRenderer *renderer,
+                      GthreeScene    *scene,
+                      GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GArray *opaque = priv->current_render_list->opaque;
+  gboolean started = FALSE;
+  int i;
+
+  for (i = 0; i < opaque->len; i++)
+    {
+      int render_list_index = g_array_index (opaque, int, i);
+      GthreeRenderListItem *item = &g_array_index (priv->current_render_list->items, GthreeRenderListItem, render_list_index);
+      GthreeMaterial *depth_material;
+      gboolean polygon_offset;
+      float factor, units;
+
+      if (item->material == NULL ||
+          !gthree_material_get_is_visible (item->material) ||
+          !use_depth_prepass (renderer, item))
+        continue;
+
+      if (!started)
+        {
+          push_debug_group ("depth pre-pass");
+          gthree_renderer_push_gpu_timer (renderer, "depth pre-pass");
+          glColorMask (GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+          set_depth_func (renderer, GL_LEQUAL);
+          started = TRUE;
+        }
+
+      gthree_object_call_before_render_callback (item->object, scene, camera);
+      gthree_object_update_matrix_view (item->object, gthree_camera_get_world_inverse_matrix (camera));
+
+      depth_material = get_depth_prepass_material (renderer, item);
+
+      set_depth_test (renderer, TRUE);
+      set_depth_write (renderer, TRUE);
+      polygon_offset = gthree_material_get_polygon_offset (item->material, &factor, &units);
+      set_polygon_offset (renderer, polygon_offset, factor, units);
+      set_material_faces (renderer, depth_material);
+
+      render_item (renderer, camera, NULL, depth_material, item);
+      item->depth_prepassed = TRUE;
+    }
+
+  if (started)
+    {
+      glColorMask (GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+      gthree_renderer_pop_gpu_timer (renderer);
+      pop_debug_group ();
+    }
+}
+
 static void
 clear (gboolean color, gboolean depth, gboolean stencil)
 {
@@ -3201,6 +5557,198 @@ gthree_renderer_render_background (GthreeRenderer *renderer,
     }
 }
 
+/* Like project_object(), but without culling, so everything that
+ * may be drawn from some point of view is included */
+static void
+compile_object (GthreeRenderer *renderer,
+                GthreeObject   *object,
+                GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeObject *child;
+  GthreeObjectIter iter;
+
+  if (!gthree_object_get_visible (object))
+    return;
+
+  if (gthree_object_check_layer (object, gthree_object_get_layer_mask (GTHREE_OBJECT (camera))))
+    {
+      if (GTHREE_IS_LIGHT (object))
+        {
+          priv->lights = g_list_append (priv->lights, object);
+          if (gthree_object_get_cast_shadow (object))
+            priv->shadows = g_list_append (priv->shadows, object);
+        }
+      else if ((GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_SPRITE (object) || GTHREE_IS_POINTS (object)) &&
+               !gthree_object_get_static_batched (object))
+        {
+          gthree_object_update (object, renderer);
+          gthree_object_fill_render_list (object, priv->current_render_list);
+        }
+    }
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    compile_object (renderer, child, camera);
+}
+
+/* Whether a GthreeLOD above the object may cross-fade it */
+static gboolean
+object_may_lod_fade (GthreeObject *object)
+{
+  GthreeObject *parent;
+
+  for (parent = gthree_object_get_parent (object); parent != NULL; parent = gthree_object_get_parent (parent))
+    {
+      if (GTHREE_IS_LOD (parent) &&
+          gthree_lod_get_cross_fade_duration (GTHREE_LOD (parent)) > 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Sets up the material for all the variants the object may be drawn
+ * with, not just the one it needs right now */
+static void
+compile_material (GthreeRenderer *renderer,
+                  GthreeFog      *fog,
+                  GthreeMaterial *material,
+                  GthreeObject   *object,
+                  gboolean        for_shadow)
+{
+  guint variant_index = get_material_variant (object, TRUE);
+
+  update_material_variant (renderer, fog, material, object, variant_index);
+  if (!for_shadow && object_may_lod_fade (object))
+    update_material_variant (renderer, fog, material, object,
+                             variant_index | GTHREE_MATERIAL_VARIANT_LOD_FADE);
+}
+
+/* The depth and distance materials render_shadow_map() would use for
+ * the item. Their light position and camera range uniforms are set
+ * again for each shadow render, so those don't matter here. */
+static void
+compile_shadow_materials (GthreeRenderer       *renderer,
+                          GthreeRenderListItem *item)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  graphene_vec3_t light_position;
+  GList *l;
+
+  if (!GTHREE_IS_MESH (item->object) ||
+      !gthree_object_get_cast_shadow (item->object) ||
+      item->material == NULL ||
+      !gthree_material_get_is_visible (item->material))
+    return;
+
+  graphene_vec3_init (&light_position, 0, 0, 0);
+
+  if (priv->clipping_enabled)
+    clipping_begin_shadows (renderer);
+
+  for (l = priv->shadows; l != NULL; l = l->next)
+    {
+      GthreeLight *light = l->data;
+      GthreeLightShadow *shadow = gthree_light_get_shadow (light);
+      GthreeCamera *shadow_camera;
+      GthreeMaterial *depth_material;
+
+      if (shadow == NULL)
+        continue;
+
+      shadow_camera = gthree_light_shadow_get_camera (shadow);
+      depth_material = getDepthMaterial (renderer, item->object, item->geometry, item->material,
+                                         GTHREE_IS_POINT_LIGHT (light), &light_position,
+                                         gthree_camera_get_near (shadow_camera),
+                                         gthree_camera_get_far (shadow_camera));
+
+      if (priv->clipping_enabled && priv->local_clipping_enabled)
+        clipping_set_state (renderer, shadow_camera, depth_material, FALSE);
+
+      compile_material (renderer, NULL, depth_material, item->object, TRUE);
+    }
+
+  if (priv->clipping_enabled)
+    clipping_end_shadows (renderer);
+}
+
+/* Set up all the materials in the scene for rendering with this
+ * camera, including the shadow map and depth pre-pass materials drawn
+ * for them, and start compiling the programs they need. Call this when
+ * new objects are added, to avoid compiling them in the middle of a
+ * later frame. Returns TRUE if all the programs are ready, otherwise
+ * call it again (e.g. once per frame) until it is. */
+gboolean
+gthree_renderer_compile (GthreeRenderer *renderer,
+                         GthreeScene    *scene,
+                         GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeMaterial *override_material;
+  GthreeFog *fog;
+  guint pending;
+  int i;
+
+  gthree_renderer_push_current (renderer);
+
+  g_list_free (priv->lights);
+  priv->lights = NULL;
+
+  g_list_free (priv->shadows);
+  priv->shadows = NULL;
+
+  gthree_scene_update_matrix_world (scene);
+
+  if (gthree_object_get_parent (GTHREE_OBJECT (camera)) == NULL)
+    gthree_object_update_matrix_world (GTHREE_OBJECT (camera), FALSE);
+
+  gthree_camera_update_matrix (camera);
+
+  priv->clipping_enabled = clipping_init (renderer, camera);
+
+  gthree_render_list_init (priv->current_render_list);
+  compile_object (renderer, GTHREE_OBJECT (scene), camera);
+
+  setup_lights (renderer, camera);
+
+  fog = gthree_scene_get_fog (scene);
+  override_material = gthree_scene_get_override_material (scene);
+
+  for (i = 0; i < priv->current_render_list->items->len; i++)
+    {
+      GthreeRenderListItem *item = &g_array_index (priv->current_render_list->items, GthreeRenderListItem, i);
+      GthreeMaterial *material = override_material ? override_material : item->material;
+
+      if (material == NULL)
+        continue;
+
+      if (priv->clipping_enabled && priv->local_clipping_enabled)
+        clipping_set_state (renderer, camera, material, FALSE);
+
+      compile_material (renderer, fog, material, item->object, FALSE);
+
+      if (priv->depth_prepass && override_material == NULL &&
+          gthree_material_get_is_visible (material) &&
+          !gthree_material_get_is_transparent (material) &&
+          use_depth_prepass (renderer, item))
+        compile_material (renderer, NULL, get_depth_prepass_material (renderer, item), item->object, FALSE);
+
+      if (priv->shadowmap_enabled && priv->shadows != NULL)
+        compile_shadow_materials (renderer, item);
+    }
+
+  gthree_render_list_init (priv->current_render_list);
+
+  /* Nothing above waits for the compiles, so this only finishes the
+   * programs that are already done */
+  pending = gthree_program_cache_poll (priv->program_cache);
+
+  gthree_renderer_pop_current (renderer);
+
+  return pending == 0;
+}
+
 void
 gthree_renderer_render (GthreeRenderer *renderer,
                         GthreeScene    *scene,
@@ -3209,13 +5757,27 @@ gthree_renderer_render (GthreeRenderer *renderer,
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
   GthreeMaterial *override_material;
   GthreeFog *fog;
+  guint64 evicted_bytes;
+  guint evicted;
+  GTHREE_TRACE_BEGIN (trace_render);
 
   /* The GtkGLArea code can change the GL_DEPTH_TEST state, so read current state back here */
   priv->old_depth_test = glIsEnabled (GL_DEPTH_TEST) == GL_TRUE;
 
+  if (priv->info_auto_reset)
+    gthree_renderer_reset_info (renderer);
+  priv->info_renders++;
+
   gthree_renderer_push_current (renderer);
 
+  if (priv->gpu_timer_frames->len > 0)
+    gpu_timers_collect (renderer);
+
+  /* Pick up the programs that finished compiling since the last frame */
+  gthree_program_cache_poll (priv->program_cache);
+
   push_debug_group ("gthree render to %p", priv->current_render_target);
+  gthree_renderer_push_gpu_timer (renderer, "render");
 
   g_list_free (priv->lights);
   priv->lights = NULL;
@@ -3228,10 +5790,11 @@ gthree_renderer_render (GthreeRenderer *renderer,
   priv->current_geometry_program_geometry = NULL;
   priv->current_geometry_program_program = NULL;
   priv->current_geometry_program_wireframe = FALSE;
+  priv->current_geometry_program_instances = NULL;
 
   /* update scene graph */
 
-  gthree_object_update_matrix_world (GTHREE_OBJECT (scene), FALSE);
+  gthree_scene_update_matrix_world (scene);
 
   /* update camera matrices and frustum */
 
@@ -3248,12 +5811,50 @@ gthree_renderer_render (GthreeRenderer *renderer,
   /* Flush lazily deleted resources to avoid leaking until widget unrealize */
   gthree_renderer_flush_deletes (renderer);
 
+  ++priv->frame_count;
+  if (priv->frame_count % VERTEX_ARRAY_MAX_AGE == 0)
+    vertex_arrays_collect_unused (renderer);
+  if (priv->frame_count % OCCLUSION_QUERY_MAX_AGE == 0)
+    occlusion_queries_collect_unused (renderer);
+
+  if (!priv->explicit_frames || priv->frame_pending)
+    {
+      priv->frame_pending = FALSE;
+      evicted = gthree_program_cache_collect (priv->program_cache, ++priv->program_cache_frame,
+                                              priv->program_cache_max_unused_frames,
+                                              priv->program_cache_max_programs,
+                                              &evicted_bytes);
+      if (evicted > 0)
+        {
+          priv->frame_stats.programs_evicted += evicted;
+          priv->frame_stats.program_bytes_evicted += evicted_bytes;
+          /* A new program could be allocated at the same address */
+          priv->current_program = NULL;
+        }
+    }
+
+  /* Occluders are rasterized while the scene is projected */
+  if (priv->software_occlusion_culling)
+    software_occlusion_begin (renderer, scene, camera);
+
   gthree_render_list_init (priv->current_render_list);
 
-  project_object (renderer, scene, GTHREE_OBJECT (scene), camera);
+  {
+    GTHREE_TRACE_BEGIN (trace_project);
+
+    if (priv->retained_mode)
+      project_retained (renderer, scene, camera);
+    else
+      project_object (renderer, scene, GTHREE_OBJECT (scene), camera, FALSE);
+
+    GTHREE_TRACE_END_FORMAT (trace_project, "project", "%u items", priv->current_render_list->items->len);
+  }
+
+  if (priv->software_occlusion_culling)
+    software_occlusion_cull (renderer);
 
   if (priv->sort_objects)
-    gthree_render_list_sort (priv->current_render_list);
+    gthree_render_list_sort (priv->current_render_list, priv->opaque_sort_mode);
 
   if (priv->clipping_enabled )
     clipping_begin_shadows (renderer);
@@ -3262,12 +5863,17 @@ gthree_renderer_render (GthreeRenderer *renderer,
 
   setup_lights (renderer, camera);
 
+  if (priv->supports_uniform_blocks)
+    update_light_uniform_blocks (renderer);
+
   if (priv->clipping_enabled)
     clipping_end_shadows (renderer);
 
   gthree_renderer_set_render_target (renderer, priv->current_render_target, 0, 0);
 
+  gthree_renderer_push_gpu_timer (renderer, "clear");
   gthree_renderer_render_background (renderer, scene);
+  gthree_renderer_pop_gpu_timer (renderer);
 
   /* set matrices for regular objects (frustum culled) */
 
@@ -3287,21 +5893,41 @@ gthree_renderer_render (GthreeRenderer *renderer,
       polygon_offset = gthree_material_get_polygon_offset (override_material, &factor, &units);
       set_polygon_offset (renderer, polygon_offset, factor, units);
 
+      gthree_renderer_push_gpu_timer (renderer, "background");
       render_objects (renderer, scene, priv->current_render_list->background, camera, fog, TRUE, override_material );
+      gthree_renderer_pop_gpu_timer (renderer);
+      gthree_renderer_push_gpu_timer (renderer, "opaque");
       render_objects (renderer, scene, priv->current_render_list->opaque, camera, fog, TRUE, override_material );
+      gthree_renderer_pop_gpu_timer (renderer);
+      issue_occlusion_queries (renderer);
+      gthree_renderer_push_gpu_timer (renderer, "transparent");
       render_objects (renderer, scene, priv->current_render_list->transparent, camera, fog, TRUE, override_material );
+      gthree_renderer_pop_gpu_timer (renderer);
     }
   else
     {
       set_blending (renderer, GTHREE_BLEND_NO, 0, 0, 0);
 
+      gthree_renderer_push_gpu_timer (renderer, "background");
       render_objects (renderer, scene, priv->current_render_list->background, camera, fog, FALSE, NULL);
+      gthree_renderer_pop_gpu_timer (renderer);
+
+      if (priv->depth_prepass)
+        render_depth_prepass (renderer, scene, camera);
 
       // opaque pass (front-to-back order)
+      gthree_renderer_push_gpu_timer (renderer, "opaque");
       render_objects (renderer, scene, priv->current_render_list->opaque, camera, fog, FALSE, NULL);
+      set_depth_func (renderer, GL_LEQUAL);
+      gthree_renderer_pop_gpu_timer (renderer);
+
+      /* The opaque depth buffer is complete here */
+      issue_occlusion_queries (renderer);
 
       // transparent pass (back-to-front order)
+      gthree_renderer_push_gpu_timer (renderer, "transparent");
       render_objects (renderer, scene, priv->current_render_list->transparent, camera, fog, TRUE, NULL);
+      gthree_renderer_pop_gpu_timer (renderer);
     }
 
   if (priv->current_render_target != NULL)
@@ -3312,9 +5938,14 @@ gthree_renderer_render (GthreeRenderer *renderer,
       update_multisample_render_target (renderer, priv->current_render_target);
     }
 
+  glBindVertexArray (priv->vertex_array_object);
+
+  gthree_renderer_pop_gpu_timer (renderer);
   pop_debug_group ();
 
   gthree_renderer_pop_current (renderer);
+
+  GTHREE_TRACE_END (trace_render, "render");
 }
 
 guint
@@ -3341,6 +5972,8 @@ gthree_render_list_new ()
   list->opaque = g_array_new (FALSE, FALSE, sizeof (int));
   list->transparent = g_array_new (FALSE, FALSE, sizeof (int));
   list->background = g_array_new (FALSE, FALSE, sizeof (int));
+  list->sort_entries = g_array_new (FALSE, FALSE, sizeof (GthreeRenderListSortEntry));
+  list->sort_entries_tmp = g_array_new (FALSE, FALSE, sizeof (GthreeRenderListSortEntry));
 
   return list;
 }
@@ -3352,6 +5985,8 @@ gthree_render_list_free (GthreeRenderList *list)
   g_array_unref (list->opaque);
   g_array_unref (list->transparent);
   g_array_unref (list->background);
+  g_array_unref (list->sort_entries);
+  g_array_unref (list->sort_entries_tmp);
   g_free (list);
 }
 
@@ -3366,65 +6001,180 @@ gthree_render_list_init (GthreeRenderList *list)
   g_array_set_size (list->background, 0);
 }
 
-static gint
-render_list_painter_sort_stable (gconstpointer _a, gconstpointer _b, gpointer user_data)
+/* The depth is in normalized device coordinates, i.e. -1 to 1 */
+static guint64
+render_list_quantize_depth (float z)
+{
+  float d = CLAMP (z * 0.5f + 0.5f, 0.0f, 1.0f);
+
+  return (guint64)(d * 0xffff) & 0xffff;
+}
+
+static guint64
+render_list_item_state_bits (GthreeRenderListItem *item)
+{
+  GthreeMaterialProperties *material_properties = gthree_material_get_properties (item->material);
+  GthreeMaterialVariant *variant = &material_properties->variants[get_material_variant (item->object, FALSE)];
+
+  /* These wrap at 16 bits, which may cause some extra state changes
+   * in very large scenes, but never incorrect rendering */
+  return
+    ((guint64)(variant->program_id & 0xffff) << 32) |
+    ((guint64)(gthree_material_get_id (item->material) & 0xffff) << 16) |
+    ((guint64)(gthree_geometry_get_id (item->geometry) & 0xffff));
+}
+
+static guint64
+render_list_item_opaque_key (GthreeRenderListItem *item,
+                             GthreeSortMode mode)
+{
+  guint64 depth = render_list_quantize_depth (item->z);
+  guint64 state = render_list_item_state_bits (item);
+
+  if (mode == GTHREE_SORT_MODE_DEPTH_FIRST)
+    return depth << 48 | state;
+  else
+    return state << 16 | depth;
+}
+
+/* Maps the float bits so that unsigned integer order matches the
+ * float order, including for negative values */
+static guint32
+render_list_float_key (float z)
+{
+  union { float f; guint32 i; } u = { z };
+
+  if (u.i & 0x80000000)
+    return ~u.i;
+  else
+    return u.i | 0x80000000;
+}
+
+/* Transparent items must be drawn strictly back-to-front, so these are
+ * sorted on the full depth rather than the quantized one, and never
+ * by state. The sort is stable, so items at the same depth (like the
+ * groups of a multi-material object) keep their push order. */
+static guint64
+render_list_item_transparent_key (GthreeRenderListItem *item)
+{
+  /* Back-to-front, so invert the depth */
+  guint32 depth = ~render_list_float_key (item->z);
+
+  return (guint64)depth << 32;
+}
+
+/* Stable LSD radix sort, 8 bits per pass. Passes where all keys have
+ * the same byte are skipped, which is common for the high bits of the
+ * ids. */
+static void
+render_list_radix_sort (GthreeRenderList *list,
+                        GArray *indexes)
 {
-  GthreeRenderList *list = user_data;
-  int ai = *(int *)_a;
-  int bi = *(int *)_b;
-  GthreeRenderListItem *a = &g_array_index (list->items, GthreeRenderListItem, ai);
-  GthreeRenderListItem *b = &g_array_index (list->items, GthreeRenderListItem, bi);
+  GthreeRenderListSortEntry *src, *dst, *tmp;
+  guint counts[256];
+  guint n = indexes->len;
+  guint i, pass;
+
+  if (n < 2)
+    return;
 
-  if (a->z != b->z)
+  g_array_set_size (list->sort_entries, n);
+  g_array_set_size (list->sort_entries_tmp, n);
+  src = (GthreeRenderListSortEntry *)list->sort_entries->data;
+  dst = (GthreeRenderListSortEntry *)list->sort_entries_tmp->data;
+
+  for (i = 0; i < n; i++)
     {
-      if (a->z > b->z)
-        return 1;
-      else
-        return -1;
+      int index = g_array_index (indexes, int, i);
+      src[i].index = index;
+      src[i].key = g_array_index (list->items, GthreeRenderListItem, index).sort_key;
     }
-  else if (a->object != b->object)
+
+  for (pass = 0; pass < 8; pass++)
     {
-      if ((gsize)a->object > (gsize)b->object)
-        return 1;
-      else
-        return -1;
+      guint shift = pass * 8;
+      guint offset = 0;
+
+      memset (counts, 0, sizeof (counts));
+      for (i = 0; i < n; i++)
+        counts[(src[i].key >> shift) & 0xff]++;
+
+      if (counts[(src[0].key >> shift) & 0xff] == n)
+        continue;
+
+      for (i = 0; i < 256; i++)
+        {
+          guint c = counts[i];
+          counts[i] = offset;
+          offset += c;
+        }
+
+      for (i = 0; i < n; i++)
+        dst[counts[(src[i].key >> shift) & 0xff]++] = src[i];
+
+      tmp = src;
+      src = dst;
+      dst = tmp;
     }
 
-  return 0;
+  for (i = 0; i < n; i++)
+    g_array_index (indexes, int, i) = src[i].index;
 }
 
-static gint
-render_list_reverse_painter_sort_stable (gconstpointer _a, gconstpointer _b, gpointer user_data)
+void
+gthree_render_list_sort (GthreeRenderList *list,
+                         GthreeSortMode opaque_sort_mode)
 {
-  GthreeRenderList *list = user_data;
-  int ai = *(int *)_a;
-  int bi = *(int *)_b;
-  GthreeRenderListItem *a = &g_array_index (list->items, GthreeRenderListItem, ai);
-  GthreeRenderListItem *b = &g_array_index (list->items, GthreeRenderListItem, bi);
+  int i;
 
-  if (a->z != b->z)
+  for (i = 0; i < list->opaque->len; i++)
     {
-      if (b->z > a->z)
-        return 1;
-      else
-        return -1;
+      GthreeRenderListItem *item = &g_array_index (list->items, GthreeRenderListItem, g_array_index (list->opaque, int, i));
+      item->sort_key = render_list_item_opaque_key (item, opaque_sort_mode);
     }
-  else if (a->object != b->object)
+
+  for (i = 0; i < list->transparent->len; i++)
     {
-      if ((gsize)a->object > (gsize)b->object)
-        return 1;
-      else
-        return -1;
+      GthreeRenderListItem *item = &g_array_index (list->items, GthreeRenderListItem, g_array_index (list->transparent, int, i));
+      item->sort_key = render_list_item_transparent_key (item);
     }
 
-  return 0;
+  render_list_radix_sort (list, list->opaque);
+  render_list_radix_sort (list, list->transparent);
+}
+
+/* The sorted items, in draw order. Only used by the tests. */
+gboolean
+gthree_render_list_peek_item (GthreeRenderList  *list,
+                              gboolean           transparent,
+                              guint              i,
+                              GthreeGeometry   **geometry,
+                              GthreeMaterial   **material,
+                              float             *z)
+{
+  GArray *indexes = transparent ? list->transparent : list->opaque;
+  GthreeRenderListItem *item;
+
+  if (i >= indexes->len)
+    return FALSE;
+
+  item = &g_array_index (list->items, GthreeRenderListItem, g_array_index (indexes, int, i));
+  if (geometry)
+    *geometry = item->geometry;
+  if (material)
+    *material = item->material;
+  if (z)
+    *z = item->z;
+
+  return TRUE;
 }
 
+/* The depth of the items pushed after this, in normalized device coordinates */
 void
-gthree_render_list_sort (GthreeRenderList *list)
+gthree_render_list_set_current_z (GthreeRenderList *list,
+                                  float             z)
 {
-  g_array_sort_with_data (list->opaque, render_list_painter_sort_stable, list);
-  g_array_sort_with_data (list->transparent, render_list_reverse_painter_sort_stable, list);
+  list->current_z = z;
 }
 
 void
@@ -3434,7 +6184,7 @@ gthree_render_list_push (GthreeRenderList *list,
                          GthreeMaterial *material,
                          GthreeGeometryGroup *group)
 {
-  GthreeRenderListItem item = { object, geometry, material, group, list->current_z };
+  GthreeRenderListItem item = { object, geometry, material, group, list->current_z, 0 };
   int index = list->items->len;
 
   g_array_append_val (list->items, item);
@@ -29,6 +29,51 @@ typedef struct {
 
 } GthreeRendererClass;
 
+typedef struct {
+  guint   draw_calls;
+  guint64 triangles;
+  guint64 lines;
+  guint64 points;
+  guint   program_switches;
+  guint   material_refreshes;
+  guint   uniform_uploads;
+  guint64 buffer_upload_bytes;
+  guint64 texture_upload_bytes;
+  guint   shadow_map_renders;
+  guint   objects_drawn;
+  guint   objects_culled;
+  guint   occlusion_queries; /* Not included in draw_calls or triangles */
+  guint   programs_evicted;
+  guint64 program_bytes_evicted;
+
+  /*< private >*/
+  guint64 padding[6];
+} GthreeRenderStats;
+
+typedef struct {
+  GthreeRenderStats frame; /* Since the last reset */
+  GthreeRenderStats total; /* Since the renderer was created */
+  guint64 renders;         /* Number of gthree_renderer_render() calls */
+
+  guint   programs;
+  guint64 program_bytes;
+  guint   geometries;
+  guint64 geometry_bytes;
+  guint   textures;
+  guint64 texture_bytes;
+  guint   render_targets;
+  guint64 render_target_bytes;
+
+  /*< private >*/
+  guint64 padding[8];
+} GthreeRendererInfo;
+
+typedef struct {
+  const char *name;
+  int         depth;   /* Nesting level of the timer */
+  guint64     time_ns;
+} GthreeGpuTiming;
+
 GTHREE_API
 GthreeRenderer *gthree_renderer_new ();
 GTHREE_API
@@ -87,6 +132,80 @@ void                gthree_renderer_set_gamma_factor          (GthreeRenderer
 GTHREE_API
 float               gthree_renderer_get_gamma_factor          (GthreeRenderer     *renderer);
 GTHREE_API
+void                gthree_renderer_set_opaque_sort_mode      (GthreeRenderer     *renderer,
+                                                               GthreeSortMode      mode);
+GTHREE_API
+GthreeSortMode      gthree_renderer_get_opaque_sort_mode      (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_retained_mode         (GthreeRenderer     *renderer,
+                                                               gboolean            retained);
+GTHREE_API
+gboolean            gthree_renderer_get_retained_mode         (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_occlusion_culling     (GthreeRenderer     *renderer,
+                                                               gboolean            occlusion_culling);
+GTHREE_API
+gboolean            gthree_renderer_get_occlusion_culling     (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_software_occlusion_culling (GthreeRenderer     *renderer,
+                                                                    gboolean            software_occlusion_culling);
+GTHREE_API
+gboolean            gthree_renderer_get_software_occlusion_culling (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_depth_prepass         (GthreeRenderer     *renderer,
+                                                               gboolean            depth_prepass);
+GTHREE_API
+gboolean            gthree_renderer_get_depth_prepass         (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_async_compile         (GthreeRenderer     *renderer,
+                                                               gboolean            async_compile);
+GTHREE_API
+gboolean            gthree_renderer_get_async_compile         (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_program_binary_cache_dir (GthreeRenderer *renderer,
+                                                                  const char     *directory);
+GTHREE_API
+const char *        gthree_renderer_get_program_binary_cache_dir (GthreeRenderer *renderer);
+GTHREE_API
+void                gthree_renderer_set_program_binary_cache_max_size (GthreeRenderer *renderer,
+                                                                       guint64         max_size);
+GTHREE_API
+guint64             gthree_renderer_get_program_binary_cache_max_size (GthreeRenderer *renderer);
+GTHREE_API
+void                gthree_renderer_set_program_cache_max_unused_frames (GthreeRenderer *renderer,
+                                                                         guint           frames);
+GTHREE_API
+guint               gthree_renderer_get_program_cache_max_unused_frames (GthreeRenderer *renderer);
+GTHREE_API
+void                gthree_renderer_begin_frame               (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_program_cache_max_programs (GthreeRenderer *renderer,
+                                                                    guint           max_programs);
+GTHREE_API
+guint               gthree_renderer_get_program_cache_max_programs (GthreeRenderer *renderer);
+GTHREE_API
+void                gthree_renderer_set_info_auto_reset       (GthreeRenderer     *renderer,
+                                                               gboolean            auto_reset);
+GTHREE_API
+gboolean            gthree_renderer_get_info_auto_reset       (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_get_info                  (GthreeRenderer     *renderer,
+                                                               GthreeRendererInfo *info);
+GTHREE_API
+void                gthree_renderer_reset_info                (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_gpu_timing            (GthreeRenderer     *renderer,
+                                                               gboolean            gpu_timing);
+GTHREE_API
+gboolean            gthree_renderer_get_gpu_timing            (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_push_gpu_timer            (GthreeRenderer     *renderer,
+                                                               const char         *name);
+GTHREE_API
+void                gthree_renderer_pop_gpu_timer             (GthreeRenderer     *renderer);
+GTHREE_API
+GArray             *gthree_renderer_get_gpu_timings           (GthreeRenderer     *renderer);
+GTHREE_API
 gboolean            gthree_renderer_get_shadow_map_enabled    (GthreeRenderer     *renderer);
 GTHREE_API
 void                gthree_renderer_set_shadow_map_enabled    (GthreeRenderer     *renderer,
@@ -146,6 +265,10 @@ void                gthree_renderer_render                    (GthreeRenderer
                                                                GthreeScene        *scene,
                                                                GthreeCamera       *camera);
 GTHREE_API
+gboolean            gthree_renderer_compile                   (GthreeRenderer     *renderer,
+                                                               GthreeScene        *scene,
+                                                               GthreeCamera       *camera);
+GTHREE_API
 void                gthree_renderer_unrealize                 (GthreeRenderer     *renderer);
 
 
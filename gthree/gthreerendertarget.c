@@ -34,6 +34,9 @@ typedef struct {
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeRenderTarget, gthree_render_target, GTHREE_TYPE_RESOURCE)
 
+static gboolean texture_needs_generate_mipmaps (GthreeTexture *texture,
+                                                gboolean       is_power_of_two);
+
 static void
 gthree_render_target_init (GthreeRenderTarget *target)
 {
@@ -117,6 +120,37 @@ gthree_render_target_unrealize (GthreeResource *resource,
     }
 }
 
+/* The color texture is accounted here rather than as a texture,
+ * as it never has any image data uploaded */
+static gsize
+gthree_render_target_get_gl_bytes (GthreeResource *resource,
+                                   GthreeRenderer *renderer)
+{
+  GthreeRenderTarget *target = GTHREE_RENDER_TARGET (resource);
+  GthreeRenderTargetPrivate *priv = gthree_render_target_get_instance_private (target);
+  GthreeRenderTargetRealizeData *data = gthree_resource_get_data_for (resource, renderer);
+  gsize n_pixels = (gsize)priv->width * priv->height;
+  gsize bytes = 0;
+
+  if (data->gl_framebuffer == 0)
+    return 0;
+
+  if (priv->texture)
+    {
+      guint gl_format = gthree_texture_format_to_gl (gthree_texture_get_format (priv->texture));
+      guint gl_type = gthree_texture_data_type_to_gl (gthree_texture_get_data_type (priv->texture));
+
+      bytes += n_pixels * gthree_texture_get_gl_bytes_per_pixel (gl_format, gl_type);
+      if (texture_needs_generate_mipmaps (priv->texture, gthree_render_target_is_power_of_two (target)))
+        bytes += bytes / 3;
+    }
+
+  if (data->gl_depthbuffer)
+    bytes += n_pixels * (priv->stencil_buffer ? 4 : 2);
+
+  return bytes;
+}
+
 static void
 gthree_render_target_class_init (GthreeRenderTargetClass *klass)
 {
@@ -127,6 +161,7 @@ gthree_render_target_class_init (GthreeRenderTargetClass *klass)
   G_OBJECT_CLASS (klass)->finalize = gthree_render_target_finalize;
   resource_class->unrealize = gthree_render_target_unrealize;
   resource_class->set_used = gthree_render_target_set_used;
+  resource_class->get_gl_bytes = gthree_render_target_get_gl_bytes;
 }
 
 GthreeRenderTarget *
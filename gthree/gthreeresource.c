@@ -183,6 +183,20 @@ gthree_resource_get_dirty_for (GthreeResource  *resource,
 }
 
 
+/* Estimated size of the gl objects backing the resource */
+gsize
+gthree_resource_get_gl_bytes (GthreeResource *resource,
+                              GthreeRenderer *renderer)
+{
+  GthreeResourceClass *class = GTHREE_RESOURCE_GET_CLASS(resource);
+
+  if (class->get_gl_bytes == NULL ||
+      !gthree_resource_is_realized_for (resource, renderer))
+    return 0;
+
+  return class->get_gl_bytes (resource, renderer);
+}
+
 void
 gthree_resource_unrealize (GthreeResource *resource,
                            GthreeRenderer *renderer)
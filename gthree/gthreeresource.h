@@ -30,8 +30,10 @@ typedef struct {
                     gboolean        used);
   void (*unrealize) (GthreeResource *resource,
                      GthreeRenderer   *renderer);
+  gsize (*get_gl_bytes) (GthreeResource *resource,
+                         GthreeRenderer *renderer);
 
-  gpointer padding[8];
+  gpointer padding[7];
 } GthreeResourceClass;
 
 typedef struct {
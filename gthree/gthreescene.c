@@ -3,8 +3,11 @@
 
 #include "gthreescene.h"
 #include "gthreelight.h"
+#include "gthreelod.h"
 
 #include "gthreeobjectprivate.h"
+#include "gthreeprivate.h"
+#include "gthreestaticbatchprivate.h"
 
 typedef struct {
   graphene_vec3_t bg_color;
@@ -13,6 +16,9 @@ typedef struct {
   GthreeTexture *bg_texture;
   GthreeMaterial *override_material;
   GthreeFog *fog;
+  guint parallel_update_threshold;
+  GthreeTransformStore *transform_store;
+  GPtrArray *static_batches;
 } GthreeScenePrivate;
 
 
@@ -35,9 +41,26 @@ gthree_scene_init (GthreeScene *scene)
   GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
 
   priv->bg_alpha = -1;
+  priv->static_batches = g_ptr_array_new_with_free_func (g_object_unref);
   gthree_object_set_matrix_auto_update (GTHREE_OBJECT (scene), FALSE);
 }
 
+static void
+gthree_scene_dispose (GObject *obj)
+{
+  GthreeScene *scene = GTHREE_SCENE (obj);
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  g_clear_pointer (&priv->transform_store, gthree_transform_store_free);
+  if (priv->static_batches)
+    {
+      g_ptr_array_foreach (priv->static_batches, (GFunc)gthree_static_batch_release, NULL);
+      g_clear_pointer (&priv->static_batches, g_ptr_array_unref);
+    }
+
+  G_OBJECT_CLASS (gthree_scene_parent_class)->dispose (obj);
+}
+
 static void
 gthree_scene_finalize (GObject *obj)
 {
@@ -148,8 +171,208 @@ gthree_scene_set_fog (GthreeScene *scene,
   g_set_object (&priv->fog, fog);
 }
 
+/**
+ * gthree_scene_set_parallel_update_threshold:
+ * @scene: a #GthreeScene
+ * @n_objects: the minimum number of objects, or 0 to disable
+ *
+ * Enables updating the world matrices of the scene using multiple
+ * threads when the scene contains at least @n_objects objects. Smaller
+ * scenes are updated on the calling thread, as the overhead of
+ * distributing the work would outweigh the gains.
+ *
+ * The resulting matrices are identical to the ones from a serial
+ * update. Objects that override the update_matrix_world virtual
+ * function (and their children) are always updated on the calling
+ * thread.
+ *
+ * The default is 0, which means the update is always serial.
+ */
+void
+gthree_scene_set_parallel_update_threshold (GthreeScene *scene,
+                                            guint        n_objects)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  priv->parallel_update_threshold = n_objects;
+}
+
+guint
+gthree_scene_get_parallel_update_threshold (GthreeScene *scene)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  return priv->parallel_update_threshold;
+}
+
+/**
+ * gthree_scene_set_use_transform_store:
+ * @scene: a #GthreeScene
+ * @use_transform_store: whether to use a transform store
+ *
+ * Makes the scene keep the local and world matrices of all its
+ * objects in contiguous arrays, ordered depth first. This makes
+ * updating the world matrices a single linear pass over memory, which
+ * is considerably faster for large scenes with many moving objects.
+ *
+ * The arrays are rebuilt whenever objects are added or removed, so this
+ * is best suited for scenes where the structure changes rarely. When
+ * enabled, the parallel update threshold is ignored.
+ */
+void
+gthree_scene_set_use_transform_store (GthreeScene *scene,
+                                      gboolean     use_transform_store)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  use_transform_store = !!use_transform_store;
+  if ((priv->transform_store != NULL) == use_transform_store)
+    return;
+
+  if (use_transform_store)
+    priv->transform_store = gthree_transform_store_new (GTHREE_OBJECT (scene));
+  else
+    g_clear_pointer (&priv->transform_store, gthree_transform_store_free);
+}
+
+gboolean
+gthree_scene_get_use_transform_store (GthreeScene *scene)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  return priv->transform_store != NULL;
+}
+
+static void
+collect_static_meshes (GthreeObject *object,
+                       GHashTable   *buckets,
+                       GPtrArray    *keys)
+{
+  GthreeObject *child;
+  GthreeObjectIter iter;
+  char *key;
+
+  key = gthree_static_batch_get_key (object);
+  if (key)
+    {
+      GPtrArray *meshes = g_hash_table_lookup (buckets, key);
+
+      if (meshes == NULL)
+        {
+          meshes = g_ptr_array_new ();
+          g_hash_table_insert (buckets, key, meshes);
+          g_ptr_array_add (keys, key);
+        }
+      else
+        g_free (key);
+
+      g_ptr_array_add (meshes, object);
+    }
+
+  /* Only one level of a lod is drawn at a time */
+  if (GTHREE_IS_LOD (object))
+    return;
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    collect_static_meshes (child, buckets, keys);
+}
+
+/**
+ * gthree_scene_build_static_batches:
+ * @scene: a #GthreeScene
+ *
+ * Merges the meshes in the scene that are marked static with
+ * gthree_object_set_is_static() and share a material into combined
+ * vertex and index buffers, so that each such set is drawn with as
+ * few draw calls as possible. The vertices are stored pre-transformed,
+ * so only plain meshes with a single material qualify, and
+ * transparent materials are skipped as they need per-object sorting.
+ *
+ * The batches track their members every frame: hiding a member
+ * removes its range from the draw, moving it rewrites its vertices,
+ * and changing its geometry, material or parent makes it render on its
+ * own again. Meshes that became static after this call are only picked
+ * up when it is called again, which also compacts the buffers.
+ *
+ * Note that members of a batch are frustum culled together.
+ */
+void
+gthree_scene_build_static_batches (GthreeScene *scene)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+  g_autoptr(GHashTable) buckets = NULL;
+  g_autoptr(GPtrArray) keys = NULL;
+  guint i;
+
+  gthree_scene_clear_static_batches (scene);
+
+  /* Vertices are baked with the current world matrices */
+  gthree_scene_update_matrix_world (scene);
+
+  buckets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+  keys = g_ptr_array_new ();
+  collect_static_meshes (GTHREE_OBJECT (scene), buckets, keys);
+
+  for (i = 0; i < keys->len; i++)
+    {
+      GPtrArray *meshes = g_hash_table_lookup (buckets, g_ptr_array_index (keys, i));
+      GthreeStaticBatch *batch;
+
+      /* Nothing to gain from a single mesh */
+      if (meshes->len < 2)
+        continue;
+
+      batch = gthree_static_batch_new (scene, meshes);
+      gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (batch));
+      g_ptr_array_add (priv->static_batches, batch);
+    }
+}
+
+/**
+ * gthree_scene_clear_static_batches:
+ * @scene: a #GthreeScene
+ *
+ * Removes all batches created by gthree_scene_build_static_batches(),
+ * so their members are rendered individually again.
+ */
+void
+gthree_scene_clear_static_batches (GthreeScene *scene)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+  guint i;
+
+  for (i = 0; i < priv->static_batches->len; i++)
+    {
+      GthreeObject *batch = g_ptr_array_index (priv->static_batches, i);
+
+      gthree_static_batch_release (GTHREE_STATIC_BATCH (batch));
+      if (gthree_object_get_parent (batch) == GTHREE_OBJECT (scene))
+        gthree_object_remove_child (GTHREE_OBJECT (scene), batch);
+    }
+
+  g_ptr_array_set_size (priv->static_batches, 0);
+}
+
+void
+gthree_scene_update_matrix_world (GthreeScene *scene)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+  guint i;
+
+  if (priv->transform_store)
+    gthree_transform_store_update_matrix_world (priv->transform_store, FALSE);
+  else
+    gthree_object_update_matrix_world_parallel (GTHREE_OBJECT (scene), FALSE,
+                                                priv->parallel_update_threshold);
+
+  for (i = 0; i < priv->static_batches->len; i++)
+    gthree_static_batch_sync (g_ptr_array_index (priv->static_batches, i));
+}
+
 static void
 gthree_scene_class_init (GthreeSceneClass *klass)
 {
+  G_OBJECT_CLASS (klass)->dispose = gthree_scene_dispose;
   G_OBJECT_CLASS (klass)->finalize = gthree_scene_finalize;
 }
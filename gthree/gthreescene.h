@@ -60,6 +60,20 @@ GthreeFog *     gthree_scene_get_fog                (GthreeScene   *scene);
 GTHREE_API
 void            gthree_scene_set_fog                (GthreeScene   *scene,
                                                      GthreeFog     *fog);
+GTHREE_API
+guint           gthree_scene_get_parallel_update_threshold (GthreeScene *scene);
+GTHREE_API
+void            gthree_scene_set_parallel_update_threshold (GthreeScene *scene,
+                                                            guint        n_objects);
+GTHREE_API
+gboolean        gthree_scene_get_use_transform_store (GthreeScene *scene);
+GTHREE_API
+void            gthree_scene_set_use_transform_store (GthreeScene *scene,
+                                                      gboolean     use_transform_store);
+GTHREE_API
+void            gthree_scene_build_static_batches    (GthreeScene *scene);
+GTHREE_API
+void            gthree_scene_clear_static_batches    (GthreeScene *scene);
 
 G_END_DECLS
 
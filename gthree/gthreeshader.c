@@ -15,8 +15,15 @@ typedef struct {
   char *fragment_shader_text;
   GthreeShader *owner_of_shader_text;
   guint hash;
+
+  /* Flattened uniforms, one for each program the shader was recently
+   * used with (like the variants of a material), oldest first */
+  GPtrArray *uniform_tables;
+  guint locations_program_id; /* The program the uniform locations are set for */
 } GthreeShaderPrivate;
 
+#define MAX_UNIFORM_TABLES 8
+
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeShader, gthree_shader, G_TYPE_OBJECT);
 
 static void gthree_shader_init_libs ();
@@ -72,6 +79,7 @@ gthree_shader_finalize (GObject *obj)
 
   g_free (priv->name);
   g_clear_pointer (&priv->defines, g_ptr_array_unref);
+  g_clear_pointer (&priv->uniform_tables, g_ptr_array_unref);
   g_clear_object (&priv->uniforms);
 
   if (priv->owner_of_shader_text)
@@ -206,6 +214,8 @@ gthree_shader_update_uniform_locations_for_program (GthreeShader *shader,
   GthreeShaderPrivate *priv = gthree_shader_get_instance_private (shader);
   GList *unis, *l, *ll;
 
+  priv->locations_program_id = gthree_program_get_id (program);
+
   unis = gthree_uniforms_get_all (priv->uniforms);
   for (l = unis; l != NULL; l = l->next)
     {
@@ -263,6 +273,53 @@ gthree_shader_update_uniform_locations_for_program (GthreeShader *shader,
   g_list_free (unis);
 }
 
+void
+gthree_shader_load_uniforms (GthreeShader   *shader,
+                             GthreeProgram  *program,
+                             GthreeRenderer *renderer)
+{
+  GthreeShaderPrivate *priv = gthree_shader_get_instance_private (shader);
+  GthreeUniformTable *table = NULL;
+  guint program_id = gthree_program_get_id (program);
+  int i;
+
+  if (priv->uniform_tables == NULL)
+    priv->uniform_tables = g_ptr_array_new_with_free_func ((GDestroyNotify)gthree_uniform_table_free);
+
+  for (i = 0; i < priv->uniform_tables->len; i++)
+    {
+      GthreeUniformTable *t = g_ptr_array_index (priv->uniform_tables, i);
+
+      if (gthree_uniform_table_get_program_id (t) == program_id)
+        {
+          if (gthree_uniform_table_is_valid_for (t, priv->uniforms, program))
+            table = t;
+          else
+            g_ptr_array_remove_index (priv->uniform_tables, i);
+          break;
+        }
+    }
+
+  if (table == NULL)
+    {
+      /* Uniforms may have been added or replaced since the locations were looked up */
+      gthree_shader_update_uniform_locations_for_program (shader, program);
+      table = gthree_uniform_table_new (priv->uniforms, program);
+
+      if (priv->uniform_tables->len == MAX_UNIFORM_TABLES)
+        g_ptr_array_remove_index (priv->uniform_tables, 0);
+      g_ptr_array_add (priv->uniform_tables, table);
+    }
+  else if (priv->locations_program_id != program_id)
+    {
+      /* Some uniforms are loaded directly, not from the table */
+      gthree_uniform_table_apply_locations (table);
+      priv->locations_program_id = program_id;
+    }
+
+  gthree_uniform_table_load (table, program, renderer);
+}
+
 GPtrArray *
 gthree_shader_get_defines (GthreeShader  *shader)
 {
@@ -347,18 +404,48 @@ gthree_shader_clone (GthreeShader *orig)
   return clone;
 }
 
+/* Chunks are included by many shaders, so keep them around */
+static GHashTable *chunk_cache;
+G_LOCK_DEFINE_STATIC (chunk_cache);
+
+static GBytes *
+lookup_chunk (const char *name)
+{
+  GBytes *bytes;
+
+  G_LOCK (chunk_cache);
+
+  if (chunk_cache == NULL)
+    chunk_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_bytes_unref);
+
+  bytes = g_hash_table_lookup (chunk_cache, name);
+  if (bytes == NULL)
+    {
+      g_autofree char *full_path = g_strconcat ("/org/gnome/gthree/shader_chunks/", name, ".glsl", NULL);
+
+      bytes = g_resources_lookup_data (full_path, 0, NULL);
+      if (bytes)
+        g_hash_table_insert (chunk_cache, g_strdup (name), bytes);
+    }
+
+  G_UNLOCK (chunk_cache);
+
+  return bytes;
+}
+
 static void
-parse_include (char *file,
+parse_include (const char *file,
+               const char *file_end,
                GString *s)
 {
+  g_autofree char *name = NULL;
   GBytes *bytes;
-  char *end;
-  g_autofree char *full_path = NULL;
+  const char *end;
 
-  while (*file != '<' && *file != 0)
+  while (file < file_end && *file != '<')
     file++;
 
-  if (*file == 0)
+  if (file == file_end)
     {
       g_warning ("No initial \" in include");
       return;
@@ -367,58 +454,62 @@ parse_include (char *file,
   file++;
 
   end = file;
-  while (*end != '>' && *end != 0)
+  while (end < file_end && *end != '>')
     end++;
 
-  if (*end == 0)
+  if (end == file_end)
     {
       g_warning ("No final \" in include");
       return;
     }
 
-  *end = 0;
+  name = g_strndup (file, end - file);
 
-  full_path = g_strconcat ("/org/gnome/gthree/shader_chunks/", file, ".glsl", NULL);
-  bytes = g_resources_lookup_data (full_path, 0, NULL);
+  bytes = lookup_chunk (name);
   if (bytes == NULL)
     {
-      g_warning ("shader snipped %s not found", file);
+      g_warning ("shader snipped %s not found", name);
       return;
     }
 
-  g_string_append_printf (s, "// Include: %s\n", file);
+  g_string_append_printf (s, "// Include: %s\n", name);
   g_string_append_len (s,
                         g_bytes_get_data (bytes, NULL),
                         g_bytes_get_size (bytes));
   g_string_append_c (s, '\n');
-  g_bytes_unref (bytes);
 }
 
-static char *
-parse_text_with_includes (const char *text)
+/* Replaces all "#include <chunk>" lines with the chunk text */
+char *
+gthree_shader_expand_includes (const char *text)
 {
   GString *s;
-  char **lines;
-  int i;
+  const char *line, *line_end, *p;
 
-  s = g_string_new ("");
+  s = g_string_sized_new (strlen (text));
 
-  lines = g_strsplit (text, "\n", -1);
-  for (i = 0; lines[i] != NULL; i++)
+  line = text;
+  while (line != NULL)
     {
-      char *line = lines[i];
-      while (g_ascii_isspace (*line))
-        line++;
-      if (g_str_has_prefix (line, "#include"))
-        parse_include (lines[i] + strlen ("#include"), s);
+      line_end = strchr (line, '\n');
+      if (line_end == NULL)
+        line_end = line + strlen (line);
+
+      p = line;
+      while (p < line_end && g_ascii_isspace (*p))
+        p++;
+
+      if ((gsize)(line_end - p) >= strlen ("#include") &&
+          strncmp (p, "#include", strlen ("#include")) == 0)
+        parse_include (p + strlen ("#include"), line_end, s);
       else
         {
-          g_string_append (s, lines[i]);
+          g_string_append_len (s, line, line_end - line);
           g_string_append_c (s, '\n');
         }
-    }
 
-  g_strfreev (lines);
+      line = *line_end ? line_end + 1 : NULL;
+    }
 
   return g_string_free (s, FALSE);
 }
@@ -456,13 +547,13 @@ gthree_shader_new_from_definitions (const char **lib_uniforms,
   vertex_path = g_strconcat ("/org/gnome/gthree/shader_lib/", vertex_shader_name, ".glsl", NULL);
   vertex_bytes = g_resources_lookup_data (vertex_path, 0, NULL);
   g_assert (vertex_bytes != NULL);
-  priv->vertex_shader_text = parse_text_with_includes (g_bytes_get_data (vertex_bytes, NULL));
+  priv->vertex_shader_text = gthree_shader_expand_includes (g_bytes_get_data (vertex_bytes, NULL));
   g_assert (priv->vertex_shader_text != NULL);
 
   fragment_path = g_strconcat ("/org/gnome/gthree/shader_lib/", fragment_shader_name, ".glsl", NULL);
   fragment_bytes = g_resources_lookup_data (fragment_path, 0, NULL);
   g_assert (fragment_bytes != NULL);
-  priv->fragment_shader_text = parse_text_with_includes (g_bytes_get_data (fragment_bytes, NULL));
+  priv->fragment_shader_text = gthree_shader_expand_includes (g_bytes_get_data (fragment_bytes, NULL));
   g_assert (priv->fragment_shader_text != NULL);
 
   if (defines)
@@ -149,19 +149,28 @@ gthree_sprite_fill_render_list (GthreeObject   *object,
 }
 
 static gboolean
-gthree_sprite_in_frustum (GthreeObject *object,
-                        const graphene_frustum_t *frustum)
+gthree_sprite_get_world_bounding_sphere (GthreeObject *object,
+                                         graphene_sphere_t *sphere)
 {
-  graphene_sphere_t sphere;
   graphene_point3d_t center;
 
-  graphene_sphere_init (&sphere,
+  graphene_sphere_init (sphere,
                         graphene_point3d_init (&center, 0, 0,0),
                         0.7071067811865476);
 
   graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
-                                    &sphere,
-                                    &sphere);
+                                    sphere,
+                                    sphere);
+  return TRUE;
+}
+
+static gboolean
+gthree_sprite_in_frustum (GthreeObject *object,
+                        const graphene_frustum_t *frustum)
+{
+  graphene_sphere_t sphere;
+
+  gthree_sprite_get_world_bounding_sphere (object, &sphere);
 
   return graphene_frustum_intersects_sphere (frustum, &sphere);
 }
@@ -259,6 +268,7 @@ gthree_sprite_class_init (GthreeSpriteClass *klass)
   gobject_class->finalize = gthree_sprite_finalize;
 
   object_class->in_frustum = gthree_sprite_in_frustum;
+  object_class->get_world_bounding_sphere = gthree_sprite_get_world_bounding_sphere;
   object_class->update = gthree_sprite_update;
   object_class->fill_render_list = gthree_sprite_fill_render_list;
   object_class->set_direct_uniforms = gthree_sprite_set_direct_uniforms;
@@ -0,0 +1,565 @@
+#include <string.h>
+
+#include "gthreestaticbatchprivate.h"
+#include "gthreeobjectprivate.h"
+#include "gthreeprivate.h"
+
+typedef struct {
+  GthreeMesh *mesh; /* Weak pointer */
+  GthreeGeometry *geometry;
+  guint32 transform_stamp; /* When the vertices were last written */
+
+  int vertex_start;
+  int vertex_count;
+  int index_start;
+  int index_count;
+
+  guint visible : 1;
+  guint removed : 1;
+} GthreeStaticBatchMember;
+
+typedef struct {
+  GthreeScene *scene;
+
+  GthreeStaticBatchMember *members;
+  guint n_members;
+
+  guint32 tree_stamp;
+  guint groups_dirty : 1;
+} GthreeStaticBatchPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (GthreeStaticBatch, gthree_static_batch, GTHREE_TYPE_MESH)
+
+static gboolean
+is_float_attribute (GthreeAttribute *attribute,
+                    int item_size)
+{
+  return
+    attribute != NULL &&
+    gthree_attribute_get_attribute_type (attribute) == GTHREE_ATTRIBUTE_TYPE_FLOAT &&
+    gthree_attribute_get_item_size (attribute) == item_size;
+}
+
+/* Returns a key that is the same for all meshes that can be merged
+ * into one batch, or NULL if the object can't be batched at all */
+char *
+gthree_static_batch_get_key (GthreeObject *object)
+{
+  GthreeMesh *mesh;
+  GthreeGeometry *geometry;
+  GthreeMaterial *material;
+  GthreeAttribute *index;
+  g_autoptr(GList) names = NULL;
+  GString *key;
+  GList *l;
+
+  /* Subclasses like skinned or instanced meshes transform on the gpu */
+  if (G_OBJECT_TYPE (object) != GTHREE_TYPE_MESH ||
+      !gthree_object_get_is_static (object))
+    return NULL;
+
+  mesh = GTHREE_MESH (object);
+  geometry = gthree_mesh_get_geometry (mesh);
+  if (geometry == NULL ||
+      gthree_mesh_get_n_materials (mesh) != 1 ||
+      gthree_mesh_get_draw_mode (mesh) != GTHREE_DRAW_MODE_TRIANGLES ||
+      gthree_geometry_has_morph_attributes (geometry) ||
+      gthree_geometry_get_draw_range_start (geometry) != 0 ||
+      gthree_geometry_get_draw_range_count (geometry) != -1)
+    return NULL;
+
+  /* Transparent objects need to be depth sorted individually */
+  material = gthree_mesh_get_material (mesh, 0);
+  if (material == NULL ||
+      gthree_material_get_is_transparent (material))
+    return NULL;
+
+  if (!is_float_attribute (gthree_geometry_get_position (geometry), 3) ||
+      (gthree_geometry_has_attribute (geometry, "normal") &&
+       !is_float_attribute (gthree_geometry_get_normal (geometry), 3)) ||
+      (gthree_geometry_has_attribute (geometry, "tangent") &&
+       !is_float_attribute (gthree_geometry_get_attribute (geometry, "tangent"), 4)))
+    return NULL;
+
+  index = gthree_geometry_get_index (geometry);
+  if (index != NULL &&
+      gthree_attribute_get_attribute_type (index) != GTHREE_ATTRIBUTE_TYPE_UINT16 &&
+      gthree_attribute_get_attribute_type (index) != GTHREE_ATTRIBUTE_TYPE_UINT32)
+    return NULL;
+
+  key = g_string_new (NULL);
+  g_string_append_printf (key, "%u:%d:%d:%x",
+                          gthree_material_get_id (material),
+                          gthree_object_get_cast_shadow (object),
+                          gthree_object_get_receive_shadow (object),
+                          gthree_object_get_layer_mask (object));
+
+  names = g_list_sort (gthree_geometry_get_attribute_names (geometry), (GCompareFunc)strcmp);
+  for (l = names; l != NULL; l = l->next)
+    {
+      const char *name = l->data;
+      GthreeAttribute *attribute = gthree_geometry_get_attribute (geometry, name);
+
+      g_string_append_printf (key, ":%s/%d/%d/%d", name,
+                              gthree_attribute_get_attribute_type (attribute),
+                              gthree_attribute_get_item_size (attribute),
+                              gthree_attribute_get_normalized (attribute));
+    }
+
+  return g_string_free (key, FALSE);
+}
+
+static gboolean
+is_transformed_attribute (const char *name)
+{
+  return
+    strcmp (name, "position") == 0 ||
+    strcmp (name, "normal") == 0 ||
+    strcmp (name, "tangent") == 0;
+}
+
+/* Returns FALSE if @object is no longer part of @scene */
+static gboolean
+member_get_visible (GthreeObject *object,
+                    GthreeObject *scene,
+                    gboolean     *visible)
+{
+  *visible = TRUE;
+  while (object != NULL && object != scene)
+    {
+      if (!gthree_object_get_visible (object))
+        *visible = FALSE;
+      object = gthree_object_get_parent (object);
+    }
+
+  return object == scene;
+}
+
+static void
+write_member_vertices (GthreeStaticBatch       *batch,
+                       GthreeStaticBatchMember *member)
+{
+  GthreeStaticBatchPrivate *priv = gthree_static_batch_get_instance_private (batch);
+  GthreeObject *object = GTHREE_OBJECT (member->mesh);
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (GTHREE_MESH (batch));
+  GthreeAttribute *src, *dst;
+  graphene_matrix_t scene_inverse, matrix, normal_matrix;
+  int i, n;
+
+  /* The batch is a child of the scene, so vertices are in scene space */
+  if (!graphene_matrix_inverse (gthree_object_get_world_matrix (GTHREE_OBJECT (priv->scene)), &scene_inverse))
+    graphene_matrix_init_identity (&scene_inverse);
+  graphene_matrix_multiply (gthree_object_get_world_matrix (object), &scene_inverse, &matrix);
+
+  if (graphene_matrix_inverse (&matrix, &normal_matrix))
+    graphene_matrix_transpose (&normal_matrix, &normal_matrix);
+  else
+    normal_matrix = matrix;
+
+  src = gthree_geometry_get_position (member->geometry);
+  dst = gthree_geometry_get_position (geometry);
+  n = MIN (member->vertex_count, gthree_attribute_get_count (src));
+  for (i = 0; i < n; i++)
+    {
+      graphene_point3d_t p, transformed;
+
+      gthree_attribute_get_point3d (src, i, &p);
+      graphene_matrix_transform_point3d (&matrix, &p, &transformed);
+      gthree_attribute_set_point3d (dst, member->vertex_start + i, &transformed);
+    }
+
+  src = gthree_geometry_get_normal (member->geometry);
+  dst = gthree_geometry_get_normal (geometry);
+  if (src && dst)
+    {
+      n = MIN (member->vertex_count, gthree_attribute_get_count (src));
+      for (i = 0; i < n; i++)
+        {
+          graphene_vec3_t v, transformed;
+          float x, y, z;
+
+          gthree_attribute_get_xyz (src, i, &x, &y, &z);
+          graphene_vec3_init (&v, x, y, z);
+          graphene_matrix_transform_vec3 (&normal_matrix, &v, &transformed);
+          graphene_vec3_normalize (&transformed, &transformed);
+          gthree_attribute_set_xyz (dst, member->vertex_start + i,
+                                    graphene_vec3_get_x (&transformed),
+                                    graphene_vec3_get_y (&transformed),
+                                    graphene_vec3_get_z (&transformed));
+        }
+    }
+
+  src = gthree_geometry_get_attribute (member->geometry, "tangent");
+  dst = gthree_geometry_get_attribute (geometry, "tangent");
+  if (src && dst)
+    {
+      n = MIN (member->vertex_count, gthree_attribute_get_count (src));
+      for (i = 0; i < n; i++)
+        {
+          graphene_vec3_t v, transformed;
+          float x, y, z, w;
+
+          gthree_attribute_get_xyzw (src, i, &x, &y, &z, &w);
+          graphene_vec3_init (&v, x, y, z);
+          graphene_matrix_transform_vec3 (&matrix, &v, &transformed);
+          graphene_vec3_normalize (&transformed, &transformed);
+          gthree_attribute_set_xyzw (dst, member->vertex_start + i,
+                                     graphene_vec3_get_x (&transformed),
+                                     graphene_vec3_get_y (&transformed),
+                                     graphene_vec3_get_z (&transformed),
+                                     w);
+        }
+    }
+
+  member->transform_stamp = gthree_object_get_transform_stamp (object);
+}
+
+/* The mesh is rendered on its own again from now on, its vertices
+ * stay in the buffers until the batches are rebuilt */
+static void
+drop_member (GthreeStaticBatch       *batch,
+             GthreeStaticBatchMember *member)
+{
+  GthreeStaticBatchPrivate *priv = gthree_static_batch_get_instance_private (batch);
+
+  member->removed = TRUE;
+  priv->groups_dirty = TRUE;
+
+  if (member->mesh)
+    {
+      g_object_remove_weak_pointer (G_OBJECT (member->mesh), (gpointer *)&member->mesh);
+      gthree_object_set_static_batched (GTHREE_OBJECT (member->mesh), FALSE);
+      member->mesh = NULL;
+    }
+
+  g_clear_object (&member->geometry);
+}
+
+/* Each run of consecutive visible members becomes one group, and
+ * each group is one draw call */
+static void
+update_groups (GthreeStaticBatch *batch)
+{
+  GthreeStaticBatchPrivate *priv = gthree_static_batch_get_instance_private (batch);
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (GTHREE_MESH (batch));
+  int start = -1, end = -1;
+  guint i;
+
+  gthree_geometry_clear_groups (geometry);
+
+  for (i = 0; i < priv->n_members; i++)
+    {
+      GthreeStaticBatchMember *member = &priv->members[i];
+
+      if (member->removed || !member->visible || member->index_count == 0)
+        continue;
+
+      if (start >= 0 && member->index_start == end)
+        {
+          end += member->index_count;
+          continue;
+        }
+
+      if (start >= 0)
+        gthree_geometry_add_group (geometry, start, end - start, 0);
+
+      start = member->index_start;
+      end = start + member->index_count;
+    }
+
+  if (start >= 0)
+    gthree_geometry_add_group (geometry, start, end - start, 0);
+
+  priv->groups_dirty = FALSE;
+}
+
+GthreeStaticBatch *
+gthree_static_batch_new (GthreeScene *scene,
+                         GPtrArray   *meshes)
+{
+  GthreeMesh *first = g_ptr_array_index (meshes, 0);
+  GthreeGeometry *first_geometry = gthree_mesh_get_geometry (first);
+  g_autoptr(GthreeGeometry) geometry = gthree_geometry_new ();
+  g_autoptr(GPtrArray) materials = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GthreeAttribute) index = NULL;
+  g_autoptr(GList) names = NULL;
+  GthreeStaticBatchPrivate *priv;
+  GthreeStaticBatch *batch;
+  guint32 layer_mask;
+  guint32 *indices;
+  int n_vertices = 0, n_indices = 0;
+  GList *l;
+  guint i;
+  int j;
+
+  g_ptr_array_add (materials, g_object_ref (gthree_mesh_get_material (first, 0)));
+
+  batch = g_object_new (gthree_static_batch_get_type (),
+                        "geometry", geometry,
+                        "materials", materials,
+                        NULL);
+  priv = gthree_static_batch_get_instance_private (batch);
+
+  gthree_object_set_name (GTHREE_OBJECT (batch), "static batch");
+  gthree_object_set_cast_shadow (GTHREE_OBJECT (batch), gthree_object_get_cast_shadow (GTHREE_OBJECT (first)));
+  gthree_object_set_receive_shadow (GTHREE_OBJECT (batch), gthree_object_get_receive_shadow (GTHREE_OBJECT (first)));
+  layer_mask = gthree_object_get_layer_mask (GTHREE_OBJECT (first));
+  for (i = 0; i < 32; i++)
+    {
+      if (layer_mask & (1u << i))
+        gthree_object_enable_layer (GTHREE_OBJECT (batch), i);
+      else
+        gthree_object_disable_layer (GTHREE_OBJECT (batch), i);
+    }
+
+  priv->scene = scene;
+  priv->n_members = meshes->len;
+  priv->members = g_new0 (GthreeStaticBatchMember, meshes->len);
+
+  for (i = 0; i < meshes->len; i++)
+    {
+      GthreeMesh *mesh = g_ptr_array_index (meshes, i);
+      GthreeStaticBatchMember *member = &priv->members[i];
+      GthreeGeometry *member_geometry = gthree_mesh_get_geometry (mesh);
+      GthreeAttribute *member_index = gthree_geometry_get_index (member_geometry);
+      gboolean visible;
+
+      member->mesh = mesh;
+      g_object_add_weak_pointer (G_OBJECT (mesh), (gpointer *)&member->mesh);
+      member->geometry = g_object_ref (member_geometry);
+
+      member->vertex_start = n_vertices;
+      member->vertex_count = gthree_geometry_get_position_count (member_geometry);
+      member->index_start = n_indices;
+      member->index_count = member_index ? gthree_attribute_get_count (member_index) : member->vertex_count;
+      n_vertices += member->vertex_count;
+      n_indices += member->index_count;
+
+      member_get_visible (GTHREE_OBJECT (mesh), GTHREE_OBJECT (scene), &visible);
+      member->visible = visible;
+
+      gthree_object_set_static_batched (GTHREE_OBJECT (mesh), TRUE);
+    }
+
+  names = gthree_geometry_get_attribute_names (first_geometry);
+  for (l = names; l != NULL; l = l->next)
+    {
+      const char *name = l->data;
+      GthreeAttribute *source = gthree_geometry_get_attribute (first_geometry, name);
+      g_autoptr(GthreeAttribute) attribute =
+        gthree_attribute_new (name,
+                              gthree_attribute_get_attribute_type (source),
+                              n_vertices,
+                              gthree_attribute_get_item_size (source),
+                              gthree_attribute_get_normalized (source));
+
+      gthree_geometry_add_attribute (geometry, name, attribute);
+
+      /* These are written per member below */
+      if (is_transformed_attribute (name))
+        continue;
+
+      for (i = 0; i < priv->n_members; i++)
+        {
+          GthreeStaticBatchMember *member = &priv->members[i];
+          GthreeAttribute *member_attribute = gthree_geometry_get_attribute (member->geometry, name);
+
+          gthree_attribute_copy_at (attribute, member->vertex_start, member_attribute, 0,
+                                    MIN (member->vertex_count, gthree_attribute_get_count (member_attribute)));
+        }
+    }
+
+  /* Always 32bit, as the combined vertex count can easily exceed 64k */
+  index = gthree_attribute_new ("index", GTHREE_ATTRIBUTE_TYPE_UINT32, n_indices, 1, FALSE);
+  indices = gthree_attribute_peek_uint32 (index);
+  for (i = 0; i < priv->n_members; i++)
+    {
+      GthreeStaticBatchMember *member = &priv->members[i];
+      GthreeAttribute *member_index = gthree_geometry_get_index (member->geometry);
+
+      for (j = 0; j < member->index_count; j++)
+        indices[member->index_start + j] = member->vertex_start +
+          (member_index ? gthree_attribute_get_uint (member_index, j) : j);
+
+      write_member_vertices (batch, member);
+    }
+  gthree_geometry_set_index (geometry, index);
+
+  update_groups (batch);
+  priv->tree_stamp = gthree_object_get_tree_stamp (GTHREE_OBJECT (scene));
+
+  return batch;
+}
+
+/* Called once per frame after the world matrices are updated. Moved
+ * members have their vertices rewritten, hidden members are left out
+ * of the draw ranges, and members that no longer qualify are dropped. */
+void
+gthree_static_batch_sync (GthreeStaticBatch *batch)
+{
+  GthreeStaticBatchPrivate *priv = gthree_static_batch_get_instance_private (batch);
+  GthreeObject *scene = GTHREE_OBJECT (priv->scene);
+  GthreeObject *batch_object = GTHREE_OBJECT (batch);
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (GTHREE_MESH (batch));
+  GthreeMaterial *material = gthree_mesh_get_material (GTHREE_MESH (batch), 0);
+  gboolean tree_changed = priv->tree_stamp != gthree_object_get_tree_stamp (scene);
+  gboolean vertices_changed = FALSE;
+  guint i;
+
+  /* Removed from the scene, e.g. by destroying all its children */
+  if (gthree_object_get_parent (batch_object) != scene)
+    {
+      gthree_static_batch_release (batch);
+      return;
+    }
+
+  for (i = 0; i < priv->n_members; i++)
+    {
+      GthreeStaticBatchMember *member = &priv->members[i];
+      GthreeObject *object;
+      gboolean visible;
+
+      if (member->removed)
+        continue;
+
+      object = GTHREE_OBJECT (member->mesh);
+      if (object == NULL ||
+          !gthree_object_get_is_static (object) ||
+          gthree_mesh_get_geometry (member->mesh) != member->geometry ||
+          gthree_mesh_get_n_materials (member->mesh) != 1 ||
+          gthree_mesh_get_material (member->mesh, 0) != material ||
+          gthree_object_get_cast_shadow (object) != gthree_object_get_cast_shadow (batch_object) ||
+          gthree_object_get_receive_shadow (object) != gthree_object_get_receive_shadow (batch_object) ||
+          gthree_object_get_layer_mask (object) != gthree_object_get_layer_mask (batch_object))
+        {
+          drop_member (batch, member);
+          continue;
+        }
+
+      /* Parenting and visibility changes always update the tree stamp */
+      if (tree_changed)
+        {
+          if (!member_get_visible (object, scene, &visible))
+            {
+              drop_member (batch, member);
+              continue;
+            }
+
+          if (member->visible != visible)
+            {
+              member->visible = visible;
+              priv->groups_dirty = TRUE;
+            }
+        }
+
+      if (member->transform_stamp != gthree_object_get_transform_stamp (object))
+        {
+          write_member_vertices (batch, member);
+          vertices_changed = TRUE;
+        }
+    }
+
+  if (vertices_changed)
+    {
+      GthreeAttribute *attribute;
+
+      attribute = gthree_geometry_get_position (geometry);
+      gthree_attribute_set_needs_update (attribute);
+      attribute = gthree_geometry_get_normal (geometry);
+      if (attribute)
+        gthree_attribute_set_needs_update (attribute);
+      attribute = gthree_geometry_get_attribute (geometry, "tangent");
+      if (attribute)
+        gthree_attribute_set_needs_update (attribute);
+
+      gthree_geometry_invalidate_bounds (geometry);
+      gthree_object_mark_transform_changed (batch_object);
+    }
+
+  if (priv->groups_dirty)
+    update_groups (batch);
+
+  /* Dropping members changes the stamp too, which is fine */
+  priv->tree_stamp = gthree_object_get_tree_stamp (scene);
+}
+
+/* Hands all members back to the renderer */
+void
+gthree_static_batch_release (GthreeStaticBatch *batch)
+{
+  GthreeStaticBatchPrivate *priv = gthree_static_batch_get_instance_private (batch);
+  guint i;
+
+  for (i = 0; i < priv->n_members; i++)
+    {
+      GthreeStaticBatchMember *member = &priv->members[i];
+
+      if (!member->removed)
+        drop_member (batch, member);
+    }
+
+  if (priv->groups_dirty)
+    update_groups (batch);
+}
+
+static void
+gthree_static_batch_init (GthreeStaticBatch *batch)
+{
+}
+
+static void
+gthree_static_batch_dispose (GObject *obj)
+{
+  GthreeStaticBatch *batch = GTHREE_STATIC_BATCH (obj);
+
+  gthree_static_batch_release (batch);
+
+  G_OBJECT_CLASS (gthree_static_batch_parent_class)->dispose (obj);
+}
+
+static void
+gthree_static_batch_finalize (GObject *obj)
+{
+  GthreeStaticBatch *batch = GTHREE_STATIC_BATCH (obj);
+  GthreeStaticBatchPrivate *priv = gthree_static_batch_get_instance_private (batch);
+
+  g_free (priv->members);
+
+  G_OBJECT_CLASS (gthree_static_batch_parent_class)->finalize (obj);
+}
+
+static void
+gthree_static_batch_fill_render_list (GthreeObject     *object,
+                                      GthreeRenderList *list)
+{
+  GthreeMesh *mesh = GTHREE_MESH (object);
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (mesh);
+  GthreeMaterial *material = gthree_mesh_get_material (mesh, 0);
+  GthreeGeometryGroup *groups = gthree_geometry_peek_groups (geometry);
+  int n_groups = gthree_geometry_get_n_groups (geometry);
+  int i;
+
+  for (i = 0; i < n_groups; i++)
+    gthree_render_list_push (list, object, geometry, material, &groups[i]);
+}
+
+static void
+gthree_static_batch_raycast (GthreeObject    *object,
+                             GthreeRaycaster *raycaster,
+                             GPtrArray       *intersections)
+{
+  /* The member meshes are still in the scene and report their own hits */
+}
+
+static void
+gthree_static_batch_class_init (GthreeStaticBatchClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GthreeObjectClass *object_class = GTHREE_OBJECT_CLASS (klass);
+
+  gobject_class->dispose = gthree_static_batch_dispose;
+  gobject_class->finalize = gthree_static_batch_finalize;
+
+  object_class->fill_render_list = gthree_static_batch_fill_render_list;
+  object_class->raycast = gthree_static_batch_raycast;
+}
@@ -0,0 +1,44 @@
+#ifndef __GTHREE_STATIC_BATCH_H__
+#define __GTHREE_STATIC_BATCH_H__
+
+#if !defined (__GTHREE_H_INSIDE__) && !defined (GTHREE_COMPILATION)
+#error "Only <gthree/gthree.h> can be included directly."
+#endif
+
+#include <gthree/gthreemesh.h>
+#include <gthree/gthreescene.h>
+
+G_BEGIN_DECLS
+
+#define GTHREE_TYPE_STATIC_BATCH      (gthree_static_batch_get_type ())
+#define GTHREE_STATIC_BATCH(inst)     (G_TYPE_CHECK_INSTANCE_CAST ((inst),  \
+                                                GTHREE_TYPE_STATIC_BATCH, \
+                                                GthreeStaticBatch))
+#define GTHREE_STATIC_BATCH_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), GTHREE_TYPE_STATIC_BATCH, GthreeStaticBatchClass))
+#define GTHREE_IS_STATIC_BATCH(inst)  (G_TYPE_CHECK_INSTANCE_TYPE ((inst),  \
+                                                GTHREE_TYPE_STATIC_BATCH))
+#define GTHREE_STATIC_BATCH_GET_CLASS(inst) (G_TYPE_INSTANCE_GET_CLASS ((inst), GTHREE_TYPE_STATIC_BATCH, GthreeStaticBatchClass))
+
+/* A mesh drawing the pre-transformed geometry of several static
+ * meshes that share a material, see gthree_scene_build_static_batches() */
+typedef struct {
+  GthreeMesh parent;
+} GthreeStaticBatch;
+
+typedef struct {
+  GthreeMeshClass parent_class;
+} GthreeStaticBatchClass;
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GthreeStaticBatch, g_object_unref)
+
+GType gthree_static_batch_get_type (void) G_GNUC_CONST;
+
+char *             gthree_static_batch_get_key (GthreeObject      *object);
+GthreeStaticBatch *gthree_static_batch_new     (GthreeScene       *scene,
+                                                GPtrArray         *meshes);
+void               gthree_static_batch_sync    (GthreeStaticBatch *batch);
+void               gthree_static_batch_release (GthreeStaticBatch *batch);
+
+G_END_DECLS
+
+#endif /* __GTHREE_STATIC_BATCH_H__ */
@@ -4,6 +4,7 @@
 
 #include "gthreetexture.h"
 #include "gthreeprivate.h"
+#include "gthreetraceprivate.h"
 #include "gthreeenums.h"
 
 enum
@@ -52,6 +53,7 @@ typedef struct {
 typedef struct {
   GthreeResourceRealizeData parent;
   guint gl_texture;
+  gsize gl_bytes; /* Size of the uploaded image data, including mipmaps */
 } GthreeTextureRealizeData;
 
 
@@ -238,6 +240,7 @@ gthree_texture_class_init (GthreeTextureClass *klass)
   gobject_class->finalize = gthree_texture_finalize;
 
   resource_class->unrealize = gthree_texture_real_unrealize;
+  resource_class->get_gl_bytes = gthree_texture_real_get_gl_bytes;
 
   klass->load = gthree_texture_real_load;
 
@@ -531,6 +534,29 @@ gthree_texture_real_unrealize (GthreeResource *resource,
   gthree_renderer_lazy_delete (renderer, GTHREE_RESOURCE_KIND_TEXTURE, data->gl_texture);
 
   data->gl_texture = 0;
+  data->gl_bytes = 0;
+}
+
+static gsize
+gthree_texture_real_get_gl_bytes (GthreeResource *resource,
+                                  GthreeRenderer *renderer)
+{
+  GthreeTextureRealizeData *data = gthree_resource_get_data_for (resource, renderer);
+
+  return data->gl_bytes;
+}
+
+/* Called after uploading new image data, bytes replaces the size of
+ * whatever was uploaded before */
+void
+gthree_texture_set_gl_bytes (GthreeTexture  *texture,
+                             GthreeRenderer *renderer,
+                             gsize           bytes)
+{
+  GthreeTextureRealizeData *data = gthree_resource_get_data_for (GTHREE_RESOURCE (texture), renderer);
+
+  data->gl_bytes = bytes;
+  gthree_renderer_count_texture_upload (renderer, bytes);
 }
 
 void
@@ -593,6 +619,44 @@ gthree_texture_format_to_gl (GthreeTextureFormat format)
     }
 }
 
+gsize
+gthree_texture_get_gl_bytes_per_pixel (guint gl_format,
+                                       guint gl_type)
+{
+  gsize n_components, component_size;
+
+  switch (gl_format)
+    {
+    case GL_RED:
+      n_components = 1;
+      break;
+    case GL_RGB:
+      n_components = 3;
+      break;
+    default:
+    case GL_RGBA:
+      n_components = 4;
+      break;
+    }
+
+  switch (gl_type)
+    {
+    case GL_FLOAT:
+      component_size = 4;
+      break;
+    case GL_HALF_FLOAT:
+      component_size = 2;
+      break;
+    default:
+    case GL_UNSIGNED_BYTE:
+    case GL_BYTE:
+      component_size = 1;
+      break;
+    }
+
+  return n_components * component_size;
+}
+
 int
 gthree_texture_get_internal_gl_format (guint gl_format,
                                        guint gl_type)
@@ -671,6 +735,8 @@ gthree_texture_real_load (GthreeTexture *texture, GthreeRenderer *renderer, int
       guint height;
       guint gl_format, gl_type;
       gboolean is_image_power_of_two;
+      gsize gl_bytes;
+      GTHREE_TRACE_BEGIN (trace_upload);
 
       if (priv->pixbuf)
         {
@@ -762,6 +828,7 @@ gthree_texture_real_load (GthreeTexture *texture, GthreeRenderer *renderer, int
                   glTexImage2D (GL_TEXTURE_2D, 0, gl_format, width, height, 0, gl_format, gl_type,
                                 gdk_pixbuf_get_pixels (pixbuf));
                   g_object_unref (pixbuf);
+                  gl_bytes = (gsize)width * height * gthree_texture_get_gl_bytes_per_pixel (gl_format, gl_type);
                 }
               else
                 {
@@ -774,6 +841,7 @@ gthree_texture_real_load (GthreeTexture *texture, GthreeRenderer *renderer, int
                   glTexImage2D (GL_TEXTURE_2D, 0, gl_format, width, height, 0,
                                 GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
                                 cairo_image_surface_get_data (priv->surface));
+                  gl_bytes = (gsize)width * height * 4;
                 }
             }
         }
@@ -782,9 +850,14 @@ gthree_texture_real_load (GthreeTexture *texture, GthreeRenderer *renderer, int
         {
           glGenerateMipmap (GL_TEXTURE_2D);
           gthree_texture_set_max_mip_level (texture, log2 (MAX (width, height)));
+          gl_bytes += gl_bytes / 3;
         }
 
+      gthree_texture_set_gl_bytes (texture, renderer, gl_bytes);
       gthree_resource_mark_clean_for (GTHREE_RESOURCE (texture), renderer);
+
+      GTHREE_TRACE_END_FORMAT (trace_upload, "upload texture", "%ux%u, %" G_GSIZE_FORMAT " bytes",
+                               width, height, gl_bytes);
     }
 }
 
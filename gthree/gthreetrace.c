@@ -0,0 +1,287 @@
+#include <gio/gio.h>
+#include <json-glib/json-glib.h>
+
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYSPROF
+#include <sysprof-capture.h>
+#endif
+
+#include "gthreetraceprivate.h"
+
+/**
+ * SECTION:gthreetrace
+ * @Title: Tracing
+ * @Short_description: A cpu timeline of the renderer
+ *
+ * When gthree is built with `-Dtracing=true` the renderer, the
+ * loaders and the animation code record how long their main steps
+ * take. While a trace is running (see gthree_trace_start()) these are
+ * collected and can be saved in the Chrome trace event format with
+ * gthree_trace_save_chrome_json(), for viewing in chrome://tracing or
+ * Perfetto. If sysprof is running they are also sent to it as marks,
+ * whether a trace is started or not.
+ *
+ * The names of the trace events are the same as the gpu timers of
+ * gthree_renderer_set_gpu_timing(), so the two can be compared.
+ *
+ * Without tracing built in the trace points compile to nothing and
+ * these functions do nothing.
+ */
+
+#ifdef GTHREE_ENABLE_TRACING
+
+/* Keep a runaway trace from eating all memory */
+#define MAX_TRACE_EVENTS (1 << 20)
+
+typedef struct {
+  const char *name; /* static */
+  char *message;
+  gint64 begin;
+  gint64 duration;
+  guint thread_id;
+} GthreeTraceEvent;
+
+static GMutex trace_lock;
+static gboolean trace_recording;
+static GArray *trace_events;
+static GPrivate trace_thread_id;
+static guint trace_next_thread_id = 1;
+
+static void
+trace_event_clear (GthreeTraceEvent *event)
+{
+  g_free (event->message);
+}
+
+static guint
+get_thread_id (void)
+{
+  guint id = GPOINTER_TO_UINT (g_private_get (&trace_thread_id));
+
+  if (id == 0)
+    {
+      id = g_atomic_int_add (&trace_next_thread_id, 1);
+      g_private_set (&trace_thread_id, GUINT_TO_POINTER (id));
+    }
+
+  return id;
+}
+
+static gboolean
+trace_is_active (void)
+{
+#ifdef HAVE_SYSPROF
+  if (sysprof_collector_is_active ())
+    return TRUE;
+#endif
+
+  return g_atomic_int_get (&trace_recording);
+}
+
+/* Returns 0 if nothing is listening, which makes the matching
+ * GTHREE_TRACE_END() skip all work */
+gint64
+gthree_trace_begin (void)
+{
+  if (!trace_is_active ())
+    return 0;
+
+  return g_get_monotonic_time () * 1000;
+}
+
+/* Takes ownership of message */
+void
+gthree_trace_end (gint64      begin,
+                  const char *name,
+                  char       *message)
+{
+  gint64 duration = g_get_monotonic_time () * 1000 - begin;
+
+#ifdef HAVE_SYSPROF
+  sysprof_collector_mark (begin, duration, "gthree", name, message);
+#endif
+
+  if (g_atomic_int_get (&trace_recording))
+    {
+      g_mutex_lock (&trace_lock);
+
+      if (trace_recording && trace_events->len < MAX_TRACE_EVENTS)
+        {
+          GthreeTraceEvent event;
+
+          event.name = name;
+          event.message = g_steal_pointer (&message);
+          event.begin = begin;
+          event.duration = duration;
+          event.thread_id = get_thread_id ();
+          g_array_append_val (trace_events, event);
+        }
+
+      g_mutex_unlock (&trace_lock);
+    }
+
+  g_free (message);
+}
+
+void
+gthree_trace_end_format (gint64      begin,
+                         const char *name,
+                         const char *format,
+                         ...)
+{
+  va_list args;
+  char *message;
+
+  va_start (args, format);
+  message = g_strdup_vprintf (format, args);
+  va_end (args);
+
+  gthree_trace_end (begin, name, message);
+}
+
+#endif /* GTHREE_ENABLE_TRACING */
+
+/**
+ * gthree_trace_is_supported:
+ *
+ * Returns whether gthree was built with trace points.
+ *
+ * Returns: %TRUE if tracing is available
+ */
+gboolean
+gthree_trace_is_supported (void)
+{
+#ifdef GTHREE_ENABLE_TRACING
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/**
+ * gthree_trace_start:
+ *
+ * Starts recording trace events, dropping any previously recorded ones.
+ */
+void
+gthree_trace_start (void)
+{
+#ifdef GTHREE_ENABLE_TRACING
+  g_mutex_lock (&trace_lock);
+
+  if (trace_events == NULL)
+    {
+      trace_events = g_array_new (FALSE, FALSE, sizeof (GthreeTraceEvent));
+      g_array_set_clear_func (trace_events, (GDestroyNotify)trace_event_clear);
+    }
+  g_array_set_size (trace_events, 0);
+
+  g_atomic_int_set (&trace_recording, TRUE);
+
+  g_mutex_unlock (&trace_lock);
+#endif
+}
+
+/**
+ * gthree_trace_stop:
+ *
+ * Stops recording trace events. The events recorded so far are kept
+ * until the next gthree_trace_start(), so they can be saved.
+ */
+void
+gthree_trace_stop (void)
+{
+#ifdef GTHREE_ENABLE_TRACING
+  g_mutex_lock (&trace_lock);
+  g_atomic_int_set (&trace_recording, FALSE);
+  g_mutex_unlock (&trace_lock);
+#endif
+}
+
+/**
+ * gthree_trace_save_chrome_json:
+ * @filename: the file to write
+ * @error: return location for an error
+ *
+ * Writes the recorded trace events as Chrome trace event JSON.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gthree_trace_save_chrome_json (const char  *filename,
+                               GError     **error)
+{
+#ifdef GTHREE_ENABLE_TRACING
+  g_autoptr(JsonBuilder) builder = NULL;
+  g_autoptr(JsonGenerator) generator = NULL;
+  g_autoptr(JsonNode) root = NULL;
+  gint64 pid = 0;
+  guint i;
+
+#ifdef G_OS_UNIX
+  pid = getpid ();
+#endif
+
+  builder = json_builder_new ();
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "traceEvents");
+  json_builder_begin_array (builder);
+
+  g_mutex_lock (&trace_lock);
+
+  for (i = 0; trace_events != NULL && i < trace_events->len; i++)
+    {
+      GthreeTraceEvent *event = &g_array_index (trace_events, GthreeTraceEvent, i);
+
+      json_builder_begin_object (builder);
+
+      json_builder_set_member_name (builder, "name");
+      json_builder_add_string_value (builder, event->name);
+      json_builder_set_member_name (builder, "cat");
+      json_builder_add_string_value (builder, "gthree");
+      json_builder_set_member_name (builder, "ph");
+      json_builder_add_string_value (builder, "X");
+      /* Chrome uses microseconds */
+      json_builder_set_member_name (builder, "ts");
+      json_builder_add_double_value (builder, event->begin / 1000.0);
+      json_builder_set_member_name (builder, "dur");
+      json_builder_add_double_value (builder, event->duration / 1000.0);
+      json_builder_set_member_name (builder, "pid");
+      json_builder_add_int_value (builder, pid);
+      json_builder_set_member_name (builder, "tid");
+      json_builder_add_int_value (builder, event->thread_id);
+
+      if (event->message)
+        {
+          json_builder_set_member_name (builder, "args");
+          json_builder_begin_object (builder);
+          json_builder_set_member_name (builder, "message");
+          json_builder_add_string_value (builder, event->message);
+          json_builder_end_object (builder);
+        }
+
+      json_builder_end_object (builder);
+    }
+
+  g_mutex_unlock (&trace_lock);
+
+  json_builder_end_array (builder);
+  json_builder_set_member_name (builder, "displayTimeUnit");
+  json_builder_add_string_value (builder, "ms");
+  json_builder_end_object (builder);
+
+  root = json_builder_get_root (builder);
+  generator = json_generator_new ();
+  json_generator_set_root (generator, root);
+
+  return json_generator_to_file (generator, filename, error);
+#else
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+               "gthree was built without tracing");
+  return FALSE;
+#endif
+}
@@ -0,0 +1,25 @@
+#ifndef __GTHREE_TRACE_H__
+#define __GTHREE_TRACE_H__
+
+#if !defined (__GTHREE_H_INSIDE__) && !defined (GTHREE_COMPILATION)
+#error "Only <gthree/gthree.h> can be included directly."
+#endif
+
+#include <glib.h>
+#include <gthree/gthreetypes.h>
+
+G_BEGIN_DECLS
+
+GTHREE_API
+gboolean gthree_trace_is_supported     (void);
+GTHREE_API
+void     gthree_trace_start            (void);
+GTHREE_API
+void     gthree_trace_stop             (void);
+GTHREE_API
+gboolean gthree_trace_save_chrome_json (const char  *filename,
+                                        GError     **error);
+
+G_END_DECLS
+
+#endif /* __GTHREE_TRACE_H__ */
@@ -0,0 +1,39 @@
+#ifndef __GTHREE_TRACE_PRIVATE_H__
+#define __GTHREE_TRACE_PRIVATE_H__
+
+#include "gthreetrace.h"
+
+G_BEGIN_DECLS
+
+/* Trace points are only compiled in with -Dtracing=true. Names are
+ * static strings, and match the gpu timer names where there is one,
+ * so the cpu and gpu timelines line up. */
+
+#ifdef GTHREE_ENABLE_TRACING
+
+gint64 gthree_trace_begin      (void);
+void   gthree_trace_end        (gint64      begin,
+                                const char *name,
+                                char       *message);
+void   gthree_trace_end_format (gint64      begin,
+                                const char *name,
+                                const char *format,
+                                ...) G_GNUC_PRINTF (3, 4);
+
+#define GTHREE_TRACE_BEGIN(var) gint64 var = gthree_trace_begin ()
+#define GTHREE_TRACE_END(var, name) \
+  G_STMT_START { if (var != 0) gthree_trace_end (var, name, NULL); } G_STMT_END
+#define GTHREE_TRACE_END_FORMAT(var, name, ...) \
+  G_STMT_START { if (var != 0) gthree_trace_end_format (var, name, __VA_ARGS__); } G_STMT_END
+
+#else
+
+#define GTHREE_TRACE_BEGIN(var)
+#define GTHREE_TRACE_END(var, name) G_STMT_START { } G_STMT_END
+#define GTHREE_TRACE_END_FORMAT(var, name, ...) G_STMT_START { } G_STMT_END
+
+#endif
+
+G_END_DECLS
+
+#endif /* __GTHREE_TRACE_PRIVATE_H__ */
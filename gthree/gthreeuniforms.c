@@ -1,4 +1,5 @@
 #include <math.h>
+#include <string.h>
 #include <epoxy/gl.h>
 
 #include "gthreeuniforms.h"
@@ -9,6 +10,7 @@ struct _GthreeUniform {
   GthreeUniformType type;
   gint location;
   gboolean needs_update;
+  guint32 version; /* Bumped when the value changes, 0 is never used */
   union {
     float floats[4];
     int ints[4];
@@ -21,11 +23,34 @@ struct _GthreeUniform {
 
 typedef struct {
   GHashTable *hash;
+  guint32 stamp; /* Bumped when the set of uniforms changes */
 } GthreeUniformsPrivate;
 
+typedef struct {
+  GthreeUniform *uniform;
+  GthreeUniform *parent; /* The uniforms array this is in, or NULL */
+  gint location;
+  guint versioned : 1;
+  guint32 uploaded_version; /* 0 if the current value is not known to be uploaded */
+} GthreeUniformTableEntry;
+
+struct _GthreeUniformTable {
+  guint id;
+  guint program_id;
+  GthreeUniforms *uniforms; /* Not owned */
+  guint32 uniforms_stamp;
+  GArray *entries; /* GthreeUniformTableEntry, sorted by location */
+  GArray *uarray_versions; /* guint32, version of each uniforms array parent when flattened */
+  GPtrArray *uarrays; /* GthreeUniform, the uniform arrays that were flattened */
+  GPtrArray *unused; /* GthreeUniform, the ones that are not in the program */
+};
+
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeUniforms, gthree_uniforms, G_TYPE_OBJECT);
 
 static void gthree_uniform_free (GthreeUniform *uniform);
+static void gthree_uniform_upload (GthreeUniform *uniform,
+                                   gint location,
+                                   GthreeRenderer *renderer);
 static GthreeUniform *gthree_uniform_clone (GthreeUniform *uniform);
 static void gthree_uniforms_init_libs ();
 
@@ -74,6 +99,7 @@ gthree_uniforms_add (GthreeUniforms *uniforms,
   GthreeUniformsPrivate *priv = gthree_uniforms_get_instance_private (uniforms);
 
   g_hash_table_replace (priv->hash, GINT_TO_POINTER (uniform->name), uniform);
+  priv->stamp++;
 }
 
 GthreeUniform *
@@ -134,6 +160,7 @@ gthree_uniforms_merge (GthreeUniforms *uniforms,
   g_hash_table_iter_init (&iter, source_priv->hash);
   while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&uniform))
     g_hash_table_replace (priv->hash, GINT_TO_POINTER (uniform->name), gthree_uniform_clone (uniform));
+  priv->stamp++;
 }
 
 void
@@ -149,6 +176,84 @@ gthree_uniforms_load (GthreeUniforms *uniforms,
     gthree_uniform_load (uniform, renderer);
 }
 
+static gboolean
+get_std140_layout (GthreeUniformType type,
+                   guint *align,
+                   guint *size)
+{
+  switch (type)
+    {
+    case GTHREE_UNIFORM_TYPE_INT:
+    case GTHREE_UNIFORM_TYPE_FLOAT:
+      *align = *size = 4;
+      return TRUE;
+    case GTHREE_UNIFORM_TYPE_FLOAT2:
+    case GTHREE_UNIFORM_TYPE_VECTOR2:
+      *align = *size = 8;
+      return TRUE;
+    case GTHREE_UNIFORM_TYPE_FLOAT3:
+    case GTHREE_UNIFORM_TYPE_VECTOR3:
+      *align = 16;
+      *size = 12;
+      return TRUE;
+    case GTHREE_UNIFORM_TYPE_FLOAT4:
+    case GTHREE_UNIFORM_TYPE_VECTOR4:
+      *align = *size = 16;
+      return TRUE;
+    case GTHREE_UNIFORM_TYPE_MATRIX4:
+      *align = 16;
+      *size = 64;
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+/* Writes the values of @members (looked up in @uniforms) as one struct
+ * with std140 layout to @dest, which may be NULL to only compute the
+ * size. The returned size is the array stride of the struct, i.e. it is
+ * rounded up to a multiple of a vec4. Members that are missing or have
+ * a different type are zero-filled. */
+gsize
+gthree_uniforms_pack_std140 (GthreeUniforms           *uniforms,
+                             GthreeUniformBlockMember *members,
+                             guint                     n_members,
+                             guint8                   *dest)
+{
+  gsize offset = 0;
+
+  for (guint i = 0; i < n_members; i++)
+    {
+      GthreeUniformBlockMember *member = &members[i];
+      GthreeUniform *uniform;
+      guint align, size;
+
+      if (!get_std140_layout (member->type, &align, &size))
+        {
+          g_warning ("Unsupported uniform block member type for %s", member->name);
+          continue;
+        }
+
+      offset = (offset + align - 1) & ~(gsize)(align - 1);
+
+      if (dest)
+        {
+          uniform = gthree_uniforms_lookup (uniforms, member->qname);
+          if (uniform == NULL || uniform->type != member->type ||
+              (uniform->type == GTHREE_UNIFORM_TYPE_MATRIX4 && uniform->value.more_floats == NULL))
+            memset (dest + offset, 0, size);
+          else if (uniform->type == GTHREE_UNIFORM_TYPE_MATRIX4)
+            memcpy (dest + offset, uniform->value.more_floats, size);
+          else
+            memcpy (dest + offset, uniform->value.floats, size);
+        }
+
+      offset += size;
+    }
+
+  return (offset + 15) & ~(gsize)15;
+}
+
 void
 gthree_uniforms_set_float (GthreeUniforms  *uniforms,
                            const char      *name,
@@ -312,10 +417,31 @@ gthree_uniform_newq (GQuark name, GthreeUniformType type)
   uniform->type = type;
   uniform->location = 0;
   uniform->needs_update = TRUE;
+  uniform->version = 1;
 
   return uniform;
 }
 
+static inline void
+gthree_uniform_changed (GthreeUniform *uniform)
+{
+  if (++uniform->version == 0)
+    uniform->version = 1;
+}
+
+/* Only inline values are bit-compared, anything else is always considered changed */
+static inline void
+set_floats (GthreeUniform *uniform,
+            const float *values,
+            guint n_values)
+{
+  if (memcmp (uniform->value.floats, values, n_values * sizeof (float)) == 0)
+    return;
+
+  memcpy (uniform->value.floats, values, n_values * sizeof (float));
+  gthree_uniform_changed (uniform);
+}
+
 const char *
 gthree_uniform_get_name (GthreeUniform *uniform)
 {
@@ -451,7 +577,24 @@ gthree_uniform_copy_value (GthreeUniform   *uniform,
 {
   g_assert (uniform->type == source->type);
 
+  switch (uniform->type)
+    {
+    case GTHREE_UNIFORM_TYPE_INT:
+    case GTHREE_UNIFORM_TYPE_FLOAT:
+    case GTHREE_UNIFORM_TYPE_FLOAT2:
+    case GTHREE_UNIFORM_TYPE_FLOAT3:
+    case GTHREE_UNIFORM_TYPE_FLOAT4:
+    case GTHREE_UNIFORM_TYPE_VECTOR2:
+    case GTHREE_UNIFORM_TYPE_VECTOR3:
+    case GTHREE_UNIFORM_TYPE_VECTOR4:
+      set_floats (uniform, source->value.floats, 4);
+      return;
+    default:
+      break;
+    }
+
   uniform->value = source->value;
+  gthree_uniform_changed (uniform);
 
   switch (uniform->type)
     {
@@ -602,8 +745,10 @@ void
 gthree_uniform_set_float (GthreeUniform *uniform,
                           double val)
 {
+  float f = val;
+
   g_return_if_fail (uniform->type == GTHREE_UNIFORM_TYPE_FLOAT);
-  uniform->value.floats[0] = val;
+  set_floats (uniform, &f, 1);
 }
 
 static void
@@ -615,6 +760,7 @@ set_array (GthreeUniform *uniform, GArray *array)
     g_array_unref (uniform->value.array);
 
   uniform->value.array = array;
+  gthree_uniform_changed (uniform);
 }
 
 void
@@ -658,37 +804,45 @@ gthree_uniform_set_int (GthreeUniform *uniform,
                         int val)
 {
   g_return_if_fail (uniform->type == GTHREE_UNIFORM_TYPE_INT);
+
+  if (uniform->value.ints[0] == val)
+    return;
+
   uniform->value.ints[0] = val;
+  gthree_uniform_changed (uniform);
 }
 
 void
 gthree_uniform_set_vec4 (GthreeUniform *uniform,
                          const graphene_vec4_t *value)
 {
+  float floats[4];
+
   g_return_if_fail (uniform->type == GTHREE_UNIFORM_TYPE_VECTOR4);
-  uniform->value.floats[0] = graphene_vec4_get_x (value);
-  uniform->value.floats[1] = graphene_vec4_get_y (value);
-  uniform->value.floats[2] = graphene_vec4_get_z (value);
-  uniform->value.floats[3] = graphene_vec4_get_w (value);
+  graphene_vec4_to_float (value, floats);
+  set_floats (uniform, floats, 4);
 }
 
 void
 gthree_uniform_set_vec3 (GthreeUniform *uniform,
                          const graphene_vec3_t *value)
 {
+  float floats[3];
+
   g_return_if_fail (uniform->type == GTHREE_UNIFORM_TYPE_VECTOR3);
-  uniform->value.floats[0] = graphene_vec3_get_x (value);
-  uniform->value.floats[1] = graphene_vec3_get_y (value);
-  uniform->value.floats[2] = graphene_vec3_get_z (value);
+  graphene_vec3_to_float (value, floats);
+  set_floats (uniform, floats, 3);
 }
 
 void
 gthree_uniform_set_vec2 (GthreeUniform *uniform,
                          const graphene_vec2_t *value)
 {
+  float floats[2];
+
   g_return_if_fail (uniform->type == GTHREE_UNIFORM_TYPE_VECTOR2);
-  uniform->value.floats[0] = graphene_vec2_get_x (value);
-  uniform->value.floats[1] = graphene_vec2_get_y (value);
+  graphene_vec2_to_float (value, floats);
+  set_floats (uniform, floats, 2);
 }
 
 void
@@ -703,6 +857,7 @@ gthree_uniform_set_texture (GthreeUniform *uniform,
     g_object_unref (uniform->value.texture);
 
   uniform->value.texture = value;
+  gthree_uniform_changed (uniform);
 }
 
 void
@@ -725,6 +880,8 @@ gthree_uniform_set_texture_array (GthreeUniform *uniform,
       else
         g_ptr_array_add (uniform->value.ptr_array, NULL);
     }
+
+  gthree_uniform_changed (uniform);
 }
 
 void
@@ -759,6 +916,7 @@ gthree_uniform_set_uarray (GthreeUniform *uniform,
           GthreeUniforms *src = g_ptr_array_index (value, i);
           g_ptr_array_add (uniform->value.ptr_array, gthree_uniforms_clone (src));
         }
+      gthree_uniform_changed (uniform);
     }
 }
 
@@ -780,62 +938,74 @@ gthree_uniform_load (GthreeUniform *uniform,
   if (!uniform->needs_update)
     return;
 
+  gthree_uniform_upload (uniform, uniform->location, renderer);
+}
+
+static void
+gthree_uniform_upload (GthreeUniform *uniform,
+                       gint location,
+                       GthreeRenderer *renderer)
+{
+  /* Arrays of uniforms count as their individual members */
+  if (uniform->type != GTHREE_UNIFORM_TYPE_UNIFORMS_ARRAY)
+    gthree_renderer_count_uniform_upload (renderer);
+
   switch (uniform->type)
     {
     case GTHREE_UNIFORM_TYPE_INT:
-      glUniform1i (uniform->location, uniform->value.ints[0]);
+      glUniform1i (location, uniform->value.ints[0]);
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT:
-      glUniform1f (uniform->location, uniform->value.floats[0]);
+      glUniform1f (location, uniform->value.floats[0]);
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT2:
     case GTHREE_UNIFORM_TYPE_VECTOR2:
-      glUniform2f (uniform->location, uniform->value.floats[0], uniform->value.floats[1]);
+      glUniform2f (location, uniform->value.floats[0], uniform->value.floats[1]);
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT3:
     case GTHREE_UNIFORM_TYPE_VECTOR3:
-      glUniform3f (uniform->location, uniform->value.floats[0], uniform->value.floats[1], uniform->value.floats[2]);
+      glUniform3f (location, uniform->value.floats[0], uniform->value.floats[1], uniform->value.floats[2]);
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT4:
     case GTHREE_UNIFORM_TYPE_VECTOR4:
-      glUniform4f (uniform->location, uniform->value.floats[0], uniform->value.floats[1], uniform->value.floats[2], uniform->value.floats[3]);
+      glUniform4f (location, uniform->value.floats[0], uniform->value.floats[1], uniform->value.floats[2], uniform->value.floats[3]);
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT_ARRAY:
       if (uniform->value.array)
-        glUniform1fv (uniform->location, uniform->value.array->len, &g_array_index (uniform->value.array, float, 0));
+        glUniform1fv (location, uniform->value.array->len, &g_array_index (uniform->value.array, float, 0));
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT2_ARRAY:
       if (uniform->value.array)
-        glUniform2fv (uniform->location, uniform->value.array->len / 2, &g_array_index (uniform->value.array, float, 0));
+        glUniform2fv (location, uniform->value.array->len / 2, &g_array_index (uniform->value.array, float, 0));
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT3_ARRAY:
       if (uniform->value.array)
-        glUniform3fv (uniform->location, uniform->value.array->len / 3, &g_array_index (uniform->value.array, float, 0));
+        glUniform3fv (location, uniform->value.array->len / 3, &g_array_index (uniform->value.array, float, 0));
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT4_ARRAY:
       if (uniform->value.array)
-        glUniform4fv (uniform->location, uniform->value.array->len / 4, &g_array_index (uniform->value.array, float, 0));
+        glUniform4fv (location, uniform->value.array->len / 4, &g_array_index (uniform->value.array, float, 0));
       break;
     case GTHREE_UNIFORM_TYPE_MATRIX3:
-      glUniformMatrix3fv (uniform->location, 1, FALSE, uniform->value.more_floats);
+      glUniformMatrix3fv (location, 1, FALSE, uniform->value.more_floats);
       break;
     case GTHREE_UNIFORM_TYPE_MATRIX4:
-      glUniformMatrix4fv (uniform->location, 1, FALSE, uniform->value.more_floats);
+      glUniformMatrix4fv (location, 1, FALSE, uniform->value.more_floats);
       break;
     case GTHREE_UNIFORM_TYPE_INT_ARRAY:
       if (uniform->value.array)
-        glUniform1iv (uniform->location, uniform->value.array->len, &g_array_index (uniform->value.array, int, 0));
+        glUniform1iv (location, uniform->value.array->len, &g_array_index (uniform->value.array, int, 0));
       break;
     case GTHREE_UNIFORM_TYPE_INT3_ARRAY:
       if (uniform->value.array)
-        glUniform3iv (uniform->location, uniform->value.array->len, &g_array_index (uniform->value.array, int, 0));
+        glUniform3iv (location, uniform->value.array->len, &g_array_index (uniform->value.array, int, 0));
       break;
     case GTHREE_UNIFORM_TYPE_TEXTURE:
       if (uniform->value.texture)
         {
           int unit = gthree_renderer_allocate_texture_unit (renderer);
           gthree_texture_load (uniform->value.texture, renderer, unit);
-          glUniform1i(uniform->location, unit);
+          glUniform1i(location, unit);
         }
 
       break;
@@ -862,7 +1032,7 @@ gthree_uniform_load (GthreeUniform *uniform,
                 {
                   units[i] = gthree_renderer_allocate_texture_unit (renderer);
                   gthree_texture_load (texture, renderer, units[i]);
-                  glUniform1iv (uniform->location, len, units);
+                  glUniform1iv (location, len, units);
                 }
             }
         }
@@ -880,7 +1050,7 @@ gthree_uniform_load (GthreeUniform *uniform,
               graphene_matrix_to_float (m, &floats[16*i]);
             }
 
-          glUniformMatrix4fv (uniform->location, len, FALSE, floats);
+          glUniformMatrix4fv (location, len, FALSE, floats);
         }
       break;
     case GTHREE_UNIFORM_TYPE_VEC2_ARRAY:
@@ -891,6 +1061,210 @@ gthree_uniform_load (GthreeUniform *uniform,
     }
 }
 
+static gboolean
+uniform_type_is_versioned (GthreeUniformType type)
+{
+  switch (type)
+    {
+    case GTHREE_UNIFORM_TYPE_INT:
+    case GTHREE_UNIFORM_TYPE_FLOAT:
+    case GTHREE_UNIFORM_TYPE_FLOAT2:
+    case GTHREE_UNIFORM_TYPE_FLOAT3:
+    case GTHREE_UNIFORM_TYPE_FLOAT4:
+    case GTHREE_UNIFORM_TYPE_VECTOR2:
+    case GTHREE_UNIFORM_TYPE_VECTOR3:
+    case GTHREE_UNIFORM_TYPE_VECTOR4:
+    case GTHREE_UNIFORM_TYPE_MATRIX3:
+    case GTHREE_UNIFORM_TYPE_MATRIX4:
+      return TRUE;
+    default:
+      /* Textures get a new unit each time the material is set up, so always load those */
+      return FALSE;
+    }
+}
+
+static void
+uniform_table_add (GthreeUniformTable *table,
+                   GthreeUniform *uniform,
+                   GthreeUniform *parent)
+{
+  GthreeUniformTableEntry entry = { 0 };
+
+  if (uniform->location == -1)
+    {
+      g_ptr_array_add (table->unused, uniform);
+      return;
+    }
+
+  entry.uniform = uniform;
+  entry.parent = parent;
+  entry.location = uniform->location;
+  entry.versioned = uniform_type_is_versioned (uniform->type);
+  entry.uploaded_version = 0;
+
+  g_array_append_val (table->entries, entry);
+}
+
+static int
+uniform_table_entry_compare (gconstpointer a,
+                             gconstpointer b)
+{
+  const GthreeUniformTableEntry *ea = a;
+  const GthreeUniformTableEntry *eb = b;
+
+  return ea->location - eb->location;
+}
+
+static guint next_uniform_table_id = 0;
+
+/* Flattens the uniforms (including the ones in uniform arrays) into an
+ * array of the ones that are used by program, using the locations
+ * last set for it by gthree_shader_update_uniform_locations_for_program().
+ */
+GthreeUniformTable *
+gthree_uniform_table_new (GthreeUniforms *uniforms,
+                          GthreeProgram *program)
+{
+  GthreeUniformsPrivate *priv = gthree_uniforms_get_instance_private (uniforms);
+  GthreeUniformTable *table = g_new0 (GthreeUniformTable, 1);
+  GHashTableIter iter;
+  GthreeUniform *uniform;
+
+  table->id = ++next_uniform_table_id;
+  table->program_id = gthree_program_get_id (program);
+  table->uniforms = uniforms;
+  table->uniforms_stamp = priv->stamp;
+  table->entries = g_array_new (FALSE, FALSE, sizeof (GthreeUniformTableEntry));
+  table->uarrays = g_ptr_array_new ();
+  table->uarray_versions = g_array_new (FALSE, FALSE, sizeof (guint32));
+  table->unused = g_ptr_array_new ();
+
+  g_hash_table_iter_init (&iter, priv->hash);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&uniform))
+    {
+      if (uniform->type == GTHREE_UNIFORM_TYPE_UNIFORMS_ARRAY)
+        {
+          /* If the array is replaced the child uniforms are freed, so track that */
+          g_ptr_array_add (table->uarrays, uniform);
+          g_array_append_val (table->uarray_versions, uniform->version);
+
+          for (int i = 0; uniform->value.ptr_array && i < uniform->value.ptr_array->len; i++)
+            {
+              GthreeUniforms *child_unis = g_ptr_array_index (uniform->value.ptr_array, i);
+              GthreeUniformsPrivate *child_priv;
+              GHashTableIter child_iter;
+              GthreeUniform *child;
+
+              if (child_unis == NULL)
+                continue;
+
+              child_priv = gthree_uniforms_get_instance_private (child_unis);
+              g_hash_table_iter_init (&child_iter, child_priv->hash);
+              while (g_hash_table_iter_next (&child_iter, NULL, (gpointer *)&child))
+                uniform_table_add (table, child, uniform);
+            }
+        }
+      else
+        uniform_table_add (table, uniform, NULL);
+    }
+
+  g_array_sort (table->entries, uniform_table_entry_compare);
+
+  return table;
+}
+
+void
+gthree_uniform_table_free (GthreeUniformTable *table)
+{
+  g_array_unref (table->entries);
+  g_ptr_array_unref (table->uarrays);
+  g_array_unref (table->uarray_versions);
+  g_ptr_array_unref (table->unused);
+  g_free (table);
+}
+
+guint
+gthree_uniform_table_get_program_id (GthreeUniformTable *table)
+{
+  return table->program_id;
+}
+
+/* Sets the uniform locations back to the ones of the program of the
+ * table, after they were looked up for another program. Only valid
+ * while gthree_uniform_table_is_valid_for() is. */
+void
+gthree_uniform_table_apply_locations (GthreeUniformTable *table)
+{
+  GthreeUniformTableEntry *entries = (GthreeUniformTableEntry *)table->entries->data;
+
+  for (guint i = 0; i < table->entries->len; i++)
+    entries[i].uniform->location = entries[i].location;
+
+  for (guint i = 0; i < table->unused->len; i++)
+    ((GthreeUniform *)g_ptr_array_index (table->unused, i))->location = -1;
+}
+
+gboolean
+gthree_uniform_table_is_valid_for (GthreeUniformTable *table,
+                                   GthreeUniforms *uniforms,
+                                   GthreeProgram *program)
+{
+  GthreeUniformsPrivate *priv = gthree_uniforms_get_instance_private (uniforms);
+
+  if (table->uniforms != uniforms ||
+      table->uniforms_stamp != priv->stamp ||
+      table->program_id != gthree_program_get_id (program))
+    return FALSE;
+
+  for (guint i = 0; i < table->uarrays->len; i++)
+    {
+      GthreeUniform *uarray = g_ptr_array_index (table->uarrays, i);
+      if (uarray->version != g_array_index (table->uarray_versions, guint32, i))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Program uniform state persists across glUseProgram, so if program
+ * was last loaded from this table we only need to upload the uniforms
+ * whose value changed since then. Otherwise another table may have
+ * overwritten anything, so upload it all.
+ */
+void
+gthree_uniform_table_load (GthreeUniformTable *table,
+                           GthreeProgram *program,
+                           GthreeRenderer *renderer)
+{
+  gboolean owns_program = gthree_program_get_uniform_table_id (program) == table->id;
+  GthreeUniformTableEntry *entries = (GthreeUniformTableEntry *)table->entries->data;
+  guint n_entries = table->entries->len;
+
+  for (guint i = 0; i < n_entries; i++)
+    {
+      GthreeUniformTableEntry *entry = &entries[i];
+      GthreeUniform *uniform = entry->uniform;
+
+      if (!uniform->needs_update ||
+          (entry->parent != NULL && !entry->parent->needs_update))
+        {
+          entry->uploaded_version = 0;
+          continue;
+        }
+
+      if (entry->versioned)
+        {
+          if (owns_program && entry->uploaded_version == uniform->version)
+            continue;
+          entry->uploaded_version = uniform->version;
+        }
+
+      gthree_uniform_upload (uniform, entry->location, renderer);
+    }
+
+  gthree_program_set_uniform_table_id (program, table->id);
+}
+
 static int i0 = 0;
 static float f0 = 0.0;
 static float f1 = 1.0;
@@ -1,5 +1,17 @@
+#if defined( USE_COLOR ) || defined( USE_INSTANCING_COLOR )
+
+	vColor = vec3( 1.0 );
+
+#endif
+
 #ifdef USE_COLOR
 
-	vColor.xyz = color.xyz;
+	vColor.xyz *= color.xyz;
+
+#endif
+
+#ifdef USE_INSTANCING_COLOR
+
+	vColor.xyz *= instanceColor.xyz;
 
 #endif
@@ -64,7 +64,13 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 		vec2 shadowMapSize;
 	};
 
-	uniform DirectionalLight directionalLights[ NUM_DIR_LIGHTS ];
+	#ifdef USE_UNIFORM_BLOCKS
+		layout(std140) uniform GthreeDirectionalLights {
+			DirectionalLight directionalLights[ NUM_DIR_LIGHTS ];
+		};
+	#else
+		uniform DirectionalLight directionalLights[ NUM_DIR_LIGHTS ];
+	#endif
 
 	void getDirectionalDirectLightIrradiance( const in DirectionalLight directionalLight, const in GeometricContext geometry, out IncidentLight directLight ) {
 
@@ -93,7 +99,13 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 		float shadowCameraFar;
 	};
 
-	uniform PointLight pointLights[ NUM_POINT_LIGHTS ];
+	#ifdef USE_UNIFORM_BLOCKS
+		layout(std140) uniform GthreePointLights {
+			PointLight pointLights[ NUM_POINT_LIGHTS ];
+		};
+	#else
+		uniform PointLight pointLights[ NUM_POINT_LIGHTS ];
+	#endif
 
 	// directLight is an out parameter as having it as a return value caused compiler errors on some devices
 	void getPointDirectLightIrradiance( const in PointLight pointLight, const in GeometricContext geometry, out IncidentLight directLight ) {
@@ -129,7 +141,13 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 		vec2 shadowMapSize;
 	};
 
-	uniform SpotLight spotLights[ NUM_SPOT_LIGHTS ];
+	#ifdef USE_UNIFORM_BLOCKS
+		layout(std140) uniform GthreeSpotLights {
+			SpotLight spotLights[ NUM_SPOT_LIGHTS ];
+		};
+	#else
+		uniform SpotLight spotLights[ NUM_SPOT_LIGHTS ];
+	#endif
 
 	// directLight is an out parameter as having it as a return value caused compiler errors on some devices
 	void getSpotDirectLightIrradiance( const in SpotLight spotLight, const in GeometricContext geometry, out IncidentLight directLight  ) {
@@ -186,7 +204,13 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 		vec3 groundColor;
 	};
 
-	uniform HemisphereLight hemisphereLights[ NUM_HEMI_LIGHTS ];
+	#ifdef USE_UNIFORM_BLOCKS
+		layout(std140) uniform GthreeHemisphereLights {
+			HemisphereLight hemisphereLights[ NUM_HEMI_LIGHTS ];
+		};
+	#else
+		uniform HemisphereLight hemisphereLights[ NUM_HEMI_LIGHTS ];
+	#endif
 
 	vec3 getHemisphereLightIrradiance( const in HemisphereLight hemiLight, const in GeometricContext geometry ) {
 
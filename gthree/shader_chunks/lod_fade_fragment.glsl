@@ -0,0 +1,7 @@
+#ifdef USE_LOD_FADE
+
+	float lodFadeThreshold = lodFadeDither( gl_FragCoord.xy );
+
+	if ( lodFade >= 0.0 ? lodFadeThreshold >= lodFade : lodFadeThreshold < 1.0 + lodFade ) discard;
+
+#endif
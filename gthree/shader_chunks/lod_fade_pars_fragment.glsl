@@ -0,0 +1,21 @@
+#ifdef USE_LOD_FADE
+
+	// Positive values keep the pixels below the dither threshold,
+	// negative values the complementary ones, so two levels fading
+	// with lodFade = f and lodFade = f - 1 cover each pixel once
+	uniform float lodFade;
+
+	float lodFadeDither( vec2 coord ) {
+
+		const float bayer[ 16 ] = float[ 16 ](
+			0.0, 8.0, 2.0, 10.0,
+			12.0, 4.0, 14.0, 6.0,
+			3.0, 11.0, 1.0, 9.0,
+			15.0, 7.0, 13.0, 5.0 );
+
+		ivec2 p = ivec2( mod( coord, 4.0 ) );
+		return ( bayer[ p.y * 4 + p.x ] + 0.5 ) / 16.0;
+
+	}
+
+#endif
@@ -11,10 +11,12 @@ varying float vLineDistance;
 #include <fog_pars_fragment>
 #include <logdepthbuf_pars_fragment>
 #include <clipping_planes_pars_fragment>
+#include <lod_fade_pars_fragment>
 
 void main() {
 
 	#include <clipping_planes_fragment>
+	#include <lod_fade_fragment>
 
 	if ( mod( vLineDistance, totalSize ) > dashSize ) {
 
@@ -20,10 +20,12 @@ uniform float opacity;
 #include <specularmap_pars_fragment>
 #include <logdepthbuf_pars_fragment>
 #include <clipping_planes_pars_fragment>
+#include <lod_fade_pars_fragment>
 
 void main() {
 
 	#include <clipping_planes_fragment>
+	#include <lod_fade_fragment>
 
 	vec4 diffuseColor = vec4( diffuse, opacity );
 
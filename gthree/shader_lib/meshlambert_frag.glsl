@@ -31,10 +31,12 @@ varying vec3 vIndirectFront;
 #include <specularmap_pars_fragment>
 #include <logdepthbuf_pars_fragment>
 #include <clipping_planes_pars_fragment>
+#include <lod_fade_pars_fragment>
 
 void main() {
 
 	#include <clipping_planes_fragment>
+	#include <lod_fade_fragment>
 
 	vec4 diffuseColor = vec4( diffuse, opacity );
 	ReflectedLight reflectedLight = ReflectedLight( vec3( 0.0 ), vec3( 0.0 ), vec3( 0.0 ), vec3( 0.0 ) );
@@ -0,0 +1,289 @@
+/* Tests the software occlusion buffer, which doesn't need GL
+ *
+ * The occlusion buffer is private, so this uses the internal headers.
+ */
+
+#include <math.h>
+#include <gthree/gthree.h>
+#include "gthreeprivate.h"
+
+/* 8x4 tiles of 32x32 pixels */
+#define WIDTH 256
+#define HEIGHT 128
+
+typedef struct {
+  GthreeOcclusionBuffer *buffer;
+  graphene_matrix_t identity;
+} Fixture;
+
+static void
+fixture_setup (Fixture       *fixture,
+               gconstpointer  data)
+{
+  fixture->buffer = gthree_occlusion_buffer_new (WIDTH, HEIGHT);
+  graphene_matrix_init_identity (&fixture->identity);
+}
+
+static void
+fixture_teardown (Fixture       *fixture,
+                  gconstpointer  data)
+{
+  gthree_occlusion_buffer_free (fixture->buffer);
+}
+
+/* Two unindexed triangles */
+static GthreeGeometry *
+quad_new_from_positions (float positions[18])
+{
+  GthreeGeometry *geometry = gthree_geometry_new ();
+  g_autoptr(GthreeAttribute) position = gthree_attribute_new_from_float ("position", positions, 6, 3);
+
+  gthree_geometry_add_attribute (geometry, "position", position);
+
+  return geometry;
+}
+
+/* From (x0, y0, z0) to (x1, y1, z1), with z changing along x */
+static GthreeGeometry *
+quad_new (float x0, float y0, float z0,
+          float x1, float y1, float z1)
+{
+  float positions[] = {
+    x0, y0, z0,  x1, y0, z1,  x1, y1, z1,
+    x0, y0, z0,  x1, y1, z1,  x0, y1, z0,
+  };
+
+  return quad_new_from_positions (positions);
+}
+
+/* With an identity view projection the coordinates are in ndc, x and
+ * y from -1 to 1 over the buffer and z from -1 (depth 0) to 1 (depth 1) */
+static void
+add_ndc_quad (Fixture *fixture,
+              float x0, float y0, float z0,
+              float x1, float y1, float z1)
+{
+  g_autoptr(GthreeGeometry) quad = quad_new (x0, y0, z0, x1, y1, z1);
+
+  gthree_occlusion_buffer_add_occluder (fixture->buffer, &fixture->identity, quad);
+}
+
+static float
+depth_at (Fixture *fixture,
+          int      x,
+          int      y)
+{
+  return gthree_occlusion_buffer_peek_depth (fixture->buffer)[y * WIDTH + x];
+}
+
+static gboolean
+test_ndc_box (Fixture *fixture,
+              float x0, float y0, float z0,
+              float x1, float y1, float z1)
+{
+  graphene_box_t box;
+  graphene_point3d_t min, max;
+
+  graphene_box_init (&box,
+                     graphene_point3d_init (&min, x0, y0, z0),
+                     graphene_point3d_init (&max, x1, y1, z1));
+
+  return gthree_occlusion_buffer_test_box (fixture->buffer, &box);
+}
+
+/* A quad at depth 0.5 covering pixels 64 to 191 by 32 to 95 */
+static void
+test_known_occluder (Fixture       *fixture,
+                     gconstpointer  data)
+{
+  int x, y, n_covered = 0;
+
+  gthree_occlusion_buffer_begin (fixture->buffer, &fixture->identity);
+  add_ndc_quad (fixture, -0.5, -0.5, 0, 0.5, 0.5, 0);
+  gthree_occlusion_buffer_rasterize (fixture->buffer);
+
+  for (y = 0; y < HEIGHT; y++)
+    for (x = 0; x < WIDTH; x++)
+      {
+        gboolean inside = x >= 64 && x < 192 && y >= 32 && y < 96;
+
+        if (inside)
+          {
+            g_assert_cmpfloat (fabsf (depth_at (fixture, x, y) - 0.5f), <, 1e-5f);
+            n_covered++;
+          }
+        else
+          g_assert_cmpfloat (depth_at (fixture, x, y), ==, 1.f);
+      }
+
+  g_assert_cmpint (n_covered, ==, 128 * 64);
+
+  /* Begin drops the occluders, rasterizing clears the buffer */
+  gthree_occlusion_buffer_begin (fixture->buffer, &fixture->identity);
+  gthree_occlusion_buffer_rasterize (fixture->buffer);
+  g_assert_cmpfloat (depth_at (fixture, 100, 60), ==, 1.f);
+}
+
+static void
+test_boxes (Fixture       *fixture,
+            gconstpointer  data)
+{
+  gthree_occlusion_buffer_begin (fixture->buffer, &fixture->identity);
+  add_ndc_quad (fixture, -0.5, -0.5, 0, 0.5, 0.5, 0);
+  gthree_occlusion_buffer_rasterize (fixture->buffer);
+
+  /* In front */
+  g_assert_true (test_ndc_box (fixture, -0.3, -0.3, -0.5, 0.3, 0.3, -0.2));
+  /* Behind */
+  g_assert_false (test_ndc_box (fixture, -0.3, -0.3, 0.2, 0.3, 0.3, 0.5));
+  /* Straddling the occluder in depth */
+  g_assert_true (test_ndc_box (fixture, -0.3, -0.3, -0.2, 0.3, 0.3, 0.2));
+  /* Behind, but reaching past the side of the occluder */
+  g_assert_true (test_ndc_box (fixture, 0.3, -0.3, 0.2, 0.7, 0.3, 0.5));
+  /* Behind, next to the occluder */
+  g_assert_true (test_ndc_box (fixture, 0.6, -0.3, 0.2, 0.8, 0.3, 0.5));
+  /* Off screen is for the frustum culling to decide */
+  g_assert_true (test_ndc_box (fixture, 1.5, -0.3, 0.2, 1.8, 0.3, 0.5));
+}
+
+/* A plane tilted 45 degrees in front of the camera, z = y - 2, with
+ * its top behind the camera, so its triangles cross the near plane */
+static void
+test_near_plane (Fixture       *fixture,
+                 gconstpointer  data)
+{
+  float positions[] = {
+    -100, -30, -32,   100, -30, -32,   100, 30, 28,
+    -100, -30, -32,   100,  30,  28,  -100, 30, 28,
+  };
+  g_autoptr(GthreeGeometry) plane = quad_new_from_positions (positions);
+  graphene_matrix_t projection;
+  graphene_box_t box;
+  graphene_point3d_t min, max;
+  const float *depth;
+  int i;
+
+  graphene_matrix_init_perspective (&projection, 90, (float)WIDTH / HEIGHT, 1, 100);
+
+  gthree_occlusion_buffer_begin (fixture->buffer, &projection);
+  gthree_occlusion_buffer_add_occluder (fixture->buffer, &fixture->identity, plane);
+  gthree_occlusion_buffer_rasterize (fixture->buffer);
+
+  /* Vertices behind the camera would project to garbage if not
+   * clipped */
+  depth = gthree_occlusion_buffer_peek_depth (fixture->buffer);
+  for (i = 0; i < WIDTH * HEIGHT; i++)
+    {
+      g_assert_cmpfloat (depth[i], >=, -1e-4f);
+      g_assert_cmpfloat (depth[i], <=, 1.f);
+    }
+
+  /* The bottom rows are past the far plane, but the plane covers the
+   * middle and the top of the screen */
+  g_assert_cmpfloat (depth_at (fixture, WIDTH / 2, HEIGHT / 2), <, 1.f);
+  g_assert_cmpfloat (depth_at (fixture, 0, HEIGHT - 1), <, 1.f);
+  g_assert_cmpfloat (depth_at (fixture, WIDTH - 1, HEIGHT - 1), <, 1.f);
+
+  /* Nearer towards the top, where the plane passes the near plane */
+  g_assert_cmpfloat (depth_at (fixture, WIDTH / 2, HEIGHT - 1), <, depth_at (fixture, WIDTH / 2, HEIGHT / 2));
+
+  /* The plane is at z = -2 in the middle of the screen */
+  graphene_box_init (&box,
+                     graphene_point3d_init (&min, -0.1, -0.1, -5.1),
+                     graphene_point3d_init (&max, 0.1, 0.1, -4.9));
+  g_assert_false (gthree_occlusion_buffer_test_box (fixture->buffer, &box));
+
+  graphene_box_init (&box,
+                     graphene_point3d_init (&min, -0.1, -0.1, -1.6),
+                     graphene_point3d_init (&max, 0.1, 0.1, -1.4));
+  g_assert_true (gthree_occlusion_buffer_test_box (fixture->buffer, &box));
+
+  /* Crossing the near plane is always visible */
+  graphene_box_init (&box,
+                     graphene_point3d_init (&min, -0.1, -0.1, -5),
+                     graphene_point3d_init (&max, 0.1, 0.1, 1));
+  g_assert_true (gthree_occlusion_buffer_test_box (fixture->buffer, &box));
+}
+
+/* A quad covering exactly tiles 2-3 by 1-2, with depth changing along
+ * x, must come out the same on both sides of each tile boundary */
+static void
+test_tile_boundaries (Fixture       *fixture,
+                      gconstpointer  data)
+{
+  int x, y;
+
+  g_assert_cmpint (gthree_occlusion_buffer_get_width (fixture->buffer), ==, WIDTH);
+  g_assert_cmpint (gthree_occlusion_buffer_get_height (fixture->buffer), ==, HEIGHT);
+
+  gthree_occlusion_buffer_begin (fixture->buffer, &fixture->identity);
+  add_ndc_quad (fixture, -0.5, -0.5, -0.5, 0, 0.5, 0.5);
+  gthree_occlusion_buffer_rasterize (fixture->buffer);
+
+  for (y = 0; y < HEIGHT; y++)
+    {
+      /* First and last columns of the quad, and the pixels just
+       * outside, which are in the neighbouring tiles */
+      if (y >= 32 && y < 96)
+        {
+          g_assert_cmpfloat (depth_at (fixture, 63, y), ==, 1.f);
+          g_assert_cmpfloat (depth_at (fixture, 64, y), <, 1.f);
+          g_assert_cmpfloat (depth_at (fixture, 127, y), <, 1.f);
+          g_assert_cmpfloat (depth_at (fixture, 128, y), ==, 1.f);
+
+          /* Depth is affine in x, also across the boundary at 96 */
+          for (x = 65; x < 127; x++)
+            {
+              float slope = depth_at (fixture, x, y) - depth_at (fixture, x - 1, y);
+              float next_slope = depth_at (fixture, x + 1, y) - depth_at (fixture, x, y);
+
+              g_assert_cmpfloat (fabsf (slope - next_slope), <, 1e-5f);
+            }
+        }
+      else
+        {
+          for (x = 0; x < WIDTH; x++)
+            g_assert_cmpfloat (depth_at (fixture, x, y), ==, 1.f);
+        }
+    }
+
+  /* Rows just outside, in the tiles above and below */
+  g_assert_cmpfloat (depth_at (fixture, 96, 31), ==, 1.f);
+  g_assert_cmpfloat (depth_at (fixture, 96, 32), <, 1.f);
+  g_assert_cmpfloat (depth_at (fixture, 96, 95), <, 1.f);
+  g_assert_cmpfloat (depth_at (fixture, 96, 96), ==, 1.f);
+
+  /* Boxes behind the quad, spanning the tile boundaries inside it are
+   * hidden, reaching into the empty tiles next to it they are not */
+  g_assert_false (test_ndc_box (fixture, -0.4, -0.4, 0.6, -0.1, 0.4, 0.7));
+  g_assert_true (test_ndc_box (fixture, -0.4, -0.4, 0.6, 0.1, 0.4, 0.7));
+  g_assert_true (test_ndc_box (fixture, -0.4, -0.6, 0.6, -0.1, 0.4, 0.7));
+
+  /* The last tile, at the bottom right corner of the buffer */
+  gthree_occlusion_buffer_begin (fixture->buffer, &fixture->identity);
+  add_ndc_quad (fixture, 0.5, 0.5, 0, 1, 1, 0);
+  gthree_occlusion_buffer_rasterize (fixture->buffer);
+
+  g_assert_cmpfloat (depth_at (fixture, WIDTH - 1, HEIGHT - 1), <, 1.f);
+  g_assert_cmpfloat (depth_at (fixture, 192, 96), <, 1.f);
+  g_assert_cmpfloat (depth_at (fixture, 191, 96), ==, 1.f);
+  g_assert_cmpfloat (depth_at (fixture, 100, 60), ==, 1.f);
+  g_assert_false (test_ndc_box (fixture, 0.6, 0.6, 0.5, 0.9, 0.9, 0.6));
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/occlusion-buffer/known-occluder", Fixture, NULL,
+              fixture_setup, test_known_occluder, fixture_teardown);
+  g_test_add ("/occlusion-buffer/boxes", Fixture, NULL,
+              fixture_setup, test_boxes, fixture_teardown);
+  g_test_add ("/occlusion-buffer/near-plane", Fixture, NULL,
+              fixture_setup, test_near_plane, fixture_teardown);
+  g_test_add ("/occlusion-buffer/tile-boundaries", Fixture, NULL,
+              fixture_setup, test_tile_boundaries, fixture_teardown);
+
+  return g_test_run ();
+}
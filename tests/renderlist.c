@@ -0,0 +1,254 @@
+/* Tests the draw order produced by gthree_render_list_sort()
+ *
+ * The render list is private, so this uses the internal headers.
+ */
+
+#include <gthree/gthree.h>
+#include "gthreeprivate.h"
+
+#define N_ITEMS 1000
+
+typedef struct {
+  GthreeRenderList *list;
+  GthreeObject *object;
+  GthreeGeometry *geometries[N_ITEMS];
+  GthreeMaterial *opaque[4];
+  GthreeMaterial *transparent[4];
+} Fixture;
+
+static void
+fixture_setup (Fixture       *fixture,
+               gconstpointer  data)
+{
+  int i;
+
+  fixture->list = gthree_render_list_new ();
+  fixture->object = GTHREE_OBJECT (gthree_group_new ());
+
+  for (i = 0; i < N_ITEMS; i++)
+    fixture->geometries[i] = gthree_geometry_new ();
+
+  for (i = 0; i < G_N_ELEMENTS (fixture->opaque); i++)
+    {
+      fixture->opaque[i] = GTHREE_MATERIAL (gthree_mesh_basic_material_new ());
+      fixture->transparent[i] = GTHREE_MATERIAL (gthree_mesh_basic_material_new ());
+      gthree_material_set_is_transparent (fixture->transparent[i], TRUE);
+    }
+}
+
+static void
+fixture_teardown (Fixture       *fixture,
+                  gconstpointer  data)
+{
+  int i;
+
+  for (i = 0; i < N_ITEMS; i++)
+    g_object_unref (fixture->geometries[i]);
+
+  for (i = 0; i < G_N_ELEMENTS (fixture->opaque); i++)
+    {
+      g_object_unref (fixture->opaque[i]);
+      g_object_unref (fixture->transparent[i]);
+    }
+
+  g_object_unref (fixture->object);
+  gthree_render_list_free (fixture->list);
+}
+
+static void
+push (Fixture        *fixture,
+      float           z,
+      int             geometry,
+      GthreeMaterial *material)
+{
+  gthree_render_list_set_current_z (fixture->list, z);
+  gthree_render_list_push (fixture->list, fixture->object,
+                           fixture->geometries[geometry], material, NULL);
+}
+
+static int
+peek_geometry (Fixture  *fixture,
+               gboolean  transparent,
+               guint     i)
+{
+  GthreeGeometry *geometry;
+  int j;
+
+  g_assert_true (gthree_render_list_peek_item (fixture->list, transparent, i, &geometry, NULL, NULL));
+
+  for (j = 0; j < N_ITEMS; j++)
+    {
+      if (fixture->geometries[j] == geometry)
+        return j;
+    }
+
+  g_assert_not_reached ();
+}
+
+/* Depths much closer than the 16 bits the opaque keys use, and
+ * pushed front to back, must still come out back to front */
+static void
+test_transparent_depth (Fixture       *fixture,
+                        gconstpointer  data)
+{
+  push (fixture, 0.99990f, 0, fixture->transparent[0]);
+  push (fixture, 0.99991f, 1, fixture->transparent[1]);
+  push (fixture, 0.99992f, 2, fixture->transparent[2]);
+  push (fixture, -0.5f, 3, fixture->transparent[3]);
+  push (fixture, 0.0f, 4, fixture->transparent[0]);
+  push (fixture, -0.75f, 5, fixture->transparent[1]);
+
+  gthree_render_list_sort (fixture->list, GTHREE_SORT_MODE_STATE_FIRST);
+
+  g_assert_cmpint (peek_geometry (fixture, TRUE, 0), ==, 2);
+  g_assert_cmpint (peek_geometry (fixture, TRUE, 1), ==, 1);
+  g_assert_cmpint (peek_geometry (fixture, TRUE, 2), ==, 0);
+  g_assert_cmpint (peek_geometry (fixture, TRUE, 3), ==, 4);
+  g_assert_cmpint (peek_geometry (fixture, TRUE, 4), ==, 3);
+  g_assert_cmpint (peek_geometry (fixture, TRUE, 5), ==, 5);
+  g_assert_false (gthree_render_list_peek_item (fixture->list, TRUE, 6, NULL, NULL, NULL));
+}
+
+/* Like the groups of a multi-material object, which share the depth,
+ * regardless of the material and geometry ids */
+static void
+test_transparent_push_order (Fixture       *fixture,
+                             gconstpointer  data)
+{
+  int i;
+
+  for (i = 0; i < 8; i++)
+    push (fixture, 0.5f, 7 - i, fixture->transparent[3 - i % 4]);
+
+  gthree_render_list_sort (fixture->list, GTHREE_SORT_MODE_DEPTH_FIRST);
+
+  for (i = 0; i < 8; i++)
+    g_assert_cmpint (peek_geometry (fixture, TRUE, i), ==, 7 - i);
+}
+
+static void
+push_random_opaque (Fixture *fixture)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  int i;
+
+  for (i = 0; i < N_ITEMS; i++)
+    push (fixture, g_rand_double_range (rand, -1, 1), i,
+          fixture->opaque[g_rand_int_range (rand, 0, G_N_ELEMENTS (fixture->opaque))]);
+}
+
+/* State first keeps all the items of a material together */
+static void
+test_opaque_state_first (Fixture       *fixture,
+                         gconstpointer  data)
+{
+  GthreeMaterial *material, *last_material = NULL;
+  int i, n_switches = 0;
+
+  push_random_opaque (fixture);
+  gthree_render_list_sort (fixture->list, GTHREE_SORT_MODE_STATE_FIRST);
+
+  for (i = 0; gthree_render_list_peek_item (fixture->list, FALSE, i, NULL, &material, NULL); i++)
+    {
+      if (material != last_material)
+        {
+          n_switches++;
+          last_material = material;
+        }
+    }
+
+  g_assert_cmpint (i, ==, N_ITEMS);
+  g_assert_cmpint (n_switches, ==, G_N_ELEMENTS (fixture->opaque));
+}
+
+/* Depth first draws front to back, to the 16 bits of the key */
+static void
+test_opaque_depth_first (Fixture       *fixture,
+                         gconstpointer  data)
+{
+  float z, last_z = -1;
+  int i;
+
+  push_random_opaque (fixture);
+  gthree_render_list_sort (fixture->list, GTHREE_SORT_MODE_DEPTH_FIRST);
+
+  for (i = 0; gthree_render_list_peek_item (fixture->list, FALSE, i, NULL, NULL, &z); i++)
+    {
+      g_assert_cmpfloat (z, >=, last_z - 2.0f / 0xffff);
+      last_z = z;
+    }
+
+  g_assert_cmpint (i, ==, N_ITEMS);
+}
+
+/* The same input always gives the same order */
+static void
+test_deterministic (Fixture       *fixture,
+                    gconstpointer  data)
+{
+  GthreeSortMode modes[] = { GTHREE_SORT_MODE_STATE_FIRST, GTHREE_SORT_MODE_DEPTH_FIRST };
+  int first[N_ITEMS];
+  guint n_opaque;
+  int m, run, i;
+
+  for (m = 0; m < G_N_ELEMENTS (modes); m++)
+    {
+      for (run = 0; run < 2; run++)
+        {
+          g_autoptr(GRand) rand = g_rand_new_with_seed (1234);
+
+          gthree_render_list_init (fixture->list);
+          for (i = 0; i < N_ITEMS; i++)
+            {
+              /* Lots of equal depths, so ties matter */
+              float z = g_rand_int_range (rand, 0, 16) / 8.0f - 1.0f;
+              int material = g_rand_int_range (rand, 0, 8);
+
+              push (fixture, z, i,
+                    material < 4 ? fixture->opaque[material] : fixture->transparent[material - 4]);
+            }
+
+          gthree_render_list_sort (fixture->list, modes[m]);
+
+          n_opaque = 0;
+          while (gthree_render_list_peek_item (fixture->list, FALSE, n_opaque, NULL, NULL, NULL))
+            n_opaque++;
+
+          for (i = 0; i < N_ITEMS; i++)
+            {
+              gboolean transparent = FALSE;
+              guint j = i;
+
+              if (j >= n_opaque)
+                {
+                  transparent = TRUE;
+                  j -= n_opaque;
+                }
+
+              if (run == 0)
+                first[i] = peek_geometry (fixture, transparent, j);
+              else
+                g_assert_cmpint (peek_geometry (fixture, transparent, j), ==, first[i]);
+            }
+        }
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/render-list/transparent-depth", Fixture, NULL,
+              fixture_setup, test_transparent_depth, fixture_teardown);
+  g_test_add ("/render-list/transparent-push-order", Fixture, NULL,
+              fixture_setup, test_transparent_push_order, fixture_teardown);
+  g_test_add ("/render-list/opaque-state-first", Fixture, NULL,
+              fixture_setup, test_opaque_state_first, fixture_teardown);
+  g_test_add ("/render-list/opaque-depth-first", Fixture, NULL,
+              fixture_setup, test_opaque_depth_first, fixture_teardown);
+  g_test_add ("/render-list/deterministic", Fixture, NULL,
+              fixture_setup, test_deterministic, fixture_teardown);
+
+  return g_test_run ();
+}
@@ -0,0 +1,154 @@
+/* Tests that a scene using a transform store computes the same world
+ * matrices as the object graph walk, and only rebuilds the store when
+ * the structure of the tree changes.
+ *
+ * The scene matrix update is private, so this uses the internal headers.
+ */
+
+#include <math.h>
+#include <gthree/gthree.h>
+#include "gthreeprivate.h"
+
+#define N_OBJECTS 200
+
+static void
+build_tree (GthreeObject *root,
+            GthreeObject *objects[N_OBJECTS])
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  int i;
+
+  for (i = 0; i < N_OBJECTS; i++)
+    {
+      GthreeObject *parent = i == 0 ? root : objects[g_rand_int_range (rand, 0, i)];
+
+      objects[i] = GTHREE_OBJECT (gthree_group_new ());
+      gthree_object_set_position_xyz (objects[i],
+                                      g_rand_double_range (rand, -10, 10),
+                                      g_rand_double_range (rand, -10, 10),
+                                      g_rand_double_range (rand, -10, 10));
+      gthree_object_set_rotation_xyz (objects[i],
+                                      g_rand_double_range (rand, -G_PI, G_PI),
+                                      g_rand_double_range (rand, -G_PI, G_PI),
+                                      g_rand_double_range (rand, -G_PI, G_PI));
+      gthree_object_set_scale_uniform (objects[i], g_rand_double_range (rand, 0.5, 2));
+      gthree_object_add_child (parent, objects[i]);
+      g_object_unref (objects[i]);
+    }
+}
+
+static void
+assert_same_world_matrices (GthreeObject *a[N_OBJECTS],
+                            GthreeObject *b[N_OBJECTS])
+{
+  int i;
+
+  for (i = 0; i < N_OBJECTS; i++)
+    g_assert_true (graphene_matrix_near (gthree_object_get_world_matrix (a[i]),
+                                         gthree_object_get_world_matrix (b[i]),
+                                         0.001f));
+}
+
+static void
+test_matches_tree (void)
+{
+  g_autoptr(GthreeScene) stored = gthree_scene_new ();
+  g_autoptr(GthreeScene) walked = gthree_scene_new ();
+  GthreeObject *stored_objects[N_OBJECTS];
+  GthreeObject *walked_objects[N_OBJECTS];
+  int i;
+
+  gthree_scene_set_use_transform_store (stored, TRUE);
+  build_tree (GTHREE_OBJECT (stored), stored_objects);
+  build_tree (GTHREE_OBJECT (walked), walked_objects);
+
+  gthree_scene_update_matrix_world (stored);
+  gthree_scene_update_matrix_world (walked);
+  assert_same_world_matrices (stored_objects, walked_objects);
+
+  /* Partial updates, including a subtree that moves */
+  for (i = 0; i < N_OBJECTS; i += 7)
+    {
+      gthree_object_set_position_xyz (stored_objects[i], i, 0, 0);
+      gthree_object_set_position_xyz (walked_objects[i], i, 0, 0);
+    }
+
+  gthree_scene_update_matrix_world (stored);
+  gthree_scene_update_matrix_world (walked);
+  assert_same_world_matrices (stored_objects, walked_objects);
+}
+
+/* The world matrices live in the store arrays, which are reallocated
+ * on every rebuild, so the matrix pointers tell if one happened */
+static void
+test_rebuild (void)
+{
+  g_autoptr(GthreeScene) scene = gthree_scene_new ();
+  GthreeObject *objects[N_OBJECTS];
+  const graphene_matrix_t *matrix;
+  GthreeObject *extra;
+
+  gthree_scene_set_use_transform_store (scene, TRUE);
+  build_tree (GTHREE_OBJECT (scene), objects);
+  gthree_scene_update_matrix_world (scene);
+
+  matrix = gthree_object_get_world_matrix (objects[10]);
+
+  gthree_object_set_visible (objects[10], FALSE);
+  gthree_object_set_layer (objects[20], 3);
+  gthree_object_enable_layer (objects[30], 5);
+  gthree_object_set_position_xyz (objects[10], 1, 2, 3);
+  gthree_scene_update_matrix_world (scene);
+
+  g_assert_true (gthree_object_get_world_matrix (objects[10]) == matrix);
+
+  extra = GTHREE_OBJECT (gthree_group_new ());
+  gthree_object_add_child (objects[50], extra);
+  g_object_unref (extra);
+  gthree_scene_update_matrix_world (scene);
+
+  g_assert_true (gthree_object_get_world_matrix (objects[10]) != matrix);
+  g_assert_true (graphene_matrix_near (gthree_object_get_world_matrix (extra),
+                                       gthree_object_get_world_matrix (objects[50]),
+                                       0.001f));
+}
+
+/* A scene that is not the root of its tree still sees children being
+ * added below it */
+static void
+test_nested_scene (void)
+{
+  g_autoptr(GthreeGroup) root = gthree_group_new ();
+  GthreeScene *scene = gthree_scene_new ();
+  GthreeObject *child;
+  graphene_vec4_t translation;
+
+  gthree_object_add_child (GTHREE_OBJECT (root), GTHREE_OBJECT (scene));
+  g_object_unref (scene);
+
+  gthree_scene_set_use_transform_store (scene, TRUE);
+  gthree_scene_update_matrix_world (scene);
+
+  child = GTHREE_OBJECT (gthree_group_new ());
+  gthree_object_set_position_xyz (child, 1, 2, 3);
+  gthree_object_add_child (GTHREE_OBJECT (scene), child);
+  g_object_unref (child);
+  gthree_scene_update_matrix_world (scene);
+
+  graphene_matrix_get_row (gthree_object_get_world_matrix (child), 3, &translation);
+  g_assert_cmpfloat (fabsf (graphene_vec4_get_x (&translation) - 1), <, 0.001f);
+  g_assert_cmpfloat (fabsf (graphene_vec4_get_y (&translation) - 2), <, 0.001f);
+  g_assert_cmpfloat (fabsf (graphene_vec4_get_z (&translation) - 3), <, 0.001f);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/transform-store/matches-tree", test_matches_tree);
+  g_test_add_func ("/transform-store/rebuild", test_rebuild);
+  g_test_add_func ("/transform-store/nested-scene", test_nested_scene);
+
+  return g_test_run ();
+}
@@ -0,0 +1,265 @@
+/* Tests the world matrix updates of the scene graph
+ *
+ * The scene matrix update is private, so this uses the internal headers.
+ */
+
+#include <gthree/gthree.h>
+#include "gthreeprivate.h"
+#include "gthreeobjectprivate.h"
+
+#define N_OBJECTS 5000
+
+/* An object with its own update_matrix_world(), like skinned meshes
+ * and helpers, which the threaded update has to run on the calling
+ * thread */
+typedef struct {
+  GthreeObject parent;
+  GThread *update_thread;
+  guint n_updates;
+} TestObject;
+
+typedef struct {
+  GthreeObjectClass parent_class;
+} TestObjectClass;
+
+static GType test_object_get_type (void);
+
+G_DEFINE_TYPE (TestObject, test_object, GTHREE_TYPE_OBJECT)
+
+static gboolean
+test_object_update_matrix_world (GthreeObject *object,
+                                 gboolean      force)
+{
+  TestObject *test = (TestObject *)object;
+
+  test->update_thread = g_thread_self ();
+  test->n_updates++;
+
+  return GTHREE_OBJECT_CLASS (test_object_parent_class)->update_matrix_world (object, force);
+}
+
+static void
+test_object_init (TestObject *test)
+{
+}
+
+static void
+test_object_class_init (TestObjectClass *klass)
+{
+  GTHREE_OBJECT_CLASS (klass)->update_matrix_world = test_object_update_matrix_world;
+}
+
+static void
+set_random_transform (GthreeObject *object,
+                      GRand        *rand)
+{
+  gthree_object_set_position_xyz (object,
+                                  g_rand_double_range (rand, -10, 10),
+                                  g_rand_double_range (rand, -10, 10),
+                                  g_rand_double_range (rand, -10, 10));
+  gthree_object_set_rotation_xyz (object,
+                                  g_rand_double_range (rand, -G_PI, G_PI),
+                                  g_rand_double_range (rand, -G_PI, G_PI),
+                                  g_rand_double_range (rand, -G_PI, G_PI));
+  gthree_object_set_scale_uniform (object, g_rand_double_range (rand, 0.5, 2));
+}
+
+/* A few wide subtrees off the root, with every 97th object a
+ * TestObject */
+static GthreeScene *
+build_scene (GthreeObject *objects[N_OBJECTS])
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  GthreeScene *scene = gthree_scene_new ();
+  int i;
+
+  for (i = 0; i < N_OBJECTS; i++)
+    {
+      GthreeObject *parent = i < 8 ? GTHREE_OBJECT (scene) : objects[g_rand_int_range (rand, 0, i)];
+
+      if (i % 97 == 96)
+        objects[i] = g_object_new (test_object_get_type (), NULL);
+      else
+        objects[i] = GTHREE_OBJECT (gthree_group_new ());
+
+      set_random_transform (objects[i], rand);
+      gthree_object_add_child (parent, objects[i]);
+      g_object_unref (objects[i]);
+    }
+
+  return scene;
+}
+
+static void
+move_some (GthreeObject *objects[N_OBJECTS],
+           guint32       seed)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (seed);
+  int i;
+
+  for (i = 0; i < 50; i++)
+    set_random_transform (objects[g_rand_int_range (rand, 0, N_OBJECTS)], rand);
+}
+
+static void
+assert_equal_world_matrices (GthreeObject *a[N_OBJECTS],
+                             GthreeObject *b[N_OBJECTS])
+{
+  int i;
+
+  for (i = 0; i < N_OBJECTS; i++)
+    g_assert_true (graphene_matrix_equal (gthree_object_get_world_matrix (a[i]),
+                                          gthree_object_get_world_matrix (b[i])));
+}
+
+/* The threaded update gives exactly the serial result, also for
+ * partial updates, every time */
+static void
+test_parallel_matches_serial (void)
+{
+  GthreeObject *serial_objects[N_OBJECTS];
+  GthreeObject *parallel_objects[N_OBJECTS];
+  g_autoptr(GthreeScene) serial = build_scene (serial_objects);
+  g_autoptr(GthreeScene) parallel = build_scene (parallel_objects);
+  int run;
+
+  gthree_scene_set_parallel_update_threshold (parallel, 1);
+
+  gthree_scene_update_matrix_world (serial);
+  gthree_scene_update_matrix_world (parallel);
+  assert_equal_world_matrices (serial_objects, parallel_objects);
+
+  for (run = 0; run < 10; run++)
+    {
+      move_some (serial_objects, run);
+      move_some (parallel_objects, run);
+
+      gthree_scene_update_matrix_world (serial);
+      gthree_scene_update_matrix_world (parallel);
+      assert_equal_world_matrices (serial_objects, parallel_objects);
+    }
+}
+
+static void
+test_parallel_custom_update (void)
+{
+  GthreeObject *objects[N_OBJECTS];
+  g_autoptr(GthreeScene) scene = build_scene (objects);
+  int i;
+
+  gthree_scene_set_parallel_update_threshold (scene, 1);
+  gthree_scene_update_matrix_world (scene);
+
+  for (i = 96; i < N_OBJECTS; i += 97)
+    {
+      TestObject *test = (TestObject *)objects[i];
+
+      g_assert_cmpuint (test->n_updates, >, 0);
+      g_assert_true (test->update_thread == g_thread_self ());
+    }
+}
+
+/* Moves a random subtree to a random parent outside it */
+static void
+reparent_some (GthreeObject *objects[N_OBJECTS],
+               guint32       seed)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (seed);
+  GthreeObject *object, *parent, *ancestor;
+
+  object = objects[g_rand_int_range (rand, 8, N_OBJECTS)];
+  do
+    {
+      parent = objects[g_rand_int_range (rand, 0, N_OBJECTS)];
+      for (ancestor = parent;
+           ancestor != NULL && ancestor != object;
+           ancestor = gthree_object_get_parent (ancestor))
+        ;
+    }
+  while (ancestor == object);
+
+  g_object_ref (object);
+  gthree_object_remove_child (gthree_object_get_parent (object), object);
+  gthree_object_add_child (parent, object);
+  g_object_unref (object);
+}
+
+/* Only walking the dirty subtrees gives exactly the result of a
+ * forced update of the whole tree */
+static void
+test_dirty_matches_full (void)
+{
+  GthreeObject *dirty_objects[N_OBJECTS];
+  GthreeObject *full_objects[N_OBJECTS];
+  g_autoptr(GthreeScene) dirty = build_scene (dirty_objects);
+  g_autoptr(GthreeScene) full = build_scene (full_objects);
+  int run;
+
+  for (run = 0; run < 10; run++)
+    {
+      move_some (dirty_objects, run);
+      move_some (full_objects, run);
+      reparent_some (dirty_objects, run);
+      reparent_some (full_objects, run);
+
+      gthree_scene_update_matrix_world (dirty);
+      gthree_object_update_matrix_world (GTHREE_OBJECT (full), TRUE);
+      assert_equal_world_matrices (dirty_objects, full_objects);
+    }
+}
+
+static gboolean
+is_ancestor (GthreeObject *ancestor,
+             GthreeObject *object)
+{
+  for (; object != NULL; object = gthree_object_get_parent (object))
+    {
+      if (object == ancestor)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Only the moved object and its descendants get new world matrices */
+static void
+test_dirty_only_changed (void)
+{
+  GthreeObject *objects[N_OBJECTS];
+  g_autoptr(GthreeScene) scene = build_scene (objects);
+  guint32 stamps[N_OBJECTS];
+  GthreeObject *moved = objects[100];
+  int i;
+
+  gthree_scene_update_matrix_world (scene);
+  for (i = 0; i < N_OBJECTS; i++)
+    stamps[i] = gthree_object_get_transform_stamp (objects[i]);
+
+  /* Nothing changed */
+  gthree_scene_update_matrix_world (scene);
+  for (i = 0; i < N_OBJECTS; i++)
+    g_assert_cmpuint (gthree_object_get_transform_stamp (objects[i]), ==, stamps[i]);
+
+  gthree_object_set_position_xyz (moved, 1, 2, 3);
+  gthree_scene_update_matrix_world (scene);
+  for (i = 0; i < N_OBJECTS; i++)
+    {
+      if (is_ancestor (moved, objects[i]))
+        g_assert_cmpuint (gthree_object_get_transform_stamp (objects[i]), !=, stamps[i]);
+      else
+        g_assert_cmpuint (gthree_object_get_transform_stamp (objects[i]), ==, stamps[i]);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/world-matrix/parallel-matches-serial", test_parallel_matches_serial);
+  g_test_add_func ("/world-matrix/parallel-custom-update", test_parallel_custom_update);
+  g_test_add_func ("/world-matrix/dirty-matches-full", test_dirty_matches_full);
+  g_test_add_func ("/world-matrix/dirty-only-changed", test_dirty_only_changed);
+
+  return g_test_run ();
+}